@@ -0,0 +1,146 @@
+
+#include <stdlib.h>         // For C's malloc / free
+#include <iostream>
+
+#include "CerealAllocator.hpp"
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+  #define CPM_ES_CEREAL_HAVE_MMAP
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+namespace CPM_ES_CEREAL_NS {
+
+CerealAllocator& CerealAllocator::getDefault()
+{
+  static MallocAllocator defaultAllocator;
+  return defaultAllocator;
+}
+
+void* MallocAllocator::allocate(size_t size)
+{
+  return malloc(size);
+}
+
+void MallocAllocator::deallocate(void* ptr, size_t /* size */)
+{
+  free(ptr);
+}
+
+namespace {
+
+#ifdef CPM_ES_CEREAL_HAVE_MMAP
+
+// Avoid a dependency on libnuma. These mirror linux/mempolicy.h.
+const int kMPolPreferred = 1;
+
+size_t getHugePageSize()
+{
+  return static_cast<size_t>(2) << 20;
+}
+
+size_t roundToHugePage(size_t size)
+{
+  size_t page = getHugePageSize();
+  return ((size + page - 1) / page) * page;
+}
+
+void bindToCallingThreadNode(void* ptr, size_t size)
+{
+#if defined(SYS_getcpu) && defined(SYS_mbind)
+  unsigned int cpu = 0;
+  unsigned int node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    return;
+
+  const size_t bitsPerMask = sizeof(unsigned long) * 8;
+  if (node >= bitsPerMask)
+    return;
+
+  unsigned long nodeMask = 1UL << node;
+  // Failure is not an error, the machine may simply not be NUMA.
+  syscall(SYS_mbind, ptr, size, kMPolPreferred, &nodeMask, bitsPerMask, 0);
+#else
+  (void)ptr;
+  (void)size;
+#endif
+}
+
+#endif
+
+} // anonymous namespace
+
+LargeBufferAllocator::LargeBufferAllocator(size_t hugePageThreshold,
+                                           NumaPolicy numaPolicy,
+                                           bool prefault) :
+    mHugePageThreshold(hugePageThreshold),
+    mNumaPolicy(numaPolicy),
+    mPrefault(prefault)
+{
+}
+
+bool LargeBufferAllocator::isHugePageSupported()
+{
+#if defined(CPM_ES_CEREAL_HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  return true;
+#else
+  return false;
+#endif
+}
+
+void* LargeBufferAllocator::allocate(size_t size)
+{
+#ifdef CPM_ES_CEREAL_HAVE_MMAP
+  if (size != 0 && size >= mHugePageThreshold)
+  {
+    size_t mappedSize = roundToHugePage(size);
+    void* ptr = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+      std::cerr << "cpm-es-cereal: Failed to map large buffer of size " << size << std::endl;
+      return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    // Advisory only. Kernels without THP support will reject this.
+    madvise(ptr, mappedSize, MADV_HUGEPAGE);
+#endif
+
+    if (mNumaPolicy == NUMA_CALLING_THREAD)
+      bindToCallingThreadNode(ptr, mappedSize);
+
+    if (mPrefault)
+    {
+      const size_t stride = 4096;
+      volatile char* bytes = static_cast<volatile char*>(ptr);
+      for (size_t i = 0; i < mappedSize; i += stride)
+        bytes[i] = 0;
+    }
+
+    return ptr;
+  }
+#endif
+
+  return malloc(size);
+}
+
+void LargeBufferAllocator::deallocate(void* ptr, size_t size)
+{
+  if (ptr == NULL)
+    return;
+
+#ifdef CPM_ES_CEREAL_HAVE_MMAP
+  if (size != 0 && size >= mHugePageThreshold)
+  {
+    munmap(ptr, roundToHugePage(size));
+    return;
+  }
+#endif
+
+  free(ptr);
+}
+
+} // namespace CPM_ES_CEREAL_NS
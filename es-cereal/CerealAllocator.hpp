@@ -0,0 +1,131 @@
+#ifndef IAUNS_CEREALALLOCATOR_HPP
+#define IAUNS_CEREALALLOCATOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+namespace CPM_ES_CEREAL_NS {
+
+/// Allocation hook used by es-cereal for the buffers it hands back to the
+/// caller (dumps of Tny documents, etc...). Implementations must be safe to
+/// call from any thread that is serializing.
+class CerealAllocator
+{
+public:
+  virtual ~CerealAllocator() {}
+
+  /// Allocates \p size bytes. Returns NULL on failure.
+  virtual void* allocate(size_t size) = 0;
+
+  /// Releases memory obtained from allocate. \p size is the same size that
+  /// was given to allocate.
+  virtual void deallocate(void* ptr, size_t size) = 0;
+
+  /// Retrieves the process wide default allocator (C's malloc / free).
+  static CerealAllocator& getDefault();
+};
+
+/// Adapts a CerealAllocator to the standard library allocator interface so
+/// std containers can draw their storage from it. The CerealAllocator must
+/// return memory suitably aligned for T (malloc alignment is sufficient).
+template <typename T>
+class CerealStlAllocator
+{
+public:
+  typedef T value_type;
+
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  CerealStlAllocator() : mAllocator(&CerealAllocator::getDefault()) {}
+  explicit CerealStlAllocator(CerealAllocator& allocator) : mAllocator(&allocator) {}
+
+  template <typename U>
+  CerealStlAllocator(const CerealStlAllocator<U>& other) : mAllocator(&other.getAllocator()) {}
+
+  T* allocate(size_t n)
+  {
+    void* ptr = mAllocator->allocate(n * sizeof(T));
+    if (ptr == NULL) throw std::bad_alloc();
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, size_t n)
+  {
+    mAllocator->deallocate(static_cast<void*>(ptr), n * sizeof(T));
+  }
+
+  CerealAllocator& getAllocator() const {return *mAllocator;}
+
+private:
+  CerealAllocator* mAllocator;
+};
+
+template <typename T, typename U>
+bool operator==(const CerealStlAllocator<T>& a, const CerealStlAllocator<U>& b)
+{
+  return &a.getAllocator() == &b.getAllocator();
+}
+
+template <typename T, typename U>
+bool operator!=(const CerealStlAllocator<T>& a, const CerealStlAllocator<U>& b)
+{
+  return !(a == b);
+}
+
+/// Allocator that forwards to C's malloc and free.
+class MallocAllocator : public CerealAllocator
+{
+public:
+  void* allocate(size_t size) override;
+  void deallocate(void* ptr, size_t size) override;
+};
+
+/// Allocator tuned for very large snapshot buffers (hundreds of MB and up).
+/// Allocations at or above the huge page threshold are mapped directly and
+/// advised to use transparent huge pages (MADV_HUGEPAGE), which cuts TLB
+/// misses when the buffer is written or scanned. Smaller allocations fall back
+/// to malloc. On platforms without mmap / madvise this behaves exactly like
+/// MallocAllocator.
+class LargeBufferAllocator : public CerealAllocator
+{
+public:
+  /// NUMA placement policy for mapped buffers.
+  enum NumaPolicy
+  {
+    NUMA_DEFAULT,         ///< Leave placement to the kernel.
+    NUMA_CALLING_THREAD   ///< Prefer the node of the thread calling allocate.
+  };
+
+  /// \param hugePageThreshold  Allocations of at least this many bytes are
+  ///                           mapped and advised to use huge pages.
+  /// \param numaPolicy         Placement of mapped buffers. When serializing
+  ///                           in parallel, use one allocator call per worker
+  ///                           thread with NUMA_CALLING_THREAD so each
+  ///                           worker's buffer is local to its socket.
+  /// \param prefault           If true, pages are touched by the calling
+  ///                           thread at allocation time. Combined with the
+  ///                           kernel's first touch policy this places memory
+  ///                           even when explicit NUMA binding is unavailable.
+  LargeBufferAllocator(size_t hugePageThreshold = (2 << 20),
+                       NumaPolicy numaPolicy = NUMA_DEFAULT,
+                       bool prefault = false);
+
+  void* allocate(size_t size) override;
+  void deallocate(void* ptr, size_t size) override;
+
+  /// Returns true if this platform supports mapped, huge page advised buffers.
+  static bool isHugePageSupported();
+
+private:
+  size_t      mHugePageThreshold; ///< Minimum size for a mapped allocation.
+  NumaPolicy  mNumaPolicy;        ///< Placement of mapped allocations.
+  bool        mPrefault;          ///< Touch pages from the allocating thread.
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
@@ -0,0 +1,118 @@
+
+#include <stdlib.h>         // For C's free
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "CerealBuffer.hpp"
+#include "CerealAllocator.hpp"
+#include <tny/tny.hpp>
+
+namespace CPM_ES_CEREAL_NS {
+
+namespace {
+
+struct MallocDeleter
+{
+  void operator()(const char* ptr) const
+  {
+    free(const_cast<char*>(ptr));
+  }
+};
+
+struct AllocatorDeleter
+{
+  AllocatorDeleter(CerealAllocator& allocator, size_t size) :
+      mAllocator(&allocator),
+      mSize(size)
+  {}
+
+  void operator()(const char* ptr) const
+  {
+    mAllocator->deallocate(const_cast<char*>(ptr), mSize);
+  }
+
+  CerealAllocator* mAllocator;
+  size_t           mSize;
+};
+
+}
+
+CerealBuffer::CerealBuffer() :
+    mData(nullptr),
+    mSize(0)
+{
+}
+
+CerealBuffer::CerealBuffer(std::shared_ptr<const char> storage, const char* data, size_t size) :
+    mStorage(std::move(storage)),
+    mData(data),
+    mSize(size)
+{
+}
+
+CerealBuffer CerealBuffer::adoptMalloc(void* data, size_t size)
+{
+  if (data == nullptr)
+    return CerealBuffer();
+
+  const char* bytes = static_cast<const char*>(data);
+  return CerealBuffer(std::shared_ptr<const char>(bytes, MallocDeleter()), bytes, size);
+}
+
+CerealBuffer CerealBuffer::adopt(void* data, size_t size, CerealAllocator& allocator)
+{
+  if (data == nullptr)
+    return CerealBuffer();
+
+  const char* bytes = static_cast<const char*>(data);
+  return CerealBuffer(std::shared_ptr<const char>(bytes, AllocatorDeleter(allocator, size)),
+                      bytes, size);
+}
+
+CerealBuffer CerealBuffer::copy(const void* data, size_t size, CerealAllocator& allocator)
+{
+  if (size == 0)
+    return CerealBuffer();
+
+  void* bytes = allocator.allocate(size);
+  if (bytes == nullptr)
+  {
+    std::cerr << "cpm-es-cereal: Failed to allocate buffer of size " << size << std::endl;
+    throw std::runtime_error("Failed allocation");
+  }
+
+  std::memcpy(bytes, data, size);
+  return adopt(bytes, size, allocator);
+}
+
+CerealBuffer CerealBuffer::share(const void* data, size_t size, std::shared_ptr<const void> owner)
+{
+  if (data == nullptr)
+    return CerealBuffer();
+
+  const char* bytes = static_cast<const char*>(data);
+  return CerealBuffer(std::shared_ptr<const char>(owner, bytes), bytes, size);
+}
+
+CerealBuffer CerealBuffer::slice(size_t offset, size_t size) const
+{
+  if (offset > mSize || size > mSize - offset)
+  {
+    std::cerr << "cpm-es-cereal: Buffer slice [" << offset << ", " << offset + size
+              << ") out of range (size " << mSize << ")." << std::endl;
+    throw std::out_of_range("Buffer slice out of range");
+  }
+
+  return CerealBuffer(mStorage, mData + offset, size);
+}
+
+Tny* CerealBuffer::loadTny() const
+{
+  if (mData == nullptr)
+    return nullptr;
+
+  return Tny_loads(const_cast<char*>(mData), mSize);
+}
+
+} // namespace CPM_ES_CEREAL_NS
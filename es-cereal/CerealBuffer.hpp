@@ -0,0 +1,70 @@
+#ifndef IAUNS_CEREALBUFFER_HPP
+#define IAUNS_CEREALBUFFER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct _Tny;
+typedef _Tny Tny;
+
+namespace CPM_ES_CEREAL_NS {
+
+class CerealAllocator;
+
+/// Immutable, reference counted block of bytes. Copying a CerealBuffer only
+/// bumps a reference count: every copy (and every slice) shares the same
+/// memory, which is released when the last of them is destroyed. Reference
+/// counting is atomic, so copies may be handed to other threads (network
+/// senders, disk writers, recorders) without further synchronization.
+class CerealBuffer
+{
+public:
+  /// Empty buffer.
+  CerealBuffer();
+
+  /// Takes ownership of \p data, which must have been allocated with C's
+  /// malloc (Tny_dumps output, for instance). Freed with C's free.
+  static CerealBuffer adoptMalloc(void* data, size_t size);
+
+  /// Takes ownership of \p data, which must have been obtained from
+  /// \p allocator with the given \p size. The allocator must outlive every
+  /// copy of the returned buffer.
+  static CerealBuffer adopt(void* data, size_t size, CerealAllocator& allocator);
+
+  /// Copies \p size bytes from \p data into memory obtained from
+  /// \p allocator.
+  static CerealBuffer copy(const void* data, size_t size, CerealAllocator& allocator);
+
+  /// Refers to \p size bytes at \p data without copying or owning them.
+  /// \p data must stay valid as long as \p owner lives; every copy of the
+  /// returned buffer keeps \p owner alive (a mapping, for instance).
+  static CerealBuffer share(const void* data, size_t size, std::shared_ptr<const void> owner);
+
+  /// Returns a buffer referring to [offset, offset + size) of this buffer.
+  /// No memory is copied. Throws std::out_of_range if the range does not
+  /// lie inside of this buffer.
+  CerealBuffer slice(size_t offset, size_t size) const;
+
+  const void* data() const  {return mData;}
+  size_t size() const       {return mSize;}
+  bool empty() const        {return mSize == 0;}
+
+  /// Number of CerealBuffer objects (including slices) sharing this memory.
+  long getUseCount() const  {return mStorage.use_count();}
+
+  /// Parses the buffer as a Tny document. The caller is responsible for
+  /// calling Tny_free on the returned Tny*. Returns NULL on failure.
+  Tny* loadTny() const;
+
+private:
+  CerealBuffer(std::shared_ptr<const char> storage, const char* data, size_t size);
+
+  std::shared_ptr<const char> mStorage; ///< Owns the underlying allocation.
+  const char*                 mData;    ///< Start of this (possibly sliced) view.
+  size_t                      mSize;    ///< Size of this view.
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef IAUNS_CEREALBYTEORDER_HPP
+#define IAUNS_CEREALBYTEORDER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace CPM_ES_CEREAL_NS {
+
+/// Little endian encoding of the integers used in es-cereal's own framing
+/// (snapshots, replays). Tny documents carry their own encoding.
+namespace byte_detail {
+
+inline void writeU32(char* out, uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+    out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+inline void writeU64(char* out, uint64_t value)
+{
+  for (int i = 0; i < 8; ++i)
+    out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+inline uint32_t readU32(const char* in)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i)
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+  return value;
+}
+
+inline uint64_t readU64(const char* in)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i)
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+  return value;
+}
+
+inline bool isHostLittleEndian()
+{
+  const uint16_t probe = 1;
+  unsigned char first = 0;
+  std::memcpy(&first, &probe, 1);
+  return first == 1;
+}
+
+/// Copies the \p size byte scalar at \p in to \p out, converting between
+/// host and little endian byte order (the conversion is its own inverse).
+inline void copyLittleEndian(void* out, const void* in, size_t size)
+{
+  if (isHostLittleEndian())
+  {
+    std::memcpy(out, in, size);
+    return;
+  }
+
+  const char* from = static_cast<const char*>(in);
+  char* to = static_cast<char*>(out);
+  for (size_t i = 0; i < size; ++i)
+    to[i] = from[size - 1 - i];
+}
+
+} // namespace byte_detail
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
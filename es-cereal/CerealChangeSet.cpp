@@ -0,0 +1,118 @@
+
+#include <algorithm>
+#include <vector>
+
+#include "CerealChangeSet.hpp"
+#include <tny/tny.hpp>
+
+namespace CPM_ES_CEREAL_NS {
+
+namespace changeset_detail {
+
+Tny* sortRecords(Tny* records)
+{
+  struct Record
+  {
+    uint64_t  entityID;
+    Tny*      component;
+  };
+
+  std::vector<Record> sorted;
+  sorted.reserve(records->root->size / 2);
+
+  Tny* cur = records->root;
+  while (Tny_hasNext(cur))
+  {
+    cur = Tny_next(cur);
+    Record record;
+    record.entityID = cur->value.num;
+    cur = Tny_next(cur);
+    record.component = cur->value.tny;
+    sorted.push_back(record);
+  }
+
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const Record& a, const Record& b) {return a.entityID < b.entityID;});
+
+  Tny* result = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+  for (const Record& record : sorted)
+    result = heap_detail::addSerializedComponent(result, record.component, record.entityID);
+  return result->root;
+}
+
+} // namespace changeset_detail
+
+ChangeSetBuilder::ChangeSetBuilder(CerealCore& core) :
+    mCore(core),
+    mNumChanges(0)
+{
+}
+
+ChangeSetBuilder::~ChangeSetBuilder()
+{
+  clear();
+}
+
+ChangeSetBuilder::HeapChanges& ChangeSetBuilder::getHeapChanges(
+    uint64_t templateID, ComponentSerializeInterface* heap)
+{
+  HeapChanges& changes = mHeaps[templateID];
+  if (changes.heap == nullptr)
+  {
+    changes.heap = heap;
+    changes.serializer.reset(new ComponentSerialize(mCore, false));
+    changes.records = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+  }
+  return changes;
+}
+
+void ChangeSetBuilder::appendRecord(HeapChanges& changes, Tny* component, uint64_t entityID)
+{
+  if (changes.records->root->size != 0 && entityID < changes.lastEntityID)
+    changes.sorted = false;
+  changes.lastEntityID = entityID;
+
+  changes.records = heap_detail::addSerializedComponent(changes.records, component, entityID);
+  ++mNumChanges;
+}
+
+Tny* ChangeSetBuilder::build()
+{
+  Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  for (auto it = mHeaps.begin(); it != mHeaps.end(); ++it)
+  {
+    HeapChanges& changes = it->second;
+
+    Tny* records = changes.records->root;
+    if (!changes.sorted)
+    {
+      Tny* sorted = changeset_detail::sortRecords(records);
+      Tny_free(records);
+      records = sorted;
+    }
+    changes.records = NULL;
+
+    Tny* serializedHeap = heap_detail::writeSerializedHeap(*changes.serializer, records);
+    Tny_free(records);
+
+    root = Tny_add(root, TNY_OBJ, const_cast<char*>(mCore.getHeapKey(it->first, changes.heap)),
+                   serializedHeap->root, 0);
+    Tny_free(serializedHeap->root);
+  }
+
+  clear();
+  return root->root;
+}
+
+void ChangeSetBuilder::clear()
+{
+  for (auto it = mHeaps.begin(); it != mHeaps.end(); ++it)
+  {
+    if (it->second.records != NULL)
+      Tny_free(it->second.records->root);
+  }
+  mHeaps.clear();
+  mNumChanges = 0;
+}
+
+} // namespace CPM_ES_CEREAL_NS
@@ -0,0 +1,104 @@
+#ifndef IAUNS_CEREALCHANGESET_HPP
+#define IAUNS_CEREALCHANGESET_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <iostream>
+#include <stdexcept>
+
+#include "CerealCore.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+/// Accumulates component values into a single change set for
+/// CerealCore::deserializeComponentMerge. Where every call to
+/// CerealCore::serializeValue produces a complete document (its own type
+/// header, heap and root), the builder keeps one component array and one
+/// type header per heap, so a change set of thousands of edits is built
+/// with one serialization per value and emitted as one document.
+///
+///   ChangeSetBuilder changes(core);
+///   changes.add(position, entityID);
+///   changes.add(health, otherEntityID);
+///   Tny* root = changes.build();
+///   remoteCore.deserializeComponentMerge(root, true);
+///   Tny_free(root);
+class ChangeSetBuilder
+{
+public:
+  /// Values are serialized with \p core's allocator and heaps are keyed as
+  /// \p core keys them (see CerealCore::setHeapKeyMode).
+  explicit ChangeSetBuilder(CerealCore& core);
+  ~ChangeSetBuilder();
+
+  /// Adds \p value as the new state of the component of \p entityID.
+  /// \param componentIndex   If not -1, the index of the component among the
+  ///                         components of \p entityID in its heap. Values
+  ///                         added for the same entity without an index are
+  ///                         applied to its components in order.
+  template <typename T>
+  void add(T& value, uint64_t entityID, int32_t componentIndex = -1)
+  {
+    CerealHeap<T>* heap = mCore.getOrCreateComponentContainer<T>();
+    if (heap->isSerializable() == false)
+    {
+      std::cerr << "Attempting to explicitly serialize value from non-serializable component." << std::endl;
+      throw std::runtime_error("Non-serializable component.");
+    }
+
+    HeapChanges& changes = getHeapChanges(CPM_ES_NS::TemplateID<T>::getID(), heap);
+    ComponentSerialize& s = *changes.serializer;
+    s.prepareForNewComponent(componentIndex);
+    if (value.serialize(s, entityID))
+      appendRecord(changes, s.getSerializedObject(), entityID);
+  }
+
+  /// Emits every value added since construction (or the last call to build
+  /// or clear) as one document, then empties the builder. Records of each
+  /// heap are ordered by entity ID; values of the same entity keep the order
+  /// they were added in. The caller is responsible for calling Tny_free on
+  /// the returned Tny*.
+  Tny* build();
+
+  /// Discards every value added.
+  void clear();
+
+  /// Number of values added.
+  size_t getNumChanges() const  {return mNumChanges;}
+  bool empty() const            {return mNumChanges == 0;}
+
+private:
+  ChangeSetBuilder(const ChangeSetBuilder&);
+  ChangeSetBuilder& operator=(const ChangeSetBuilder&);
+
+  /// Values added for one heap.
+  struct HeapChanges
+  {
+    HeapChanges() : heap(nullptr), records(NULL), sorted(true), lastEntityID(0) {}
+
+    ComponentSerializeInterface*        heap;
+    std::unique_ptr<ComponentSerialize> serializer;   ///< Shared type header.
+    Tny*                                records;      ///< Component array.
+    bool                                sorted;       ///< Records added in entity order.
+    uint64_t                            lastEntityID;
+  };
+
+  HeapChanges& getHeapChanges(uint64_t templateID, ComponentSerializeInterface* heap);
+  void appendRecord(HeapChanges& changes, Tny* component, uint64_t entityID);
+
+  CerealCore&                       mCore;
+  std::map<uint64_t, HeapChanges>   mHeaps;       ///< By component template ID.
+  size_t                            mNumChanges;
+};
+
+namespace changeset_detail {
+
+/// Returns a copy of the component array \p records with its (entity ID,
+/// component) records stably sorted by entity ID.
+Tny* sortRecords(Tny* records);
+}
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
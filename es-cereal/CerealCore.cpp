@@ -1,18 +1,28 @@
 
 #include <stdlib.h>         // For C's free
+#include <algorithm>
 #include <cstring>
+#include <vector>
 
 #include "CerealCore.hpp"
 #include <tny/tny.hpp>
 
 namespace CPM_ES_CEREAL_NS {
 
-CerealCore::CerealCore()
+const char CerealCore::HEAP_ID_KEY_MARKER;
+const size_t CerealCore::HEAP_ID_KEY_SIZE;
+
+CerealCore::CerealCore() :
+    mAllocator(&CerealAllocator::getDefault()),
+    mHeapKeyMode(HEAP_KEY_NAME),
+    mReuseUnchangedHeaps(false),
+    mNumHeapsReused(0)
 {
 }
 
 CerealCore::~CerealCore()
 {
+  clearHeapCache();
 }
 
 std::tuple<void*, size_t> CerealCore::dumpTny(Tny* tny)
@@ -22,6 +32,37 @@ std::tuple<void*, size_t> CerealCore::dumpTny(Tny* tny)
   return std::make_tuple(data, dataSize);
 }
 
+std::tuple<void*, size_t> CerealCore::dumpTny(Tny* tny, CerealAllocator& allocator)
+{
+  if (tny == NULL)
+    return std::make_tuple(static_cast<void*>(NULL), static_cast<size_t>(0));
+
+  void* dump = NULL;
+  size_t dataSize = Tny_dumps(tny, &dump);
+  if (dump == NULL || &allocator == &CerealAllocator::getDefault())
+    return std::make_tuple(dump, dataSize);
+
+  // Tny only dumps into memory it mallocs.
+  void* data = allocator.allocate(dataSize);
+  if (data == NULL)
+  {
+    free(dump);
+    std::cerr << "cpm-es-cereal: Failed to allocate dump of size " << dataSize << std::endl;
+    throw std::runtime_error("Failed allocation");
+  }
+
+  std::memcpy(data, dump, dataSize);
+  free(dump);
+  return std::make_tuple(data, dataSize);
+}
+
+CerealBuffer CerealCore::dumpTnyShared(Tny* tny)
+{
+  void* data = NULL;
+  size_t dataSize = Tny_dumps(tny, &data);
+  return CerealBuffer::adoptMalloc(data, dataSize);
+}
+
 Tny* CerealCore::loadTny(void* data, size_t dataSize)
 {
   return Tny_loads(data, dataSize);
@@ -32,10 +73,270 @@ void CerealCore::freeTnyDataPtr(void* ptr)
   free(ptr);
 }
 
+void CerealCore::setAllocator(CerealAllocator& allocator)
+{
+  mAllocator = &allocator;
+
+  // Rebuild the registries so that their storage comes from the new
+  // allocator. Swapping propagates the allocator along with the contents.
+  HeapRegistry registry(mHeapRegistry.begin(), mHeapRegistry.end(),
+                        CerealStlAllocator<HeapEntry>(allocator));
+  mHeapRegistry.swap(registry);
+
+  IDIndexMap byNameHash(mHeapsByNameHash.begin(), mHeapsByNameHash.end(),
+                        mHeapsByNameHash.bucket_count(),
+                        std::hash<uint64_t>(), std::equal_to<uint64_t>(),
+                        CerealStlAllocator<std::pair<const uint64_t, size_t>>(allocator));
+  mHeapsByNameHash.swap(byNameHash);
+
+  IDIndexMap byID(mHeapsByID.begin(), mHeapsByID.end(), mHeapsByID.bucket_count(),
+                  std::hash<uint64_t>(), std::equal_to<uint64_t>(),
+                  CerealStlAllocator<std::pair<const uint64_t, size_t>>(allocator));
+  mHeapsByID.swap(byID);
+
+  IDIndexMap byTemplateID(mHeapsByTemplateID.begin(), mHeapsByTemplateID.end(),
+                          mHeapsByTemplateID.bucket_count(),
+                          std::hash<uint64_t>(), std::equal_to<uint64_t>(),
+                          CerealStlAllocator<std::pair<const uint64_t, size_t>>(allocator));
+  mHeapsByTemplateID.swap(byTemplateID);
+}
+
+uint32_t CerealCore::registerHeap(ComponentSerializeInterface* heap, uint64_t templateID,
+                                  uint32_t nameHash, uint32_t heapID)
+{
+  const char* name = heap->getComponentName();
+
+  // Ensure there are no duplicate component names, and that no two names
+  // share a hash (lookups by name go through the hash alone).
+  auto existing = mHeapsByNameHash.find(nameHash);
+  if (existing != mHeapsByNameHash.end())
+  {
+    HeapEntry& entry = mHeapRegistry[existing->second];
+    const std::string& existingName = entry.name;
+    if (existingName == name && entry.heap == nullptr)
+    {
+      // Registering an unregistered name again: the heap ID is kept.
+      if (heapID != 0 && heapID != entry.heapID)
+      {
+        std::cerr << "cpm-es-cereal: " << name << " was registered with heap ID " << entry.heapID
+                  << " and can't be registered again with heap ID " << heapID << std::endl;
+        throw std::runtime_error("cpm-es-cereal: Heap ID changed on re-registration.");
+      }
+
+      mHeapsByTemplateID.erase(entry.templateID);
+      entry.templateID = templateID;
+      entry.heap = heap;
+      mHeapsByTemplateID[templateID] = existing->second;
+      return entry.heapID;
+    }
+
+    if (existingName == name)
+    {
+      std::cerr << "cpm-es-cereal: Component with duplicate name." << " Name: " << name << std::endl;
+      throw std::runtime_error("cpm-es-cereal: Component with duplicate name.");
+    }
+
+    std::cerr << "cpm-es-cereal: Component name hash collision between " << name
+              << " and " << existingName << ". Rename one of them." << std::endl;
+    throw std::runtime_error("cpm-es-cereal: Component name hash collision.");
+  }
+
+  if (heapID == 0)
+    heapID = nameHash;
+
+  if (mHeapsByID.find(heapID) != mHeapsByID.end())
+  {
+    std::cerr << "cpm-es-cereal: Heap ID " << heapID << " requested by " << name
+              << " is already in use by " << mHeapRegistry[mHeapsByID[heapID]].name << std::endl;
+    throw std::runtime_error("cpm-es-cereal: Duplicate heap ID.");
+  }
+
+  HeapEntry entry;
+  entry.heapID = heapID;
+  entry.templateID = templateID;
+  entry.name = name;
+  entry.wireKey = makeHeapIDKey(heapID);
+  entry.heap = heap;
+
+  size_t index = mHeapRegistry.size();
+  mHeapRegistry.push_back(entry);
+  mHeapsByNameHash.insert(std::make_pair(static_cast<uint64_t>(nameHash), index));
+  mHeapsByID.insert(std::make_pair(static_cast<uint64_t>(heapID), index));
+  mHeapsByTemplateID.insert(std::make_pair(templateID, index));
+
+  return heapID;
+}
+
+bool CerealCore::unregisterHeap(uint64_t templateID)
+{
+  auto it = mHeapsByTemplateID.find(templateID);
+  if (it == mHeapsByTemplateID.end() || mHeapRegistry[it->second].heap == nullptr)
+    return false;
+
+  // The entry stays, reserving its name and heap ID.
+  mHeapRegistry[it->second].heap = nullptr;
+  return true;
+}
+
+bool CerealCore::isHeapRetired(uint64_t templateID) const
+{
+  auto it = mHeapsByTemplateID.find(templateID);
+  return it != mHeapsByTemplateID.end() && mHeapRegistry[it->second].heap == nullptr;
+}
+
+std::string CerealCore::makeHeapIDKey(uint32_t heapID)
+{
+  std::string key(HEAP_ID_KEY_SIZE, HEAP_ID_KEY_MARKER);
+  for (size_t i = HEAP_ID_KEY_SIZE - 1; i > 0; --i)
+  {
+    key[i] = static_cast<char>(0x80 | (heapID & 0x7F));
+    heapID >>= 7;
+  }
+  return key;
+}
+
+bool CerealCore::parseHeapIDKey(const char* key, uint32_t& heapID)
+{
+  if (key[0] != HEAP_ID_KEY_MARKER)
+    return false;
+
+  uint64_t value = 0;
+  for (size_t i = 1; i < HEAP_ID_KEY_SIZE; ++i)
+  {
+    // Also stops at the terminator of a short key.
+    uint8_t byte = static_cast<uint8_t>(key[i]);
+    if ((byte & 0x80) == 0)
+      return false;
+    value = (value << 7) | (byte & 0x7F);
+  }
+
+  if (key[HEAP_ID_KEY_SIZE] != '\0' || value > UINT32_MAX)
+    return false;
+
+  heapID = static_cast<uint32_t>(value);
+  return true;
+}
+
+int64_t CerealCore::findRegistryIndex(const char* name) const
+{
+  auto it = mHeapsByNameHash.find(hashName(name));
+  if (it != mHeapsByNameHash.end() && mHeapRegistry[it->second].name == name
+      && mHeapRegistry[it->second].heap != nullptr)
+    return static_cast<int64_t>(it->second);
+  else
+    return -1;
+}
+
+uint32_t CerealCore::getHeapID(const char* name) const
+{
+  int64_t index = findRegistryIndex(name);
+  if (index >= 0)
+    return mHeapRegistry[index].heapID;
+  else
+    return 0;
+}
+
+ComponentSerializeInterface* CerealCore::getHeapByID(uint32_t heapID) const
+{
+  auto it = mHeapsByID.find(heapID);
+  if (it != mHeapsByID.end())
+    return mHeapRegistry[it->second].heap;
+  else
+    return nullptr;
+}
+
+const char* CerealCore::getHeapKey(uint64_t templateID, ComponentSerializeInterface* heap) const
+{
+  if (mHeapKeyMode == HEAP_KEY_ID)
+  {
+    auto it = mHeapsByTemplateID.find(templateID);
+    if (it != mHeapsByTemplateID.end() && mHeapRegistry[it->second].heap != nullptr)
+      return mHeapRegistry[it->second].wireKey.c_str();
+  }
+
+  // Unregistered heaps are always keyed by name.
+  return heap->getComponentName();
+}
+
+void CerealCore::setReuseUnchangedHeaps(bool reuse)
+{
+  mReuseUnchangedHeaps = reuse;
+  if (!reuse)
+    clearHeapCache();
+}
+
+void CerealCore::clearHeapCache()
+{
+  for (auto it = mHeapCache.begin(); it != mHeapCache.end(); ++it)
+  {
+    if (it->second.serialized != NULL)
+      Tny_free(it->second.serialized);
+  }
+  mHeapCache.clear();
+}
+
+CerealCore::HeapCacheEntry* CerealCore::getHeapCacheEntry(
+    uint64_t templateID, ComponentSerializeInterface* heap, bool& valid)
+{
+  valid = false;
+  if (!mReuseUnchangedHeaps)
+    return nullptr;
+
+  // Generation 0 means the heap does not track changes.
+  uint64_t generation = heap->getGeneration();
+  if (generation == 0)
+    return nullptr;
+
+  HeapCacheEntry& entry = mHeapCache[templateID];
+  if (entry.generation == generation)
+  {
+    valid = true;
+  }
+  else
+  {
+    if (entry.serialized != NULL)
+      Tny_free(entry.serialized);
+    entry.generation = generation;
+    entry.serialized = NULL;
+    entry.dumpKey.clear();
+    entry.dump = CerealBuffer();
+    entry.dumpFingerprint = 0;
+  }
+  return &entry;
+}
+
+Tny* CerealCore::acquireSerializedHeap(uint64_t templateID, ComponentSerializeInterface* heap,
+                                       bool& owned)
+{
+  bool valid = false;
+  HeapCacheEntry* entry = getHeapCacheEntry(templateID, heap, valid);
+  owned = (entry == nullptr);
+  if (entry == nullptr)
+    return heap->serialize(*this);
+
+  if (valid && entry->serialized != NULL)
+  {
+    ++mNumHeapsReused;
+    return entry->serialized;
+  }
+
+  entry->serialized = heap->serialize(*this);
+  return entry->serialized;
+}
+
+void CerealCore::releaseSerializedHeap(Tny* serialized, bool owned)
+{
+  // Cached heaps are owned by the cache.
+  if (owned)
+    Tny_free(serialized);
+}
+
 // serializeAllComponents and serializeEntity are the same function with a
 // different ComponentSerialize call. Figure out a way to fix this.
 Tny* CerealCore::serializeAllComponents()
 {
+  mNumHeapsReused = 0;
+
   // Build dictionary whose keys correspond to the names of the components.
 	Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
   Tny* cur = root;
@@ -47,11 +348,15 @@ Tny* CerealCore::serializeAllComponents()
 
     if (heap->isSerializable())
     {
-      Tny* serializedHeap = heap->serialize(*this);
+      bool owned = false;
+      Tny* serializedHeap = acquireSerializedHeap(it->first, heap, owned);
 
-      // Add the serialized heap as a Tny object. Then free serializedHeap.
+      // Add the serialized heap as a Tny object. Then release serializedHeap.
       // When a TNY_OBJ is added, it is deep copied and not moved.
-      cur = Tny_add(cur, TNY_OBJ, const_cast<char*>(heap->getComponentName()), serializedHeap, 0);
+      cur = Tny_add(cur, TNY_OBJ, const_cast<char*>(getHeapKey(it->first, heap)), serializedHeap, 0);
+
+      // Clean up the heap.
+      releaseSerializedHeap(serializedHeap, owned);
 
       if (cur == NULL)
       {
@@ -59,15 +364,221 @@ Tny* CerealCore::serializeAllComponents()
         std::cerr << "Failed on component: " << heap->getComponentName() << std::endl;
         throw std::runtime_error("Failed serialization");
       }
-
-      // Clean up the heap.
-      Tny_free(serializedHeap);
     }
   }
 
   return root;
 }
 
+void CerealCore::dumpHeaps(std::vector<HeapDump>& dumps)
+{
+  mNumHeapsReused = 0;
+
+  for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+  {
+    ComponentSerializeInterface* heap =
+        dynamic_cast<ComponentSerializeInterface*>(it->second);
+
+    if (heap->isSerializable())
+    {
+      HeapDump dump;
+      dumpHeap(it->first, heap, dump);
+      dumps.push_back(dump);
+    }
+  }
+}
+
+bool CerealCore::findHeapDump(uint64_t templateID, ComponentSerializeInterface* heap,
+                              HeapDump& dump, bool fingerprint, HeapCacheEntry*& entry)
+{
+  dump.name = getHeapKey(templateID, heap);
+  dump.nameLength = std::strlen(dump.name);
+  dump.fingerprint = 0;
+
+  bool valid = false;
+  entry = getHeapCacheEntry(templateID, heap, valid);
+  if (!valid || entry->dump.empty() || entry->dumpKey != dump.name)
+    return false;
+
+  dump.bytes = entry->dump;
+  ++mNumHeapsReused;
+  if (fingerprint)
+  {
+    if (entry->dumpFingerprint == 0)
+      entry->dumpFingerprint = hashBytes(dump.bytes.data(), dump.bytes.size());
+    dump.fingerprint = entry->dumpFingerprint;
+  }
+  return true;
+}
+
+void CerealCore::cacheHeapDump(HeapCacheEntry* entry, const HeapDump& dump)
+{
+  if (entry != nullptr)
+  {
+    entry->dumpKey = dump.name;
+    entry->dump = dump.bytes;
+    entry->dumpFingerprint = dump.fingerprint;
+  }
+}
+
+Tny* CerealCore::serializeHeapForDump(ComponentSerializeInterface* heap, const char* name)
+{
+  Tny* serializedHeap = heap->serialize(*this);
+  if (serializedHeap == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Failed to serialize all components." << std::endl;
+    std::cerr << "Failed on component: " << name << std::endl;
+    throw std::runtime_error("Failed serialization");
+  }
+  return serializedHeap;
+}
+
+void CerealCore::dumpHeap(uint64_t templateID, ComponentSerializeInterface* heap, HeapDump& dump,
+                          bool fingerprint)
+{
+  HeapCacheEntry* entry = nullptr;
+  if (findHeapDump(templateID, heap, dump, fingerprint, entry))
+    return;
+
+  // Each heap is dumped as its own {name: heap} document so that slices
+  // can be deserialized independently.
+  Tny* serializedHeap = serializeHeapForDump(heap, dump.name);
+  Tny* document = NULL;
+  try
+  {
+    document = heap_detail::makeHeapDocument(dump.name, serializedHeap);
+    Tny_free(serializedHeap);
+    serializedHeap = NULL;
+    dump.bytes = heap_detail::dumpToBuffer(document, *mAllocator);
+    Tny_free(document);
+  }
+  catch (...)
+  {
+    if (serializedHeap != NULL) Tny_free(serializedHeap);
+    if (document != NULL) Tny_free(document);
+    throw;
+  }
+
+  if (fingerprint)
+    dump.fingerprint = hashBytes(dump.bytes.data(), dump.bytes.size());
+  cacheHeapDump(entry, dump);
+}
+
+CerealSnapshot CerealCore::dumpSnapshot()
+{
+  std::vector<HeapDump> dumps;
+  dumpHeaps(dumps);
+
+  size_t totalSize = CerealSnapshot::getHeaderSize();
+  for (const HeapDump& dump : dumps)
+    totalSize += CerealSnapshot::getRecordHeaderSize(dump.nameLength) + dump.bytes.size();
+
+  char* data = static_cast<char*>(mAllocator->allocate(totalSize));
+  if (data == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Failed to allocate snapshot of size " << totalSize << std::endl;
+    throw std::runtime_error("Failed allocation");
+  }
+
+  CerealSnapshot::writeHeader(data, static_cast<uint32_t>(dumps.size()));
+  size_t offset = CerealSnapshot::getHeaderSize();
+  for (HeapDump& dump : dumps)
+  {
+    CerealSnapshot::writeRecordHeader(data + offset, dump.name,
+                                      static_cast<uint32_t>(dump.nameLength), dump.bytes.size());
+    offset += CerealSnapshot::getRecordHeaderSize(dump.nameLength);
+    std::memcpy(data + offset, dump.bytes.data(), dump.bytes.size());
+    offset += dump.bytes.size();
+  }
+
+  return CerealSnapshot::parse(CerealBuffer::adopt(data, totalSize, *mAllocator));
+}
+
+CerealSegmentList CerealCore::dumpSnapshotSegments()
+{
+  std::vector<HeapDump> dumps;
+  dumpHeaps(dumps);
+
+  // All of the framing goes into one allocation. Each frame is sliced out
+  // so that it directly precedes its heap's dump in the segment list.
+  size_t framingSize = CerealSnapshot::getHeaderSize();
+  for (const HeapDump& dump : dumps)
+    framingSize += CerealSnapshot::getRecordHeaderSize(dump.nameLength);
+
+  CerealBuffer framing;
+  {
+    char* data = static_cast<char*>(mAllocator->allocate(framingSize));
+    if (data == NULL)
+    {
+      std::cerr << "cpm-es-cereal: Failed to allocate snapshot framing of size " << framingSize << std::endl;
+      throw std::runtime_error("Failed allocation");
+    }
+    framing = CerealBuffer::adopt(data, framingSize, *mAllocator);
+
+    CerealSnapshot::writeHeader(data, static_cast<uint32_t>(dumps.size()));
+    size_t offset = CerealSnapshot::getHeaderSize();
+    for (const HeapDump& dump : dumps)
+    {
+      CerealSnapshot::writeRecordHeader(data + offset, dump.name,
+                                        static_cast<uint32_t>(dump.nameLength), dump.bytes.size());
+      offset += CerealSnapshot::getRecordHeaderSize(dump.nameLength);
+    }
+  }
+
+  CerealSegmentList segments;
+  size_t offset = 0;
+  size_t frameSize = CerealSnapshot::getHeaderSize();
+  for (const HeapDump& dump : dumps)
+  {
+    frameSize += CerealSnapshot::getRecordHeaderSize(dump.nameLength);
+    segments.append(framing.slice(offset, frameSize));
+    segments.append(dump.bytes);
+    offset += frameSize;
+    frameSize = 0;
+  }
+  if (dumps.empty())
+    segments.append(framing);
+
+  return segments;
+}
+
+#ifndef _WIN32
+void CerealCore::writeSnapshot(CerealFileWriter& writer)
+{
+  mNumHeapsReused = 0;
+
+  uint32_t numHeaps = 0;
+  for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+  {
+    if (dynamic_cast<ComponentSerializeInterface*>(it->second)->isSerializable())
+      ++numHeaps;
+  }
+
+  char header[12];
+  CerealSnapshot::writeHeader(header, numHeaps);
+  writer.submit(CerealBuffer::copy(header, CerealSnapshot::getHeaderSize(), *mAllocator));
+
+  std::vector<char> frame;
+  for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+  {
+    ComponentSerializeInterface* heap =
+        dynamic_cast<ComponentSerializeInterface*>(it->second);
+
+    if (heap->isSerializable())
+    {
+      HeapDump dump;
+      dumpHeap(it->first, heap, dump);
+
+      frame.resize(CerealSnapshot::getRecordHeaderSize(dump.nameLength));
+      CerealSnapshot::writeRecordHeader(&frame[0], dump.name,
+                                        static_cast<uint32_t>(dump.nameLength), dump.bytes.size());
+      writer.submit(CerealBuffer::copy(&frame[0], frame.size(), *mAllocator));
+      writer.submit(dump.bytes);
+    }
+  }
+}
+#endif
+
 // serializeAllComponents and serializeEntity are the same function with a
 // different ComponentSerialize call. Figure out a way to fix this.
 Tny* CerealCore::serializeEntity(uint64_t entityID)
@@ -87,7 +598,7 @@ Tny* CerealCore::serializeEntity(uint64_t entityID)
 
       // Add the serialized heap as a Tny object. Then free serializedHeap.
       // When a TNY_OBJ is added, it is deep copied and not moved.
-      cur = Tny_add(cur, TNY_OBJ, const_cast<char*>(heap->getComponentName()), serializedHeap, 0);
+      cur = Tny_add(cur, TNY_OBJ, const_cast<char*>(getHeapKey(it->first, heap)), serializedHeap, 0);
 
       if (cur == NULL)
       {
@@ -104,6 +615,123 @@ Tny* CerealCore::serializeEntity(uint64_t entityID)
   return root;
 }
 
+CerealBuffer CerealCore::dumpEntity(uint64_t entityID)
+{
+  // Heaps hand out their (possibly cached) dumps; Tny can only combine
+  // documents it has loaded.
+  Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  Tny* cur = root;
+  try
+  {
+    for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+    {
+      ComponentSerializeInterface* heap =
+          dynamic_cast<ComponentSerializeInterface*>(it->second);
+      if (heap->isSerializable() == false)
+        continue;
+
+      CerealBuffer dump = heap->dumpEntity(*this, entityID);
+      if (dump.empty())
+        continue;
+
+      Tny* serializedHeap = dump.loadTny();
+      if (serializedHeap == NULL)
+      {
+        std::cerr << "cpm-es-cereal: Failed to load entity dump of: " << heap->getComponentName() << std::endl;
+        throw std::runtime_error("Failed serialization");
+      }
+      cur = Tny_add(cur, TNY_OBJ, const_cast<char*>(getHeapKey(it->first, heap)), serializedHeap, 0);
+      Tny_free(serializedHeap);
+    }
+
+    CerealBuffer dump = heap_detail::dumpToBuffer(root, *mAllocator);
+    Tny_free(root);
+    return dump;
+  }
+  catch (...)
+  {
+    Tny_free(root);
+    throw;
+  }
+}
+
+CerealBuffer CerealCore::extractEntities(const std::vector<uint64_t>& entityIDs, bool remove)
+{
+  std::vector<uint64_t> sorted(entityIDs);
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  Tny* cur = root;
+  for (auto it = mComponents.begin(); it != mComponents.end() && !sorted.empty(); ++it)
+  {
+    ComponentSerializeInterface* heap =
+        dynamic_cast<ComponentSerializeInterface*>(it->second);
+
+    if (heap->isSerializable())
+    {
+      Tny* serializedHeap = heap->serializeEntities(*this, &sorted[0], sorted.size());
+      if (serializedHeap == NULL)
+        continue;
+
+      // When a TNY_OBJ is added, it is deep copied and not moved.
+      cur = Tny_add(cur, TNY_OBJ, const_cast<char*>(getHeapKey(it->first, heap)), serializedHeap, 0);
+      Tny_free(serializedHeap);
+
+      if (cur == NULL)
+      {
+        Tny_free(root);
+        std::cerr << "cpm-es-cereal: Failed to extract entities." << std::endl;
+        std::cerr << "Failed on component: " << heap->getComponentName() << std::endl;
+        throw std::runtime_error("Failed serialization");
+      }
+    }
+  }
+
+  CerealBuffer payload = dumpTnyShared(root);
+  Tny_free(root);
+
+  if (remove && !sorted.empty())
+  {
+    for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+    {
+      ComponentSerializeInterface* heap =
+          dynamic_cast<ComponentSerializeInterface*>(it->second);
+      if (heap != nullptr && heap->removeEntities(*this, &sorted[0], sorted.size()))
+        continue;
+
+      for (uint64_t entityID : sorted)
+        it->second->removeSequence(entityID);
+    }
+  }
+
+  return payload;
+}
+
+void CerealCore::insertEntities(const CerealBuffer& payload, EntityRemap* remap)
+{
+  Tny* root = payload.loadTny();
+  if (root == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Entity payload of " << payload.size() << " bytes is not a Tny document." << std::endl;
+    throw std::runtime_error("Malformed entity payload");
+  }
+
+  try
+  {
+    if (remap != nullptr)
+      deserializeComponentCreate(root, *remap);
+    else
+      deserializeCreateWithRemap(root, nullptr);
+  }
+  catch (...)
+  {
+    Tny_free(root);
+    throw;
+  }
+  Tny_free(root);
+}
+
 // deserializeComponentMerge and deserializeComponentCreate are the same 
 // function with a different ComponentSerialize call. Figure out a way to 
 // fix this.
@@ -143,27 +771,14 @@ void CerealCore::deserializeComponentMerge(Tny* root, bool copyExisting)
 
     const char* heapName = cur->key;
 
-    // Search for the correct system name in our current set of registered
-    // systems. This is not efficient. If more speed is needed, use a map with
-    // hashed strings.
-    bool foundHeap = false;
-    for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
-    {
-      ComponentSerializeInterface* heap = dynamic_cast<ComponentSerializeInterface*>(it->second);
-      if (std::strcmp(heap->getComponentName(), heapName) == 0)
-      {
-        // Found the appropriate container, obtain Tny object and 
-        heap->deserializeMerge(*this, cur->value.tny, copyExisting);
-        foundHeap = true;
-        break;
-      }
-    }
-
-    if (foundHeap != true)
+    ComponentSerializeInterface* heap = findHeapByKey(heapName);
+    if (heap == nullptr)
     {
       std::cerr << "cpm-es-cereal: Warning - Unable to find heap with key: " << heapName << std::endl;
       return;
     }
+
+    heap->deserializeMerge(*this, cur->value.tny, copyExisting);
   }
 }
 
@@ -171,6 +786,33 @@ void CerealCore::deserializeComponentMerge(Tny* root, bool copyExisting)
 // function with a different ComponentSerialize call. Figure out a way to 
 // fix this.
 void CerealCore::deserializeComponentCreate(Tny* root)
+{
+  deserializeCreateWithRemap(root, nullptr);
+}
+
+void CerealCore::deserializeComponentCreate(Tny* root, EntityRemap& remap)
+{
+  // Entities owning components are the ones being created. Other IDs found
+  // in entity ID fields refer to entities outside of root.
+  if (root != NULL && root->type == TNY_DICT)
+  {
+    std::vector<uint64_t> entityIDs;
+    Tny* cur = root;
+    while (Tny_hasNext(cur))
+    {
+      cur = Tny_next(cur);
+      if (cur->type == TNY_OBJ)
+        heap_detail::collectSerializedEntityIDs(cur->value.tny, entityIDs);
+    }
+
+    for (uint64_t entityID : entityIDs)
+      remap.addEntity(entityID);
+  }
+
+  deserializeCreateWithRemap(root, &remap);
+}
+
+void CerealCore::deserializeCreateWithRemap(Tny* root, EntityRemap* remap)
 {
   if (root == NULL)
   {
@@ -206,27 +848,167 @@ void CerealCore::deserializeComponentCreate(Tny* root)
 
     const char* heapName = cur->key;
 
-    // Search for the correct system name in our current set of registered
-    // systems. This is not efficient. If more speed is needed, use a map with
-    // hashed strings.
-    bool foundHeap = false;
-    for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+    ComponentSerializeInterface* heap = findHeapByKey(heapName);
+    if (heap == nullptr)
     {
-      ComponentSerializeInterface* heap = dynamic_cast<ComponentSerializeInterface*>(it->second);
-      if (std::strcmp(heap->getComponentName(), heapName) == 0)
-      {
-        // Found the appropriate container, obtain Tny object and 
-        heap->deserializeCreate(*this, cur->value.tny);
-        foundHeap = true;
-        break;
-      }
+      std::cerr << "cpm-es-cereal: Warning - Unable to find heap with key: " << heapName << std::endl;
+      return;
     }
 
-    if (foundHeap != true)
+    heap->deserializeCreate(*this, cur->value.tny, remap);
+  }
+}
+
+void CerealCore::deserializeComponentMerge(const CerealSnapshot& snapshot, bool copyExisting)
+{
+  for (size_t i = 0; i < snapshot.getNumHeaps(); ++i)
+  {
+    Tny* root = snapshot.getHeap(i).loadTny();
+    if (root == NULL)
     {
-      std::cerr << "cpm-es-cereal: Warning - Unable to find heap with key: " << heapName << std::endl;
-      return;
+      std::cerr << "cpm-es-cereal: Unable to load snapshot heap " << snapshot.getHeapName(i) << std::endl;
+      throw std::runtime_error("Failed to load snapshot heap");
     }
+
+    deserializeComponentMerge(root, copyExisting);
+    Tny_free(root);
+  }
+}
+
+void CerealCore::deserializeComponentCreate(const CerealSnapshot& snapshot)
+{
+  for (size_t i = 0; i < snapshot.getNumHeaps(); ++i)
+  {
+    Tny* root = snapshot.getHeap(i).loadTny();
+    if (root == NULL)
+    {
+      std::cerr << "cpm-es-cereal: Unable to load snapshot heap " << snapshot.getHeapName(i) << std::endl;
+      throw std::runtime_error("Failed to load snapshot heap");
+    }
+
+    deserializeComponentCreate(root);
+    Tny_free(root);
+  }
+}
+
+ComponentSerializeInterface* CerealCore::findHeapByName(const char* name)
+{
+  int64_t index = findRegistryIndex(name);
+  if (index >= 0)
+    return mHeapRegistry[index].heap;
+
+  // Heaps created by adding components without registering them first.
+  // Heaps removed with unregisterComponent are skipped.
+  for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+  {
+    if (mHeapsByTemplateID.find(it->first) != mHeapsByTemplateID.end())
+      continue;
+
+    ComponentSerializeInterface* heap = dynamic_cast<ComponentSerializeInterface*>(it->second);
+    if (heap != nullptr && std::strcmp(heap->getComponentName(), name) == 0)
+      return heap;
+  }
+  return nullptr;
+}
+
+ComponentSerializeInterface* CerealCore::findHeapByKey(const char* key)
+{
+  if (key == NULL)
+    return nullptr;
+
+  uint32_t heapID = 0;
+  if (parseHeapIDKey(key, heapID))
+    return getHeapByID(heapID);
+
+  if (key[0] == '#')
+  {
+    char* end = NULL;
+    unsigned long decimalID = std::strtoul(key + 1, &end, 10);
+    if (end != key + 1 && *end == '\0')
+      return getHeapByID(static_cast<uint32_t>(decimalID));
+  }
+
+  return findHeapByName(key);
+}
+
+std::shared_ptr<CerealPrefab> CerealCore::createPrefab(Tny* root)
+{
+  if (root == NULL)
+  {
+    std::cerr << "cpm-es-cereal: createPrefab root is NULL" << std::endl;
+    throw std::runtime_error("Tny root NULL");
+  }
+
+  if (root->type != TNY_DICT)
+  {
+    std::cerr << "cpm-es-cereal: Unexpected Tny type to createPrefab." << std::endl;
+    throw std::runtime_error("Unexpected Tny type");
+  }
+
+  std::shared_ptr<CerealPrefab> prefab(new CerealPrefab());
+
+  Tny* cur = root;
+  while (Tny_hasNext(cur))
+  {
+    cur = Tny_next(cur);
+
+    if (cur->type != TNY_OBJ)
+    {
+      std::cerr << "cpm-es-cereal: Unexpected Tny type deserializing heap." << std::endl;
+      throw std::runtime_error("Unexpected Tny type");
+    }
+
+    ComponentSerializeInterface* heap = findHeapByKey(cur->key);
+    if (heap == nullptr)
+    {
+      std::cerr << "cpm-es-cereal: Warning - Unable to find heap with key: " << cur->key << std::endl;
+      continue;
+    }
+
+    std::unique_ptr<PrefabHeapInterface> decoded = heap->decodePrefab(*this, cur->value.tny);
+    if (decoded)
+      prefab->addHeap(std::move(decoded));
+  }
+
+  return prefab;
+}
+
+std::shared_ptr<CerealPrefab> CerealCore::cachePrefab(const std::string& name, Tny* root)
+{
+  std::shared_ptr<CerealPrefab> prefab = createPrefab(root);
+  mPrefabs[name] = prefab;
+  return prefab;
+}
+
+std::shared_ptr<CerealPrefab> CerealCore::getCachedPrefab(const std::string& name)
+{
+  auto it = mPrefabs.find(name);
+  if (it != mPrefabs.end())
+    return it->second;
+  else
+    return std::shared_ptr<CerealPrefab>();
+}
+
+void CerealCore::uncachePrefab(const std::string& name)
+{
+  mPrefabs.erase(name);
+}
+
+void CerealCore::instantiatePrefab(const CerealPrefab& prefab, EntityRemap& remap)
+{
+  prefab.instantiate(remap);
+}
+
+void CerealCore::remapEntityReferences(const EntityIDTable& table)
+{
+  if (table.empty())
+    return;
+
+  for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+  {
+    ComponentSerializeInterface* heap = dynamic_cast<ComponentSerializeInterface*>(it->second);
+    if (heap != nullptr)
+      heap->remapEntityReferences(*this, table);
   }
 }
 
@@ -1,13 +1,27 @@
 #ifndef IAUNS_CEREALCORE_HPP
 #define IAUNS_CEREALCORE_HPP
 
+#include <map>
+#include <memory>
 #include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <iostream>
 #include <stdexcept>
 #include <entity-system/ESCoreBase.hpp>
 
 #include "CerealHeap.hpp"
 #include "ComponentSerialize.hpp"
+#include "CerealAllocator.hpp"
+#include "CerealPrefab.hpp"
+#include "CerealBuffer.hpp"
+#include "CerealSnapshot.hpp"
+#include "CerealSegmentList.hpp"
+#include "CerealFileWriter.hpp"
+#include "CerealShards.hpp"
+#include "CerealHash.hpp"
+#include "CerealWire.hpp"
 
 struct _Tny;
 typedef _Tny Tny;
@@ -17,6 +31,33 @@ namespace CPM_ES_CEREAL_NS {
 class CerealCore : public CPM_ES_NS::ESCoreBase
 {
 public:
+  /// How heaps are keyed in serialized output.
+  enum HeapKeyMode
+  {
+    HEAP_KEY_NAME,  ///< Default. Heaps are keyed by component name, and
+                    ///< heap IDs never reach the wire; the registry only
+                    ///< uses name hashes to find heaps by name.
+    HEAP_KEY_ID     ///< Registered heaps are keyed by heap ID, written as
+                    ///< a binary integer (see makeHeapIDKey). The reading
+                    ///< core must register the same components under the
+                    ///< same heap IDs (the default hashed IDs agree).
+  };
+
+  /// Heap ID keys are HEAP_ID_KEY_MARKER followed by the 32 bit ID in five
+  /// big endian groups of 7 bits, each with the high bit set. Tny keys are
+  /// NUL terminated, so the ID can't be written as plain bytes; this form
+  /// has no NUL, is never a component name, and decodes without parsing
+  /// digits.
+  static const char HEAP_ID_KEY_MARKER = '\x01';
+  static const size_t HEAP_ID_KEY_SIZE = 6;
+
+  /// Key heap \p heapID is written under in HEAP_KEY_ID mode.
+  static std::string makeHeapIDKey(uint32_t heapID);
+
+  /// Decodes a key written by makeHeapIDKey. Returns false if \p key is
+  /// not a heap ID key.
+  static bool parseHeapIDKey(const char* key, uint32_t& heapID);
+
   CerealCore();
   virtual ~CerealCore();
 
@@ -30,6 +71,19 @@ public:
   /// the returned void*.
   static std::tuple<void*, size_t> dumpTny(Tny* tny);
 
+  /// Same as dumpTny above, except the returned memory is obtained from
+  /// \p allocator. Tny only dumps into memory it mallocs, so allocators
+  /// other than the default one receive a copy of the dump. Use a
+  /// LargeBufferAllocator for multi-gigabyte snapshots so the resulting
+  /// buffer is backed by huge pages. The caller is responsible for calling allocator.deallocate on the returned void*,
+  /// passing along the returned size.
+  static std::tuple<void*, size_t> dumpTny(Tny* tny, CerealAllocator& allocator);
+
+  /// Same as dumpTny above, except the dump is returned as a reference
+  /// counted CerealBuffer. No copy is made: the buffer takes ownership of
+  /// Tny's allocation and frees it when the last copy is destroyed.
+  static CerealBuffer dumpTnyShared(Tny* tny);
+
   /// Accepts a pointer to Tny data and the size of the Tny data, and
   /// then converts the inputs into a Tny pointer which can be given to
   /// any one of the deserialize functions below. The data pointer is not
@@ -42,13 +96,177 @@ public:
   /// by dumpTny.
   static void freeTnyDataPtr(void* ptr);
 
+  /// Installs the allocator that es-cereal's own allocations are routed
+  /// through (name registries, type headers, and memory handed out by
+  /// ComponentSerialize::getAllocator). The allocator must outlive this core.
+  /// Allocations made internally by the Tny library are not affected.
+  void setAllocator(CerealAllocator& allocator);
+
+  /// Retrieves the allocator installed with setAllocator. Defaults to
+  /// CerealAllocator::getDefault().
+  CerealAllocator& getAllocator() {return *mAllocator;}
+
   /// Serializes all components.
   /// The caller is responsible for calling Tny_free on the returned Tny*.
   Tny* serializeAllComponents();
 
+  /// Serializes all components into a single shared buffer framed by heap
+  /// (see CerealSnapshot). The buffer is allocated from getAllocator(). Use
+  /// this when a snapshot fans out to several consumers: copies of the
+  /// snapshot, its buffer, or any of its per-heap slices share memory.
+  CerealSnapshot dumpSnapshot();
+
+  /// Same bytes as dumpSnapshot().getBuffer(), returned as a list of
+  /// segments instead of a single buffer: one segment holds the framing of
+  /// the snapshot (header and every heap's frame, sliced out of a single
+  /// small allocation) and the Tny dump of each heap is its own segment.
+  /// Hand the segments to writev or sendmsg (see CerealSegmentList) to
+  /// avoid concatenating large snapshots. The receiver parses the bytes
+  /// with CerealSnapshot::parse as usual.
+  CerealSegmentList dumpSnapshotSegments();
+
+#ifndef _WIN32
+  /// Streams the bytes of dumpSnapshot().getBuffer() into \p writer, one
+  /// heap at a time: each heap is submitted as soon as it is dumped, so
+  /// earlier heaps are written to disk while later ones are serialized.
+  /// Does not call CerealFileWriter::finish.
+  void writeSnapshot(CerealFileWriter& writer);
+
+  /// Saves every serializable heap to its own file in \p directory (created
+  /// if missing), alongside a manifest of fingerprints (see
+  /// CerealShardManifest). Heaps whose file already holds identical bytes,
+  /// according to the previous manifest, are not rewritten; combined with
+  /// setReuseUnchangedHeaps, unchanged heaps cost neither serialization nor
+  /// I/O. Changed heaps are written to new files on up to \p numThreads
+  /// threads and, if \p sync is set, synced along with the directory. Then
+  /// the manifest is replaced atomically and files it no longer refers to
+  /// are removed. Returns the number of heap files written. Throws
+  /// std::runtime_error on failure; the previous save stays loadable then.
+  size_t saveShards(const std::string& directory, size_t numThreads = 1, bool sync = true);
+
+  /// Creates components from a directory written by saveShards. Files are
+  /// read, checked against their fingerprints and parsed on up to
+  /// \p numThreads threads, then decoded as deserializeComponentCreate
+  /// would. Renormalization is required afterwards. Throws
+  /// std::runtime_error if the manifest is missing or any file is missing
+  /// or doesn't match its fingerprint; no components are created then.
+  void loadShards(const std::string& directory, size_t numThreads = 1);
+#endif
+
+  /// Encodes all components with the wire backend \p Backend (see
+  /// CerealWire.hpp) into a buffer allocated from getAllocator():
+  ///
+  ///   CerealBuffer data = core.encodeAllComponents<cereal::RecordWireBackend>();
+  ///   other.decodeComponentCreate<cereal::RecordWireBackend>(data);
+  ///
+  /// The exact size is computed before anything is written, so the buffer is
+  /// allocated once. If \p maxSize is not 0 and the output would be larger,
+  /// nothing is encoded and an empty buffer is returned. Throws
+  /// std::runtime_error if the backend can't encode a component.
+  template <typename Backend>
+  CerealBuffer encodeAllComponents(size_t maxSize = 0)
+  {
+    WireEncoders<Backend> encoders;
+    size_t size = prepareWireEncoders(encoders);
+    if (maxSize != 0 && size > maxSize)
+      return CerealBuffer();
+
+    void* data = mAllocator->allocate(size);
+    if (data == NULL)
+    {
+      std::cerr << "cpm-es-cereal: Failed to allocate encoding of size " << size << std::endl;
+      throw std::runtime_error("Failed allocation");
+    }
+
+    char* out = wire_detail::writeHeader(static_cast<char*>(data), Backend::ID,
+                                         static_cast<uint32_t>(encoders.heaps.size()));
+    for (size_t i = 0; i < encoders.heaps.size(); ++i)
+    {
+      const typename Backend::HeapEncoder& encoder = *encoders.heaps[i];
+      out = wire_detail::writeFrame(out, encoders.keys[i], encoder.getSize());
+      encoder.write(out);
+      out += encoder.getSize();
+    }
+
+    return CerealBuffer::adopt(data, size, *mAllocator);
+  }
+
+  /// Exact size of the output of encodeAllComponents<Backend>, without
+  /// encoding. Use it to reserve network buffers or enforce a budget.
+  /// BinaryWireBackend and RecordWireBackend pack every component to learn
+  /// its size (see ComponentSerializeInterface::packComponents), and
+  /// TnyWireBackend dumps every heap.
+  template <typename Backend>
+  size_t measureAllComponents()
+  {
+    WireEncoders<Backend> encoders;
+    return prepareWireEncoders(encoders);
+  }
+
+  /// Creates components from the output of encodeAllComponents<Backend>.
+  /// Same semantics as deserializeComponentCreate: renormalization is
+  /// required afterwards. Throws std::runtime_error if \p data is malformed
+  /// or was encoded by a different backend.
+  template <typename Backend>
+  void decodeComponentCreate(const CerealBuffer& data)
+  {
+    wire_detail::WireReader reader(data.data(), data.size(), Backend::ID);
+
+    std::string key;
+    const char* payload = NULL;
+    size_t payloadSize = 0;
+    while (reader.nextHeap(key, payload, payloadSize))
+    {
+      ComponentSerializeInterface* heap = findHeapByKey(key.c_str());
+      if (heap == nullptr)
+      {
+        std::cerr << "cpm-es-cereal: Warning - Unable to find heap with key: " << key << std::endl;
+        return;
+      }
+
+      Backend::decodeHeapCreate(*this, *heap, payload, payloadSize);
+    }
+  }
+
   /// Serializes a single entity into CerealSerialize.
   /// The caller is responsible for calling Tny_free on the returned Tny*.
   Tny* serializeEntity(uint64_t entityID);
+
+  /// Same document as serializeEntity, already dumped (see dumpTny) and
+  /// allocated from getAllocator(). Heaps without components of \p entityID
+  /// are left out. The dump is assembled from the bytes each heap dumps for
+  /// the entity, so heaps caching their entities (see
+  /// CerealHeap::setCacheEncodedEntities) don't serialize them again; the
+  /// bytes are loaded and dumped again as a single document.
+  CerealBuffer dumpEntity(uint64_t entityID);
+
+  /// Hands a batch of entities over to another core (shard handoff):
+  ///
+  ///   CerealBuffer payload = source.extractEntities(entityIDs);
+  ///   ...                               // Send payload to the other shard.
+  ///   destination.insertEntities(payload);
+  ///
+  /// Serializes every component of \p entityIDs, in all serializable heaps,
+  /// into a single Tny document shaped like serializeAllComponents output
+  /// restricted to those entities. Heaps without any of the entities are
+  /// left out. If \p remove is true the entities are then removed from every
+  /// heap, including non-serializable ones, as removeEntity would.
+  /// Renormalization is required afterwards. The IDs are sorted once, and
+  /// each heap is walked (or galloped) once for the whole batch, both to
+  /// serialize and to remove the entities.
+  CerealBuffer extractEntities(const std::vector<uint64_t>& entityIDs, bool remove = true);
+
+  /// Creates the entities extracted by extractEntities. Same semantics as
+  /// deserializeComponentCreate: renormalization is required afterwards.
+  /// Throws std::runtime_error if \p payload is not a Tny document.
+  ///
+  /// Without \p remap the entities keep their IDs. ESCoreBase offers no way
+  /// to move its ID counter, so this core's getNewEntityID may later hand
+  /// out one of those IDs; only do this when cores allocate IDs from
+  /// disjoint ranges. Otherwise pass EntityRemap(*this): the inserted
+  /// entities get fresh IDs from this core (as deserializeComponentCreate
+  /// with a remap), and \p remap reports them afterwards.
+  void insertEntities(const CerealBuffer& payload, EntityRemap* remap = nullptr);
   
   /// Serializes a Tny pointer as if it were an entity. Useful in constructing
   /// change sets. Output can be used in conjunction with
@@ -77,7 +295,8 @@ public:
 
     // Add val to a dictionary which contains the component's name.
     Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
-    root = Tny_add(root, TNY_OBJ, const_cast<char*>(heap->getComponentName()), val, 0);
+    root = Tny_add(root, TNY_OBJ,
+                   const_cast<char*>(getHeapKey(CPM_ES_NS::TemplateID<T>::getID(), heap)), val, 0);
 
     // Get rid of value since a deep copy was made.
     Tny_free(val);
@@ -98,6 +317,10 @@ public:
   /// delta compression is being used.
   void deserializeComponentMerge(Tny* root, bool copyExisting);
 
+  /// Same as deserializeComponentMerge above, reading each heap of
+  /// \p snapshot in turn.
+  void deserializeComponentMerge(const CerealSnapshot& snapshot, bool copyExisting);
+
   /// Create components from serialized data. Creates components regardless of
   /// the existence of any other components. Renormalization is required after
   /// calling this function in order to add the components. Accepts Tny output
@@ -105,27 +328,131 @@ public:
   /// components). This function does not call Tny_free.
   void deserializeComponentCreate(Tny* root);
 
+  /// Same as deserializeComponentCreate above, reading each heap of
+  /// \p snapshot in turn.
+  void deserializeComponentCreate(const CerealSnapshot& snapshot);
+
+  /// Same as deserializeComponentCreate above, except all entity IDs are
+  /// translated through \p remap. This includes the IDs of the entities that
+  /// own the components and any entity ID fields serialized with
+  /// ComponentSerialize::serializeEntityID. Every entity owning a component
+  /// in \p root is declared to \p remap first (EntityRemap::addEntity), so
+  /// a remap with a core only gives those fresh IDs: references to entities
+  /// outside of \p root, and null (0) references, are kept. Use this to
+  /// instantiate a serialized template (prefab) many times from the same
+  /// Tny root:
+  ///
+  ///   EntityRemap remap(core);        // Fresh IDs from core.
+  ///   core.deserializeComponentCreate(prefab, remap);
+  ///   remap.clear();                  // Next instance gets new IDs.
+  ///   core.deserializeComponentCreate(prefab, remap);
+  void deserializeComponentCreate(Tny* root, EntityRemap& remap);
+
+  /// Decodes a serialized entity template (output of serializeAllComponents
+  /// or serializeEntity) into typed component arrays. The returned prefab can
+  /// then be instantiated any number of times with instantiatePrefab without
+  /// touching Tny again. Entity ID fields that are serialized through
+  /// ComponentSerialize::serializeEntityID and refer to entities inside of
+  /// the template are remapped on instantiation. This function does not call
+  /// Tny_free.
+  std::shared_ptr<CerealPrefab> createPrefab(Tny* root);
+
+  /// Decodes \p root with createPrefab and caches the result under \p name.
+  /// Replaces any prefab previously cached under the same name.
+  std::shared_ptr<CerealPrefab> cachePrefab(const std::string& name, Tny* root);
+
+  /// Retrieves a prefab cached with cachePrefab. Returns an empty pointer if
+  /// no prefab is cached under \p name.
+  std::shared_ptr<CerealPrefab> getCachedPrefab(const std::string& name);
+
+  /// Removes a prefab from the cache.
+  void uncachePrefab(const std::string& name);
+
+  /// Instantiates \p prefab, mapping every template entity through
+  /// \p remap. Renormalization is required after calling this function.
+  void instantiatePrefab(const CerealPrefab& prefab, EntityRemap& remap);
+
+  /// Rewrites every entity ID field (see ComponentSerialize::serializeEntityID)
+  /// of every component in the system through \p table. IDs not present in
+  /// the table are left untouched, as are the entities owning the components.
+  /// Use after bulk loads or merges that renumber entities. Each heap is
+  /// fixed up with one linear sweep over its component array.
+  void remapEntityReferences(const EntityIDTable& table);
+
   /// Registers a component. This builds a component heap if one is not already
   /// present. This is not strictly mandatory, but will help avoid errors if you
   /// are deserializing a saved state and have not used all of the components
   /// in the system yet.
+  ///
+  /// Each registered heap receives a numeric heap ID, used as its key on the
+  /// wire in HEAP_KEY_ID mode. If \p heapID is 0 the ID is hashName of the
+  /// component name, so every core agrees on IDs regardless of registration
+  /// order. Throws std::runtime_error if two names hash to the same value
+  /// or an ID is already taken; pass an explicit ID to resolve a collision.
+  /// Returns the heap ID.
+  ///
+  /// A name removed with unregisterComponent keeps its heap ID: registering
+  /// it again, with T or a replacement type, returns the same ID, and
+  /// \p heapID must then be 0 or that ID.
   template <typename T>
-  void registerComponent()
+  uint32_t registerComponent(uint32_t heapID = 0)
   {
-    CPM_ES_NS::BaseComponentContainer* system = ensureComponentArrayExists<T, CerealHeap<T>>();
-    const char* name = dynamic_cast<CerealHeap<T>*>(system)->getComponentName();
+    CerealHeap<T>* heap = dynamic_cast<CerealHeap<T>*>(ensureComponentArrayExists<T, CerealHeap<T>>());
+    bool retired = isHeapRetired(CPM_ES_NS::TemplateID<T>::getID());
+    uint32_t id = registerHeap(heap, CPM_ES_NS::TemplateID<T>::getID(), ComponentNameHash<T>::get(), heapID);
+    if (retired)
+      heap->setSerializable(true);
+    return id;
+  }
 
-    // Ensure there are no duplicate component names.
-    if (std::get<1>(mComponentNames.insert(std::string(name))) == false)
-    {
-      std::cerr << "cpm-es-cereal: Component with duplicate name." << " Name: " << name << std::endl;
-      throw std::runtime_error("cpm-es-cereal: Component with duplicate name.");
-      return;
-    }
+  /// Removes T from the registry so that its name can be registered again,
+  /// typically by a reloaded version of the component type. T's heap is
+  /// emptied (removeAllComponentsImmediately) and stops being serialized
+  /// until T is registered again. The name and its heap ID stay reserved
+  /// (see registerComponent). Returns false if T isn't registered.
+  template <typename T>
+  bool unregisterComponent()
+  {
+    uint64_t templateID = CPM_ES_NS::TemplateID<T>::getID();
+    if (!unregisterHeap(templateID))
+      return false;
 
-    mComponentIDNameMap.insert(std::make_pair(CPM_ES_NS::TemplateID<T>::getID(), std::string(name)));
+    CerealHeap<T>* heap = dynamic_cast<CerealHeap<T>*>(getComponentContainer(templateID));
+    heap->removeAllComponentsImmediately();
+    heap->setSerializable(false);
+    return true;
   }
 
+  /// Retrieves the heap ID of the component registered under \p name.
+  /// Returns 0 if no such component is registered.
+  uint32_t getHeapID(const char* name) const;
+
+  /// Retrieves the heap registered under \p heapID. Returns NULL if no
+  /// heap is registered under that ID.
+  ComponentSerializeInterface* getHeapByID(uint32_t heapID) const;
+
+  /// Selects how heaps are keyed by serializeAllComponents, serializeEntity,
+  /// serializeValue and dumpSnapshot. Deserialization accepts either form.
+  void setHeapKeyMode(HeapKeyMode mode)   {mHeapKeyMode = mode;}
+  HeapKeyMode getHeapKeyMode() const      {return mHeapKeyMode;}
+
+  /// Key \p heap (of component template ID \p templateID) is written under,
+  /// given the current HeapKeyMode.
+  const char* getHeapKey(uint64_t templateID, ComponentSerializeInterface* heap) const;
+
+  /// When enabled, serializeAllComponents and dumpSnapshot keep the
+  /// serialized form of every heap and reuse it for as long as the heap's
+  /// generation (see CerealHeap::getGeneration) is unchanged, so periodic
+  /// saves only pay for heaps that were modified. Heaps of components that
+  /// aren't trivially copyable have no generation and are always serialized
+  /// again. Disabling releases the cache. Default: disabled.
+  void setReuseUnchangedHeaps(bool reuse);
+  bool getReuseUnchangedHeaps() const     {return mReuseUnchangedHeaps;}
+
+  /// Number of heaps reused from the cache by the last call to
+  /// serializeAllComponents or dumpSnapshot.
+  size_t getNumHeapsReused() const        {return mNumHeapsReused;}
+
   template <typename T>
   void addComponent(uint64_t entityID, const T& component)
   {
@@ -138,6 +465,7 @@ public:
     }
 
     coreAddComponent<T, CerealHeap<T>>(entityID, component);
+    getOrCreateComponentContainer<T>()->markModified(entityID);
   }
 
   template <typename T>
@@ -151,7 +479,10 @@ public:
       std::cerr << "cpm-es-cereal: Component - " << std::decay<T>::type::getName() << std::endl;
     }
 
-    return coreAddStaticComponent<T, CerealHeap<typename std::decay<T>::type>>(std::forward<T>(component));
+    typedef typename std::decay<T>::type U;
+    size_t index = coreAddStaticComponent<T, CerealHeap<U>>(std::forward<T>(component));
+    getOrCreateComponentContainer<U>()->markModified();
+    return index;
   }
 
   /// Marks the entire component container as non-serializable. This is useful
@@ -178,10 +509,149 @@ public:
 
 protected:
 
-  /// Set containing names of all components registered this far. Used to ensure
-  /// no name conflicts are registered.
-  std::set<std::string>           mComponentNames;
-  std::map<uint64_t, std::string> mComponentIDNameMap;
+  void deserializeCreateWithRemap(Tny* root, EntityRemap* remap);
+
+  /// Finds the serializable heap whose component name is \p name. Returns
+  /// NULL if there is no such heap.
+  ComponentSerializeInterface* findHeapByName(const char* name);
+
+  /// Finds the heap for a key found in serialized data: either a component
+  /// name or a heap ID key (see makeHeapIDKey). Heap IDs written as "#3",
+  /// by earlier versions, are accepted as well. Returns NULL if there is no
+  /// such heap.
+  ComponentSerializeInterface* findHeapByKey(const char* key);
+
+  /// Heap encoders of one encodeAllComponents call, in heap order.
+  template <typename Backend>
+  struct WireEncoders
+  {
+    std::vector<std::unique_ptr<typename Backend::HeapEncoder>> heaps;
+    std::vector<const char*> keys;
+  };
+
+  /// Creates an encoder for every serializable heap. Returns the total
+  /// encoded size, framing included.
+  template <typename Backend>
+  size_t prepareWireEncoders(WireEncoders<Backend>& encoders)
+  {
+    size_t size = wire_detail::HEADER_SIZE;
+    for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+    {
+      ComponentSerializeInterface* heap =
+          dynamic_cast<ComponentSerializeInterface*>(it->second);
+      if (heap->isSerializable() == false)
+        continue;
+
+      const char* key = getHeapKey(it->first, heap);
+      encoders.heaps.emplace_back(new typename Backend::HeapEncoder(*this, *heap));
+      encoders.keys.push_back(key);
+      size += wire_detail::getFrameSize(key) + encoders.heaps.back()->getSize();
+    }
+    return size;
+  }
+
+
+  uint32_t registerHeap(ComponentSerializeInterface* heap, uint64_t templateID,
+                        uint32_t nameHash, uint32_t heapID);
+
+  /// Retires the registry entry of \p templateID. Returns false if it isn't
+  /// registered.
+  bool unregisterHeap(uint64_t templateID);
+
+  /// True if \p templateID was unregistered and not registered since.
+  bool isHeapRetired(uint64_t templateID) const;
+
+  /// One heap of a snapshot: a {key: heap} Tny document.
+  struct HeapDump
+  {
+    const char*   name;
+    size_t        nameLength;
+    CerealBuffer  bytes;
+    uint64_t      fingerprint;  ///< hashBytes of bytes. 0 unless requested.
+  };
+
+  /// Dumps every serializable heap for dumpSnapshot and
+  /// dumpSnapshotSegments, reusing cached dumps where possible.
+  void dumpHeaps(std::vector<HeapDump>& dumps);
+
+  /// Dumps a single serializable heap (see dumpHeaps). Also computes
+  /// dump.fingerprint if \p fingerprint is set, reusing the cached one.
+  void dumpHeap(uint64_t templateID, ComponentSerializeInterface* heap, HeapDump& dump,
+                bool fingerprint = false);
+
+  /// Serialized form of a heap kept while mReuseUnchangedHeaps is set.
+  struct HeapCacheEntry
+  {
+    HeapCacheEntry() : generation(0), serialized(NULL), dumpFingerprint(0) {}
+
+    uint64_t      generation;   ///< Heap generation the entries below belong to.
+    Tny*          serialized;   ///< Result of serialize. May be NULL.
+    std::string   dumpKey;      ///< Key the dump was written under.
+    CerealBuffer  dump;         ///< {key: heap} document. May be empty.
+    uint64_t      dumpFingerprint; ///< hashBytes of dump. 0 if not computed.
+  };
+
+  /// Serializes \p heap, or returns the cached result if the heap has not
+  /// changed since it was cached. \p owned is set if the caller owns the
+  /// result (it isn't cached). Release with releaseSerializedHeap, passing
+  /// \p owned along.
+  Tny* acquireSerializedHeap(uint64_t templateID, ComponentSerializeInterface* heap, bool& owned);
+  void releaseSerializedHeap(Tny* serialized, bool owned);
+
+  /// Cache entry of \p heap if it is still valid, otherwise resets the entry
+  /// to the heap's current generation. NULL if reuse is disabled.
+  HeapCacheEntry* getHeapCacheEntry(uint64_t templateID, ComponentSerializeInterface* heap,
+                                    bool& valid);
+
+  /// Fills in \p dump's name and, if the heap's cached dump is still valid,
+  /// its bytes (and fingerprint if \p fingerprint is set); returns true
+  /// then. Otherwise returns false. \p entry is set to the heap's cache
+  /// entry, nullptr if it isn't cached.
+  bool findHeapDump(uint64_t templateID, ComponentSerializeInterface* heap, HeapDump& dump,
+                    bool fingerprint, HeapCacheEntry*& entry);
+  void cacheHeapDump(HeapCacheEntry* entry, const HeapDump& dump);
+
+  /// heap->serialize, throwing std::runtime_error if it fails.
+  Tny* serializeHeapForDump(ComponentSerializeInterface* heap, const char* name);
+  void clearHeapCache();
+
+  /// Index into mHeapRegistry of the heap registered as \p name, or -1.
+  int64_t findRegistryIndex(const char* name) const;
+
+  /// A registered heap.
+  struct HeapEntry
+  {
+    uint32_t                      heapID;
+    uint64_t                      templateID;
+    std::string                   name;     ///< Component name.
+    std::string                   wireKey;  ///< Key used in HEAP_KEY_ID mode.
+    ComponentSerializeInterface*  heap;     ///< NULL once unregistered.
+  };
+
+  typedef std::vector<HeapEntry, CerealStlAllocator<HeapEntry>> HeapRegistry;
+
+  typedef std::unordered_map<uint64_t, size_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                             CerealStlAllocator<std::pair<const uint64_t, size_t>>> IDIndexMap;
+
+  CerealAllocator*        mAllocator;   ///< Allocator for all es-cereal allocations.
+  HeapKeyMode             mHeapKeyMode;
+
+  /// Registered heaps, in registration order. The maps below index into
+  /// this array: by hashName of the component name (also used to reject
+  /// duplicate names and hash collisions), by heap ID, and by component
+  /// template ID. Unregistered entries are kept, without a heap, to reserve
+  /// their name and heap ID.
+  HeapRegistry            mHeapRegistry;
+  IDIndexMap              mHeapsByNameHash;
+  IDIndexMap              mHeapsByID;
+  IDIndexMap              mHeapsByTemplateID;
+
+  bool                    mReuseUnchangedHeaps;
+  size_t                  mNumHeapsReused;
+  std::map<uint64_t, HeapCacheEntry> mHeapCache;  ///< By component template ID.
+
+  /// Prefabs cached by name.
+  std::map<std::string, std::shared_ptr<CerealPrefab>> mPrefabs;
 };
 
 } // namespace CPM_ES_CEREAL_NS
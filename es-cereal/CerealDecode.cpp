@@ -0,0 +1,372 @@
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "CerealDecode.hpp"
+#include <tny/tny.hpp>
+
+namespace CPM_ES_CEREAL_NS {
+
+CerealDecodeLimits::CerealDecodeLimits() :
+    maxBytes(16 * 1024 * 1024),
+    maxNodes(1024 * 1024),
+    maxDepth(16),
+    maxBlobSize(1024 * 1024),
+    maxHeaps(256),
+    maxComponentsPerHeap(64 * 1024)
+{
+}
+
+const char* getDecodeResultString(CerealDecodeResult result)
+{
+  switch (result)
+  {
+    case DECODE_OK:                   return "ok";
+    case DECODE_TOO_LARGE:            return "input too large";
+    case DECODE_MALFORMED:            return "malformed input";
+    case DECODE_TOO_MANY_NODES:       return "too many nodes";
+    case DECODE_TOO_DEEP:             return "nesting too deep";
+    case DECODE_BLOB_TOO_LARGE:       return "binary value too large";
+    case DECODE_TOO_MANY_HEAPS:       return "too many heaps";
+    case DECODE_TOO_MANY_COMPONENTS:  return "too many components in heap";
+  }
+  return "unknown";
+}
+
+namespace decode_detail {
+
+CerealDecodeResult checkTree(Tny* root, const CerealDecodeLimits& limits, size_t& numNodes)
+{
+  if (root == NULL || (root->type != TNY_DICT && root->type != TNY_ARRAY))
+    return DECODE_MALFORMED;
+
+  // Explicit stack instead of recursion: depth is bounded by maxDepth, so
+  // the stack never holds more than maxDepth + 1 containers.
+  struct Pending
+  {
+    Tny*    container;
+    size_t  depth;
+  };
+  std::vector<Pending> stack;
+  Pending first = {root, 0};
+  stack.push_back(first);
+
+  while (!stack.empty())
+  {
+    Pending pending = stack.back();
+    stack.pop_back();
+
+    Tny* cur = pending.container;
+    if (++numNodes > limits.maxNodes) return DECODE_TOO_MANY_NODES;
+
+    uint64_t numElements = 0;
+    while (Tny_hasNext(cur))
+    {
+      cur = Tny_next(cur);
+      ++numElements;
+      if (++numNodes > limits.maxNodes) return DECODE_TOO_MANY_NODES;
+
+      switch (cur->type)
+      {
+        case TNY_BIN:
+          if (cur->size > limits.maxBlobSize) return DECODE_BLOB_TOO_LARGE;
+          if (cur->size != 0 && cur->value.ptr == NULL) return DECODE_MALFORMED;
+          break;
+
+        case TNY_OBJ:
+        {
+          Tny* child = cur->value.tny;
+          if (child == NULL || (child->type != TNY_DICT && child->type != TNY_ARRAY))
+            return DECODE_MALFORMED;
+          if (pending.depth + 1 > limits.maxDepth) return DECODE_TOO_DEEP;
+
+          Pending next = {child, pending.depth + 1};
+          stack.push_back(next);
+          break;
+        }
+
+        case TNY_DICT:
+        case TNY_ARRAY:
+          // Containers only appear as roots.
+          return DECODE_MALFORMED;
+
+        default:
+          break;
+      }
+    }
+
+    // Readers use the declared size (e.g. to count records), so it must
+    // match the elements actually present.
+    if (numElements != pending.container->size)
+      return DECODE_MALFORMED;
+  }
+
+  return DECODE_OK;
+}
+
+namespace {
+
+/// Bounds checked cursor over a Tny dump. Tny writes integers big endian.
+struct DumpReader
+{
+  const unsigned char*  pos;
+  const unsigned char*  end;
+
+  size_t getRemaining() const {return static_cast<size_t>(end - pos);}
+
+  bool skip(size_t size)
+  {
+    if (getRemaining() < size) return false;
+    pos += size;
+    return true;
+  }
+
+  bool readU8(uint8_t& value)
+  {
+    if (pos == end) return false;
+    value = *pos++;
+    return true;
+  }
+
+  bool readU32(uint32_t& value)
+  {
+    if (getRemaining() < 4) return false;
+    value = (static_cast<uint32_t>(pos[0]) << 24) | (static_cast<uint32_t>(pos[1]) << 16)
+        | (static_cast<uint32_t>(pos[2]) << 8) | static_cast<uint32_t>(pos[3]);
+    pos += 4;
+    return true;
+  }
+};
+
+/// Nodes a scan takes from a NodeBudget at a time.
+const size_t NODE_BUDGET_BLOCK = 1024;
+
+/// Nodes a scan has taken from a NodeBudget, covering the nodes it has
+/// visited. Whatever was taken but not visited is given back when the scan
+/// ends.
+struct BudgetClaim
+{
+  NodeBudget*   budget;
+  const size_t& numNodes;   ///< Nodes visited by the scan.
+  size_t        numTaken;
+
+  ~BudgetClaim()
+  {
+    if (budget != nullptr && numTaken > numNodes)
+      budget->giveBack(numTaken - numNodes);
+  }
+
+  /// Takes another block once the scan has visited every node taken.
+  bool cover()
+  {
+    if (budget == nullptr || numNodes <= numTaken) return true;
+    numTaken += budget->take(NODE_BUDGET_BLOCK);
+    return numNodes <= numTaken;
+  }
+};
+
+}
+
+size_t NodeBudget::take(size_t numNodes)
+{
+  size_t remaining = mRemaining.load();
+  for (;;)
+  {
+    size_t taken = std::min(numNodes, remaining);
+    if (taken == 0) return 0;
+    if (mRemaining.compare_exchange_weak(remaining, remaining - taken)) return taken;
+  }
+}
+
+CerealDecodeResult scanDump(const void* data, size_t dataSize, const CerealDecodeLimits& limits,
+                            NodeBudget* budget)
+{
+  if (data == NULL) return DECODE_MALFORMED;
+
+  DumpReader reader;
+  reader.pos = static_cast<const unsigned char*>(data);
+  reader.end = reader.pos + dataSize;
+
+  // One entry per open container, so the stack never holds more than
+  // maxDepth + 1 entries.
+  struct Level
+  {
+    uint32_t  remaining;    ///< Elements not yet scanned.
+    bool      dictionary;   ///< Elements carry keys.
+  };
+  std::vector<Level> stack;
+  size_t numNodes = 0;
+  BudgetClaim claim = {budget, numNodes, 0};
+
+  // Reads the header of a container (the root of the document or of a
+  // TNY_OBJ value) at depth stack.size().
+  auto openContainer = [&]() -> CerealDecodeResult
+  {
+    uint8_t type = 0;
+    uint32_t count = 0;
+    if (!reader.readU8(type) || !reader.readU32(count)) return DECODE_MALFORMED;
+    if (type != TNY_DICT && type != TNY_ARRAY) return DECODE_MALFORMED;
+    if (++numNodes > limits.maxNodes || !claim.cover()) return DECODE_TOO_MANY_NODES;
+    if (count > limits.maxNodes - numNodes) return DECODE_TOO_MANY_NODES;
+    // Every element takes at least its type byte.
+    if (count > reader.getRemaining()) return DECODE_MALFORMED;
+
+    // Heaps are {name: [type header, component array]}; the component
+    // array holds an entity ID and a dictionary per component.
+    if (stack.size() == 0 && count > limits.maxHeaps) return DECODE_TOO_MANY_HEAPS;
+    if (stack.size() == 2 && type == TNY_ARRAY && count / 2 > limits.maxComponentsPerHeap)
+      return DECODE_TOO_MANY_COMPONENTS;
+
+    Level level = {count, type == TNY_DICT};
+    stack.push_back(level);
+    return DECODE_OK;
+  };
+
+  CerealDecodeResult result = openContainer();
+  while (result == DECODE_OK && !stack.empty())
+  {
+    Level& level = stack.back();
+    if (level.remaining == 0)
+    {
+      stack.pop_back();
+      continue;
+    }
+    --level.remaining;
+
+    uint8_t type = 0;
+    uint32_t size = 0;
+    if (!reader.readU8(type)) return DECODE_MALFORMED;
+    if (level.dictionary && (!reader.readU32(size) || !reader.skip(size))) return DECODE_MALFORMED;
+    if (++numNodes > limits.maxNodes || !claim.cover()) return DECODE_TOO_MANY_NODES;
+
+    switch (type)
+    {
+      case TNY_NULL:  break;
+      case TNY_CHAR:  if (!reader.skip(1)) return DECODE_MALFORMED; break;
+      case TNY_INT32: if (!reader.skip(4)) return DECODE_MALFORMED; break;
+      case TNY_INT64: if (!reader.skip(8)) return DECODE_MALFORMED; break;
+
+      case TNY_BIN:
+        if (!reader.readU32(size)) return DECODE_MALFORMED;
+        if (size > limits.maxBlobSize) return DECODE_BLOB_TOO_LARGE;
+        if (!reader.skip(size)) return DECODE_MALFORMED;
+        break;
+
+      case TNY_OBJ:
+        if (stack.size() > limits.maxDepth) return DECODE_TOO_DEEP;
+        result = openContainer();
+        break;
+
+      default:
+        // Containers only appear as roots.
+        return DECODE_MALFORMED;
+    }
+  }
+
+  if (result == DECODE_OK && reader.pos != reader.end)
+    result = DECODE_MALFORMED;
+  return result;
+}
+
+CerealDecodeResult checkHeaps(Tny* root, const CerealDecodeLimits& limits)
+{
+  if (root == NULL || root->type != TNY_DICT) return DECODE_MALFORMED;
+  if (root->size > limits.maxHeaps) return DECODE_TOO_MANY_HEAPS;
+
+  Tny* heap = root;
+  while (Tny_hasNext(heap))
+  {
+    heap = Tny_next(heap);
+    if (heap->type != TNY_OBJ || heap->key == NULL) return DECODE_MALFORMED;
+
+    // [OBJ type header, OBJ component array]
+    Tny* heapRoot = heap->value.tny;
+    if (heapRoot->type != TNY_ARRAY || heapRoot->size != 2) return DECODE_MALFORMED;
+
+    Tny* header = Tny_next(heapRoot);
+    if (header->type != TNY_OBJ || header->value.tny->type != TNY_DICT) return DECODE_MALFORMED;
+    Tny* headerItem = header->value.tny;
+    while (Tny_hasNext(headerItem))
+    {
+      headerItem = Tny_next(headerItem);
+      if (headerItem->type != TNY_BIN || headerItem->size == 0) return DECODE_MALFORMED;
+
+      // Type names are read as C strings.
+      if (static_cast<const char*>(headerItem->value.ptr)[headerItem->size - 1] != '\0')
+        return DECODE_MALFORMED;
+    }
+
+    Tny* components = Tny_next(header);
+    if (components->type != TNY_OBJ || components->value.tny->type != TNY_ARRAY)
+      return DECODE_MALFORMED;
+
+    Tny* record = components->value.tny;
+    if (record->size % 2 != 0) return DECODE_MALFORMED;
+    if (record->size / 2 > limits.maxComponentsPerHeap) return DECODE_TOO_MANY_COMPONENTS;
+
+    while (Tny_hasNext(record))
+    {
+      record = Tny_next(record);
+      if (record->type != TNY_INT64) return DECODE_MALFORMED;
+      record = Tny_next(record);
+      if (record->type != TNY_OBJ || record->value.tny->type != TNY_DICT) return DECODE_MALFORMED;
+    }
+  }
+
+  return DECODE_OK;
+}
+
+} // namespace decode_detail
+
+Tny* loadTnyChecked(const void* data, size_t dataSize, const CerealDecodeLimits& limits,
+                    CerealDecodeResult* result, decode_detail::NodeBudget* budget)
+{
+  CerealDecodeResult status = DECODE_OK;
+  Tny* root = NULL;
+
+  if (data == NULL)
+  {
+    status = DECODE_MALFORMED;
+  }
+  else if (dataSize > limits.maxBytes)
+  {
+    // Checked before Tny_loads so oversized input costs nothing to reject.
+    status = DECODE_TOO_LARGE;
+  }
+  else if ((status = decode_detail::scanDump(data, dataSize, limits, budget)) == DECODE_OK)
+  {
+    // Tny_loads recurses and allocates as the input declares, so it only
+    // ever sees input that passed the scan.
+    root = Tny_loads(const_cast<void*>(data), dataSize);
+    if (root == NULL)
+    {
+      status = DECODE_MALFORMED;
+    }
+    else
+    {
+      size_t numNodes = 0;
+      status = decode_detail::checkTree(root, limits, numNodes);
+      if (status == DECODE_OK)
+        status = decode_detail::checkHeaps(root, limits);
+    }
+  }
+
+  if (status != DECODE_OK)
+  {
+#ifdef CPM_ES_CEREAL_VERBOSE_OUTPUT
+    std::cerr << "cpm-es-cereal: Rejected input - " << getDecodeResultString(status) << std::endl;
+#endif
+    if (root != NULL)
+    {
+      Tny_free(root);
+      root = NULL;
+    }
+  }
+
+  if (result != nullptr)
+    *result = status;
+  return root;
+}
+
+} // namespace CPM_ES_CEREAL_NS
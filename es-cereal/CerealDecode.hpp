@@ -0,0 +1,103 @@
+#ifndef IAUNS_CEREALDECODE_HPP
+#define IAUNS_CEREALDECODE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+struct _Tny;
+typedef _Tny Tny;
+
+namespace CPM_ES_CEREAL_NS {
+
+/// Limits enforced when decoding untrusted data (network packets, files
+/// from unknown sources). With these in place the cost of rejecting or
+/// accepting any input is bounded by the limits, not by what the input
+/// claims about itself.
+struct CerealDecodeLimits
+{
+  /// Defaults suitable for a game server receiving change sets.
+  CerealDecodeLimits();
+
+  size_t maxBytes;              ///< Size of the serialized input.
+  size_t maxNodes;              ///< Tny nodes in the whole document.
+  size_t maxDepth;              ///< Nesting of TNY_OBJ values.
+  size_t maxBlobSize;           ///< Size of any single TNY_BIN value.
+  size_t maxHeaps;              ///< Heaps in the document.
+  size_t maxComponentsPerHeap;  ///< Components in any single heap.
+};
+
+enum CerealDecodeResult
+{
+  DECODE_OK,
+  DECODE_TOO_LARGE,             ///< Input exceeds maxBytes.
+  DECODE_MALFORMED,             ///< Not a Tny document, or not shaped like serialized heaps.
+  DECODE_TOO_MANY_NODES,
+  DECODE_TOO_DEEP,
+  DECODE_BLOB_TOO_LARGE,
+  DECODE_TOO_MANY_HEAPS,
+  DECODE_TOO_MANY_COMPONENTS
+};
+
+/// Human readable description of \p result.
+const char* getDecodeResultString(CerealDecodeResult result);
+
+namespace decode_detail {
+
+/// Nodes shared by several scans, such as the heap slices of a snapshot
+/// validated on several threads. Scans take nodes in blocks and give back
+/// what they did not visit, so together they never visit more nodes than
+/// the budget started with.
+class NodeBudget
+{
+public:
+  explicit NodeBudget(size_t numNodes) : mRemaining(numNodes) {}
+
+  /// Takes up to \p numNodes nodes and returns how many were taken; 0 once
+  /// the budget is spent.
+  size_t take(size_t numNodes);
+
+  /// Returns \p numNodes taken but not visited.
+  void giveBack(size_t numNodes) {mRemaining += numNodes;}
+
+private:
+  std::atomic<size_t> mRemaining;
+};
+
+/// Walks \p root once, counting nodes and checking depth, blob sizes, and
+/// that every container holds as many elements as it declares. The walk
+/// stops as soon as a limit is exceeded. \p numNodes is incremented by the
+/// number of nodes visited.
+CerealDecodeResult checkTree(Tny* root, const CerealDecodeLimits& limits, size_t& numNodes);
+
+/// Walks the Tny dump \p data (the byte layout written by Tny_dumps)
+/// without building a tree and without recursion, enforcing every limit of
+/// \p limits: nodes, depth, blob sizes, heaps and components per heap.
+/// Declared counts and sizes are checked against the bytes actually
+/// present, so Tny_loads never sees input that could exhaust the stack or
+/// allocate more than the input holds. If \p budget is given, every node
+/// visited is also taken from it.
+CerealDecodeResult scanDump(const void* data, size_t dataSize, const CerealDecodeLimits& limits,
+                            NodeBudget* budget = nullptr);
+
+/// Checks that \p root has the shape produced by serializeAllComponents
+/// (dictionary of heaps, each a type header and an array of entity ID and
+/// component dictionary pairs) and that heap and component counts are
+/// within \p limits. Assumes checkTree succeeded.
+CerealDecodeResult checkHeaps(Tny* root, const CerealDecodeLimits& limits);
+}
+
+/// Checks \p data with decode_detail::scanDump, decodes it with Tny_loads
+/// and checks the shape of the result.
+/// Returns NULL if the data is invalid or exceeds any limit; \p result (if
+/// given) receives the reason. The caller is responsible for calling
+/// Tny_free on the returned Tny*. Documents accepted by this function are
+/// safe to hand to CerealCore's deserialize functions. \p budget (if given)
+/// is passed to the scan, so nodes count against it as well as maxNodes.
+Tny* loadTnyChecked(const void* data, size_t dataSize, const CerealDecodeLimits& limits,
+                    CerealDecodeResult* result = nullptr,
+                    decode_detail::NodeBudget* budget = nullptr);
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
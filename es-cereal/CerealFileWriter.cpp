@@ -0,0 +1,553 @@
+
+#ifndef _WIN32
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The ring needs the 5.6 kernel headers (io_uring_probe, IORING_OP_WRITE),
+// which also introduced IO_URING_OP_SUPPORTED. With older headers, or a
+// compiler without __has_include, the ring is compiled out and the writer
+// thread is always used.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup)
+#define CPM_ES_CEREAL_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#include "CerealFileWriter.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+namespace uring_detail {
+
+#ifdef CPM_ES_CEREAL_HAVE_IO_URING
+
+/// Minimal io_uring driven through the raw system calls (no liburing), only
+/// issuing IORING_OP_WRITE. Used from a single thread.
+struct Ring
+{
+  /// A write in flight. Short writes are resubmitted for the remainder.
+  struct Write
+  {
+    CerealBuffer  buffer;
+    size_t        written;
+    uint64_t      offset;
+  };
+
+  Ring() :
+      fd(-1),
+      file(-1),
+      sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED),
+      sqRingSize(0), cqRingSize(0), sqesSize(0),
+      numInFlight(0),
+      error(0)
+  {}
+
+  ~Ring()
+  {
+    // The kernel may still be reading from the buffers.
+    waitAll();
+    if (sqes != MAP_FAILED)
+      ::munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+      ::munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+      ::munmap(sqRing, sqRingSize);
+    if (fd != -1)
+      ::close(fd);
+  }
+
+  /// Sets up a ring of \p entries submissions writing to \p target.
+  /// Returns false if io_uring is unavailable or can't write.
+  bool setup(unsigned entries, int target)
+  {
+    file = target;
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (fd == -1 || !canWrite())
+      return false;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRing = ::mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+      return false;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      cqRing = sqRing;
+    else
+      cqRing = ::mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = ::mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_SQES);
+    if (cqRing == MAP_FAILED || sqes == MAP_FAILED)
+      return false;
+
+    char* sq = static_cast<char*>(sqRing);
+    sqHead  = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask  = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(cqRing);
+    cqHead  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask  = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes    = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // Never more writes in flight than submission entries, so the
+    // completion queue (twice as large) can't overflow.
+    writes.resize(params.sq_entries);
+    for (unsigned i = 0; i < params.sq_entries; ++i)
+      freeSlots.push_back(params.sq_entries - 1 - i);
+    return true;
+  }
+
+  /// Queues a write of \p buffer at \p offset. Waits for an earlier write
+  /// to complete if every slot is in use. Returns false, with errno set, if
+  /// the ring failed.
+  bool submitWrite(const CerealBuffer& buffer, uint64_t offset)
+  {
+    while (freeSlots.empty())
+    {
+      if (!reap(1))
+        return false;
+    }
+
+    unsigned slot = freeSlots.back();
+    freeSlots.pop_back();
+    writes[slot].buffer = buffer;
+    writes[slot].written = 0;
+    writes[slot].offset = offset;
+    ++numInFlight;
+    queueWrite(slot);
+    return enter(0);
+  }
+
+  /// Waits for every write in flight. Returns false, with errno set, if
+  /// any write failed.
+  bool waitAll()
+  {
+    while (numInFlight != 0)
+    {
+      if (!reap(1))
+        break;
+    }
+    if (error != 0)
+      errno = error;
+    return error == 0 && numInFlight == 0;
+  }
+
+  int       fd;
+  int       file;       ///< Written to by every write.
+  void*     sqRing;
+  void*     cqRing;
+  void*     sqes;
+  size_t    sqRingSize;
+  size_t    cqRingSize;
+  size_t    sqesSize;
+
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned  sqMask;
+  unsigned* sqArray;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned  cqMask;
+  struct io_uring_cqe* cqes;
+
+  std::vector<Write>    writes;     ///< Indexed by slot (the sqe's user_data).
+  std::vector<unsigned> freeSlots;
+  unsigned              numInFlight;
+  int                   error;      ///< errno of the first failed write.
+
+private:
+  /// True if the kernel supports IORING_OP_WRITE (5.6 and later).
+  bool canWrite()
+  {
+    const unsigned numOps = 256;
+    std::vector<char> storage(sizeof(struct io_uring_probe) + numOps * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(&storage[0]);
+    if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, numOps) != 0)
+      return false;
+    return probe->last_op >= IORING_OP_WRITE &&
+           (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  }
+
+  void queueWrite(unsigned slot)
+  {
+    const Write& write = writes[slot];
+    unsigned tail = *sqTail;
+    unsigned index = tail & sqMask;
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes) + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = file;
+    sqe->addr = reinterpret_cast<uint64_t>(static_cast<const char*>(write.buffer.data()) + write.written);
+    sqe->len = static_cast<uint32_t>(write.buffer.size() - write.written);
+    sqe->off = write.offset + write.written;
+    sqe->user_data = slot;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  /// Submits every queued entry and waits for \p minComplete completions.
+  bool enter(unsigned minComplete)
+  {
+    for (;;)
+    {
+      unsigned toSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+      if (toSubmit == 0 && minComplete == 0)
+        return true;
+      long result = ::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+                              minComplete != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (result >= 0 || errno != EINTR)
+        return result >= 0;
+    }
+  }
+
+  /// Waits for \p minComplete completions and retires every completed write.
+  bool reap(unsigned minComplete)
+  {
+    if (!enter(minComplete))
+      return false;
+
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+      const struct io_uring_cqe& cqe = cqes[head & cqMask];
+      unsigned slot = static_cast<unsigned>(cqe.user_data);
+      Write& write = writes[slot];
+      if (cqe.res > 0)
+        write.written += static_cast<size_t>(cqe.res);
+      else if (error == 0)
+        error = (cqe.res < 0) ? -cqe.res : EIO;
+
+      if (cqe.res > 0 && write.written < write.buffer.size())
+      {
+        queueWrite(slot);
+        continue;
+      }
+
+      write.buffer = CerealBuffer();
+      freeSlots.push_back(slot);
+      --numInFlight;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+    // Resubmit short writes.
+    return enter(0);
+  }
+};
+
+#else
+
+struct Ring
+{
+  bool setup(unsigned /* entries */, int /* target */)  {return false;}
+  bool submitWrite(const CerealBuffer&, uint64_t)      {return false;}
+  bool waitAll()                                       {return true;}
+};
+
+#endif
+
+} // namespace uring_detail
+
+const size_t CerealFileWriter::DIRECT_ALIGNMENT;
+const size_t CerealFileWriter::DIRECT_STAGING_SIZE;
+const unsigned CerealFileWriter::IO_URING_DEPTH;
+
+CerealFileWriter::CerealFileWriter() :
+    mFD(-1),
+    mDirect(false),
+    mStaged(false),
+    mAllowIoUring(true),
+    mBytesSubmitted(0),
+    mFileOffset(0),
+    mStaging(NULL),
+    mStagingUsed(0),
+    mStopping(false),
+    mError(0)
+{
+}
+
+CerealFileWriter::~CerealFileWriter()
+{
+  if (isOpen())
+  {
+    try
+    {
+      finish();
+    }
+    catch (const std::exception&)
+    {
+      // finish already reported the failure.
+    }
+  }
+}
+
+void CerealFileWriter::open(const char* path, bool direct)
+{
+  if (isOpen())
+  {
+    std::cerr << "cpm-es-cereal: File writer already has a file open." << std::endl;
+    throw std::runtime_error("File writer already open");
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  mDirect = false;
+#ifdef O_DIRECT
+  if (direct)
+  {
+    mFD = ::open(path, flags | O_DIRECT, 0644);
+    mDirect = (mFD != -1);
+  }
+#endif
+  // Some file systems (tmpfs, for instance) refuse O_DIRECT.
+  if (mFD == -1)
+    mFD = ::open(path, flags, 0644);
+
+  if (mFD == -1)
+  {
+    std::cerr << "cpm-es-cereal: Failed to open " << path << ": " << std::strerror(errno) << std::endl;
+    throw std::runtime_error("Failed to open file");
+  }
+
+  mStaged = direct;
+  mBytesSubmitted = 0;
+  mFileOffset = 0;
+  mStagingUsed = 0;
+  mStopping = false;
+  mError = 0;
+
+#ifdef CPM_ES_CEREAL_HAVE_IO_URING
+  if (mAllowIoUring)
+  {
+    mRing.reset(new uring_detail::Ring());
+    if (!mRing->setup(IO_URING_DEPTH, mFD))
+      mRing.reset();
+  }
+#endif
+  // With io_uring, staging blocks are allocated as they are filled.
+  if (mRing)
+    return;
+
+  if (mStaged && posix_memalign(reinterpret_cast<void**>(&mStaging), DIRECT_ALIGNMENT,
+                                DIRECT_STAGING_SIZE) != 0)
+  {
+    ::close(mFD);
+    mFD = -1;
+    std::cerr << "cpm-es-cereal: Failed to allocate aligned staging buffer." << std::endl;
+    throw std::runtime_error("Failed allocation");
+  }
+
+  mThread = std::thread(&CerealFileWriter::run, this);
+}
+
+void CerealFileWriter::submit(const CerealBuffer& buffer)
+{
+  if (buffer.empty())
+    return;
+
+  mBytesSubmitted += buffer.size();
+  if (mRing)
+  {
+    // Later buffers are dropped after a failure, as the writer thread does.
+    if (mError == 0 && !writeBuffer(buffer))
+      mError = errno;
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQueue.push_back(buffer);
+  }
+  mWake.notify_one();
+}
+
+void CerealFileWriter::submit(const CerealSegmentList& segments)
+{
+  for (size_t i = 0; i < segments.getNumSegments(); ++i)
+    submit(segments.getSegment(i));
+}
+
+void CerealFileWriter::finish(bool sync)
+{
+  if (!isOpen())
+    return;
+
+  if (!mRing)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStopping = true;
+    }
+    mWake.notify_one();
+    mThread.join();
+  }
+
+  int error = mError;
+
+  // Flush the final partial block. O_DIRECT requires whole blocks, so it is
+  // padded and the padding truncated away afterwards.
+  uint64_t length = mFileOffset + mStagingUsed;
+  bool padded = false;
+  if (error == 0 && mStaged && mStagingUsed != 0)
+  {
+    size_t size = (mStagingUsed + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    std::memset(mStaging + mStagingUsed, 0, size - mStagingUsed);
+    if (!writeStaging(size))
+      error = errno;
+    padded = true;
+  }
+
+  if (mRing && !mRing->waitAll() && error == 0)
+    error = errno;
+  mRing.reset();
+
+  if (error == 0 && padded && ::ftruncate(mFD, static_cast<off_t>(length)) != 0)
+    error = errno;
+
+  if (error == 0 && sync && ::fsync(mFD) != 0)
+    error = errno;
+  if (::close(mFD) != 0 && error == 0)
+    error = errno;
+
+  mFD = -1;
+  mDirect = false;
+  free(mStaging);
+  mStaging = NULL;
+  mQueue.clear();
+
+  if (error != 0)
+  {
+    std::cerr << "cpm-es-cereal: Failed to write file: " << std::strerror(error) << std::endl;
+    throw std::runtime_error("Failed to write file");
+  }
+}
+
+void CerealFileWriter::run()
+{
+  for (;;)
+  {
+    CerealBuffer buffer;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      while (mQueue.empty() && !mStopping)
+        mWake.wait(lock);
+      if (mQueue.empty())
+        return;
+      buffer = mQueue.front();
+      mQueue.pop_front();
+      if (mError != 0)
+        continue;
+    }
+
+    if (!writeBuffer(buffer))
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mError = errno;
+    }
+  }
+}
+
+bool CerealFileWriter::writeBuffer(const CerealBuffer& buffer)
+{
+  if (!mStaged && mRing)
+  {
+    uint64_t offset = mFileOffset;
+    mFileOffset += buffer.size();
+    return mRing->submitWrite(buffer, offset);
+  }
+  if (!mStaged)
+    return writeAll(static_cast<const char*>(buffer.data()), buffer.size());
+
+  const char* data = static_cast<const char*>(buffer.data());
+  size_t remaining = buffer.size();
+  while (remaining > 0)
+  {
+    if (mStaging == NULL && posix_memalign(reinterpret_cast<void**>(&mStaging), DIRECT_ALIGNMENT,
+                                           DIRECT_STAGING_SIZE) != 0)
+    {
+      mStaging = NULL;
+      errno = ENOMEM;
+      return false;
+    }
+
+    size_t count = std::min(remaining, DIRECT_STAGING_SIZE - mStagingUsed);
+    std::memcpy(mStaging + mStagingUsed, data, count);
+    mStagingUsed += count;
+    data += count;
+    remaining -= count;
+
+    if (mStagingUsed == DIRECT_STAGING_SIZE && !writeStaging(DIRECT_STAGING_SIZE))
+      return false;
+  }
+  return true;
+}
+
+bool CerealFileWriter::writeStaging(size_t size)
+{
+  if (!mRing)
+  {
+    if (!writeAll(mStaging, size))
+      return false;
+    mStagingUsed = 0;
+    return true;
+  }
+
+  // The block stays in flight after this returns, so it is handed over to
+  // the write and the next block gets new memory.
+  std::shared_ptr<const void> block(mStaging, free);
+  mStaging = NULL;
+  mStagingUsed = 0;
+  uint64_t offset = mFileOffset;
+  mFileOffset += size;
+  return mRing->submitWrite(CerealBuffer::share(block.get(), size, block), offset);
+}
+
+bool CerealFileWriter::writeAll(const char* data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t written = ::pwrite(mFD, data, size, static_cast<off_t>(mFileOffset));
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+    {
+      if (written == 0)
+        errno = EIO;
+      return false;
+    }
+
+    data += written;
+    size -= static_cast<size_t>(written);
+    mFileOffset += static_cast<uint64_t>(written);
+  }
+  return true;
+}
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif // _WIN32
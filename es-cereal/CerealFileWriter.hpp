@@ -0,0 +1,128 @@
+#ifndef IAUNS_CEREALFILEWRITER_HPP
+#define IAUNS_CEREALFILEWRITER_HPP
+
+#ifndef _WIN32
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "CerealBuffer.hpp"
+#include "CerealSegmentList.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+namespace uring_detail {
+struct Ring;
+}
+
+/// Writes buffers to a file in the background, in submission order. submit
+/// returns immediately, so a serializer can keep encoding later heaps while
+/// earlier ones are written (see CerealCore::writeSnapshot):
+///
+///   CerealFileWriter writer;
+///   writer.open("autosave.snp", true);
+///   core.writeSnapshot(writer);
+///   writer.finish();              // Waits for the disk, then fsyncs.
+///
+/// Submitted buffers are CerealBuffers; the writer holds a reference to each
+/// until it is written, so nothing is copied on submission.
+///
+/// On Linux, writes are handed to the kernel through an io_uring (see
+/// isUsingIoUring): submit queues the write at its offset in the file and
+/// returns, with up to IO_URING_DEPTH writes in flight, and no thread is
+/// started. Where io_uring is unavailable (other platforms, kernels or
+/// kernel headers before 5.6, or io_uring disabled by sysctl or seccomp) a
+/// writer thread issues the writes instead.
+///
+/// Direct mode opens the file with O_DIRECT (where the platform and file
+/// system support it) for predictable latency under large autosaves. Data
+/// is then staged through aligned blocks of DIRECT_STAGING_SIZE bytes; the
+/// final partial block is padded for the write and the file truncated back
+/// to its real length. With io_uring, staging happens in submit and every
+/// block in flight has its own staging memory.
+class CerealFileWriter
+{
+public:
+  static const size_t DIRECT_ALIGNMENT    = 4096;
+  static const size_t DIRECT_STAGING_SIZE = 1024 * 1024;
+  static const unsigned IO_URING_DEPTH    = 32;
+
+  CerealFileWriter();
+
+  /// Calls finish if a file is still open. Errors are only reported to
+  /// std::cerr; call finish explicitly to handle them.
+  ~CerealFileWriter();
+
+  /// Creates (or truncates) \p path and sets up the io_uring, or starts the
+  /// writer thread if that fails. If \p direct is set, writes go through
+  /// aligned staging blocks and the file is opened with O_DIRECT if
+  /// possible. Throws std::runtime_error if the file can't be opened or a
+  /// file is already open.
+  void open(const char* path, bool direct = false);
+
+  bool isOpen() const               {return mFD != -1;}
+
+  /// True if the open file is using O_DIRECT.
+  bool isDirect() const             {return mDirect;}
+
+  /// True if the open file is written through io_uring rather than by the
+  /// writer thread.
+  bool isUsingIoUring() const       {return mRing != nullptr;}
+
+  /// Whether open may use io_uring. Disable to always use the writer
+  /// thread. Default: enabled.
+  void setAllowIoUring(bool allow)  {mAllowIoUring = allow;}
+  bool getAllowIoUring() const      {return mAllowIoUring;}
+
+  /// Queues \p buffer to be written after everything submitted before it.
+  void submit(const CerealBuffer& buffer);
+  void submit(const CerealSegmentList& segments);
+
+  /// Waits until every submitted buffer is written, then fsyncs (if
+  /// \p sync) and closes the file. Throws std::runtime_error if any write
+  /// failed.
+  void finish(bool sync = true);
+
+  /// Bytes submitted since open.
+  uint64_t getBytesSubmitted() const {return mBytesSubmitted;}
+
+private:
+  CerealFileWriter(const CerealFileWriter&);
+  CerealFileWriter& operator=(const CerealFileWriter&);
+
+  void run();
+  bool writeBuffer(const CerealBuffer& buffer);
+  bool writeStaging(size_t size);
+  bool writeAll(const char* data, size_t size);
+
+  int                       mFD;
+  bool                      mDirect;    ///< File opened with O_DIRECT.
+  bool                      mStaged;    ///< Writes go through mStaging.
+  bool                      mAllowIoUring;
+  uint64_t                  mBytesSubmitted;
+
+  // Write state. Only touched by the writer thread while it runs, or by
+  // submit when using io_uring.
+  uint64_t                  mFileOffset;
+  char*                     mStaging;   ///< NULL until needed with io_uring.
+  size_t                    mStagingUsed;
+  std::unique_ptr<uring_detail::Ring> mRing;
+
+  std::mutex                mMutex;
+  std::condition_variable   mWake;
+  std::deque<CerealBuffer>  mQueue;
+  bool                      mStopping;
+  int                       mError;     ///< errno of the first failed write.
+  std::thread               mThread;
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif // _WIN32
+
+#endif
@@ -0,0 +1,171 @@
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "CerealForkSaver.hpp"
+#include "CerealCore.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+CerealForkSaver::CerealForkSaver() :
+    mState(FORK_SAVE_IDLE),
+    mChild(-1),
+    mNotifyFD(-1),
+    mBytesWritten(0),
+    mError(0)
+{
+}
+
+CerealForkSaver::~CerealForkSaver()
+{
+  if (isRunning())
+    wait();
+}
+
+bool CerealForkSaver::start(CerealCore& core, const std::string& path)
+{
+  if (isRunning())
+    return false;
+
+  int fds[2];
+  if (::pipe(fds) != 0)
+  {
+    std::cerr << "cpm-es-cereal: Failed to create pipe: " << std::strerror(errno) << std::endl;
+    throw std::runtime_error("Failed to fork saver");
+  }
+
+  pid_t child = ::fork();
+  if (child == -1)
+  {
+    int error = errno;
+    ::close(fds[0]);
+    ::close(fds[1]);
+    std::cerr << "cpm-es-cereal: Failed to fork: " << std::strerror(error) << std::endl;
+    throw std::runtime_error("Failed to fork saver");
+  }
+
+  if (child == 0)
+  {
+    ::close(fds[0]);
+    runChild(core, path, fds[1]);
+    // Skip the parent's atexit handlers and static destructors.
+    ::_exit(0);
+  }
+
+  ::close(fds[1]);
+  ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+  mChild = child;
+  mNotifyFD = fds[0];
+  mState = FORK_SAVE_RUNNING;
+  mBytesWritten = 0;
+  mError = 0;
+  return true;
+}
+
+void CerealForkSaver::runChild(CerealCore& core, const std::string& path, int fd)
+{
+  Report report = {0, 0, 0};
+  std::string temporary = path + ".tmp";
+  try
+  {
+    CerealSegmentList segments = core.dumpSnapshotSegments();
+
+    int file = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file == -1)
+    {
+      report.error = errno;
+    }
+    else
+    {
+      segments.writeTo(file);
+      if (::fsync(file) != 0 || ::close(file) != 0 || std::rename(temporary.c_str(), path.c_str()) != 0)
+      {
+        report.error = errno;
+      }
+      else
+      {
+        report.succeeded = 1;
+        report.bytesWritten = segments.getTotalSize();
+      }
+    }
+  }
+  catch (const std::exception& e)
+  {
+    report.error = (errno != 0) ? errno : EIO;
+    std::cerr << "cpm-es-cereal: Forked save failed: " << e.what() << std::endl;
+  }
+
+  if (!report.succeeded)
+    ::unlink(temporary.c_str());
+
+  // Smaller than PIPE_BUF, so the write is atomic.
+  ssize_t written;
+  do
+  {
+    written = ::write(fd, &report, sizeof(report));
+  } while (written < 0 && errno == EINTR);
+  ::close(fd);
+}
+
+ForkSaveState CerealForkSaver::poll()
+{
+  return check(false);
+}
+
+ForkSaveState CerealForkSaver::wait()
+{
+  return check(true);
+}
+
+ForkSaveState CerealForkSaver::check(bool block)
+{
+  if (!isRunning())
+    return mState;
+
+  if (block)
+  {
+    struct pollfd notify = {mNotifyFD, POLLIN, 0};
+    while (::poll(&notify, 1, -1) < 0 && errno == EINTR) {}
+  }
+
+  Report report;
+  ssize_t count = ::read(mNotifyFD, &report, sizeof(report));
+  if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return mState;
+
+  // Either the report arrived or the child died without sending one (the
+  // pipe closed).
+  int status = 0;
+  while (::waitpid(mChild, &status, 0) < 0 && errno == EINTR) {}
+  ::close(mNotifyFD);
+  mNotifyFD = -1;
+  mChild = -1;
+
+  if (count == static_cast<ssize_t>(sizeof(report)) && report.succeeded)
+  {
+    mBytesWritten = report.bytesWritten;
+    mState = FORK_SAVE_SUCCEEDED;
+  }
+  else
+  {
+    mError = (count == static_cast<ssize_t>(sizeof(report))) ? report.error : ECHILD;
+    mState = FORK_SAVE_FAILED;
+  }
+  return mState;
+}
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif // _WIN32
@@ -0,0 +1,94 @@
+#ifndef IAUNS_CEREALFORKSAVER_HPP
+#define IAUNS_CEREALFORKSAVER_HPP
+
+#ifndef _WIN32
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+namespace CPM_ES_CEREAL_NS {
+
+class CerealCore;
+
+enum ForkSaveState
+{
+  FORK_SAVE_IDLE,       ///< No save was started.
+  FORK_SAVE_RUNNING,
+  FORK_SAVE_SUCCEEDED,
+  FORK_SAVE_FAILED
+};
+
+/// Saves a snapshot from a forked child process. The child sees the heaps
+/// exactly as they were at fork time (the kernel shares the pages copy on
+/// write), so the parent keeps running the simulation while the child
+/// serializes and writes, without copying heaps up front:
+///
+///   saver.start(core, "world.snp");
+///   ...                                  // Keep simulating.
+///   if (saver.poll() == FORK_SAVE_SUCCEEDED) ...
+///
+/// The file holds the bytes of CerealCore::dumpSnapshot and is written to a
+/// temporary file renamed into place when complete. The child reports back
+/// through a pipe whose read end (getNotifyFD) can be added to an event
+/// loop; it becomes readable when the save finishes.
+///
+/// Only the forking thread exists in the child, so the child does not use
+/// threads and nothing else may hold locks es-cereal needs (the allocator)
+/// while start is called. Pages the parent writes to during the save are
+/// duplicated, so memory use grows with the parent's write rate.
+class CerealForkSaver
+{
+public:
+  CerealForkSaver();
+
+  /// Waits for a running save.
+  ~CerealForkSaver();
+
+  /// Forks and saves \p core to \p path in the child. Returns false, without
+  /// starting a save, if one is already running. Throws std::runtime_error
+  /// if the process can't be forked.
+  bool start(CerealCore& core, const std::string& path);
+
+  /// Checks on the save without blocking.
+  ForkSaveState poll();
+
+  /// Blocks until the save finishes.
+  ForkSaveState wait();
+
+  bool isRunning() const              {return mState == FORK_SAVE_RUNNING;}
+
+  /// Readable once the running save finishes. -1 when no save is running.
+  int getNotifyFD() const             {return mNotifyFD;}
+
+  /// Results of the last finished save.
+  uint64_t getBytesWritten() const    {return mBytesWritten;}
+  int getError() const                {return mError;}  ///< errno in the child.
+
+private:
+  CerealForkSaver(const CerealForkSaver&);
+  CerealForkSaver& operator=(const CerealForkSaver&);
+
+  /// Sent by the child through the pipe.
+  struct Report
+  {
+    uint32_t  succeeded;
+    int32_t   error;
+    uint64_t  bytesWritten;
+  };
+
+  static void runChild(CerealCore& core, const std::string& path, int fd);
+  ForkSaveState check(bool block);
+
+  ForkSaveState mState;
+  pid_t         mChild;
+  int           mNotifyFD;
+  uint64_t      mBytesWritten;
+  int           mError;
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif // _WIN32
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef IAUNS_CEREALHASH_HPP
+#define IAUNS_CEREALHASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CPM_ES_CEREAL_NS {
+
+namespace hash_detail {
+
+const uint32_t FNV1A_OFFSET_BASIS = 2166136261u;
+const uint32_t FNV1A_PRIME        = 16777619u;
+
+const uint64_t FNV1A_OFFSET_BASIS_64 = 14695981039346656037ull;
+const uint64_t FNV1A_PRIME_64        = 1099511628211ull;
+
+constexpr uint32_t fnv1a(const char* str, uint32_t hash)
+{
+  return (*str == '\0') ? hash
+                        : fnv1a(str + 1, (hash ^ static_cast<uint8_t>(*str)) * FNV1A_PRIME);
+}
+
+constexpr uint32_t nonZero(uint32_t hash)
+{
+  return (hash == 0) ? 1 : hash;
+}
+}
+
+/// 32 bit FNV-1a hash of the null terminated string \p name. constexpr, so
+/// a string literal can be hashed at compile time:
+///
+///   static_assert(hashName("render:CompPosition") != 0, "");
+///
+/// Never returns 0, which es-cereal reserves for 'no heap'.
+///
+/// Component names are hashed into heap IDs (see
+/// CerealCore::registerComponent); field keys are not. Tny compares
+/// dictionary keys as strings, so hashing field names would not speed up
+/// their lookup.
+constexpr uint32_t hashName(const char* name)
+{
+  return hash_detail::nonZero(hash_detail::fnv1a(name, hash_detail::FNV1A_OFFSET_BASIS));
+}
+
+/// 64 bit FNV-1a hash of \p size bytes at \p data. Fingerprints serialized
+/// heaps; not meant to resist deliberate collisions.
+inline uint64_t hashBytes(const void* data, size_t size)
+{
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint64_t hash = hash_detail::FNV1A_OFFSET_BASIS_64;
+  for (size_t i = 0; i < size; ++i)
+    hash = (hash ^ bytes[i]) * hash_detail::FNV1A_PRIME_64;
+  return hash;
+}
+
+/// hashName of T::getName(). getName() isn't a constant expression, so the
+/// hash is computed at run time, on first use, once per component type.
+template <typename T>
+struct ComponentNameHash
+{
+  static uint32_t get()
+  {
+    static const uint32_t hash = hashName(T::getName());
+    return hash;
+  }
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
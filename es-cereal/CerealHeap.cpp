@@ -1,3 +1,7 @@
+
+#include <stdlib.h>         // For C's free
+#include <cstring>
+
 #include "CerealHeap.hpp"
 
 namespace CPM_ES_CEREAL_NS {
@@ -49,7 +53,7 @@ Tny* writeSerializedHeap(ComponentSerialize& s, Tny* compArray)
 }
 
 Tny* readSerializedHeap(ComponentSerialize& /* s */, Tny* root,
-                        std::vector<ComponentSerialize::HeaderItem>& typeHeaders)
+                        ComponentSerialize::HeaderList& typeHeaders)
 {
   if (!heap_detail::checkTnyType(root, TNY_ARRAY)) return nullptr;
   if (!Tny_hasNext(root)) return nullptr;
@@ -85,6 +89,83 @@ Tny* readSerializedHeap(ComponentSerialize& /* s */, Tny* root,
   return components;
 }
 
+CerealBuffer dumpToBuffer(const Tny* tny, CerealAllocator& allocator)
+{
+  void* dump = NULL;
+  size_t size = Tny_dumps(tny, &dump);
+  if (dump == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Failed to dump Tny document." << std::endl;
+    throw std::runtime_error("Failed dump");
+  }
+
+  if (&allocator == &CerealAllocator::getDefault())
+    return CerealBuffer::adoptMalloc(dump, size);
+
+  void* data = allocator.allocate(size);
+  if (data == NULL)
+  {
+    free(dump);
+    std::cerr << "cpm-es-cereal: Failed to allocate dump of size " << size << std::endl;
+    throw std::runtime_error("Failed allocation");
+  }
+
+  std::memcpy(data, dump, size);
+  free(dump);
+  return CerealBuffer::adopt(data, size, allocator);
+}
+
+Tny* makeHeapDocument(const char* key, Tny* heap)
+{
+  Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  Tny* entry = Tny_add(root, TNY_OBJ, const_cast<char*>(key), heap, 0);
+  if (entry == NULL)
+  {
+    Tny_free(root);
+    std::cerr << "cpm-es-cereal: Failed to build heap document for: " << key << std::endl;
+    throw std::runtime_error("Failed serialization");
+  }
+  return root;
+}
+
+bool readSerializedRecord(Tny*& cur, uint64_t& entityID, Tny*& obj)
+{
+  if (!Tny_hasNext(cur)) return false;
+  cur = Tny_next(cur);
+  if (!heap_detail::checkTnyType(cur, TNY_INT64)) return false;
+
+  entityID = cur->value.num;
+
+  if (!Tny_hasNext(cur))
+  {
+    std::cerr << "cpm-es-cereal: Unexpected end of header." << std::endl;
+    throw std::runtime_error("cpm-es-cereal: Unexpected end of header.");
+    return false;
+  }
+
+  cur = Tny_next(cur);
+  if (!heap_detail::checkTnyType(cur, TNY_OBJ)) return false;
+
+  obj = cur->value.tny;
+  return true;
+}
+
+void collectSerializedEntityIDs(Tny* heap, std::vector<uint64_t>& ids)
+{
+  // Skip the type header.
+  if (!checkTnyType(heap, TNY_ARRAY) || !Tny_hasNext(heap)) return;
+  Tny* cur = Tny_next(heap);
+  if (!Tny_hasNext(cur)) return;
+  cur = Tny_next(cur);
+  if (cur->type != TNY_OBJ || cur->value.tny->type != TNY_ARRAY) return;
+
+  cur = cur->value.tny;
+  uint64_t entityID = 0;
+  Tny* obj = NULL;
+  while (readSerializedRecord(cur, entityID, obj))
+    ids.push_back(entityID);
+}
+
 } // namespace heap_detail
 
 } // namespace CPM_ES_CEREAL_ES
@@ -1,6 +1,10 @@
 #ifndef IAUNS_COMMON_CEREALHEAP_HPP
 #define IAUNS_COMMON_CEREALHEAP_HPP
 
+#include <algorithm>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 #include <entity-system/ESCoreBase.hpp>
 #include <tny/tny.hpp>
 
@@ -10,16 +14,46 @@
 ///       types they really are.
 
 #include "ComponentSerialize.hpp"
+#include "CerealPrefab.hpp"
+#include "CerealByteOrder.hpp"
+#include "CerealBuffer.hpp"
 
 namespace CPM_ES_CEREAL_NS {
 
+template <typename T> class CerealHeap;
+template <typename T> class PrefabHeap;
+
 namespace heap_detail {
 
 bool checkTnyType(Tny* root, TnyType type);
 Tny* addSerializedComponent(Tny* cur, Tny* component, uint64_t entityID);
 Tny* writeSerializedHeap(ComponentSerialize& s, Tny* compArray);
 Tny* readSerializedHeap(ComponentSerialize& s, Tny* compArray,
-                        std::vector<ComponentSerialize::HeaderItem>& typeHeaders);
+                        ComponentSerialize::HeaderList& typeHeaders);
+
+/// Dumps \p tny with Tny_dumps into a buffer from \p allocator. Tny only
+/// dumps into memory it mallocs, so the default allocator adopts the dump
+/// and any other allocator receives a copy. Throws std::runtime_error if
+/// dumping or the allocation fails.
+CerealBuffer dumpToBuffer(const Tny* tny, CerealAllocator& allocator);
+
+/// Builds the document {key: heap} (one heap of serializeAllComponents).
+/// \p heap is copied; the caller frees the returned root with Tny_free.
+Tny* makeHeapDocument(const char* key, Tny* heap);
+
+/// Advances \p cur to the next (entityID, component dictionary) record of a
+/// component array returned by readSerializedHeap. Returns false once there
+/// are no more records.
+bool readSerializedRecord(Tny*& cur, uint64_t& entityID, Tny*& obj);
+
+/// Appends the IDs of the entities owning a component in \p heap (a heap
+/// as written by writeSerializedHeap). Stops at the first malformed record.
+void collectSerializedEntityIDs(Tny* heap, std::vector<uint64_t>& ids);
+
+/// When merging, galloping is used once the heap holds this many times more
+/// components than there are records in the delta. Below this density a
+/// linear walk touches fewer cache lines than the gallop's probes.
+const size_t GALLOP_DENSITY_THRESHOLD = 16;
 }
 
 
@@ -56,8 +90,26 @@ class CerealHeap : public CPM_ES_NS::ComponentContainer<T>, public ComponentSeri
   };
 
 public:
-  CerealHeap() : mIsSerializable(true)  {}
-  virtual ~CerealHeap()                 {}
+  /// Strategy used to locate existing components while merging.
+  enum MergeSearch
+  {
+    MERGE_SEARCH_AUTO,    ///< Pick based on the density of the delta.
+    MERGE_SEARCH_WALK,    ///< Linear walk. Best for dense deltas.
+    MERGE_SEARCH_GALLOP   ///< Exponential search from the last position.
+                          ///< Best for sparse deltas into large heaps.
+  };
+
+  CerealHeap() :
+      mIsSerializable(true),
+      mMergeSearch(MERGE_SEARCH_AUTO),
+      mHaveEntityFieldOffsets(false),
+      mGeneration(1),
+      mChangesPending(false),
+      mCacheEncodedEntities(false),
+      mEncodedClearPending(false),
+      mHaveLayout(false)
+  {}
+  virtual ~CerealHeap()                 {clearEncodedEntities();}
 
   Tny* serialize(CPM_ES_NS::ESCoreBase& core) override
   {
@@ -103,28 +155,87 @@ public:
       return NULL;
     }
 
-    Tny* compArray = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+    if (mCacheEncodedEntities)
+      return getEncodedEntity(core, baseIndex, entityID).loadTny();
+
+    return serializeEntityItems(core, baseIndex, entityID);
+  }
+
+  CerealBuffer dumpEntity(CPM_ES_NS::ESCoreBase& core, uint64_t entityID) override
+  {
+    int baseIndex = CPM_ES_NS::ComponentContainer<T>::getComponentItemIndexWithSequence(entityID);
+    if (baseIndex == -1)
+      return CerealBuffer();
+
+    if (mCacheEncodedEntities)
+      return getEncodedEntity(core, baseIndex, entityID);
 
+    Tny* root = serializeEntityItems(core, baseIndex, entityID);
+    CerealBuffer dump = heap_detail::dumpToBuffer(root, ComponentSerialize::getCoreAllocator(core));
+    Tny_free(root);
+    return dump;
+  }
+
+  Tny* serializeEntities(CPM_ES_NS::ESCoreBase& core, const uint64_t* entityIDs,
+                         size_t count) override
+  {
+    static_assert( has_member_serialize<T>::value,
+                  "Component does not have a serialize function with signature: bool serialize(CPM_ES_CEREAL_NS::ComponentSerialize&, uint64_t)" );
+
+    Tny* compArray = nullptr;
     ComponentSerialize s(core, false);
 
+    // Both the IDs and the component array are sorted, so they are walked
+    // (or galloped, for sparse batches) in lockstep as when merging.
     typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array =
         CPM_ES_NS::ComponentContainer<T>::getComponentArray();
-    int i = baseIndex;
     size_t numComponents = CPM_ES_NS::ComponentContainer<T>::getNumComponents();
-    while (i != numComponents && array[i].sequence == entityID)
+    bool gallop = shouldGallop(count, numComponents);
+    size_t cursor = 0;
+    for (size_t e = 0; e < count; ++e)
     {
-      // Serialize the entity at index 'i'.
-      s.prepareForNewComponent();
-      if (array[i].component.serialize(s, entityID))
-        compArray = heap_detail::addSerializedComponent(compArray, s.getSerializedObject(), entityID);
-      ++i;
+      uint64_t entityID = entityIDs[e];
+      int i = seekSequence(array, numComponents, cursor, entityID, gallop);
+      if (i == -1)
+        continue;
+
+      if (compArray == nullptr)
+        compArray = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+
+      while (static_cast<size_t>(i) != numComponents && array[i].sequence == entityID)
+      {
+        s.prepareForNewComponent();
+        if (array[i].component.serialize(s, entityID))
+          compArray = heap_detail::addSerializedComponent(compArray, s.getSerializedObject(), entityID);
+        ++i;
+      }
     }
 
+    if (compArray == nullptr)
+      return nullptr;
+
     Tny* root = heap_detail::writeSerializedHeap(s, compArray);
 
     Tny_free(compArray);
 
-    return root;
+    return root->root;
+  }
+
+  bool removeEntities(CPM_ES_NS::ESCoreBase& /* core */, const uint64_t* entityIDs,
+                      size_t count) override
+  {
+    // Only entities with components are queued.
+    typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array =
+        CPM_ES_NS::ComponentContainer<T>::getComponentArray();
+    size_t numComponents = CPM_ES_NS::ComponentContainer<T>::getNumComponents();
+    bool gallop = shouldGallop(count, numComponents);
+    size_t cursor = 0;
+    for (size_t e = 0; e < count; ++e)
+    {
+      if (seekSequence(array, numComponents, cursor, entityIDs[e], gallop) != -1)
+        removeSequence(entityIDs[e]);
+    }
+    return true;
   }
 
   /// Returns the Tny* dictionary containing value's serialized contents.
@@ -152,14 +263,190 @@ public:
   {
     static_assert( has_member_serialize<T>::value,
                   "Component does not have a serialize function with signature: bool serialize(CPM_ES_CEREAL_NS::ComponentSerialize&, uint64_t)" );
+    // Individual entities are invalidated as they are modified.
+    bumpGeneration();
     deserializeMergeInternal(core, root, copyExisting);
   }
 
   void deserializeCreate(CPM_ES_NS::ESCoreBase& core, Tny* root) override
+  {
+    deserializeCreate(core, root, nullptr);
+  }
+
+  /// If \p remap is not NULL, every entity ID (both the entity owning the
+  /// component and IDs serialized with serializeEntityID) is translated
+  /// through the remap before the component is created.
+  void deserializeCreate(CPM_ES_NS::ESCoreBase& core, Tny* root, EntityRemap* remap) override
   {
     static_assert( has_member_serialize<T>::value,
                   "Component does not have a serialize function with signature: bool serialize(CPM_ES_CEREAL_NS::ComponentSerialize&, uint64_t)" );
-    deserializeCreateInternal(core, root);
+    markModified();
+    deserializeCreateInternal(core, root, remap);
+  }
+
+  std::unique_ptr<PrefabHeapInterface> decodePrefab(CPM_ES_NS::ESCoreBase& core, Tny* root) override
+  {
+    static_assert( has_member_serialize<T>::value,
+                  "Component does not have a serialize function with signature: bool serialize(CPM_ES_CEREAL_NS::ComponentSerialize&, uint64_t)" );
+
+    ComponentSerialize s(core, true);
+    ComponentSerialize::HeaderList typeHeaders(
+        CerealStlAllocator<ComponentSerialize::HeaderItem>(s.getAllocator()));
+    Tny* components = heap_detail::readSerializedHeap(s, root, typeHeaders);
+    if (components == nullptr)
+    {
+      std::cerr << "cpm-es-cereal: Corrupt heap header." << std::endl;
+      return std::unique_ptr<PrefabHeapInterface>();
+    }
+
+    std::unique_ptr<PrefabHeap<T>> prefab(new PrefabHeap<T>(*this));
+
+    // Entity ID fields are located by their offset inside of 'value' so they
+    // can be patched on copies without running serialize again.
+    T value;
+    s.setEntityFieldRecorder(&value, sizeof(T), &prefab->mEntityFieldOffsets);
+
+    Tny* cur = components;
+    uint64_t entityID = 0;
+    Tny* obj = nullptr;
+    while (heap_detail::readSerializedRecord(cur, entityID, obj))
+    {
+      s.setDeserializeRoot(obj);
+      if (value.serialize(s, entityID))
+        prefab->mComponents.push_back(std::make_pair(entityID, value));
+    }
+
+    return std::move(prefab);
+  }
+
+  /// Fixes up entity references in a single linear sweep over the component
+  /// array. The offsets of entity ID fields are recorded once, from a value
+  /// initialized component, and every component is checked against them
+  /// (serialize runs in record only mode, nothing is encoded) before any
+  /// field is translated. Components whose entity ID fields depend on their
+  /// contents throw std::runtime_error and are left untouched; remap them
+  /// while deserializing instead (see deserializeCreate).
+  void remapEntityReferences(CPM_ES_NS::ESCoreBase& core, const EntityIDTable& table) override
+  {
+    static_assert( has_member_serialize<T>::value,
+                  "Component does not have a serialize function with signature: bool serialize(CPM_ES_CEREAL_NS::ComponentSerialize&, uint64_t)" );
+
+    size_t numComponents = CPM_ES_NS::ComponentContainer<T>::getNumComponents();
+    if (table.empty() || numComponents == 0)
+      return;
+
+    typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array =
+        CPM_ES_NS::ComponentContainer<T>::getComponentArray();
+
+    ComponentSerialize s(core, false);
+    s.setRecordOnly(true);
+    if (!mHaveEntityFieldOffsets)
+    {
+      T probe = T();
+      s.setEntityFieldRecorder(&probe, sizeof(T), &mEntityFieldOffsets);
+      probe.serialize(s, 0);
+      std::sort(mEntityFieldOffsets.begin(), mEntityFieldOffsets.end());
+      mHaveEntityFieldOffsets = true;
+    }
+
+    std::vector<size_t> offsets;
+    for (size_t i = 0; i < numComponents; ++i)
+    {
+      offsets.clear();
+      s.setEntityFieldRecorder(&array[i].component, sizeof(T), &offsets);
+      array[i].component.serialize(s, array[i].sequence);
+      std::sort(offsets.begin(), offsets.end());
+      if (offsets != mEntityFieldOffsets)
+      {
+        std::cerr << "cpm-es-cereal: Entity ID fields of " << getComponentName() << " (entity "
+                  << array[i].sequence << ") differ from those of a value initialized component." << std::endl;
+        throw std::runtime_error("cpm-es-cereal: Entity ID fields vary between components.");
+      }
+    }
+    s.setEntityFieldRecorder(nullptr, 0, nullptr);
+
+    if (mEntityFieldOffsets.empty())
+      return;
+
+    markModified();
+    table.translateFields(&array[0].component, numComponents,
+                          sizeof(typename CPM_ES_NS::ComponentContainer<T>::ComponentItem),
+                          &mEntityFieldOffsets[0], mEntityFieldOffsets.size());
+  }
+
+  /// Recorded once, from a value initialized component. packComponents
+  /// checks every component against it, so components whose fields depend
+  /// on their contents can't be packed.
+  const ComponentLayout& getLayout(CPM_ES_NS::ESCoreBase& core) override
+  {
+    static_assert( has_member_serialize<T>::value,
+                  "Component does not have a serialize function with signature: bool serialize(CPM_ES_CEREAL_NS::ComponentSerialize&, uint64_t)" );
+
+    if (!mHaveLayout)
+    {
+      T probe = T();
+      ComponentSerialize s(core, false);
+      s.setLayoutRecorder(&probe, sizeof(T), &mLayout);
+      s.prepareForNewComponent();
+      // Components that manage resources (copy constructors, destructors)
+      // can't be rebuilt from a copy of their fields.
+      if (!probe.serialize(s, 0) || !std::is_trivially_copyable<T>::value)
+        mLayout.invalidate();
+      s.setLayoutRecorder(nullptr, 0, nullptr);
+      mLayout.setDefaults(&probe);
+      mHaveLayout = true;
+    }
+    return mLayout;
+  }
+
+  size_t packComponents(CPM_ES_NS::ESCoreBase& core, std::vector<char>& records) override
+  {
+    const ComponentLayout& layout = getLayout(core);
+    size_t recordSize = sizeof(uint64_t) + layout.getPackedSize();
+    size_t numComponents = CPM_ES_NS::ComponentContainer<T>::getNumComponents();
+    records.reserve(records.size() + numComponents * recordSize);
+
+    typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array =
+        CPM_ES_NS::ComponentContainer<T>::getComponentArray();
+    ComponentSerialize s(core, false);
+    size_t numRecords = 0;
+    for (size_t i = 0; i < numComponents; ++i)
+    {
+      size_t offset = records.size();
+      records.resize(offset + recordSize);
+      byte_detail::writeU64(&records[offset], array[i].sequence);
+
+      s.setRecordPacker(&array[i].component, &layout, &records[offset] + sizeof(uint64_t));
+      if (!array[i].component.serialize(s, array[i].sequence))
+      {
+        records.resize(offset);
+        continue;
+      }
+
+      if (!s.isPackComplete())
+      {
+        std::cerr << "cpm-es-cereal: " << getComponentName() << " of entity " << array[i].sequence
+                  << " serializes fields that differ from its layout, and requires TnyWireBackend." << std::endl;
+        throw std::runtime_error("cpm-es-cereal: Component fields differ from layout.");
+      }
+      ++numRecords;
+    }
+    s.setRecordPacker(nullptr, nullptr, nullptr);
+    return numRecords;
+  }
+
+  void createFromPacked(CPM_ES_NS::ESCoreBase& core, const char* records,
+                        size_t count, size_t stride) override
+  {
+    const ComponentLayout& layout = getLayout(core);
+    markModified();
+    for (size_t i = 0; i < count; ++i)
+    {
+      const char* record = records + i * stride;
+      T value = T();
+      layout.unpack(record + sizeof(uint64_t), &value);
+      CPM_ES_NS::ComponentContainer<T>::addComponent(byte_detail::readU64(record), value);
+    }
   }
 
   const char* getComponentName() override
@@ -192,8 +479,175 @@ public:
   bool isSerializable() override          {return mIsSerializable;}
   void setSerializable(bool serializable) {mIsSerializable = serializable;}
 
+  /// Overrides the automatic selection of the search strategy used to locate
+  /// sorted entities when merging, extracting and removing batches.
+  void setMergeSearch(MergeSearch search) {mMergeSearch = search;}
+  MergeSearch getMergeSearch() const      {return mMergeSearch;}
+
+  /// Bumped by every change made through es-cereal (CerealCore::addComponent,
+  /// entity removal, deserialization, entity reference remapping, clearing)
+  /// and again when renormalize applies the staged changes. renormalize
+  /// also bumps it if the number of components changed, which covers
+  /// components added through the core directly. Components written any
+  /// other way (modifyIndex, getComponentArray) must be followed by
+  /// markModified. Reading the generation is free, and is tracked for
+  /// every T.
+  uint64_t getGeneration() override       {return mGeneration;}
+
+  /// Flags the contents of this heap as changed.
+  void markModified()
+  {
+    bumpGeneration();
+    clearEncodedEntities();
+    mEncodedClearPending = mCacheEncodedEntities;
+  }
+
+  /// Flags the components of \p entityID as changed.
+  void markModified(uint64_t entityID)
+  {
+    bumpGeneration();
+    invalidateEncodedEntity(entityID);
+  }
+
+  /// Stages \p items for the next renormalize in one append, as if each
+  /// were passed to CerealCore::addComponent. \p items is left empty.
+  void addComponents(std::vector<typename CPM_ES_NS::ComponentContainer<T>::ComponentItem>& items)
+  {
+    if (items.empty())
+      return;
+
+    bumpGeneration();
+    for (const typename CPM_ES_NS::ComponentContainer<T>::ComponentItem& item : items)
+      invalidateEncodedEntity(item.sequence);
+
+    std::vector<typename CPM_ES_NS::ComponentContainer<T>::ComponentItem>& added =
+        CPM_ES_NS::ComponentContainer<T>::mAdded;
+    if (added.empty())
+      added.swap(items);
+    else
+      added.insert(added.end(), items.begin(), items.end());
+    items.clear();
+  }
+
+  /// When enabled, serializeEntity and dumpEntity keep the dumped bytes of
+  /// every entity they serialize and return them on later calls instead of
+  /// calling serialize on the components again (dumpEntity returns them
+  /// without copying; serializeEntity parses them). An entity is dropped
+  /// from the cache when its components change through es-cereal; direct
+  /// writes (modifyIndex, getComponentArray) must call markModified(entityID),
+  /// or markModified() for the whole heap. Meant for components that rarely
+  /// change but are replicated often. Disabling releases the cache.
+  /// Default: disabled.
+  void setCacheEncodedEntities(bool cache)
+  {
+    mCacheEncodedEntities = cache;
+    if (!cache)
+      clearEncodedEntities();
+  }
+  bool getCacheEncodedEntities() const    {return mCacheEncodedEntities;}
+
+  /// Number of entities currently held by the serializeEntity cache.
+  size_t getNumEncodedEntities() const    {return mEncodedEntities.size();}
+
+  void renormalize(bool stableSort) override
+  {
+    size_t numComponents = CPM_ES_NS::ComponentContainer<T>::getNumComponents();
+    CPM_ES_NS::ComponentContainer<T>::renormalize(stableSort);
+    if (mChangesPending || numComponents != CPM_ES_NS::ComponentContainer<T>::getNumComponents())
+    {
+      ++mGeneration;
+      mChangesPending = false;
+    }
+
+    // Entities may have been serialized again between being modified and
+    // the modification being applied.
+    if (mEncodedClearPending)
+      clearEncodedEntities();
+    for (uint64_t entityID : mPendingInvalidations)
+      eraseEncodedEntity(entityID);
+    mEncodedClearPending = false;
+    mPendingInvalidations.clear();
+  }
+
+  void removeSequence(uint64_t sequence) override
+  {
+    markModified(sequence);
+    CPM_ES_NS::ComponentContainer<T>::removeSequence(sequence);
+  }
+
+  void removeAllComponentsImmediately() override
+  {
+    CPM_ES_NS::ComponentContainer<T>::removeAllComponentsImmediately();
+    ++mGeneration;
+    mChangesPending = false;
+    clearEncodedEntities();
+    mEncodedClearPending = false;
+    mPendingInvalidations.clear();
+  }
+
 private:
 
+  void bumpGeneration()
+  {
+    ++mGeneration;
+    mChangesPending = true;
+  }
+
+  /// Serializes the components of \p entityID, starting at \p baseIndex,
+  /// into a heap as written by writeSerializedHeap.
+  Tny* serializeEntityItems(CPM_ES_NS::ESCoreBase& core, int baseIndex, uint64_t entityID)
+  {
+    Tny* compArray = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+
+    ComponentSerialize s(core, false);
+
+    typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array =
+        CPM_ES_NS::ComponentContainer<T>::getComponentArray();
+    size_t i = static_cast<size_t>(baseIndex);
+    size_t numComponents = CPM_ES_NS::ComponentContainer<T>::getNumComponents();
+    while (i != numComponents && array[i].sequence == entityID)
+    {
+      // Serialize the entity at index 'i'.
+      s.prepareForNewComponent();
+      if (array[i].component.serialize(s, entityID))
+        compArray = heap_detail::addSerializedComponent(compArray, s.getSerializedObject(), entityID);
+      ++i;
+    }
+
+    Tny* root = heap_detail::writeSerializedHeap(s, compArray);
+
+    Tny_free(compArray);
+
+    return root;
+  }
+
+  /// Returns the cached dump of \p entityID, dumping it first if it isn't
+  /// cached.
+  CerealBuffer getEncodedEntity(CPM_ES_NS::ESCoreBase& core, int baseIndex, uint64_t entityID)
+  {
+    auto cached = mEncodedEntities.find(entityID);
+    if (cached != mEncodedEntities.end())
+      return cached->second;
+
+    Tny* root = serializeEntityItems(core, baseIndex, entityID);
+    CerealBuffer dump = heap_detail::dumpToBuffer(root, ComponentSerialize::getCoreAllocator(core));
+    Tny_free(root);
+
+    mEncodedEntities[entityID] = dump;
+    return dump;
+  }
+
+  void invalidateEncodedEntity(uint64_t entityID)
+  {
+    if (!mCacheEncodedEntities)
+      return;
+    eraseEncodedEntity(entityID);
+    mPendingInvalidations.push_back(entityID);
+  }
+
+  void eraseEncodedEntity(uint64_t entityID)   {mEncodedEntities.erase(entityID);}
+  void clearEncodedEntities()                   {mEncodedEntities.clear();}
+
   void deserializeMergeInternal(CPM_ES_NS::ESCoreBase& core, Tny* root, bool copyExisting)
   {
     /// \xxx  We may be erasing good type headers in preference of partial
@@ -201,7 +655,8 @@ private:
     ComponentSerialize s(core, true);
 
     // Extract header information and grab Tny pointer to actual data.
-    mTypeHeaders.clear();
+    mTypeHeaders = ComponentSerialize::HeaderList(
+        CerealStlAllocator<ComponentSerialize::HeaderItem>(s.getAllocator()));
     Tny* components = heap_detail::readSerializedHeap(s, root, mTypeHeaders);
     if (components == nullptr)
     {
@@ -212,9 +667,23 @@ private:
     T value;
     typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array = 
         CPM_ES_NS::ComponentContainer<T>::getComponentArray();
+    size_t numComponents = CPM_ES_NS::ComponentContainer<T>::getNumComponents();
     Tny* cur = components;
     int componentIndex = 0;
+    int baseIndex = -1;
+    bool haveLastEntity = false;
     uint64_t lastEntityID = 0;
+
+    // Serialized records arrive sorted by entity ID, as is our component
+    // array. Walk both in lockstep using 'cursor' instead of performing a
+    // binary search for every record. This makes merging N records into
+    // M components O(N + M) instead of O(N log M). For sparse deltas
+    // (few records spread over many components) gallop from the cursor
+    // instead, which costs O(log gap) per record.
+    size_t numRecords = components->size / 2;
+    bool gallop = shouldGallop(numRecords, numComponents);
+
+    size_t cursor = 0;
     while (Tny_hasNext(cur))
     {
       cur = Tny_next(cur);
@@ -234,15 +703,28 @@ private:
 
       if (!heap_detail::checkTnyType(cur, TNY_OBJ)) return;
 
-      if (lastEntityID == entityID)
+      if (haveLastEntity && lastEntityID == entityID)
+      {
         ++componentIndex;
+      }
       else
+      {
         componentIndex = 0;
 
+        // Out of order input (hand built change sets) restarts the walk at
+        // the binary searched lower bound of the entity.
+        if (haveLastEntity && entityID < lastEntityID)
+          cursor = lowerBoundSequence(array, 0, numComponents, entityID);
+
+        baseIndex = seekSequence(array, numComponents, cursor, entityID, gallop);
+      }
+
+      haveLastEntity = true;
+      lastEntityID = entityID;
+
       // Check to ensure that the entityID exists alongised the correct
       // component ID. These will be used together to add a modification
       // to the current state of the component system.
-      int baseIndex = CPM_ES_NS::ComponentContainer<T>::getComponentItemIndexWithSequence(entityID);
       if (baseIndex != -1)
       {
         Tny* obj = cur->value.tny;
@@ -253,7 +735,7 @@ private:
         if (Tny_get(obj, "__cindex") != NULL)
         {
           int32_t serializedIndex = 0;
-          CerealSerializeType<int32_t>::in(obj, "__cindex", componentIndex);
+          CerealSerializeType<int32_t>::in(obj, "__cindex", serializedIndex);
 
           // Compute using the index that was given alongside the object.
           trueIndex = baseIndex + serializedIndex;
@@ -265,7 +747,7 @@ private:
           trueIndex = baseIndex + componentIndex;
         }
 
-        if (trueIndex < CPM_ES_NS::ComponentContainer<T>::getNumComponents())
+        if (trueIndex < numComponents)
         {
           if (array[trueIndex].sequence == entityID)
           {
@@ -281,7 +763,10 @@ private:
             // item to the modification array.
             s.setDeserializeRoot(obj);
             if (value.serialize(s, entityID))
+            {
               CPM_ES_NS::ComponentContainer<T>::modifyIndex(value, trueIndex, 10000);
+              invalidateEncodedEntity(entityID);
+            }
           }
         }
 
@@ -289,14 +774,93 @@ private:
     }
   }
 
-  void deserializeCreateInternal(CPM_ES_NS::ESCoreBase& core, Tny* root)
+  /// Returns the first index in [begin, end) whose sequence is not less than
+  /// \p entityID. The component array is always sorted by sequence.
+  static size_t lowerBoundSequence(
+      typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array,
+      size_t begin, size_t end, uint64_t entityID)
+  {
+    while (begin < end)
+    {
+      size_t mid = begin + (end - begin) / 2;
+      if (array[mid].sequence < entityID)
+        begin = mid + 1;
+      else
+        end = mid;
+    }
+    return begin;
+  }
+
+  /// Advances \p cursor to the first component whose sequence is not less
+  /// than \p entityID. Returns the cursor if it points at \p entityID, -1
+  /// otherwise. The cursor is left in place for the next (larger) entityID.
+  static int walkToSequence(
+      typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array,
+      size_t numComponents, size_t& cursor, uint64_t entityID)
+  {
+    while (cursor < numComponents && array[cursor].sequence < entityID)
+      ++cursor;
+
+    if (cursor < numComponents && array[cursor].sequence == entityID)
+      return static_cast<int>(cursor);
+    else
+      return -1;
+  }
+
+  /// Same as walkToSequence, except the cursor is advanced by exponentially
+  /// growing steps followed by a binary search of the final step.
+  static int gallopToSequence(
+      typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array,
+      size_t numComponents, size_t& cursor, uint64_t entityID)
+  {
+    if (cursor < numComponents && array[cursor].sequence < entityID)
+    {
+      // Invariant: array[cursor + step / 2].sequence < entityID.
+      size_t step = 1;
+      while (cursor + step < numComponents && array[cursor + step].sequence < entityID)
+        step *= 2;
+
+      size_t end = cursor + step + 1;
+      if (end > numComponents)
+        end = numComponents;
+      cursor = lowerBoundSequence(array, cursor + step / 2 + 1, end, entityID);
+    }
+
+    if (cursor < numComponents && array[cursor].sequence == entityID)
+      return static_cast<int>(cursor);
+    else
+      return -1;
+  }
+
+  /// Whether \p numRecords sorted entities are located among
+  /// \p numComponents components by galloping (see setMergeSearch).
+  bool shouldGallop(size_t numRecords, size_t numComponents) const
+  {
+    if (mMergeSearch == MERGE_SEARCH_AUTO)
+      return numRecords * heap_detail::GALLOP_DENSITY_THRESHOLD < numComponents;
+    return mMergeSearch == MERGE_SEARCH_GALLOP;
+  }
+
+  static int seekSequence(
+      typename CPM_ES_NS::ComponentContainer<T>::ComponentItem* array,
+      size_t numComponents, size_t& cursor, uint64_t entityID, bool gallop)
+  {
+    if (gallop)
+      return gallopToSequence(array, numComponents, cursor, entityID);
+    else
+      return walkToSequence(array, numComponents, cursor, entityID);
+  }
+
+  void deserializeCreateInternal(CPM_ES_NS::ESCoreBase& core, Tny* root, EntityRemap* remap)
   {
     /// \xxx  We may be erasing good type headers in preference of partial
     ///       type headers when we merge (delta compression).
     ComponentSerialize s(core, true);
+    s.setEntityRemap(remap);
 
     // Extract header information and grab Tny pointer to actual data.
-    mTypeHeaders.clear();
+    mTypeHeaders = ComponentSerialize::HeaderList(
+        CerealStlAllocator<ComponentSerialize::HeaderItem>(s.getAllocator()));
     Tny* components = heap_detail::readSerializedHeap(s, root, mTypeHeaders);
     if (components == nullptr)
     {
@@ -326,6 +890,9 @@ private:
 
       if (!heap_detail::checkTnyType(cur, TNY_OBJ)) return;
 
+      if (remap != nullptr)
+        entityID = remap->remap(entityID);
+
       Tny* obj = cur->value.tny;
       s.setDeserializeRoot(obj);
       if (value.serialize(s, entityID))
@@ -335,10 +902,73 @@ private:
 
   /// Type information that we obtained from deserialization. This contains
   /// what *explicit* type is associated with a particular name.
-  std::vector<ComponentSerialize::HeaderItem>   mTypeHeaders;
+  ComponentSerialize::HeaderList  mTypeHeaders;
 
   ///< Default: true. Set to false if this component should not be serialized.
   bool mIsSerializable;
+
+  ///< Default: MERGE_SEARCH_AUTO. Search strategy used when merging.
+  MergeSearch mMergeSearch;
+
+  /// Offsets of entity ID fields inside of T. Valid once
+  /// mHaveEntityFieldOffsets is true.
+  std::vector<size_t> mEntityFieldOffsets;
+  bool                mHaveEntityFieldOffsets;
+
+  uint64_t  mGeneration;      ///< See getGeneration.
+  bool      mChangesPending;  ///< Staged changes not yet renormalized.
+
+  /// Tny dumps of serialized entity heaps by entity ID. See
+  /// setCacheEncodedEntities.
+  std::unordered_map<uint64_t, CerealBuffer>  mEncodedEntities;
+  bool                                        mCacheEncodedEntities;
+  bool                                        mEncodedClearPending;   ///< Clear again on renormalize.
+  std::vector<uint64_t>                       mPendingInvalidations;  ///< Erase again on renormalize.
+
+  ComponentLayout     mLayout;      ///< Valid once mHaveLayout is true.
+  bool                mHaveLayout;
+};
+
+/// Components of type T decoded from a prefab template. See CerealPrefab.
+template <typename T>
+class PrefabHeap : public PrefabHeapInterface
+{
+public:
+  PrefabHeap(CerealHeap<T>& heap) : mHeap(heap) {}
+
+  void instantiate(const IDMap& idMap) override
+  {
+    std::vector<typename CPM_ES_NS::ComponentContainer<T>::ComponentItem> items;
+    items.reserve(mComponents.size());
+    for (const std::pair<uint64_t, T>& item : mComponents)
+    {
+      items.emplace_back(idMap.translate(item.first), item.second);
+      T& component = items.back().component;
+      for (size_t offset : mEntityFieldOffsets)
+      {
+        uint64_t* field = reinterpret_cast<uint64_t*>(
+            reinterpret_cast<char*>(&component) + offset);
+        *field = idMap.translate(*field);
+      }
+    }
+
+    mHeap.addComponents(items);
+  }
+
+  void collectEntityIDs(std::vector<uint64_t>& ids) const override
+  {
+    for (const std::pair<uint64_t, T>& item : mComponents)
+      ids.push_back(item.first);
+  }
+
+  size_t getNumComponents() const override {return mComponents.size();}
+
+private:
+  friend class CerealHeap<T>;
+
+  CerealHeap<T>&                        mHeap;                ///< Destination heap.
+  std::vector<std::pair<uint64_t, T>>   mComponents;          ///< Decoded components.
+  std::vector<size_t>                   mEntityFieldOffsets;  ///< Offsets of entity ID fields in T.
 };
 
 } // namespace CPM_ES_CEREAL_NS
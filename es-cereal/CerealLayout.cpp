@@ -0,0 +1,71 @@
+
+#include "CerealLayout.hpp"
+#include "CerealHash.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+ComponentLayout::ComponentLayout() :
+    mPackedSize(0),
+    mValid(true)
+{
+}
+
+void ComponentLayout::clear()
+{
+  mFields.clear();
+  mDefaults.clear();
+  mPackedSize = 0;
+  mValid = true;
+}
+
+void ComponentLayout::addField(const char* name, const char* typeName, const void* component,
+                               size_t componentSize, const void* field, size_t fieldSize,
+                               bool trivial, bool scalar)
+{
+  if (findField(name) != -1)
+    return;
+
+  const char* base = static_cast<const char*>(component);
+  const char* fieldPtr = static_cast<const char*>(field);
+  if (!trivial || fieldPtr < base || fieldPtr + fieldSize > base + componentSize
+      || (!scalar && fieldSize > 1 && !byte_detail::isHostLittleEndian()))
+  {
+    mValid = false;
+    return;
+  }
+
+  LayoutField item;
+  item.name = name;
+  item.typeName = typeName;
+  item.offset = static_cast<uint32_t>(fieldPtr - base);
+  item.size = static_cast<uint32_t>(fieldSize);
+  item.packedOffset = static_cast<uint32_t>(mPackedSize);
+  item.scalar = scalar;
+  mFields.push_back(item);
+  mPackedSize += fieldSize;
+}
+
+int ComponentLayout::findField(const char* name) const
+{
+  for (size_t i = 0; i < mFields.size(); ++i)
+  {
+    if (mFields[i].name == name)
+      return static_cast<int>(i);
+  }
+  return -1;
+}
+
+uint32_t ComponentLayout::getFingerprint() const
+{
+  uint32_t hash = hash_detail::FNV1A_OFFSET_BASIS;
+  for (const LayoutField& field : mFields)
+  {
+    hash = hash_detail::fnv1a(field.name.c_str(), hash);
+    hash = hash_detail::fnv1a(field.typeName.c_str(), hash);
+    for (int i = 0; i < 4; ++i)
+      hash = (hash ^ ((field.size >> (8 * i)) & 0xFF)) * hash_detail::FNV1A_PRIME;
+  }
+  return hash;
+}
+
+} // namespace CPM_ES_CEREAL_NS
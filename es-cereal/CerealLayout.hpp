@@ -0,0 +1,115 @@
+#ifndef IAUNS_CEREALLAYOUT_HPP
+#define IAUNS_CEREALLAYOUT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "CerealByteOrder.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+/// One field of a ComponentLayout.
+struct LayoutField
+{
+  std::string name;
+  std::string typeName;   ///< CerealSerializeType<T>::getTypeName().
+  uint32_t    offset;     ///< Byte offset inside of the component.
+  uint32_t    size;       ///< Size in bytes.
+  uint32_t    packedOffset; ///< Byte offset inside of a packed record.
+  bool        scalar;     ///< Arithmetic value, packed little endian.
+};
+
+/// Memory layout of the fields a component serializes, discovered by running
+/// its serialize function once (see ComponentSerialize::setLayoutRecorder).
+/// Layouts let binary wire backends copy fields directly between components
+/// and packed records without going through Tny. A layout is only valid if
+/// the component is trivially copyable and every field is trivially
+/// copyable and lives inside of the component: only then is copying the
+/// fields a faithful copy of the component.
+///
+/// Packed records hold the fields back to back in the order they were
+/// serialized. Scalar fields (arithmetic values and entity IDs) are stored
+/// little endian. Other fields are copied as is, which is only portable on
+/// little endian hosts; elsewhere they invalidate the layout.
+class ComponentLayout
+{
+public:
+  ComponentLayout();
+
+  void clear();
+
+  /// Appends a field. Fields that are not \p trivial, or that are not inside
+  /// of the component, invalidate the layout. Repeated names are ignored.
+  void addField(const char* name, const char* typeName, const void* component,
+                size_t componentSize, const void* field, size_t fieldSize, bool trivial,
+                bool scalar);
+
+  /// Marks the layout as unusable by binary backends.
+  void invalidate()                       {mValid = false;}
+  bool isValid() const                    {return mValid;}
+
+  size_t getNumFields() const             {return mFields.size();}
+  const LayoutField& getField(size_t index) const {return mFields[index];}
+
+  /// Index of the field named \p name, or -1.
+  int findField(const char* name) const;
+
+  /// Size of a packed record.
+  size_t getPackedSize() const            {return mPackedSize;}
+
+  /// Hash of every field's name, type and size. Equal fingerprints mean
+  /// packed records can be exchanged as is.
+  uint32_t getFingerprint() const;
+
+  /// Packed record of a default constructed component.
+  const std::vector<char>& getDefaults() const  {return mDefaults;}
+  void setDefaults(const void* component)
+  {
+    mDefaults.resize(mPackedSize);
+    if (mPackedSize != 0) pack(component, &mDefaults[0]);
+  }
+
+  /// Copies \p field (located at the field's offset inside of a component)
+  /// into the packed record \p out.
+  static void packField(const LayoutField& field, const void* value, char* out)
+  {
+    if (field.scalar)
+      byte_detail::copyLittleEndian(out + field.packedOffset, value, field.size);
+    else
+      std::memcpy(out + field.packedOffset, value, field.size);
+  }
+
+  /// Copies the fields of \p component into the packed record \p out.
+  void pack(const void* component, char* out) const
+  {
+    const char* in = static_cast<const char*>(component);
+    for (const LayoutField& field : mFields)
+      packField(field, in + field.offset, out);
+  }
+
+  /// Copies the packed record \p in into the fields of \p component.
+  void unpack(const char* in, void* component) const
+  {
+    char* out = static_cast<char*>(component);
+    for (const LayoutField& field : mFields)
+    {
+      if (field.scalar)
+        byte_detail::copyLittleEndian(out + field.offset, in + field.packedOffset, field.size);
+      else
+        std::memcpy(out + field.offset, in + field.packedOffset, field.size);
+    }
+  }
+
+private:
+  std::vector<LayoutField>  mFields;
+  std::vector<char>         mDefaults;
+  size_t                    mPackedSize;
+  bool                      mValid;
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
@@ -0,0 +1,38 @@
+
+#include <algorithm>
+
+#include "CerealPrefab.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+void CerealPrefab::addHeap(std::unique_ptr<PrefabHeapInterface> heap)
+{
+  heap->collectEntityIDs(mEntityIDs);
+  std::sort(mEntityIDs.begin(), mEntityIDs.end());
+  mEntityIDs.erase(std::unique(mEntityIDs.begin(), mEntityIDs.end()), mEntityIDs.end());
+
+  mHeaps.push_back(std::move(heap));
+}
+
+void CerealPrefab::instantiate(EntityRemap& remap) const
+{
+  // Resolve the new ID of every template entity once, up front. Heaps then
+  // only perform table lookups while copying components.
+  PrefabHeapInterface::IDMap idMap;
+  idMap.reserve(mEntityIDs.size());
+  for (uint64_t id : mEntityIDs)
+    idMap.insert(id, remap.remap(id));
+
+  for (const std::unique_ptr<PrefabHeapInterface>& heap : mHeaps)
+    heap->instantiate(idMap);
+}
+
+size_t CerealPrefab::getNumComponents() const
+{
+  size_t count = 0;
+  for (const std::unique_ptr<PrefabHeapInterface>& heap : mHeaps)
+    count += heap->getNumComponents();
+  return count;
+}
+
+} // namespace CPM_ES_CEREAL_NS
@@ -0,0 +1,67 @@
+#ifndef IAUNS_CEREALPREFAB_HPP
+#define IAUNS_CEREALPREFAB_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "EntityRemap.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+/// Decoded components of a single heap belonging to a prefab. Implemented by
+/// PrefabHeap<T> (see CerealHeap.hpp).
+class PrefabHeapInterface
+{
+public:
+  typedef EntityIDTable IDMap;
+
+  virtual ~PrefabHeapInterface() {}
+
+  /// Adds a copy of every decoded component to the heap the prefab was
+  /// decoded from. Entity IDs (owners and entity ID fields) present in
+  /// \p idMap are translated, all others are left as is.
+  virtual void instantiate(const IDMap& idMap) = 0;
+
+  /// Appends the IDs of all entities owning a component in this heap.
+  virtual void collectEntityIDs(std::vector<uint64_t>& ids) const = 0;
+
+  /// Number of decoded components.
+  virtual size_t getNumComponents() const = 0;
+};
+
+/// A serialized entity template decoded into typed component arrays. Built
+/// with CerealCore::createPrefab. Instantiating a prefab performs no Tny
+/// parsing and no field name lookups: components are copied out of the
+/// decoded arrays and added to each heap in one pass. A prefab is bound to
+/// the core that created it.
+class CerealPrefab
+{
+public:
+  CerealPrefab() {}
+
+  /// Adds decoded heap data. Called while the prefab is being created.
+  void addHeap(std::unique_ptr<PrefabHeapInterface> heap);
+
+  /// Instantiates one copy of the prefab. Every entity in the template is
+  /// mapped through \p remap (use EntityRemap(core) and clear it between
+  /// instances for fresh IDs). Renormalization is required afterwards.
+  void instantiate(EntityRemap& remap) const;
+
+  /// Sorted IDs of all entities in the template.
+  const std::vector<uint64_t>& getEntityIDs() const {return mEntityIDs;}
+
+  /// Total number of components in the template.
+  size_t getNumComponents() const;
+
+private:
+  CerealPrefab(const CerealPrefab&);
+  CerealPrefab& operator=(const CerealPrefab&);
+
+  std::vector<std::unique_ptr<PrefabHeapInterface>> mHeaps;
+  std::vector<uint64_t>                             mEntityIDs;
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
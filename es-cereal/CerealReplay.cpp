@@ -0,0 +1,821 @@
+
+#include <stdlib.h>         // For C's free
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+#include "CerealReplay.hpp"
+#include "CerealCore.hpp"
+#include "CerealByteOrder.hpp"
+#include <tny/tny.hpp>
+
+namespace CPM_ES_CEREAL_NS {
+
+using namespace byte_detail;
+
+namespace {
+
+const char REPLAY_MAGIC[4] = {'C', 'R', 'P', 'L'};
+const char INDEX_MAGIC[4] = {'C', 'R', 'P', 'X'};
+const char SIDECAR_MAGIC[4] = {'C', 'R', 'P', 'I'};
+
+void writeIndexEntry(char* out, const replay_detail::FrameEntry& entry)
+{
+  writeU64(out, entry.tick);
+  writeU64(out + 8, entry.offset);
+  writeU32(out + 16, entry.type);
+}
+
+replay_detail::FrameEntry readIndexEntry(const char* in)
+{
+  replay_detail::FrameEntry entry;
+  entry.tick = readU64(in);
+  entry.offset = readU64(in + 8);
+  entry.type = readU32(in + 16);
+  return entry;
+}
+
+/// Random ID tying a sidecar to its replay file.
+uint64_t makeRecordingID()
+{
+  std::random_device device;
+  uint64_t id = (static_cast<uint64_t>(device()) << 32) ^ device();
+  return id ^ static_cast<uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+}
+
+bool frameTickLess(uint64_t tick, const replay_detail::FrameEntry& entry)
+{
+  return tick < entry.tick;
+}
+
+bool tnyNodeEqual(const Tny* a, const Tny* b);
+
+/// Compares two Tny containers (ARRAY or DICT roots) element by element.
+bool tnyContainerEqual(const Tny* a, const Tny* b)
+{
+  if (a->type != b->type || a->size != b->size)
+    return false;
+
+  while (Tny_hasNext(a) && Tny_hasNext(b))
+  {
+    a = Tny_next(a);
+    b = Tny_next(b);
+
+    if ((a->key == NULL) != (b->key == NULL))
+      return false;
+    if (a->key != NULL && std::strcmp(a->key, b->key) != 0)
+      return false;
+    if (!tnyNodeEqual(a, b))
+      return false;
+  }
+
+  return !Tny_hasNext(a) && !Tny_hasNext(b);
+}
+
+/// Compares the values of two Tny nodes (keys are not compared).
+bool tnyNodeEqual(const Tny* a, const Tny* b)
+{
+  if (a->type != b->type)
+    return false;
+
+  switch (a->type)
+  {
+    case TNY_CHAR:
+      return a->value.chr == b->value.chr;
+    case TNY_INT32:
+      return std::memcmp(&a->value.num, &b->value.num, sizeof(int32_t)) == 0;
+    case TNY_INT64:
+      return a->value.num == b->value.num;
+    case TNY_BIN:
+      return a->size == b->size && std::memcmp(a->value.ptr, b->value.ptr, a->size) == 0;
+    case TNY_OBJ:
+      return tnyContainerEqual(a->value.tny, b->value.tny);
+    default:
+      return true;
+  }
+}
+
+/// Appends a copy of \p node (key and value) after \p dest.
+Tny* tnyCopyNode(Tny* dest, const Tny* node)
+{
+  switch (node->type)
+  {
+    case TNY_CHAR:
+    {
+      char value = node->value.chr;
+      return Tny_add(dest, TNY_CHAR, node->key, &value, 0);
+    }
+    case TNY_INT32:
+    {
+      int32_t value = 0;
+      std::memcpy(&value, &node->value.num, sizeof(int32_t));
+      return Tny_add(dest, TNY_INT32, node->key, &value, 0);
+    }
+    case TNY_INT64:
+    {
+      uint64_t value = node->value.num;
+      return Tny_add(dest, TNY_INT64, node->key, &value, 0);
+    }
+    case TNY_BIN:
+      return Tny_add(dest, TNY_BIN, node->key, node->value.ptr, node->size);
+    case TNY_OBJ:
+      return Tny_add(dest, TNY_OBJ, node->key, node->value.tny, 0);
+    default:
+      return Tny_add(dest, node->type, node->key, NULL, 0);
+  }
+}
+
+/// Splits a serialized heap into its type header and component array.
+bool splitHeap(Tny* heap, Tny*& typeHeader, Tny*& components)
+{
+  if (heap->type != TNY_ARRAY || !Tny_hasNext(heap)) return false;
+  heap = Tny_next(heap);
+  if (heap->type != TNY_OBJ) return false;
+  typeHeader = heap->value.tny;
+
+  if (!Tny_hasNext(heap)) return false;
+  heap = Tny_next(heap);
+  if (heap->type != TNY_OBJ) return false;
+  components = heap->value.tny;
+
+  return components->type == TNY_ARRAY;
+}
+
+/// Diffs one component dictionary. Returns a dictionary holding the changed
+/// fields, or NULL if nothing changed. Sets \p structural if the fields
+/// themselves differ.
+Tny* diffComponent(Tny* previous, Tny* current, int32_t componentIndex, bool& structural)
+{
+  if (previous->type != TNY_DICT || current->type != TNY_DICT || previous->size != current->size)
+  {
+    structural = true;
+    return NULL;
+  }
+
+  Tny* fields = NULL;
+  Tny* cur = current;
+  while (Tny_hasNext(cur))
+  {
+    cur = Tny_next(cur);
+    if (cur->key == NULL || std::strcmp(cur->key, "__cindex") == 0)
+      continue;
+
+    Tny* prev = Tny_get(previous, cur->key);
+    if (prev == NULL)
+    {
+      structural = true;
+      break;
+    }
+
+    if (!tnyNodeEqual(prev, cur))
+    {
+      if (fields == NULL)
+      {
+        fields = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+
+        // Deltas only carry some of an entity's components, so the index of
+        // the component can't be inferred from its position.
+        if (componentIndex != 0)
+          fields = Tny_add(fields, TNY_INT32, const_cast<char*>("__cindex"), &componentIndex, 0);
+      }
+      fields = tnyCopyNode(fields, cur);
+    }
+  }
+
+  if (structural && fields != NULL)
+  {
+    Tny_free(fields->root);
+    return NULL;
+  }
+
+  return (fields != NULL) ? fields->root : NULL;
+}
+
+/// Diffs one serialized heap. \p delta is set to the heap holding only the
+/// changed fields, or NULL if nothing changed. Returns false on structural
+/// differences.
+bool diffHeap(Tny* previous, Tny* current, Tny*& delta)
+{
+  delta = NULL;
+
+  Tny* prevHeader = NULL;
+  Tny* prevComponents = NULL;
+  Tny* curHeader = NULL;
+  Tny* curComponents = NULL;
+  if (!splitHeap(previous, prevHeader, prevComponents)) return false;
+  if (!splitHeap(current, curHeader, curComponents)) return false;
+  if (prevComponents->size != curComponents->size) return false;
+
+  Tny* compArray = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+  bool haveRecords = false;
+  bool structural = false;
+
+  Tny* prevCur = prevComponents;
+  Tny* curCur = curComponents;
+  uint64_t lastEntityID = 0;
+  bool haveLastEntity = false;
+  int32_t componentIndex = 0;
+  for (;;)
+  {
+    uint64_t prevID = 0;
+    uint64_t curID = 0;
+    Tny* prevObj = NULL;
+    Tny* curObj = NULL;
+    bool havePrev = heap_detail::readSerializedRecord(prevCur, prevID, prevObj);
+    bool haveCur = heap_detail::readSerializedRecord(curCur, curID, curObj);
+    if (havePrev != haveCur || prevID != curID)
+    {
+      structural = true;
+      break;
+    }
+    if (!haveCur)
+      break;
+
+    componentIndex = (haveLastEntity && lastEntityID == curID) ? componentIndex + 1 : 0;
+    haveLastEntity = true;
+    lastEntityID = curID;
+
+    Tny* fields = diffComponent(prevObj, curObj, componentIndex, structural);
+    if (structural)
+      break;
+
+    if (fields != NULL)
+    {
+      compArray = heap_detail::addSerializedComponent(compArray, fields, curID);
+      Tny_free(fields);
+      haveRecords = true;
+    }
+  }
+
+  if (!structural && haveRecords)
+  {
+    // Same layout as heap_detail::writeSerializedHeap.
+    Tny* root = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+    root = Tny_add(root, TNY_OBJ, NULL, curHeader, 0);
+    root = Tny_add(root, TNY_OBJ, NULL, compArray->root, 0);
+    delta = root->root;
+  }
+
+  Tny_free(compArray->root);
+  return !structural;
+}
+
+}
+
+namespace replay_detail {
+
+std::string getSidecarFilename(const std::string& filename)
+{
+  return filename + ".idx";
+}
+
+Tny* buildDelta(Tny* previous, Tny* current)
+{
+  if (previous == NULL || current == NULL) return NULL;
+  if (previous->type != TNY_DICT || current->type != TNY_DICT) return NULL;
+  if (previous->size != current->size) return NULL;
+
+  Tny* delta = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  bool structural = false;
+
+  Tny* cur = current;
+  while (Tny_hasNext(cur))
+  {
+    cur = Tny_next(cur);
+
+    Tny* prev = Tny_get(previous, cur->key);
+    if (prev == NULL || prev->type != TNY_OBJ || cur->type != TNY_OBJ)
+    {
+      structural = true;
+      break;
+    }
+
+    Tny* heapDelta = NULL;
+    if (!diffHeap(prev->value.tny, cur->value.tny, heapDelta))
+    {
+      structural = true;
+      break;
+    }
+
+    if (heapDelta != NULL)
+    {
+      delta = Tny_add(delta, TNY_OBJ, cur->key, heapDelta, 0);
+      Tny_free(heapDelta);
+    }
+  }
+
+  if (structural)
+  {
+    Tny_free(delta->root);
+    return NULL;
+  }
+
+  return delta->root;
+}
+
+} // namespace replay_detail
+
+//------------------------------------------------------------------------------
+// CerealReplayRecorder
+//------------------------------------------------------------------------------
+
+CerealReplayRecorder::CerealReplayRecorder(CerealCore& core, const std::string& filename,
+                                           uint32_t keyframeInterval, bool sidecarIndex) :
+    mCore(core),
+    mFile(filename.c_str(), std::ios::binary | std::ios::trunc),
+    mKeyframeInterval(keyframeInterval == 0 ? 1 : keyframeInterval),
+    mTicksSinceKeyframe(0),
+    mHaveTick(false),
+    mLastTick(0),
+    mOffset(0),
+    mNumDeltas(0),
+    mPrevious(NULL)
+{
+  if (!mFile)
+  {
+    std::cerr << "cpm-es-cereal: Unable to open replay file " << filename << std::endl;
+    throw std::runtime_error("Unable to open replay file");
+  }
+
+  uint64_t recordingID = makeRecordingID();
+  char header[replay_detail::FILE_HEADER_SIZE];
+  std::memcpy(header, REPLAY_MAGIC, 4);
+  writeU32(header + 4, replay_detail::VERSION);
+  writeU32(header + 8, mKeyframeInterval);
+  writeU64(header + 12, recordingID);
+  mFile.write(header, sizeof(header));
+  mOffset = sizeof(header);
+
+  if (!sidecarIndex)
+  {
+    // A sidecar of an earlier recording would describe other frames.
+    std::remove(replay_detail::getSidecarFilename(filename).c_str());
+  }
+  else
+  {
+    std::string sidecarName = replay_detail::getSidecarFilename(filename);
+    mSidecar.open(sidecarName.c_str(), std::ios::binary | std::ios::trunc);
+    if (!mSidecar)
+    {
+      std::cerr << "cpm-es-cereal: Unable to open replay index " << sidecarName << std::endl;
+      throw std::runtime_error("Unable to open replay index");
+    }
+
+    char sidecarHeader[replay_detail::SIDECAR_HEADER_SIZE];
+    std::memcpy(sidecarHeader, SIDECAR_MAGIC, 4);
+    writeU32(sidecarHeader + 4, replay_detail::VERSION);
+    writeU64(sidecarHeader + 8, recordingID);
+    mSidecar.write(sidecarHeader, sizeof(sidecarHeader));
+    mSidecar.flush();
+  }
+}
+
+CerealReplayRecorder::~CerealReplayRecorder()
+{
+  try
+  {
+    close();
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "cpm-es-cereal: Failed to close replay - " << e.what() << std::endl;
+  }
+}
+
+void CerealReplayRecorder::recordTick(uint64_t tick)
+{
+  if (!mFile.is_open())
+  {
+    std::cerr << "cpm-es-cereal: recordTick called on a closed replay." << std::endl;
+    throw std::runtime_error("Replay closed");
+  }
+
+  if (mHaveTick && tick <= mLastTick)
+  {
+    std::cerr << "cpm-es-cereal: Replay ticks must be increasing. Got " << tick
+              << " after " << mLastTick << std::endl;
+    throw std::runtime_error("Replay ticks must be increasing");
+  }
+
+  Tny* current = mCore.serializeAllComponents();
+
+  Tny* delta = NULL;
+  if (mPrevious != NULL && mTicksSinceKeyframe < mKeyframeInterval)
+    delta = replay_detail::buildDelta(mPrevious, current);
+
+  if (delta != NULL)
+  {
+    writeFrame(REPLAY_DELTA, tick, delta);
+    Tny_free(delta);
+    ++mNumDeltas;
+    ++mTicksSinceKeyframe;
+  }
+  else
+  {
+    writeFrame(REPLAY_KEYFRAME, tick, current);
+    mTicksSinceKeyframe = 1;
+  }
+
+  if (mPrevious != NULL)
+    Tny_free(mPrevious);
+  mPrevious = current;
+
+  mHaveTick = true;
+  mLastTick = tick;
+}
+
+void CerealReplayRecorder::writeFrame(ReplayFrameType type, uint64_t tick, Tny* root)
+{
+  void* data = NULL;
+  size_t dataSize = Tny_dumps(root, &data);
+  if (data == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Failed to dump replay frame for tick " << tick << std::endl;
+    throw std::runtime_error("Failed serialization");
+  }
+
+  char header[replay_detail::FRAME_HEADER_SIZE];
+  writeU32(header, static_cast<uint32_t>(type));
+  writeU64(header + 4, tick);
+  writeU64(header + 12, dataSize);
+  mFile.write(header, sizeof(header));
+  mFile.write(static_cast<const char*>(data), dataSize);
+  free(data);
+
+  if (!mFile)
+  {
+    std::cerr << "cpm-es-cereal: Failed to write replay frame for tick " << tick << std::endl;
+    throw std::runtime_error("Failed to write replay");
+  }
+
+  replay_detail::FrameEntry entry;
+  entry.tick = tick;
+  entry.offset = mOffset;
+  entry.type = static_cast<uint32_t>(type);
+  mIndex.push_back(entry);
+  mOffset += sizeof(header) + dataSize;
+
+  if (mSidecar.is_open())
+  {
+    // The frame must reach the file before the index refers to it.
+    mFile.flush();
+
+    char indexEntry[replay_detail::INDEX_ENTRY_SIZE];
+    writeIndexEntry(indexEntry, entry);
+    mSidecar.write(indexEntry, sizeof(indexEntry));
+    mSidecar.flush();
+  }
+}
+
+void CerealReplayRecorder::close()
+{
+  if (mPrevious != NULL)
+  {
+    Tny_free(mPrevious);
+    mPrevious = NULL;
+  }
+
+  if (mSidecar.is_open())
+    mSidecar.close();
+
+  if (!mFile.is_open())
+    return;
+
+  uint64_t indexOffset = mOffset;
+  std::vector<char> index(mIndex.size() * replay_detail::INDEX_ENTRY_SIZE);
+  for (size_t i = 0; i < mIndex.size(); ++i)
+    writeIndexEntry(&index[i * replay_detail::INDEX_ENTRY_SIZE], mIndex[i]);
+  if (!index.empty())
+    mFile.write(&index[0], index.size());
+
+  char footer[replay_detail::INDEX_FOOTER_SIZE];
+  writeU64(footer, mIndex.size());
+  writeU64(footer + 8, indexOffset);
+  std::memcpy(footer + 16, INDEX_MAGIC, 4);
+  mFile.write(footer, sizeof(footer));
+  mFile.close();
+}
+
+//------------------------------------------------------------------------------
+// CerealReplayPlayer
+//------------------------------------------------------------------------------
+
+CerealReplayPlayer::CerealReplayPlayer(CerealCore& core, const std::string& filename) :
+    mCore(core),
+    mFile(filename.c_str(), std::ios::binary),
+    mKeyframeInterval(0),
+    mRecordingID(0),
+    mHeaderSize(replay_detail::FILE_HEADER_SIZE_V2),
+    mFileSize(0),
+    mPositioned(false),
+    mCurrentFrame(0),
+    mCurrentTick(0),
+    mNumDeltasApplied(0)
+{
+  if (!mFile)
+  {
+    std::cerr << "cpm-es-cereal: Unable to open replay file " << filename << std::endl;
+    throw std::runtime_error("Unable to open replay file");
+  }
+
+  mFile.seekg(0, std::ios::end);
+  mFileSize = static_cast<uint64_t>(mFile.tellg());
+  mFile.seekg(0, std::ios::beg);
+
+  char header[replay_detail::FILE_HEADER_SIZE];
+  if (mFileSize < replay_detail::FILE_HEADER_SIZE_V2
+      || !mFile.read(header, replay_detail::FILE_HEADER_SIZE_V2)
+      || std::memcmp(header, REPLAY_MAGIC, 4) != 0)
+  {
+    std::cerr << "cpm-es-cereal: " << filename << " is not a replay file." << std::endl;
+    throw std::runtime_error("Not a replay file");
+  }
+
+  uint32_t version = readU32(header + 4);
+  if (version != replay_detail::VERSION && version != replay_detail::VERSION_2
+      && version != replay_detail::VERSION_1)
+  {
+    std::cerr << "cpm-es-cereal: " << filename << " has unsupported replay version "
+              << version << std::endl;
+    throw std::runtime_error("Unsupported replay version");
+  }
+  mKeyframeInterval = readU32(header + 8);
+
+  if (version == replay_detail::VERSION)
+  {
+    const size_t idSize = replay_detail::FILE_HEADER_SIZE - replay_detail::FILE_HEADER_SIZE_V2;
+    if (mFileSize < replay_detail::FILE_HEADER_SIZE
+        || !mFile.read(header + replay_detail::FILE_HEADER_SIZE_V2, idSize))
+    {
+      std::cerr << "cpm-es-cereal: " << filename << " is not a replay file." << std::endl;
+      throw std::runtime_error("Not a replay file");
+    }
+    mRecordingID = readU64(header + replay_detail::FILE_HEADER_SIZE_V2);
+    mHeaderSize = replay_detail::FILE_HEADER_SIZE;
+  }
+
+  if (version == replay_detail::VERSION_1)
+  {
+    // The keyframe only index can't be used for seeking to deltas. Its
+    // frames end where the index starts.
+    uint64_t numEntries = 0;
+    uint64_t indexOffset = 0;
+    if (readTrailerFooter(replay_detail::INDEX_ENTRY_SIZE_V1, numEntries, indexOffset))
+      scanFrames(indexOffset);
+    else
+      scanFrames(mFileSize);
+  }
+  else if (!readTrailerIndex()
+           && (version == replay_detail::VERSION_2 || !readSidecarIndex(filename)))
+  {
+    scanFrames(mFileSize);
+  }
+
+  buildKeyframeList();
+}
+
+bool CerealReplayPlayer::readTrailerFooter(size_t entrySize, uint64_t& numEntries,
+                                           uint64_t& indexOffset)
+{
+  if (mFileSize < mHeaderSize + replay_detail::INDEX_FOOTER_SIZE)
+    return false;
+
+  char footer[replay_detail::INDEX_FOOTER_SIZE];
+  mFile.clear();
+  mFile.seekg(static_cast<std::streamoff>(mFileSize - sizeof(footer)));
+  if (!mFile.read(footer, sizeof(footer)) || std::memcmp(footer + 16, INDEX_MAGIC, 4) != 0)
+    return false;
+
+  numEntries = readU64(footer);
+  indexOffset = readU64(footer + 8);
+  return indexOffset >= mHeaderSize
+      && indexOffset <= mFileSize - sizeof(footer)
+      && mFileSize - sizeof(footer) - indexOffset == numEntries * entrySize;
+}
+
+bool CerealReplayPlayer::readTrailerIndex()
+{
+  uint64_t numFrames = 0;
+  uint64_t indexOffset = 0;
+  if (!readTrailerFooter(replay_detail::INDEX_ENTRY_SIZE, numFrames, indexOffset))
+    return false;
+
+  std::vector<char> index(static_cast<size_t>(numFrames * replay_detail::INDEX_ENTRY_SIZE));
+  mFile.seekg(static_cast<std::streamoff>(indexOffset));
+  if (!index.empty() && !mFile.read(&index[0], index.size()))
+    return false;
+
+  mFrames.clear();
+  mFrames.reserve(static_cast<size_t>(numFrames));
+  for (size_t i = 0; i < numFrames; ++i)
+  {
+    replay_detail::FrameEntry entry = readIndexEntry(&index[i * replay_detail::INDEX_ENTRY_SIZE]);
+    if (entry.offset + replay_detail::FRAME_HEADER_SIZE > indexOffset)
+      return false;
+    mFrames.push_back(entry);
+  }
+
+  return true;
+}
+
+bool CerealReplayPlayer::readSidecarIndex(const std::string& filename)
+{
+  std::ifstream sidecar(replay_detail::getSidecarFilename(filename).c_str(), std::ios::binary);
+  if (!sidecar)
+    return false;
+
+  char header[replay_detail::SIDECAR_HEADER_SIZE];
+  if (!sidecar.read(header, sizeof(header)) || std::memcmp(header, SIDECAR_MAGIC, 4) != 0
+      || readU32(header + 4) != replay_detail::VERSION || readU64(header + 8) != mRecordingID)
+    return false;
+
+  // Entries are only appended once their frame is in the replay file, so a
+  // trailing partial entry ends the index. Every entry must point at its
+  // frame; anything else (the replay was truncated or rewritten after the
+  // fact) rejects the sidecar and the frames are scanned instead.
+  mFrames.clear();
+  char entryData[replay_detail::INDEX_ENTRY_SIZE];
+  uint64_t end = mHeaderSize;
+  while (sidecar.read(entryData, sizeof(entryData)))
+  {
+    replay_detail::FrameEntry entry = readIndexEntry(entryData);
+    uint32_t type = 0;
+    uint64_t tick = 0;
+    uint64_t size = 0;
+    if (entry.offset < end || !readFrameHeader(entry.offset, type, tick, size)
+        || type != entry.type || tick != entry.tick
+        || size > mFileSize - entry.offset - replay_detail::FRAME_HEADER_SIZE)
+    {
+      mFrames.clear();
+      return false;
+    }
+
+    end = entry.offset + replay_detail::FRAME_HEADER_SIZE + size;
+    mFrames.push_back(entry);
+  }
+
+  return true;
+}
+
+void CerealReplayPlayer::scanFrames(uint64_t end)
+{
+  // Walk frame headers only, skipping payloads. A truncated trailing frame
+  // (recording interrupted mid-write) ends the replay.
+  mFrames.clear();
+  uint64_t offset = mHeaderSize;
+  replay_detail::FrameEntry entry;
+  uint64_t size = 0;
+  while (readFrameHeader(offset, entry.type, entry.tick, size))
+  {
+    uint64_t frameEnd = offset + replay_detail::FRAME_HEADER_SIZE + size;
+    if (frameEnd > end || (entry.type != REPLAY_KEYFRAME && entry.type != REPLAY_DELTA))
+      break;
+
+    entry.offset = offset;
+    mFrames.push_back(entry);
+    offset = frameEnd;
+  }
+}
+
+void CerealReplayPlayer::buildKeyframeList()
+{
+  mKeyframes.clear();
+  for (size_t i = 0; i < mFrames.size(); ++i)
+  {
+    if (i > 0 && mFrames[i].tick <= mFrames[i - 1].tick)
+    {
+      std::cerr << "cpm-es-cereal: Replay frames are not sorted by tick." << std::endl;
+      throw std::runtime_error("Corrupt replay index");
+    }
+
+    if (mFrames[i].type == REPLAY_KEYFRAME)
+      mKeyframes.push_back(i);
+  }
+
+  if (!mFrames.empty() && (mKeyframes.empty() || mKeyframes.front() != 0))
+  {
+    std::cerr << "cpm-es-cereal: Replay does not start with a keyframe." << std::endl;
+    throw std::runtime_error("Corrupt replay index");
+  }
+}
+
+bool CerealReplayPlayer::readFrameHeader(uint64_t offset, uint32_t& type,
+                                         uint64_t& tick, uint64_t& size)
+{
+  if (offset + replay_detail::FRAME_HEADER_SIZE > mFileSize)
+    return false;
+
+  char header[replay_detail::FRAME_HEADER_SIZE];
+  mFile.clear();
+  mFile.seekg(static_cast<std::streamoff>(offset));
+  if (!mFile.read(header, sizeof(header)))
+    return false;
+
+  type = readU32(header);
+  tick = readU64(header + 4);
+  size = readU64(header + 12);
+  return true;
+}
+
+void CerealReplayPlayer::applyFrame(size_t frameIndex)
+{
+  const replay_detail::FrameEntry& entry = mFrames[frameIndex];
+
+  uint32_t type = 0;
+  uint64_t tick = 0;
+  uint64_t size = 0;
+  if (!readFrameHeader(entry.offset, type, tick, size) || type != entry.type || tick != entry.tick
+      || entry.offset + replay_detail::FRAME_HEADER_SIZE + size > mFileSize)
+  {
+    std::cerr << "cpm-es-cereal: Replay index does not match frame at tick " << entry.tick << std::endl;
+    throw std::runtime_error("Corrupt replay index");
+  }
+
+  // readFrameHeader leaves the stream positioned at the payload.
+  std::vector<char> payload(static_cast<size_t>(size));
+  if (!payload.empty() && !mFile.read(&payload[0], payload.size()))
+  {
+    std::cerr << "cpm-es-cereal: Truncated replay frame." << std::endl;
+    throw std::runtime_error("Truncated replay frame");
+  }
+
+  Tny* root = CerealCore::loadTny(payload.empty() ? NULL : &payload[0], payload.size());
+  if (root == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Corrupt replay frame." << std::endl;
+    throw std::runtime_error("Corrupt replay frame");
+  }
+
+  if (type == REPLAY_KEYFRAME)
+  {
+    mCore.clearAllComponentContainersImmediately();
+    mCore.deserializeComponentCreate(root);
+  }
+  else
+  {
+    mCore.deserializeComponentMerge(root, true);
+  }
+  mCore.renormalize(true);
+
+  Tny_free(root);
+
+  mCurrentFrame = frameIndex;
+  mCurrentTick = tick;
+}
+
+bool CerealReplayPlayer::seek(uint64_t tick)
+{
+  // Last frame at or before tick.
+  std::vector<replay_detail::FrameEntry>::const_iterator it =
+      std::upper_bound(mFrames.begin(), mFrames.end(), tick, frameTickLess);
+  if (it == mFrames.begin())
+    return false;
+  size_t target = static_cast<size_t>(it - mFrames.begin()) - 1;
+
+  // Keyframe the target frame depends on.
+  size_t keyframe = *(std::upper_bound(mKeyframes.begin(), mKeyframes.end(), target) - 1);
+
+  mNumDeltasApplied = 0;
+  size_t frame = keyframe;
+  if (mPositioned && mCurrentFrame >= keyframe && mCurrentFrame <= target)
+  {
+    // Scrubbing forward inside of the same keyframe span.
+    frame = mCurrentFrame + 1;
+  }
+  else
+  {
+    applyFrame(keyframe);
+    frame = keyframe + 1;
+  }
+  mPositioned = true;
+
+  for (; frame <= target; ++frame)
+  {
+    applyFrame(frame);
+    ++mNumDeltasApplied;
+  }
+
+  return true;
+}
+
+bool CerealReplayPlayer::step()
+{
+  if (!mPositioned)
+  {
+    if (mFrames.empty())
+      return false;
+    return seek(mFrames.front().tick);
+  }
+
+  if (mCurrentFrame + 1 >= mFrames.size())
+    return false;
+
+  applyFrame(mCurrentFrame + 1);
+  return true;
+}
+
+} // namespace CPM_ES_CEREAL_NS
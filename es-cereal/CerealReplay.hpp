@@ -0,0 +1,203 @@
+#ifndef IAUNS_CEREALREPLAY_HPP
+#define IAUNS_CEREALREPLAY_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct _Tny;
+typedef _Tny Tny;
+
+namespace CPM_ES_CEREAL_NS {
+
+class CerealCore;
+
+/// Replay files store a match as a stream of frames, one per recorded tick.
+/// A frame is either a keyframe (the full state, as serializeAllComponents)
+/// or a delta holding only the fields that changed since the previous tick
+/// (applied with deserializeComponentMerge). An index of every frame, with
+/// keyframes marked, is appended when the recording is closed so players
+/// can binary search to any tick without scanning. Recorders may also keep
+/// the same index in a sidecar file (filename + ".idx") that is updated as
+/// frames are written, so recordings still in progress (or cut short) are
+/// seekable too. Each recording gets a random ID, stored in the file header
+/// and in its sidecar, so a sidecar left behind by an earlier recording of
+/// the same name is never used.
+///
+/// Layout (all integers little endian):
+///
+///   char[4]   magic "CRPL"
+///   uint32_t  version
+///   uint32_t  keyframe interval
+///   uint64_t  recording ID
+///   per frame:
+///     uint32_t  frame type (REPLAY_KEYFRAME or REPLAY_DELTA)
+///     uint64_t  tick
+///     uint64_t  payload size
+///     char[]    payload (Tny dump)
+///   index (written by close):
+///     per frame: uint64_t tick, uint64_t file offset of frame, uint32_t type
+///     uint64_t  number of frames
+///     uint64_t  file offset of index
+///     char[4]   magic "CRPX"
+///
+/// Sidecar layout: char[4] magic "CRPI", uint32_t version, uint64_t
+/// recording ID, followed by index entries as above.
+///
+/// Version 2 files have no recording ID. Their trailer is read as usual,
+/// but their sidecars can't be matched to them, so without a trailer they
+/// are scanned. Version 1 files indexed keyframes only (per keyframe:
+/// uint64_t tick, uint64_t file offset; the footer counts keyframes) and had
+/// no sidecar. Their frames are the same, so players read them by scanning
+/// the frames up to the version 1 trailer.
+enum ReplayFrameType
+{
+  REPLAY_KEYFRAME = 0,
+  REPLAY_DELTA    = 1
+};
+
+namespace replay_detail {
+
+const uint32_t VERSION              = 3;
+const uint32_t VERSION_2            = 2;  ///< No recording ID.
+const uint32_t VERSION_1            = 1;  ///< Keyframe only trailer.
+const size_t   FILE_HEADER_SIZE     = 20;
+const size_t   FILE_HEADER_SIZE_V2  = 12; ///< Versions 1 and 2.
+const size_t   FRAME_HEADER_SIZE    = 20;
+const size_t   INDEX_ENTRY_SIZE     = 20;
+const size_t   INDEX_ENTRY_SIZE_V1  = 16;
+const size_t   INDEX_FOOTER_SIZE    = 20;
+const size_t   SIDECAR_HEADER_SIZE  = 16;
+
+/// Location of one frame inside of a replay file.
+struct FrameEntry
+{
+  uint64_t tick;
+  uint64_t offset;  ///< File offset of the frame header.
+  uint32_t type;    ///< ReplayFrameType.
+};
+
+/// Name of the sidecar index of \p filename.
+std::string getSidecarFilename(const std::string& filename);
+
+/// Builds a document holding only the fields of \p current that differ
+/// from \p previous (both outputs of serializeAllComponents). Returns NULL
+/// if the two states differ structurally (heaps, entities or fields were
+/// added or removed); such changes can't be expressed as a merge and need
+/// a keyframe. The caller is responsible for calling Tny_free on the
+/// returned Tny*.
+Tny* buildDelta(Tny* previous, Tny* current);
+}
+
+/// Records ticks of a CerealCore into a replay file.
+class CerealReplayRecorder
+{
+public:
+  /// Opens \p filename for writing. A keyframe is written every
+  /// \p keyframeInterval recorded ticks, and whenever a delta can't express
+  /// the change from the previous tick. Seeking never applies more than
+  /// \p keyframeInterval - 1 deltas. If \p sidecarIndex is true the frame
+  /// index is also written to getSidecarFilename(filename) as frames are
+  /// recorded; otherwise any existing sidecar of that name is deleted.
+  CerealReplayRecorder(CerealCore& core, const std::string& filename,
+                       uint32_t keyframeInterval = 60, bool sidecarIndex = false);
+
+  /// Calls close.
+  ~CerealReplayRecorder();
+
+  /// Serializes the core's current state as \p tick. Ticks must be strictly
+  /// increasing. The core should be renormalized.
+  void recordTick(uint64_t tick);
+
+  /// Appends the frame index and closes the file. Called automatically
+  /// on destruction.
+  void close();
+
+  size_t getNumKeyframes() const  {return mIndex.size() - mNumDeltas;}
+  size_t getNumDeltas() const     {return mNumDeltas;}
+
+private:
+  CerealReplayRecorder(const CerealReplayRecorder&);
+  CerealReplayRecorder& operator=(const CerealReplayRecorder&);
+
+  void writeFrame(ReplayFrameType type, uint64_t tick, Tny* root);
+
+  CerealCore&                             mCore;
+  std::ofstream                           mFile;
+  std::ofstream                           mSidecar;     ///< Only open if requested.
+  uint32_t                                mKeyframeInterval;
+  uint32_t                                mTicksSinceKeyframe;
+  bool                                    mHaveTick;
+  uint64_t                                mLastTick;
+  uint64_t                                mOffset;      ///< Current write offset.
+  size_t                                  mNumDeltas;
+  Tny*                                    mPrevious;    ///< State of the last recorded tick.
+  std::vector<replay_detail::FrameEntry>  mIndex;       ///< Every frame written.
+};
+
+/// Plays back a replay file into a CerealCore. Components must be
+/// registered with the core before playing.
+class CerealReplayPlayer
+{
+public:
+  /// Opens \p filename and reads its frame index from the trailer. Files
+  /// without a trailer (recordings still in progress, or never closed) use
+  /// the sidecar index if there is one, it carries the file's recording ID
+  /// and every entry matches the frame header it points at. Otherwise the
+  /// frames are scanned. Version 1 files are always scanned. Throws
+  /// std::runtime_error for other versions.
+  CerealReplayPlayer(CerealCore& core, const std::string& filename);
+
+  /// Restores the state of the last recorded tick at or before \p tick.
+  /// The frame is found by binary search. If the current state lies between
+  /// that frame and its keyframe, only the deltas in between are applied.
+  /// Otherwise the keyframe is loaded and the deltas after it are applied.
+  /// Returns false if \p tick precedes the first recorded tick.
+  bool seek(uint64_t tick);
+
+  /// Advances to the next recorded tick. Returns false at the end of the
+  /// replay.
+  bool step();
+
+  /// Tick the core currently reflects. Only valid after a successful seek
+  /// or step.
+  uint64_t getCurrentTick() const {return mCurrentTick;}
+
+  size_t getNumFrames() const     {return mFrames.size();}
+  size_t getNumKeyframes() const  {return mKeyframes.size();}
+  uint32_t getKeyframeInterval() const {return mKeyframeInterval;}
+
+  /// Number of deltas applied by the last call to seek.
+  size_t getNumDeltasApplied() const {return mNumDeltasApplied;}
+
+private:
+  /// Reads the trailer footer. Returns false unless it is intact and
+  /// describes entries of \p entrySize bytes ending at the footer.
+  bool readTrailerFooter(size_t entrySize, uint64_t& numEntries, uint64_t& indexOffset);
+  bool readTrailerIndex();
+  bool readSidecarIndex(const std::string& filename);
+
+  /// Indexes frames by walking their headers up to \p end.
+  void scanFrames(uint64_t end);
+  void buildKeyframeList();
+  bool readFrameHeader(uint64_t offset, uint32_t& type, uint64_t& tick, uint64_t& size);
+  void applyFrame(size_t frameIndex);
+
+  CerealCore&                             mCore;
+  std::ifstream                           mFile;
+  uint32_t                                mKeyframeInterval;
+  uint64_t                                mRecordingID; ///< 0 before version 3.
+  size_t                                  mHeaderSize;  ///< Offset of the first frame.
+  uint64_t                                mFileSize;
+  bool                                    mPositioned;  ///< True once seek or step succeeded.
+  size_t                                  mCurrentFrame;
+  uint64_t                                mCurrentTick;
+  size_t                                  mNumDeltasApplied;
+  std::vector<replay_detail::FrameEntry>  mFrames;      ///< Sorted by tick.
+  std::vector<size_t>                     mKeyframes;   ///< Indices into mFrames.
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
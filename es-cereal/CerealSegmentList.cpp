@@ -0,0 +1,101 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <climits>
+#include <sys/uio.h>
+#endif
+
+#include "CerealSegmentList.hpp"
+#include "CerealAllocator.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+namespace {
+
+#if !defined(_WIN32)
+#ifdef IOV_MAX
+const size_t MAX_IOVECS_PER_WRITE = IOV_MAX;
+#else
+const size_t MAX_IOVECS_PER_WRITE = 16;
+#endif
+#endif
+
+}
+
+void CerealSegmentList::append(const CerealBuffer& segment)
+{
+  if (segment.empty())
+    return;
+
+  mSegments.push_back(segment);
+  mTotalSize += segment.size();
+}
+
+CerealBuffer CerealSegmentList::concatenate(CerealAllocator& allocator) const
+{
+  if (mTotalSize == 0)
+    return CerealBuffer();
+
+  char* data = static_cast<char*>(allocator.allocate(mTotalSize));
+  if (data == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Failed to allocate buffer of size " << mTotalSize << std::endl;
+    throw std::runtime_error("Failed allocation");
+  }
+
+  size_t offset = 0;
+  for (const CerealBuffer& segment : mSegments)
+  {
+    std::memcpy(data + offset, segment.data(), segment.size());
+    offset += segment.size();
+  }
+
+  return CerealBuffer::adopt(data, mTotalSize, allocator);
+}
+
+#ifndef _WIN32
+void CerealSegmentList::writeTo(int fd) const
+{
+  std::vector<struct iovec> iov(std::min(mSegments.size(), MAX_IOVECS_PER_WRITE));
+
+  // Position of the first byte not yet written.
+  size_t segment = 0;
+  size_t offset = 0;
+  while (segment < mSegments.size())
+  {
+    size_t count = fillIOVec(&iov[0], iov.size(), segment);
+    iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + offset;
+    iov[0].iov_len -= offset;
+
+    ssize_t written = ::writev(fd, &iov[0], static_cast<int>(count));
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+    {
+      std::cerr << "cpm-es-cereal: Failed to write segments: " << std::strerror(errno) << std::endl;
+      throw std::runtime_error("Failed write");
+    }
+
+    size_t remaining = static_cast<size_t>(written);
+    while (remaining > 0)
+    {
+      size_t left = mSegments[segment].size() - offset;
+      if (remaining < left)
+      {
+        offset += remaining;
+        break;
+      }
+      remaining -= left;
+      offset = 0;
+      ++segment;
+    }
+  }
+}
+#endif
+
+} // namespace CPM_ES_CEREAL_NS
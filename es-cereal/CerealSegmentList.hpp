@@ -0,0 +1,66 @@
+#ifndef IAUNS_CEREALSEGMENTLIST_HPP
+#define IAUNS_CEREALSEGMENTLIST_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "CerealBuffer.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+class CerealAllocator;
+
+/// Ordered list of buffers that together form one serialized document,
+/// for gathered output (writev, sendmsg) without first concatenating the
+/// buffers. See CerealCore::dumpSnapshotSegments. Segments are
+/// CerealBuffers, so the list is cheap to copy and keeps its memory alive
+/// on other threads.
+class CerealSegmentList
+{
+public:
+  CerealSegmentList() : mTotalSize(0) {}
+
+  /// Appends \p segment. Empty buffers are ignored.
+  void append(const CerealBuffer& segment);
+
+  size_t getNumSegments() const                   {return mSegments.size();}
+  const CerealBuffer& getSegment(size_t index) const {return mSegments[index];}
+
+  /// Sum of the sizes of every segment.
+  size_t getTotalSize() const                     {return mTotalSize;}
+
+  /// Copies every segment, in order, into one buffer obtained from
+  /// \p allocator.
+  CerealBuffer concatenate(CerealAllocator& allocator) const;
+
+  /// Fills up to \p maxCount iovec-style entries (any type with iov_base
+  /// and iov_len members, such as struct iovec), starting at segment
+  /// \p first. Returns the number of entries filled. Entries point into the
+  /// segments, which must outlive the write.
+  template <typename IOVec>
+  size_t fillIOVec(IOVec* iov, size_t maxCount, size_t first = 0) const
+  {
+    size_t count = 0;
+    for (size_t i = first; i < mSegments.size() && count < maxCount; ++i, ++count)
+    {
+      iov[count].iov_base = const_cast<void*>(mSegments[i].data());
+      iov[count].iov_len  = mSegments[i].size();
+    }
+    return count;
+  }
+
+#ifndef _WIN32
+  /// Writes every segment to the file descriptor \p fd with writev,
+  /// continuing after partial writes and interruptions. Throws
+  /// std::runtime_error if the write fails.
+  void writeTo(int fd) const;
+#endif
+
+private:
+  std::vector<CerealBuffer> mSegments;
+  size_t                    mTotalSize;
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
@@ -0,0 +1,431 @@
+
+#ifndef _WIN32
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CerealShards.hpp"
+#include "CerealCore.hpp"
+#include <tny/tny.hpp>
+
+namespace CPM_ES_CEREAL_NS {
+
+const char* const CerealShardManifest::MANIFEST_NAME = "manifest";
+
+namespace {
+
+const char* const MANIFEST_HEADER = "cereal-shards 1";
+
+void malformedManifest(const std::string& directory, const char* reason)
+{
+  std::cerr << "cpm-es-cereal: Malformed shard manifest in " << directory << " - " << reason << std::endl;
+  throw std::runtime_error("Malformed shard manifest");
+}
+
+/// Runs \p worker on \p numThreads threads, or on the calling thread if 1.
+template <typename Worker>
+void runWorkers(size_t numThreads, Worker& worker)
+{
+  if (numThreads <= 1)
+  {
+    worker();
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < numThreads; ++i)
+    threads.push_back(std::thread(std::ref(worker)));
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+}
+
+namespace shard_detail {
+
+bool writeFileAtomic(const std::string& path, const void* data, size_t size, bool sync)
+{
+  std::string temporary = path + ".tmp";
+  int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return false;
+
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0)
+  {
+    ssize_t written = ::write(fd, bytes, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+    {
+      int error = (written == 0) ? EIO : errno;
+      ::close(fd);
+      ::unlink(temporary.c_str());
+      errno = error;
+      return false;
+    }
+    bytes += written;
+    size -= static_cast<size_t>(written);
+  }
+
+  if ((sync && ::fsync(fd) != 0) || ::close(fd) != 0)
+  {
+    int error = errno;
+    ::unlink(temporary.c_str());
+    errno = error;
+    return false;
+  }
+
+  if (std::rename(temporary.c_str(), path.c_str()) != 0)
+  {
+    int error = errno;
+    ::unlink(temporary.c_str());
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+bool syncDirectory(const std::string& directory)
+{
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
+    return false;
+
+  if (::fsync(fd) != 0)
+  {
+    int error = errno;
+    ::close(fd);
+    errno = error;
+    return false;
+  }
+  return ::close(fd) == 0;
+}
+
+bool readFile(const std::string& path, std::vector<char>& contents)
+{
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return false;
+
+  contents.clear();
+  char block[64 * 1024];
+  size_t count = 0;
+  while ((count = std::fread(block, 1, sizeof(block), file)) > 0)
+    contents.insert(contents.end(), block, block + count);
+
+  bool ok = (std::ferror(file) == 0);
+  std::fclose(file);
+  return ok;
+}
+
+int64_t getFileSize(const std::string& path)
+{
+  struct stat info;
+  if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+    return -1;
+  return static_cast<int64_t>(info.st_size);
+}
+
+}
+
+//------------------------------------------------------------------------------
+// CerealShardManifest
+//------------------------------------------------------------------------------
+
+bool CerealShardManifest::load(const std::string& directory)
+{
+  entries.clear();
+
+  std::vector<char> contents;
+  if (!shard_detail::readFile(directory + "/" + MANIFEST_NAME, contents))
+    return false;
+
+  std::istringstream stream(std::string(contents.begin(), contents.end()));
+  std::string line;
+  if (!std::getline(stream, line) || line != MANIFEST_HEADER)
+    malformedManifest(directory, "unknown header");
+
+  while (std::getline(stream, line))
+  {
+    if (line.empty())
+      continue;
+
+    Entry entry;
+    char fileName[256];
+    int keyOffset = -1;
+    if (std::sscanf(line.c_str(), "%16" SCNx64 " %" SCNu64 " %255s %n",
+                    &entry.fingerprint, &entry.size, fileName, &keyOffset) != 3
+        || keyOffset <= 0 || static_cast<size_t>(keyOffset) >= line.size())
+    {
+      malformedManifest(directory, "bad entry");
+    }
+
+    entry.fileName = fileName;
+    entry.key = line.substr(keyOffset);
+    if (entry.fileName.find('/') != std::string::npos)
+      malformedManifest(directory, "file outside of the directory");
+    entries.push_back(entry);
+  }
+
+  return true;
+}
+
+void CerealShardManifest::save(const std::string& directory) const
+{
+  std::string text = MANIFEST_HEADER;
+  text += '\n';
+  for (const Entry& entry : entries)
+  {
+    char prefix[64];
+    std::snprintf(prefix, sizeof(prefix), "%016" PRIx64 " %" PRIu64 " ",
+                  entry.fingerprint, entry.size);
+    text += prefix;
+    text += entry.fileName;
+    text += ' ';
+    text += entry.key;
+    text += '\n';
+  }
+
+  std::string path = directory + "/" + MANIFEST_NAME;
+  if (!shard_detail::writeFileAtomic(path, text.data(), text.size(), true)
+      || !shard_detail::syncDirectory(directory))
+  {
+    std::cerr << "cpm-es-cereal: Failed to write " << path << ": " << std::strerror(errno) << std::endl;
+    throw std::runtime_error("Failed to write shard manifest");
+  }
+}
+
+const CerealShardManifest::Entry* CerealShardManifest::find(const std::string& key) const
+{
+  for (const Entry& entry : entries)
+  {
+    if (entry.key == key)
+      return &entry;
+  }
+  return nullptr;
+}
+
+std::string CerealShardManifest::getFileName(const std::string& key, uint64_t fingerprint)
+{
+  char name[48];
+  std::snprintf(name, sizeof(name), "%016" PRIx64 "-%016" PRIx64 ".heap",
+                hashBytes(key.data(), key.size()), fingerprint);
+  return name;
+}
+
+void CerealShardManifest::removeUnreferenced(const std::string& directory) const
+{
+  DIR* dir = ::opendir(directory.c_str());
+  if (dir == NULL)
+    return;
+
+  std::vector<std::string> unreferenced;
+  while (struct dirent* item = ::readdir(dir))
+  {
+    std::string name = item->d_name;
+    size_t suffix = name.rfind(".heap");
+    if (suffix == std::string::npos || (name.compare(suffix, std::string::npos, ".heap") != 0
+                                        && name.compare(suffix, std::string::npos, ".heap.tmp") != 0))
+      continue;
+
+    bool referenced = false;
+    for (const Entry& entry : entries)
+      referenced = referenced || entry.fileName == name;
+    if (!referenced)
+      unreferenced.push_back(name);
+  }
+  ::closedir(dir);
+
+  for (const std::string& name : unreferenced)
+    ::unlink((directory + "/" + name).c_str());
+}
+
+//------------------------------------------------------------------------------
+// CerealCore
+//------------------------------------------------------------------------------
+
+size_t CerealCore::saveShards(const std::string& directory, size_t numThreads, bool sync)
+{
+  if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    std::cerr << "cpm-es-cereal: Failed to create " << directory << ": " << std::strerror(errno) << std::endl;
+    throw std::runtime_error("Failed to create shard directory");
+  }
+
+  // A damaged manifest only costs us the skipping of unchanged heaps.
+  CerealShardManifest previous;
+  try
+  {
+    previous.load(directory);
+  }
+  catch (const std::runtime_error&)
+  {
+    previous.entries.clear();
+  }
+
+  // Serializing touches the core, so heaps are dumped on this thread. Only
+  // the writes are spread over threads.
+  mNumHeapsReused = 0;
+  std::vector<HeapDump> dumps;
+  for (auto it = mComponents.begin(); it != mComponents.end(); ++it)
+  {
+    ComponentSerializeInterface* heap =
+        dynamic_cast<ComponentSerializeInterface*>(it->second);
+    if (heap->isSerializable())
+    {
+      HeapDump dump;
+      dumpHeap(it->first, heap, dump, true);
+      dumps.push_back(dump);
+    }
+  }
+
+  CerealShardManifest manifest;
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < dumps.size(); ++i)
+  {
+    CerealShardManifest::Entry entry;
+    entry.key = dumps[i].name;
+    entry.size = dumps[i].bytes.size();
+    entry.fingerprint = dumps[i].fingerprint;
+    entry.fileName = CerealShardManifest::getFileName(entry.key, entry.fingerprint);
+    manifest.entries.push_back(entry);
+
+    // The file name covers the fingerprint, so an unchanged heap still has
+    // its file from the previous save.
+    const CerealShardManifest::Entry* old = previous.find(entry.key);
+    bool unchanged = old != nullptr && old->fileName == entry.fileName && old->size == entry.size
+        && shard_detail::getFileSize(directory + "/" + entry.fileName) == static_cast<int64_t>(entry.size);
+    if (!unchanged)
+      pending.push_back(i);
+  }
+
+  std::atomic<size_t> nextWrite(0);
+  std::atomic<bool> failed(false);
+  std::vector<int> errors(pending.size(), 0);
+  auto worker = [&]()
+  {
+    for (size_t i = nextWrite++; i < pending.size() && !failed; i = nextWrite++)
+    {
+      const HeapDump& dump = dumps[pending[i]];
+      std::string path = directory + "/" + manifest.entries[pending[i]].fileName;
+      if (!shard_detail::writeFileAtomic(path, dump.bytes.data(), dump.bytes.size(), sync))
+      {
+        errors[i] = errno;
+        failed = true;
+      }
+    }
+  };
+  runWorkers(std::min(numThreads, pending.size()), worker);
+
+  for (size_t i = 0; i < pending.size(); ++i)
+  {
+    if (errors[i] != 0)
+    {
+      std::cerr << "cpm-es-cereal: Failed to write shard for " << dumps[pending[i]].name
+                << ": " << std::strerror(errors[i]) << std::endl;
+      // The previous manifest and its files are untouched; drop whatever
+      // this save wrote.
+      if (!previous.entries.empty())
+        previous.removeUnreferenced(directory);
+      throw std::runtime_error("Failed to write shard");
+    }
+  }
+
+  // The new files must be durable before the manifest refers to them.
+  if (sync && !pending.empty() && !shard_detail::syncDirectory(directory))
+  {
+    std::cerr << "cpm-es-cereal: Failed to sync " << directory << ": " << std::strerror(errno) << std::endl;
+    throw std::runtime_error("Failed to write shard");
+  }
+
+  manifest.save(directory);
+
+  // Only now that the new manifest is in place are the files of the
+  // previous save, and of interrupted ones, unreferenced.
+  manifest.removeUnreferenced(directory);
+
+  return pending.size();
+}
+
+void CerealCore::loadShards(const std::string& directory, size_t numThreads)
+{
+  CerealShardManifest manifest;
+  if (!manifest.load(directory))
+  {
+    std::cerr << "cpm-es-cereal: No shard manifest in " << directory << std::endl;
+    throw std::runtime_error("Missing shard manifest");
+  }
+
+  const std::vector<CerealShardManifest::Entry>& entries = manifest.entries;
+  std::vector<Tny*> roots(entries.size(), NULL);
+  std::vector<const char*> failures(entries.size(), NULL);
+  std::atomic<size_t> nextRead(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]()
+  {
+    std::vector<char> contents;
+    for (size_t i = nextRead++; i < entries.size() && !failed; i = nextRead++)
+    {
+      if (!shard_detail::readFile(directory + "/" + entries[i].fileName, contents))
+        failures[i] = "unable to read file";
+      else if (contents.size() != entries[i].size
+               || hashBytes(contents.data(), contents.size()) != entries[i].fingerprint)
+        failures[i] = "fingerprint mismatch";
+      else if ((roots[i] = Tny_loads(contents.data(), contents.size())) == NULL)
+        failures[i] = "unable to parse file";
+
+      if (failures[i] != NULL)
+        failed = true;
+    }
+  };
+  runWorkers(std::min(numThreads, entries.size()), worker);
+
+  for (size_t i = 0; i < entries.size(); ++i)
+  {
+    if (failures[i] != NULL)
+    {
+      std::cerr << "cpm-es-cereal: Failed to load shard " << entries[i].fileName
+                << " (" << entries[i].key << "): " << failures[i] << std::endl;
+      for (Tny* root : roots)
+      {
+        if (root != NULL)
+          Tny_free(root);
+      }
+      throw std::runtime_error("Failed to load shard");
+    }
+  }
+
+  for (size_t i = 0; i < roots.size(); ++i)
+  {
+    try
+    {
+      deserializeCreateWithRemap(roots[i], nullptr);
+    }
+    catch (...)
+    {
+      for (size_t j = i; j < roots.size(); ++j)
+        Tny_free(roots[j]);
+      throw;
+    }
+    Tny_free(roots[i]);
+  }
+}
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif // _WIN32
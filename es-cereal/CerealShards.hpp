@@ -0,0 +1,87 @@
+#ifndef IAUNS_CEREALSHARDS_HPP
+#define IAUNS_CEREALSHARDS_HPP
+
+#ifndef _WIN32
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace CPM_ES_CEREAL_NS {
+
+/// Manifest of a sharded save directory (see CerealCore::saveShards). A
+/// sharded save holds one file per heap, each a {key: heap} Tny document
+/// like a CerealSnapshot slice, plus this manifest. The manifest is a text
+/// file named MANIFEST_NAME:
+///
+///   cereal-shards 1
+///   <fingerprint, 16 hex digits> <size> <file name> <heap key>
+///   ...
+///
+/// Fingerprints are hashBytes of the heap file. Heap keys run to the end of
+/// the line.
+///
+/// Heap files are named after their key and fingerprint (see getFileName),
+/// so a changed heap is always written to a new file and never over a file
+/// the current manifest refers to. A save only becomes visible when the
+/// manifest is swapped; an interrupted save leaves the previous one intact.
+class CerealShardManifest
+{
+public:
+  static const char* const MANIFEST_NAME;
+
+  struct Entry
+  {
+    std::string key;          ///< Heap key (CerealCore::getHeapKey).
+    std::string fileName;     ///< Relative to the save directory.
+    uint64_t    size;
+    uint64_t    fingerprint;
+  };
+
+  /// Reads the manifest of \p directory. Returns false if there is none.
+  /// Throws std::runtime_error if the manifest is malformed.
+  bool load(const std::string& directory);
+
+  /// Writes the manifest of \p directory, replacing the previous one
+  /// atomically. Throws std::runtime_error on failure.
+  void save(const std::string& directory) const;
+
+  /// Entry for \p key, or NULL.
+  const Entry* find(const std::string& key) const;
+
+  /// File name a heap with key \p key and dump fingerprint \p fingerprint
+  /// is saved under: "<hash of key>-<fingerprint>.heap".
+  static std::string getFileName(const std::string& key, uint64_t fingerprint);
+
+  /// Removes heap files (and leftover temporary files) in \p directory that
+  /// this manifest doesn't refer to.
+  void removeUnreferenced(const std::string& directory) const;
+
+  std::vector<Entry> entries;
+};
+
+namespace shard_detail {
+
+/// Writes \p size bytes to \p path through a temporary file renamed into
+/// place, so readers never observe a partial file. Returns false on
+/// failure, with errno set.
+bool writeFileAtomic(const std::string& path, const void* data, size_t size, bool sync);
+
+/// Flushes the entries of \p directory (renames into it) to disk. Returns
+/// false on failure, with errno set.
+bool syncDirectory(const std::string& directory);
+
+/// Reads the whole of \p path into \p contents. Returns false on failure.
+bool readFile(const std::string& path, std::vector<char>& contents);
+
+/// Size of the regular file at \p path, or -1 if there is none.
+int64_t getFileSize(const std::string& path);
+
+}
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif // _WIN32
+
+#endif
@@ -0,0 +1,155 @@
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "CerealSnapshot.hpp"
+#include "CerealByteOrder.hpp"
+#include <tny/tny.hpp>
+
+namespace CPM_ES_CEREAL_NS {
+
+using namespace byte_detail;
+
+namespace {
+
+const char SNAPSHOT_MAGIC[4] = {'C', 'S', 'N', 'P'};
+
+void corruptSnapshot(const char* reason)
+{
+  std::cerr << "cpm-es-cereal: Corrupt snapshot - " << reason << std::endl;
+  throw std::runtime_error("cpm-es-cereal: Corrupt snapshot.");
+}
+
+}
+
+void CerealSnapshot::writeHeader(char* out, uint32_t numHeaps)
+{
+  std::memcpy(out, SNAPSHOT_MAGIC, 4);
+  writeU32(out + 4, VERSION);
+  writeU32(out + 8, numHeaps);
+}
+
+void CerealSnapshot::writeRecordHeader(char* out, const char* name, uint32_t nameLength,
+                                       uint64_t payloadSize)
+{
+  writeU32(out, nameLength);
+  writeU64(out + 4, payloadSize);
+  std::memcpy(out + 12, name, nameLength);
+}
+
+CerealSnapshot CerealSnapshot::parse(const CerealBuffer& buffer)
+{
+  const char* data = static_cast<const char*>(buffer.data());
+  size_t size = buffer.size();
+
+  if (size < getHeaderSize())
+    corruptSnapshot("truncated header");
+  if (std::memcmp(data, SNAPSHOT_MAGIC, 4) != 0)
+    corruptSnapshot("bad magic");
+  if (readU32(data + 4) != VERSION)
+    corruptSnapshot("unsupported version");
+
+  uint32_t numHeaps = readU32(data + 8);
+
+  CerealSnapshot snapshot;
+  snapshot.mBuffer = buffer;
+
+  size_t offset = getHeaderSize();
+  for (uint32_t i = 0; i < numHeaps; ++i)
+  {
+    if (size - offset < getRecordHeaderSize(0))
+      corruptSnapshot("truncated heap record");
+
+    uint32_t nameLength = readU32(data + offset);
+    uint64_t payloadSize = readU64(data + offset + 4);
+    offset += getRecordHeaderSize(0);
+
+    if (size - offset < nameLength)
+      corruptSnapshot("truncated heap name");
+
+    HeapEntry entry;
+    entry.name.assign(data + offset, nameLength);
+    offset += nameLength;
+
+    if (size - offset < payloadSize)
+      corruptSnapshot("truncated heap payload");
+
+    entry.payload = buffer.slice(offset, static_cast<size_t>(payloadSize));
+    offset += static_cast<size_t>(payloadSize);
+
+    snapshot.mHeaps.push_back(std::move(entry));
+  }
+
+  return snapshot;
+}
+
+CerealBuffer CerealSnapshot::findHeap(const std::string& name) const
+{
+  for (const HeapEntry& entry : mHeaps)
+  {
+    if (entry.name == name)
+      return entry.payload;
+  }
+  return CerealBuffer();
+}
+
+CerealDecodeResult CerealSnapshot::validate(const CerealDecodeLimits& limits,
+                                            size_t numThreads) const
+{
+  if (mBuffer.size() > limits.maxBytes) return DECODE_TOO_LARGE;
+  if (mHeaps.size() > limits.maxHeaps) return DECODE_TOO_MANY_HEAPS;
+
+  std::vector<CerealDecodeResult> results(mHeaps.size(), DECODE_OK);
+  std::atomic<size_t> nextHeap(0);
+  std::atomic<bool> failed(false);
+  // maxNodes bounds the snapshot, not each slice.
+  decode_detail::NodeBudget budget(limits.maxNodes);
+
+  auto worker = [&]()
+  {
+    for (size_t i = nextHeap++; i < mHeaps.size() && !failed; i = nextHeap++)
+    {
+      const HeapEntry& entry = mHeaps[i];
+      Tny* root = loadTnyChecked(entry.payload.data(), entry.payload.size(), limits, &results[i],
+                                  &budget);
+      if (root != NULL)
+      {
+        Tny* heap = Tny_next(root);
+        if (root->size != 1 || heap->key == NULL || entry.name != heap->key)
+          results[i] = DECODE_MALFORMED;
+        Tny_free(root);
+      }
+
+      if (results[i] != DECODE_OK)
+        failed = true;
+    }
+  };
+
+  if (numThreads > mHeaps.size())
+    numThreads = mHeaps.size();
+
+  if (numThreads <= 1)
+  {
+    worker();
+  }
+  else
+  {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < numThreads; ++i)
+      threads.push_back(std::thread(worker));
+    for (std::thread& thread : threads)
+      thread.join();
+  }
+
+  for (CerealDecodeResult result : results)
+  {
+    if (result != DECODE_OK)
+      return result;
+  }
+  return DECODE_OK;
+}
+
+} // namespace CPM_ES_CEREAL_NS
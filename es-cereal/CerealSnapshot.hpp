@@ -0,0 +1,94 @@
+#ifndef IAUNS_CEREALSNAPSHOT_HPP
+#define IAUNS_CEREALSNAPSHOT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "CerealBuffer.hpp"
+#include "CerealDecode.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+/// A serialized snapshot stored in a single CerealBuffer, framed so that the
+/// serialized data of each heap can be sliced out without copying. Each
+/// slice is a complete Tny document ({componentName: heap}) accepted by
+/// CerealCore::deserializeComponentMerge and deserializeComponentCreate.
+///
+/// Layout (all integers little endian):
+///
+///   char[4]   magic "CSNP"
+///   uint32_t  version
+///   uint32_t  number of heaps
+///   per heap:
+///     uint32_t  name length
+///     uint64_t  payload size
+///     char[]    name (not null terminated)
+///     char[]    payload (Tny dump)
+///
+/// Snapshots are immutable and cheap to copy; copies share the buffer.
+class CerealSnapshot
+{
+public:
+  static const uint32_t VERSION = 1;
+
+  /// Empty snapshot.
+  CerealSnapshot() {}
+
+  /// Parses the framing of \p buffer. No payload is copied or decoded.
+  /// Throws std::runtime_error if the buffer is not a valid snapshot.
+  static CerealSnapshot parse(const CerealBuffer& buffer);
+
+  /// Size in bytes of the frame preceding the heap records.
+  static size_t getHeaderSize() {return 12;}
+
+  /// Size in bytes of the record frame of a heap named \p nameLength bytes,
+  /// not including the payload itself.
+  static size_t getRecordHeaderSize(size_t nameLength) {return 12 + nameLength;}
+
+  /// Writes the snapshot header for \p numHeaps heaps into \p out, which
+  /// must hold getHeaderSize() bytes.
+  static void writeHeader(char* out, uint32_t numHeaps);
+
+  /// Writes the frame of one heap record into \p out, which must hold
+  /// getRecordHeaderSize(nameLength) bytes. The payload follows directly.
+  static void writeRecordHeader(char* out, const char* name, uint32_t nameLength,
+                                uint64_t payloadSize);
+
+  /// The whole framed snapshot. Send or write this to fan out.
+  const CerealBuffer& getBuffer() const   {return mBuffer;}
+
+  size_t getNumHeaps() const              {return mHeaps.size();}
+  const std::string& getHeapName(size_t index) const {return mHeaps[index].name;}
+
+  /// Slice of the buffer holding the Tny dump of heap \p index.
+  const CerealBuffer& getHeap(size_t index) const {return mHeaps[index].payload;}
+
+  /// Slice holding the Tny dump of the heap named \p name. Returns an empty
+  /// buffer if the snapshot does not contain that heap.
+  CerealBuffer findHeap(const std::string& name) const;
+
+  /// Checks an untrusted snapshot against \p limits. The snapshot as a whole
+  /// must fit in maxBytes and maxHeaps; every heap slice is then decoded
+  /// with loadTnyChecked and must hold exactly the heap named in the
+  /// framing. maxNodes also covers the whole snapshot: the slices share one
+  /// decode_detail::NodeBudget, however many threads decode them. Slices are independent, so they are validated on up to
+  /// \p numThreads threads (1 validates on the calling thread). Validation
+  /// stops at the first failure, which is returned.
+  CerealDecodeResult validate(const CerealDecodeLimits& limits, size_t numThreads = 1) const;
+
+private:
+  struct HeapEntry
+  {
+    std::string   name;
+    CerealBuffer  payload;
+  };
+
+  CerealBuffer            mBuffer;  ///< Entire snapshot.
+  std::vector<HeapEntry>  mHeaps;   ///< Slices of mBuffer, one per heap.
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
@@ -0,0 +1,421 @@
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CerealSnapshotRing.hpp"
+#include "CerealCore.hpp"
+#include <tny/tny.hpp>
+
+namespace CPM_ES_CEREAL_NS {
+
+namespace {
+
+const char RING_MAGIC[4] = {'C', 'R', 'N', 'G'};
+
+struct RingHeader
+{
+  char                  magic[4];
+  uint32_t              version;
+  uint32_t              numSlots;
+  uint32_t              padding;
+  uint64_t              slotCapacity;
+  std::atomic<uint64_t> latest;     ///< Sequence of the latest complete slot.
+};
+
+struct SlotHeader
+{
+  std::atomic<uint64_t> state;      ///< 2 * sequence, odd while writing.
+  std::atomic<uint64_t> size;
+};
+
+static_assert(sizeof(RingHeader) <= CerealRingPublisher::RING_HEADER_SIZE, "Ring header too large");
+static_assert(sizeof(SlotHeader) <= CerealRingPublisher::SLOT_HEADER_SIZE, "Slot header too large");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory rings need lock free 64 bit atomics");
+
+size_t getSlotStride(size_t slotCapacity)
+{
+  const size_t align = CerealRingPublisher::SLOT_HEADER_SIZE;
+  return CerealRingPublisher::SLOT_HEADER_SIZE + (slotCapacity + align - 1) / align * align;
+}
+
+size_t getRingSize(uint32_t numSlots, size_t slotCapacity)
+{
+  return CerealRingPublisher::RING_HEADER_SIZE + numSlots * getSlotStride(slotCapacity);
+}
+
+}
+
+namespace ring_detail {
+
+/// A mapped ring. Unmapped when the publisher or reader and every snapshot
+/// referring into it are gone.
+struct Mapping
+{
+  Mapping(void* addressIn, size_t sizeIn) :
+      address(static_cast<char*>(addressIn)),
+      size(sizeIn)
+  {}
+
+  ~Mapping()
+  {
+    ::munmap(address, size);
+  }
+
+  RingHeader* getHeader() const
+  {
+    return reinterpret_cast<RingHeader*>(address);
+  }
+
+  SlotHeader* getSlot(uint64_t sequence) const
+  {
+    const RingHeader* header = getHeader();
+    size_t index = static_cast<size_t>((sequence - 1) % header->numSlots);
+    return reinterpret_cast<SlotHeader*>(
+        address + CerealRingPublisher::RING_HEADER_SIZE + index * getSlotStride(header->slotCapacity));
+  }
+
+  char* getSlotData(uint64_t sequence) const
+  {
+    return reinterpret_cast<char*>(getSlot(sequence)) + CerealRingPublisher::SLOT_HEADER_SIZE;
+  }
+
+  char*   address;
+  size_t  size;
+};
+
+}
+
+//------------------------------------------------------------------------------
+// CerealRingPublisher
+//------------------------------------------------------------------------------
+
+CerealRingPublisher::CerealRingPublisher() :
+    mNumSlots(0),
+    mSlotCapacity(0),
+    mSequence(0)
+{
+}
+
+CerealRingPublisher::~CerealRingPublisher()
+{
+  close();
+}
+
+void CerealRingPublisher::create(const std::string& name, uint32_t numSlots, size_t slotCapacity)
+{
+  close();
+
+  if (numSlots == 0 || slotCapacity == 0)
+  {
+    std::cerr << "cpm-es-cereal: Snapshot rings need at least one slot of non-zero capacity." << std::endl;
+    throw std::runtime_error("Invalid snapshot ring size");
+  }
+
+  int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1 && errno == EEXIST)
+  {
+    // Left behind by a publisher that didn't shut down.
+    ::shm_unlink(name.c_str());
+    fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  }
+  if (fd == -1)
+  {
+    std::cerr << "cpm-es-cereal: Failed to create shared memory " << name << ": " << std::strerror(errno) << std::endl;
+    throw std::runtime_error("Failed to create snapshot ring");
+  }
+
+  size_t size = getRingSize(numSlots, slotCapacity);
+  void* address = MAP_FAILED;
+  if (::ftruncate(fd, static_cast<off_t>(size)) == 0)
+    address = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int error = errno;
+  ::close(fd);
+  if (address == MAP_FAILED)
+  {
+    ::shm_unlink(name.c_str());
+    std::cerr << "cpm-es-cereal: Failed to map shared memory " << name << ": " << std::strerror(error) << std::endl;
+    throw std::runtime_error("Failed to create snapshot ring");
+  }
+
+  mMapping = std::make_shared<ring_detail::Mapping>(address, size);
+  mName = name;
+  mNumSlots = numSlots;
+  mSlotCapacity = slotCapacity;
+  mSequence = 0;
+
+  // The object is zero filled. The magic goes in last so readers never see
+  // a partially initialized header.
+  RingHeader* header = new (mMapping->address) RingHeader;
+  header->version = VERSION;
+  header->numSlots = numSlots;
+  header->padding = 0;
+  header->slotCapacity = slotCapacity;
+  header->latest.store(0, std::memory_order_relaxed);
+  for (uint32_t i = 1; i <= numSlots; ++i)
+  {
+    SlotHeader* slot = new (mMapping->getSlot(i)) SlotHeader;
+    slot->state.store(0, std::memory_order_relaxed);
+    slot->size.store(0, std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+}
+
+void CerealRingPublisher::close()
+{
+  if (mMapping == nullptr)
+    return;
+
+  ::shm_unlink(mName.c_str());
+  mMapping.reset();
+  mName.clear();
+}
+
+char* CerealRingPublisher::beginSlot(size_t size)
+{
+  if (mMapping == nullptr)
+  {
+    std::cerr << "cpm-es-cereal: Publishing to a snapshot ring that isn't open." << std::endl;
+    throw std::runtime_error("Snapshot ring not open");
+  }
+  if (size > mSlotCapacity)
+  {
+    std::cerr << "cpm-es-cereal: Snapshot of " << size << " bytes exceeds the ring's slot capacity of "
+              << mSlotCapacity << " bytes." << std::endl;
+    throw std::runtime_error("Snapshot too large for ring");
+  }
+
+  uint64_t sequence = mSequence + 1;
+  mMapping->getSlot(sequence)->state.store(2 * sequence - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  return mMapping->getSlotData(sequence);
+}
+
+uint64_t CerealRingPublisher::endSlot(size_t size)
+{
+  uint64_t sequence = mSequence + 1;
+  SlotHeader* slot = mMapping->getSlot(sequence);
+  slot->size.store(size, std::memory_order_relaxed);
+  slot->state.store(2 * sequence, std::memory_order_release);
+  mMapping->getHeader()->latest.store(sequence, std::memory_order_release);
+  mSequence = sequence;
+  return sequence;
+}
+
+uint64_t CerealRingPublisher::publish(CerealCore& core)
+{
+  CerealSegmentList segments = core.dumpSnapshotSegments();
+  size_t size = segments.getTotalSize();
+
+  char* out = beginSlot(size);
+  for (size_t i = 0; i < segments.getNumSegments(); ++i)
+  {
+    const CerealBuffer& segment = segments.getSegment(i);
+    std::memcpy(out, segment.data(), segment.size());
+    out += segment.size();
+  }
+  return endSlot(size);
+}
+
+uint64_t CerealRingPublisher::publish(const CerealSnapshot& snapshot)
+{
+  const CerealBuffer& buffer = snapshot.getBuffer();
+  char* out = beginSlot(buffer.size());
+  if (!buffer.empty())
+    std::memcpy(out, buffer.data(), buffer.size());
+  return endSlot(buffer.size());
+}
+
+//------------------------------------------------------------------------------
+// CerealRingReader
+//------------------------------------------------------------------------------
+
+CerealRingReader::CerealRingReader()
+{
+}
+
+bool CerealRingReader::open(const std::string& name)
+{
+  close();
+
+  int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd == -1)
+  {
+    if (errno == ENOENT)
+      return false;
+    std::cerr << "cpm-es-cereal: Failed to open shared memory " << name << ": " << std::strerror(errno) << std::endl;
+    throw std::runtime_error("Failed to open snapshot ring");
+  }
+
+  struct stat info;
+  void* address = MAP_FAILED;
+  size_t size = 0;
+  if (::fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= CerealRingPublisher::RING_HEADER_SIZE)
+  {
+    size = static_cast<size_t>(info.st_size);
+    address = ::mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (address == MAP_FAILED)
+  {
+    std::cerr << "cpm-es-cereal: Failed to map snapshot ring " << name << "." << std::endl;
+    throw std::runtime_error("Failed to open snapshot ring");
+  }
+
+  std::shared_ptr<ring_detail::Mapping> mapping = std::make_shared<ring_detail::Mapping>(address, size);
+  const RingHeader* header = mapping->getHeader();
+  bool valid = std::memcmp(header->magic, RING_MAGIC, sizeof(RING_MAGIC)) == 0;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!valid || header->version != CerealRingPublisher::VERSION || header->numSlots == 0
+      || header->slotCapacity == 0 || getRingSize(header->numSlots, header->slotCapacity) != size)
+  {
+    std::cerr << "cpm-es-cereal: " << name << " is not a snapshot ring of version "
+              << CerealRingPublisher::VERSION << "." << std::endl;
+    throw std::runtime_error("Not a snapshot ring");
+  }
+
+  mMapping = mapping;
+  return true;
+}
+
+void CerealRingReader::close()
+{
+  mMapping.reset();
+}
+
+uint64_t CerealRingReader::getLatestSequence() const
+{
+  if (mMapping == nullptr)
+    return 0;
+  return mMapping->getHeader()->latest.load(std::memory_order_acquire);
+}
+
+bool CerealRingReader::isIntact(uint64_t sequence) const
+{
+  if (mMapping == nullptr || sequence == 0)
+    return false;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return mMapping->getSlot(sequence)->state.load(std::memory_order_relaxed) == 2 * sequence;
+}
+
+uint64_t CerealRingReader::acquireLatest(CerealSnapshot& snapshot) const
+{
+  uint64_t sequence = getLatestSequence();
+  if (sequence == 0)
+    return 0;
+
+  const SlotHeader* slot = mMapping->getSlot(sequence);
+  if (slot->state.load(std::memory_order_acquire) != 2 * sequence)
+    return 0;
+  uint64_t size = slot->size.load(std::memory_order_relaxed);
+  if (size > mMapping->getHeader()->slotCapacity || !isIntact(sequence))
+    return 0;
+
+  CerealBuffer buffer = CerealBuffer::share(mMapping->getSlotData(sequence),
+                                            static_cast<size_t>(size), mMapping);
+  try
+  {
+    snapshot = CerealSnapshot::parse(buffer);
+  }
+  catch (const std::runtime_error&)
+  {
+    // Framing torn by the publisher lapping us is not an error.
+    if (isIntact(sequence))
+      throw;
+    return 0;
+  }
+  return sequence;
+}
+
+uint64_t CerealRingReader::loadLatest(CerealCore& core, const CerealDecodeLimits& limits,
+                                      size_t maxAttempts) const
+{
+  for (size_t attempt = 0; attempt < maxAttempts; ++attempt)
+  {
+    CerealSnapshot snapshot;
+    uint64_t sequence = acquireLatest(snapshot);
+    if (sequence == 0)
+    {
+      if (getLatestSequence() == 0)
+        return 0;
+      continue;
+    }
+
+    // Decode every heap before touching the core: a lapped slot must not
+    // leave half a snapshot behind. The publisher may rewrite the slot at
+    // any moment, so each heap is copied out and only parsed once the copy
+    // is known to be intact.
+    CerealDecodeResult result = DECODE_OK;
+    std::vector<Tny*> roots;
+    std::vector<char> copy;
+    bool intact = true;
+    if (snapshot.getNumHeaps() > limits.maxHeaps)
+      result = DECODE_TOO_MANY_HEAPS;
+    for (size_t i = 0; i < snapshot.getNumHeaps() && result == DECODE_OK; ++i)
+    {
+      const CerealBuffer& heap = snapshot.getHeap(i);
+      if (heap.size() > limits.maxBytes)
+      {
+        result = DECODE_TOO_LARGE;
+        break;
+      }
+
+      copy.resize(heap.size());
+      if (!copy.empty())
+        std::memcpy(&copy[0], heap.data(), copy.size());
+      intact = isIntact(sequence);
+      if (!intact)
+        break;
+
+      Tny* root = loadTnyChecked(copy.empty() ? NULL : &copy[0], copy.size(), limits, &result);
+      if (root != NULL)
+        roots.push_back(root);
+    }
+
+    intact = intact && isIntact(sequence);
+    if (result != DECODE_OK || !intact)
+    {
+      for (Tny* root : roots)
+        Tny_free(root);
+      if (!intact)
+        continue;
+      std::cerr << "cpm-es-cereal: Snapshot " << sequence << " in ring is invalid: "
+                << getDecodeResultString(result) << std::endl;
+      throw std::runtime_error("Invalid snapshot in ring");
+    }
+
+    for (size_t i = 0; i < roots.size(); ++i)
+    {
+      try
+      {
+        core.deserializeComponentCreate(roots[i]);
+      }
+      catch (...)
+      {
+        for (size_t j = i; j < roots.size(); ++j)
+          Tny_free(roots[j]);
+        throw;
+      }
+      Tny_free(roots[i]);
+    }
+    return sequence;
+  }
+
+  return 0;
+}
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif // _WIN32
@@ -0,0 +1,151 @@
+#ifndef IAUNS_CEREALSNAPSHOTRING_HPP
+#define IAUNS_CEREALSNAPSHOTRING_HPP
+
+#ifndef _WIN32
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "CerealDecode.hpp"
+#include "CerealSnapshot.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+class CerealCore;
+
+namespace ring_detail {
+struct Mapping;
+}
+
+/// Publishes snapshots to other processes on the same machine through a
+/// POSIX shared memory object (shm_open). The object holds a ring of
+/// numSlots slots of slotCapacity bytes each; every publish serializes the
+/// core once into the next slot and stamps it with an increasing sequence
+/// number. Any number of CerealRingReaders decode straight from the mapping.
+///
+/// Layout (native byte order; only shared with processes on this machine):
+///
+///   RING_HEADER_SIZE bytes: magic "CRNG", version, numSlots, slotCapacity,
+///                           sequence of the latest complete slot
+///   per slot:
+///     SLOT_HEADER_SIZE bytes: slot state, snapshot size
+///     slotCapacity bytes:     CerealSnapshot buffer
+///
+/// A slot's state is 2 * sequence once published and odd while it is being
+/// rewritten (a sequence lock), so readers detect when the publisher laps
+/// them. There is a single publisher per ring.
+class CerealRingPublisher
+{
+public:
+  static const uint32_t VERSION = 1;
+  static const size_t RING_HEADER_SIZE = 64;
+  static const size_t SLOT_HEADER_SIZE = 64;
+
+  CerealRingPublisher();
+
+  /// Removes the shared memory object.
+  ~CerealRingPublisher();
+
+  /// Creates the shared memory object \p name ("/name", see shm_open),
+  /// replacing a stale object of the same name. Throws std::runtime_error
+  /// on failure.
+  void create(const std::string& name, uint32_t numSlots, size_t slotCapacity);
+
+  /// Unmaps and removes the shared memory object. Readers keep whatever
+  /// they have mapped.
+  void close();
+
+  bool isOpen() const                 {return mMapping != nullptr;}
+
+  /// Serializes \p core into the next slot (see CerealCore::dumpSnapshotSegments)
+  /// and returns its sequence number. Throws std::runtime_error if the
+  /// snapshot doesn't fit into a slot; nothing is published then.
+  uint64_t publish(CerealCore& core);
+
+  /// Publishes an already serialized snapshot.
+  uint64_t publish(const CerealSnapshot& snapshot);
+
+  /// Sequence number of the latest snapshot published. 0 before the first.
+  uint64_t getSequence() const        {return mSequence;}
+
+  uint32_t getNumSlots() const        {return mNumSlots;}
+  size_t getSlotCapacity() const      {return mSlotCapacity;}
+
+private:
+  CerealRingPublisher(const CerealRingPublisher&);
+  CerealRingPublisher& operator=(const CerealRingPublisher&);
+
+  /// Marks the next slot as being written. Returns its data.
+  char* beginSlot(size_t size);
+  uint64_t endSlot(size_t size);
+
+  std::shared_ptr<ring_detail::Mapping> mMapping;
+  std::string mName;
+  uint32_t    mNumSlots;
+  size_t      mSlotCapacity;
+  uint64_t    mSequence;
+};
+
+/// Reads snapshots from a ring created by CerealRingPublisher, possibly in
+/// another process:
+///
+///   reader.open("/world");
+///   CerealSnapshot snapshot;
+///   uint64_t sequence = reader.acquireLatest(snapshot);
+///   ...                             // Read snapshot.getHeap(i) directly.
+///   if (!reader.isIntact(sequence)) // Lapped while reading; discard.
+///
+/// Snapshots returned by acquireLatest refer into the mapping (no copy) and
+/// keep it mapped. The publisher may overwrite their slot at any time, so
+/// anything read from them must be confirmed with isIntact afterwards.
+/// Never hand their heap slices to Tny_loads or loadTnyChecked directly:
+/// bytes changing underneath the parser can't be bounded by any check made
+/// beforehand. Copy a slice out, confirm isIntact, then parse the copy, as
+/// loadLatest does.
+class CerealRingReader
+{
+public:
+  CerealRingReader();
+
+  /// Maps the ring \p name. Returns false if it doesn't exist. Throws
+  /// std::runtime_error if it isn't a ring.
+  bool open(const std::string& name);
+
+  /// Drops this reader's mapping. Acquired snapshots keep their own.
+  void close();
+
+  bool isOpen() const                 {return mMapping != nullptr;}
+
+  /// Sequence number of the latest complete snapshot. 0 if none.
+  uint64_t getLatestSequence() const;
+
+  /// Points \p snapshot at the latest snapshot in the ring and returns its
+  /// sequence number. Returns 0 if nothing was published yet or the slot is
+  /// being overwritten (try again).
+  uint64_t acquireLatest(CerealSnapshot& snapshot) const;
+
+  /// True if the slot of snapshot \p sequence has not been touched since it
+  /// was published.
+  bool isIntact(uint64_t sequence) const;
+
+  /// Decodes the latest snapshot as CerealCore::deserializeComponentCreate
+  /// would, checking every heap against \p limits. Each heap is copied out
+  /// of the mapping and confirmed intact before it is parsed, and the whole
+  /// snapshot is confirmed intact before \p core is modified, retrying
+  /// up to \p maxAttempts times if the publisher laps us. Returns the
+  /// sequence loaded, or 0 if there was none or every attempt was lapped.
+  /// Throws std::runtime_error if an intact snapshot is invalid.
+  uint64_t loadLatest(CerealCore& core, const CerealDecodeLimits& limits = CerealDecodeLimits(),
+                      size_t maxAttempts = 4) const;
+
+private:
+  std::shared_ptr<ring_detail::Mapping> mMapping;
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif // _WIN32
+
+#endif
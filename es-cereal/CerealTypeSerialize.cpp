@@ -1,11 +1,26 @@
 #include <iostream>
 
 #include "CerealTypeSerialize.hpp"
+#include "CerealAllocator.hpp"
 #include <tny/tny.hpp>
 
 namespace CPM_ES_CEREAL_NS {
 namespace CST_detail {
 
+void reportMismatchedType(const char* name, const char* expectedName, int expected, int got)
+{
+  if (name != NULL)
+    std::cerr << "cpm-es-cereal: Mismatched Tny types for " << name << "!" << std::endl;
+  std::cerr << "Expected " << expectedName << " (" << expected << ") got (" << got << ")" << std::endl;
+}
+
+void reportMissingName(const char* name)
+{
+  std::cerr << "cpm-es-cereal: Unable to find " << name << " in Tny dictionary." << std::endl;
+}
+
+#ifndef CPM_ES_CEREAL_INLINE_SCALARS
+
 template <typename T>
 Tny* tnyGenericOut(Tny* root, const char* name, const T& v, TnyType type)
 {
@@ -147,6 +162,8 @@ Tny* outFloat(Tny* root, const char* name, const float& v)    {return tnyGeneric
 bool inDouble(Tny* root, const char* name, double& v)         {return tny64In(root, name, v);}
 Tny* outDouble(Tny* root, const char* name, const double& v)  {return tnyGenericOut(root, name, v, TNY_INT64);}
 
+#endif // CPM_ES_CEREAL_INLINE_SCALARS
+
 bool inBinary(Tny* root, const char* name, void* data, size_t size)
 {
   Tny* obj = Tny_get(root, name);
@@ -195,11 +212,32 @@ bool inString(Tny* root, const char* name, char* str, size_t maxSize)
 
 bool inStringStd(Tny* root, const char* name, std::string& str)
 {
-  char* data = nullptr;
-  bool res = inBinaryMalloc(root, name, reinterpret_cast<void**>(&data));
-  str = data;
-  std::free(data);
-  return res;
+  // Copy straight out of the Tny object, avoiding an intermediate malloc.
+  Tny* obj = Tny_get(root, name);
+  if (obj != NULL)
+  {
+    if (obj->type == TNY_BIN)
+    {
+      const char* data = static_cast<const char*>(obj->value.ptr);
+      const void* terminator = std::memchr(data, '\0', obj->size);
+      size_t length = terminator ? static_cast<const char*>(terminator) - data : obj->size;
+      str.assign(data, length);
+      return true;
+    }
+    else
+    {
+      std::cerr << "cpm-es-cereal: Mismatched Tny types for " << name << "!" << std::endl;
+      std::cerr << "Expected TNY_BIN (" << TNY_BIN << ") got (" << obj->type << ")" << std::endl;
+      return false;
+    }
+  }
+  else
+  {
+#ifdef CPM_ES_CEREAL_VERBOSE_OUTPUT
+    std::cerr << "cpm-es-cereal: Unable to find " << name << " in Tny dictionary." << std::endl;
+#endif
+    return false;
+  }
 }
 
 Tny* outString(Tny* root, const char* name, const char* str)
@@ -248,12 +286,51 @@ Tny* outBinaryMalloc(Tny* root, const char* name, const void* data, size_t size)
   return outBinary(root, name, data, size);
 }
 
+bool inBinaryAlloc(Tny* root, const char* name, CerealAllocator& allocator,
+                   void** data, size_t* size)
+{
+  Tny* obj = Tny_get(root, name);
+  if (obj != NULL)
+  {
+    if (obj->type == TNY_BIN)
+    {
+      *data = allocator.allocate(obj->size);
+      if (*data != NULL)
+      {
+        std::memcpy(*data, obj->value.ptr, obj->size);
+        *size = obj->size;
+        return true;
+      }
+      else
+      {
+        std::cerr << "cpm-es-cereal: Failed to allocate memory for " << name << " of size " << obj->size << std::endl;
+        return false;
+      }
+    }
+    else
+    {
+      std::cerr << "cpm-es-cereal: Mismatched Tny types for " << name << "!" << std::endl;
+      std::cerr << "Expected TNY_BIN (" << TNY_BIN << ") got (" << obj->type << ")" << std::endl;
+      return false;
+    }
+  }
+  else
+  {
+#ifdef CPM_ES_CEREAL_VERBOSE_OUTPUT
+    std::cerr << "cpm-es-cereal: Unable to find " << name << " in Tny dictionary." << std::endl;
+#endif
+    return false;
+  }
+}
+
 
 
 //------------------------------------------------------------------------------
 // TNY_ARRAY implementation
 //------------------------------------------------------------------------------
 
+#ifndef CPM_ES_CEREAL_INLINE_SCALARS
+
 template <typename T>
 Tny* tnyGenericOutArray(Tny* root, const T& v, TnyType type)
 {
@@ -342,6 +419,8 @@ Tny* outFloatArray(Tny* root, const float& v)     {return tnyGenericOutArray(roo
 Tny* inDoubleArray(Tny* root, double& v)          {return tny64InArray(root, v);}
 Tny* outDoubleArray(Tny* root, const double& v)   {return tnyGenericOutArray(root, v, TNY_INT64);}
 
+#endif // CPM_ES_CEREAL_INLINE_SCALARS
+
 Tny* inBinaryArray(Tny* root, void* data, size_t size)
 {
   if (root->type == TNY_BIN)
@@ -411,6 +490,33 @@ Tny* outBinaryMallocArray(Tny* root, const void* data, size_t size)
   return outBinaryArray(root, data, size);
 }
 
+Tny* inBinaryAllocArray(Tny* root, CerealAllocator& allocator, void** data, size_t* size)
+{
+  if (root->type == TNY_BIN)
+  {
+    *data = allocator.allocate(root->size);
+    if (*data != NULL)
+    {
+      std::memcpy(*data, root->value.ptr, root->size);
+      *size = root->size;
+    }
+    else
+    {
+      std::cerr << "cpm-es-cereal: Failed to allocate memory for size " << root->size << std::endl;
+    }
+  }
+  else
+  {
+    std::cerr << "cpm-es-cereal: Mismatched Tny types!" << std::endl;
+    std::cerr << "Expected TNY_BIN (" << TNY_BIN << ") got (" << root->type << ")" << std::endl;
+  }
+
+  if (Tny_hasNext(root))
+    return Tny_next(root);
+  else
+    return root;
+}
+
 
 
 
@@ -4,16 +4,26 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <string>
 
 struct _Tny;
 typedef _Tny Tny;
 
+#ifdef CPM_ES_CEREAL_INLINE_SCALARS
+#include "CerealTypeSerializeInline.hpp"
+#endif
+
 namespace CPM_ES_CEREAL_NS {
 
+class CerealAllocator;
+
 // Cereal serialize type detail
 namespace CST_detail
 {
-  // Basic types stored in a dictionary (TNY_DICT).
+  // Basic types stored in a dictionary (TNY_DICT). With
+  // CPM_ES_CEREAL_INLINE_SCALARS the scalar functions are defined inline in
+  // CerealTypeSerializeInline.hpp instead.
+#ifndef CPM_ES_CEREAL_INLINE_SCALARS
   bool inBool(Tny* root, const char* name, bool& b);
   bool inInt8(Tny* root, const char* name, int8_t& c);
   bool inUInt8(Tny* root, const char* name, uint8_t& c);
@@ -23,11 +33,15 @@ namespace CST_detail
   bool inUInt64(Tny* root, const char* name, uint64_t& v);
   bool inFloat(Tny* root, const char* name, float& v);
   bool inDouble(Tny* root, const char* name, double& v);
+#endif
   bool inString(Tny* root, const char* name, char* str, size_t maxSize);
   bool inStringStd(Tny* root, const char* name, std::string& str);
   bool inBinary(Tny* root, const char* name, void* data, size_t size);
   bool inBinaryMalloc(Tny* root, const char* name, void** data);
+  bool inBinaryAlloc(Tny* root, const char* name, CerealAllocator& allocator,
+                     void** data, size_t* size);
 
+#ifndef CPM_ES_CEREAL_INLINE_SCALARS
   Tny* outBool(Tny* root, const char* name, const bool& b);
   Tny* outInt8(Tny* root, const char* name, const int8_t& c);
   Tny* outUInt8(Tny* root, const char* name, const uint8_t& c);
@@ -37,11 +51,13 @@ namespace CST_detail
   Tny* outUInt64(Tny* root, const char* name, const uint64_t& v);
   Tny* outFloat(Tny* root, const char* name, const float& v);
   Tny* outDouble(Tny* root, const char* name, const double& v);
+#endif
   Tny* outString(Tny* root, const char* name, const char* str);
   Tny* outBinary(Tny* root, const char* name, const void* data, size_t size);
   Tny* outBinaryMalloc(Tny* root, const char* name, const void* data, size_t size);
 
   // Basic types stored in an array (TNY_ARRAY).
+#ifndef CPM_ES_CEREAL_INLINE_SCALARS
   Tny* inBoolArray(Tny* root, bool& b);
   Tny* inInt8Array(Tny* root, int8_t& c);
   Tny* inUInt8Array(Tny* root, uint8_t& c);
@@ -51,10 +67,13 @@ namespace CST_detail
   Tny* inUInt64Array(Tny* root, uint64_t& v);
   Tny* inFloatArray(Tny* root, float& v);
   Tny* inDoubleArray(Tny* root, double& v);
+#endif
   Tny* inStringArray(Tny* root, char* str, size_t maxSize);
   Tny* inBinaryArray(Tny* root, void* data, size_t size);
   Tny* inBinaryMallocArray(Tny* root, void** data);
+  Tny* inBinaryAllocArray(Tny* root, CerealAllocator& allocator, void** data, size_t* size);
 
+#ifndef CPM_ES_CEREAL_INLINE_SCALARS
   Tny* outBoolArray(Tny* root, const bool& b);
   Tny* outInt8Array(Tny* root, const int8_t& c);
   Tny* outUInt8Array(Tny* root, const uint8_t& c);
@@ -64,6 +83,7 @@ namespace CST_detail
   Tny* outUInt64Array(Tny* root, const uint64_t& v);
   Tny* outFloatArray(Tny* root, const float& v);
   Tny* outDoubleArray(Tny* root, const double& v);
+#endif
   Tny* outStringArray(Tny* root, const char* str);
   Tny* outBinaryArray(Tny* root, const void* data, size_t size);
   Tny* outBinaryMallocArray(Tny* root, const void* data, size_t size);
@@ -0,0 +1,141 @@
+#ifndef IAUNS_CEREALTYPESERIALIZEINLINE_HPP
+#define IAUNS_CEREALTYPESERIALIZEINLINE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <tny/tny.hpp>
+
+// Header only implementation of the scalar CST_detail functions, used in
+// place of the out of line versions in CerealTypeSerialize.cpp when
+// CPM_ES_CEREAL_INLINE_SCALARS is defined (CMake option
+// ES_CEREAL_INLINE_SCALARS). Lets the compiler inline the per field work of
+// ComponentSerialize::serialize into component serialize functions. Only the
+// error reporting stays out of line. Behavior is identical to the out of
+// line versions.
+//
+// The functions live in CST_detail::inline_scalars, pulled into CST_detail
+// only when CPM_ES_CEREAL_INLINE_SCALARS is defined, so they never clash
+// with the out of line versions and both can be compared in one build (see
+// tests/TestGSInlineScalars.cpp).
+
+namespace CPM_ES_CEREAL_NS {
+namespace CST_detail {
+
+// Cold paths, defined in CerealTypeSerialize.cpp.
+void reportMismatchedType(const char* name, const char* expectedName, int expected, int got);
+void reportMissingName(const char* name);
+
+namespace inline_scalars {
+
+template <typename T>
+inline void tnyScalarRead(const Tny* obj, T& v)
+{
+  if (sizeof(T) == 1)
+    std::memcpy(&v, &obj->value.chr, 1);
+  else
+    std::memcpy(&v, &obj->value.num, sizeof(T));
+}
+
+inline void tnyScalarRead(const Tny* obj, bool& v)
+{
+  v = (obj->value.chr != 0);
+}
+
+template <typename T>
+inline bool tnyScalarIn(Tny* root, const char* name, T& v, TnyType type, const char* typeName)
+{
+  Tny* obj = Tny_get(root, name);
+  if (obj == NULL)
+  {
+#ifdef CPM_ES_CEREAL_VERBOSE_OUTPUT
+    reportMissingName(name);
+#endif
+    return false;
+  }
+  if (obj->type != type)
+  {
+    reportMismatchedType(name, typeName, type, obj->type);
+    return false;
+  }
+  tnyScalarRead(obj, v);
+  return true;
+}
+
+template <typename T>
+inline Tny* tnyScalarOut(Tny* root, const char* name, const T& v, TnyType type)
+{
+  T* ptr = const_cast<T*>(&v);
+  return Tny_add(root, type, const_cast<char*>(name), static_cast<void*>(ptr), 0);
+}
+
+template <typename T>
+inline Tny* tnyScalarInArray(Tny* root, T& v, TnyType type, const char* typeName)
+{
+  if (root->type == type)
+    tnyScalarRead(root, v);
+  else
+    reportMismatchedType(NULL, typeName, type, root->type);
+
+  if (Tny_hasNext(root))
+    return Tny_next(root);
+  else
+    return root;
+}
+
+template <typename T>
+inline Tny* tnyScalarOutArray(Tny* root, const T& v, TnyType type)
+{
+  T* ptr = const_cast<T*>(&v);
+  return Tny_add(root, type, NULL, static_cast<void*>(ptr), 0);
+}
+
+inline bool inBool(Tny* root, const char* name, bool& b)           {return tnyScalarIn(root, name, b, TNY_CHAR, "TNY_CHAR");}
+inline bool inInt8(Tny* root, const char* name, int8_t& c)         {return tnyScalarIn(root, name, c, TNY_CHAR, "TNY_CHAR");}
+inline bool inUInt8(Tny* root, const char* name, uint8_t& c)       {return tnyScalarIn(root, name, c, TNY_CHAR, "TNY_CHAR");}
+inline bool inInt32(Tny* root, const char* name, int32_t& v)       {return tnyScalarIn(root, name, v, TNY_INT32, "TNY_INT32");}
+inline bool inUInt32(Tny* root, const char* name, uint32_t& v)     {return tnyScalarIn(root, name, v, TNY_INT32, "TNY_INT32");}
+inline bool inInt64(Tny* root, const char* name, int64_t& v)       {return tnyScalarIn(root, name, v, TNY_INT64, "TNY_INT64");}
+inline bool inUInt64(Tny* root, const char* name, uint64_t& v)     {return tnyScalarIn(root, name, v, TNY_INT64, "TNY_INT64");}
+inline bool inFloat(Tny* root, const char* name, float& v)         {return tnyScalarIn(root, name, v, TNY_INT32, "TNY_INT32");}
+inline bool inDouble(Tny* root, const char* name, double& v)       {return tnyScalarIn(root, name, v, TNY_INT64, "TNY_INT64");}
+
+inline Tny* outBool(Tny* root, const char* name, const bool& b)         {return tnyScalarOut(root, name, b, TNY_CHAR);}
+inline Tny* outInt8(Tny* root, const char* name, const int8_t& c)       {return tnyScalarOut(root, name, c, TNY_CHAR);}
+inline Tny* outUInt8(Tny* root, const char* name, const uint8_t& c)     {return tnyScalarOut(root, name, c, TNY_CHAR);}
+inline Tny* outInt32(Tny* root, const char* name, const int32_t& v)     {return tnyScalarOut(root, name, v, TNY_INT32);}
+inline Tny* outUInt32(Tny* root, const char* name, const uint32_t& v)   {return tnyScalarOut(root, name, v, TNY_INT32);}
+inline Tny* outInt64(Tny* root, const char* name, const int64_t& v)     {return tnyScalarOut(root, name, v, TNY_INT64);}
+inline Tny* outUInt64(Tny* root, const char* name, const uint64_t& v)   {return tnyScalarOut(root, name, v, TNY_INT64);}
+inline Tny* outFloat(Tny* root, const char* name, const float& v)       {return tnyScalarOut(root, name, v, TNY_INT32);}
+inline Tny* outDouble(Tny* root, const char* name, const double& v)     {return tnyScalarOut(root, name, v, TNY_INT64);}
+
+inline Tny* inBoolArray(Tny* root, bool& b)           {return tnyScalarInArray(root, b, TNY_CHAR, "TNY_CHAR");}
+inline Tny* inInt8Array(Tny* root, int8_t& c)         {return tnyScalarInArray(root, c, TNY_CHAR, "TNY_CHAR");}
+inline Tny* inUInt8Array(Tny* root, uint8_t& c)       {return tnyScalarInArray(root, c, TNY_CHAR, "TNY_CHAR");}
+inline Tny* inInt32Array(Tny* root, int32_t& v)       {return tnyScalarInArray(root, v, TNY_INT32, "TNY_INT32");}
+inline Tny* inUInt32Array(Tny* root, uint32_t& v)     {return tnyScalarInArray(root, v, TNY_INT32, "TNY_INT32");}
+inline Tny* inInt64Array(Tny* root, int64_t& v)       {return tnyScalarInArray(root, v, TNY_INT64, "TNY_INT64");}
+inline Tny* inUInt64Array(Tny* root, uint64_t& v)     {return tnyScalarInArray(root, v, TNY_INT64, "TNY_INT64");}
+inline Tny* inFloatArray(Tny* root, float& v)         {return tnyScalarInArray(root, v, TNY_INT32, "TNY_INT32");}
+inline Tny* inDoubleArray(Tny* root, double& v)       {return tnyScalarInArray(root, v, TNY_INT64, "TNY_INT64");}
+
+inline Tny* outBoolArray(Tny* root, const bool& b)         {return tnyScalarOutArray(root, b, TNY_CHAR);}
+inline Tny* outInt8Array(Tny* root, const int8_t& c)       {return tnyScalarOutArray(root, c, TNY_CHAR);}
+inline Tny* outUInt8Array(Tny* root, const uint8_t& c)     {return tnyScalarOutArray(root, c, TNY_CHAR);}
+inline Tny* outInt32Array(Tny* root, const int32_t& v)     {return tnyScalarOutArray(root, v, TNY_INT32);}
+inline Tny* outUInt32Array(Tny* root, const uint32_t& v)   {return tnyScalarOutArray(root, v, TNY_INT32);}
+inline Tny* outInt64Array(Tny* root, const int64_t& v)     {return tnyScalarOutArray(root, v, TNY_INT64);}
+inline Tny* outUInt64Array(Tny* root, const uint64_t& v)   {return tnyScalarOutArray(root, v, TNY_INT64);}
+inline Tny* outFloatArray(Tny* root, const float& v)       {return tnyScalarOutArray(root, v, TNY_INT32);}
+inline Tny* outDoubleArray(Tny* root, const double& v)     {return tnyScalarOutArray(root, v, TNY_INT64);}
+
+} // namespace inline_scalars
+
+#ifdef CPM_ES_CEREAL_INLINE_SCALARS
+using namespace inline_scalars;
+#endif
+
+} // namespace CST_detail
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
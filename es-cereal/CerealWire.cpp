@@ -0,0 +1,373 @@
+
+#include <stdlib.h>         // For C's free
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "CerealWire.hpp"
+#include "CerealByteOrder.hpp"
+#include "CerealHeap.hpp"
+#include <tny/tny.hpp>
+
+namespace CPM_ES_CEREAL_NS {
+
+namespace wire_detail {
+
+namespace {
+
+void throwMalformed(const char* what)
+{
+  std::cerr << "cpm-es-cereal: Malformed wire data - " << what << std::endl;
+  throw std::runtime_error("cpm-es-cereal: Malformed wire data.");
+}
+
+}
+
+size_t getVarintSize(uint64_t value)
+{
+  size_t size = 1;
+  while (value >= 0x80)
+  {
+    value >>= 7;
+    ++size;
+  }
+  return size;
+}
+
+char* writeVarint(char* out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    *out++ = static_cast<char>((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  *out++ = static_cast<char>(value);
+  return out;
+}
+
+bool readVarint(const char* data, size_t size, size_t& offset, uint64_t& value)
+{
+  value = 0;
+  for (int shift = 0; shift < 70; shift += 7)
+  {
+    if (offset >= size)
+      return false;
+    uint8_t byte = static_cast<uint8_t>(data[offset++]);
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+char* writeHeader(char* out, uint32_t backendID, uint32_t numHeaps)
+{
+  std::memcpy(out, "CWIR", 4);
+  byte_detail::writeU32(out + 4, VERSION);
+  byte_detail::writeU32(out + 8, backendID);
+  byte_detail::writeU32(out + 12, numHeaps);
+  return out + HEADER_SIZE;
+}
+
+size_t getFrameSize(const char* key)
+{
+  return 12 + std::strlen(key);
+}
+
+char* writeFrame(char* out, const char* key, uint64_t payloadSize)
+{
+  size_t keyLength = std::strlen(key);
+  byte_detail::writeU32(out, static_cast<uint32_t>(keyLength));
+  byte_detail::writeU64(out + 4, payloadSize);
+  std::memcpy(out + 12, key, keyLength);
+  return out + 12 + keyLength;
+}
+
+WireReader::WireReader(const void* data, size_t size, uint32_t backendID) :
+    mData(static_cast<const char*>(data)),
+    mSize(size),
+    mOffset(HEADER_SIZE),
+    mNumHeaps(0),
+    mHeapsRead(0)
+{
+  if (mData == NULL || mSize < HEADER_SIZE || std::memcmp(mData, "CWIR", 4) != 0)
+    throwMalformed("missing header");
+  if (byte_detail::readU32(mData + 4) != VERSION)
+    throwMalformed("unsupported version");
+  if (byte_detail::readU32(mData + 8) != backendID)
+  {
+    std::cerr << "cpm-es-cereal: Wire data was written by backend "
+              << byte_detail::readU32(mData + 8) << ", expected " << backendID << std::endl;
+    throw std::runtime_error("cpm-es-cereal: Wire backend mismatch.");
+  }
+  mNumHeaps = byte_detail::readU32(mData + 12);
+}
+
+bool WireReader::nextHeap(std::string& key, const char*& payload, size_t& payloadSize)
+{
+  if (mHeapsRead == mNumHeaps)
+    return false;
+
+  if (mSize - mOffset < 12)
+    throwMalformed("truncated heap frame");
+  uint32_t keyLength = byte_detail::readU32(mData + mOffset);
+  uint64_t size = byte_detail::readU64(mData + mOffset + 4);
+  mOffset += 12;
+
+  if (mSize - mOffset < keyLength || mSize - mOffset - keyLength < size)
+    throwMalformed("truncated heap");
+  key.assign(mData + mOffset, keyLength);
+  mOffset += keyLength;
+  payload = mData + mOffset;
+  payloadSize = static_cast<size_t>(size);
+  mOffset += payloadSize;
+
+  ++mHeapsRead;
+  return true;
+}
+
+const ComponentLayout& requireLayout(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap)
+{
+  const ComponentLayout& layout = heap.getLayout(core);
+  if (!layout.isValid())
+  {
+    std::cerr << "cpm-es-cereal: " << heap.getComponentName() << " is not trivially copyable or"
+              << " serializes fields that are not trivially copyable members, and requires"
+              << " TnyWireBackend." << std::endl;
+    throw std::runtime_error("cpm-es-cereal: Component not supported by wire backend.");
+  }
+  return layout;
+}
+
+} // namespace wire_detail
+
+//------------------------------------------------------------------------------
+// TnyWireBackend
+//------------------------------------------------------------------------------
+
+TnyWireBackend::HeapEncoder::HeapEncoder(CPM_ES_NS::ESCoreBase& core,
+                                         ComponentSerializeInterface& heap) :
+    mDump(NULL),
+    mSize(0)
+{
+  Tny* serializedHeap = heap.serialize(core);
+  if (serializedHeap != NULL)
+  {
+    mSize = Tny_dumps(serializedHeap, &mDump);
+    Tny_free(serializedHeap);
+  }
+
+  if (mDump == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Failed to serialize component: " << heap.getComponentName() << std::endl;
+    throw std::runtime_error("Failed serialization");
+  }
+}
+
+TnyWireBackend::HeapEncoder::~HeapEncoder()
+{
+  free(mDump);
+}
+
+void TnyWireBackend::HeapEncoder::write(char* out) const
+{
+  std::memcpy(out, mDump, mSize);
+}
+
+void TnyWireBackend::decodeHeapCreate(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap,
+                                      const char* data, size_t size)
+{
+  Tny* root = Tny_loads(const_cast<char*>(data), size);
+  if (root == NULL)
+  {
+    std::cerr << "cpm-es-cereal: Failed to load component: " << heap.getComponentName() << std::endl;
+    throw std::runtime_error("Failed to load wire heap");
+  }
+
+  heap.deserializeCreate(core, root, nullptr);
+  Tny_free(root);
+}
+
+//------------------------------------------------------------------------------
+// BinaryWireBackend
+//------------------------------------------------------------------------------
+
+BinaryWireBackend::HeapEncoder::HeapEncoder(CPM_ES_NS::ESCoreBase& core,
+                                            ComponentSerializeInterface& heap) :
+    mLayout(&wire_detail::requireLayout(core, heap)),
+    mNumComponents(0),
+    mSize(0)
+{
+  mNumComponents = heap.packComponents(core, mRecords);
+
+  mSize = 4 + 8;
+  for (size_t i = 0; i < mLayout->getNumFields(); ++i)
+    mSize += 4 + mLayout->getField(i).name.size() + 4;
+
+  mSize += mNumComponents * mLayout->getPackedSize();
+  size_t recordSize = sizeof(uint64_t) + mLayout->getPackedSize();
+  uint64_t previousID = 0;
+  for (size_t i = 0; i < mNumComponents; ++i)
+  {
+    uint64_t entityID = byte_detail::readU64(&mRecords[i * recordSize]);
+    mSize += wire_detail::getVarintSize(entityID - previousID);
+    previousID = entityID;
+  }
+}
+
+void BinaryWireBackend::HeapEncoder::write(char* out) const
+{
+  byte_detail::writeU32(out, static_cast<uint32_t>(mLayout->getNumFields()));
+  out += 4;
+  for (size_t i = 0; i < mLayout->getNumFields(); ++i)
+  {
+    const LayoutField& field = mLayout->getField(i);
+    byte_detail::writeU32(out, static_cast<uint32_t>(field.name.size()));
+    std::memcpy(out + 4, field.name.data(), field.name.size());
+    out += 4 + field.name.size();
+    byte_detail::writeU32(out, field.size);
+    out += 4;
+  }
+
+  byte_detail::writeU64(out, mNumComponents);
+  out += 8;
+
+  size_t packedSize = mLayout->getPackedSize();
+  size_t recordSize = sizeof(uint64_t) + packedSize;
+  uint64_t previousID = 0;
+  for (size_t i = 0; i < mNumComponents; ++i)
+  {
+    const char* record = &mRecords[i * recordSize];
+    uint64_t entityID = byte_detail::readU64(record);
+    out = wire_detail::writeVarint(out, entityID - previousID);
+    previousID = entityID;
+
+    if (packedSize != 0)
+      std::memcpy(out, record + sizeof(uint64_t), packedSize);
+    out += packedSize;
+  }
+}
+
+void BinaryWireBackend::decodeHeapCreate(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap,
+                                         const char* data, size_t size)
+{
+  const ComponentLayout& layout = wire_detail::requireLayout(core, heap);
+
+  // Fields of the encoder that we also have, with matching sizes.
+  struct FieldMap
+  {
+    size_t wireOffset;
+    size_t localOffset;
+    size_t size;
+  };
+  std::vector<FieldMap> fieldMap;
+
+  size_t offset = 0;
+  if (size < 4) wire_detail::throwMalformed("truncated field count");
+  uint32_t numFields = byte_detail::readU32(data);
+  offset += 4;
+
+  size_t wireRecordSize = 0;
+  for (uint32_t i = 0; i < numFields; ++i)
+  {
+    if (size - offset < 4) wire_detail::throwMalformed("truncated field");
+    uint32_t nameLength = byte_detail::readU32(data + offset);
+    offset += 4;
+    if (size - offset < static_cast<size_t>(nameLength) + 4) wire_detail::throwMalformed("truncated field");
+    std::string name(data + offset, nameLength);
+    offset += nameLength;
+    uint32_t fieldSize = byte_detail::readU32(data + offset);
+    offset += 4;
+
+    int local = layout.findField(name.c_str());
+    if (local != -1 && layout.getField(local).size == fieldSize)
+    {
+      FieldMap map = {wireRecordSize, layout.getField(local).packedOffset, fieldSize};
+      fieldMap.push_back(map);
+    }
+    wireRecordSize += fieldSize;
+  }
+
+  if (size - offset < 8) wire_detail::throwMalformed("truncated record count");
+  uint64_t numRecords = byte_detail::readU64(data + offset);
+  offset += 8;
+
+  // Every record takes at least one byte of entity ID.
+  if (numRecords > size - offset) wire_detail::throwMalformed("record count");
+
+  size_t packedSize = layout.getPackedSize();
+  size_t recordStride = sizeof(uint64_t) + packedSize;
+  std::vector<char> records(static_cast<size_t>(numRecords) * recordStride);
+
+  uint64_t entityID = 0;
+  for (size_t i = 0; i < numRecords; ++i)
+  {
+    uint64_t delta = 0;
+    if (!wire_detail::readVarint(data, size, offset, delta)) wire_detail::throwMalformed("entity ID");
+    entityID += delta;
+    if (size - offset < wireRecordSize) wire_detail::throwMalformed("truncated record");
+
+    char* record = &records[i * recordStride];
+    byte_detail::writeU64(record, entityID);
+    if (packedSize != 0)
+      std::memcpy(record + sizeof(uint64_t), &layout.getDefaults()[0], packedSize);
+    for (const FieldMap& map : fieldMap)
+      std::memcpy(record + sizeof(uint64_t) + map.localOffset, data + offset + map.wireOffset, map.size);
+    offset += wireRecordSize;
+  }
+
+  if (numRecords != 0)
+    heap.createFromPacked(core, &records[0], static_cast<size_t>(numRecords), recordStride);
+}
+
+//------------------------------------------------------------------------------
+// RecordWireBackend
+//------------------------------------------------------------------------------
+
+RecordWireBackend::HeapEncoder::HeapEncoder(CPM_ES_NS::ESCoreBase& core,
+                                            ComponentSerializeInterface& heap) :
+    mLayout(&wire_detail::requireLayout(core, heap)),
+    mNumComponents(0)
+{
+  mNumComponents = heap.packComponents(core, mRecords);
+}
+
+void RecordWireBackend::HeapEncoder::write(char* out) const
+{
+  size_t recordSize = sizeof(uint64_t) + mLayout->getPackedSize();
+  byte_detail::writeU32(out, mLayout->getFingerprint());
+  byte_detail::writeU32(out + 4, static_cast<uint32_t>(recordSize));
+  byte_detail::writeU64(out + 8, mNumComponents);
+  out += 16;
+
+  if (!mRecords.empty())
+    std::memcpy(out, &mRecords[0], mRecords.size());
+}
+
+void RecordWireBackend::decodeHeapCreate(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap,
+                                         const char* data, size_t size)
+{
+  const ComponentLayout& layout = wire_detail::requireLayout(core, heap);
+
+  if (size < 16) wire_detail::throwMalformed("truncated record header");
+  uint32_t fingerprint = byte_detail::readU32(data);
+  uint32_t recordSize = byte_detail::readU32(data + 4);
+  uint64_t numRecords = byte_detail::readU64(data + 8);
+
+  if (fingerprint != layout.getFingerprint()
+      || recordSize != sizeof(uint64_t) + layout.getPackedSize())
+  {
+    std::cerr << "cpm-es-cereal: Layout of " << heap.getComponentName()
+              << " differs from the encoded records." << std::endl;
+    throw std::runtime_error("cpm-es-cereal: Record layout mismatch.");
+  }
+
+  if (numRecords > (size - 16) / recordSize || (size - 16) != numRecords * recordSize)
+    wire_detail::throwMalformed("record count");
+
+  if (numRecords != 0)
+    heap.createFromPacked(core, data + 16, static_cast<size_t>(numRecords), recordSize);
+}
+
+} // namespace CPM_ES_CEREAL_NS
@@ -0,0 +1,194 @@
+#ifndef IAUNS_CEREALWIRE_HPP
+#define IAUNS_CEREALWIRE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ComponentSerialize.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+/// Wire backends encode heaps for CerealCore::encodeAllComponents and
+/// decode them for CerealCore::decodeComponentCreate. The backend is a
+/// template parameter, so selecting one costs no virtual calls: the only
+/// virtual calls made are per heap, and the binary backends copy fields with
+/// the inline ComponentLayout::pack and unpack. Component serialize
+/// functions are the same for every backend.
+///
+/// A backend provides an encoder and a decode function:
+///
+///   static const uint32_t ID;   // Stored in the framing, checked on decode.
+///   class HeapEncoder
+///   {
+///   public:
+///     HeapEncoder(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap);
+///     size_t getSize() const;       // Exact size of the payload.
+///     void write(char* out) const;  // Writes getSize() bytes.
+///   };
+///   static void decodeHeapCreate(CPM_ES_NS::ESCoreBase& core,
+///                                ComponentSerializeInterface& heap,
+///                                const char* data, size_t size);
+///
+/// Encoders size their payload before writing any of it, so the encoded
+/// buffer is allocated exactly once and oversized output can be rejected up
+/// front (see CerealCore::measureAllComponents).
+///
+/// Framing shared by every backend (all integers little endian):
+///
+///   char[4]   magic "CWIR"
+///   uint32_t  version
+///   uint32_t  backend ID
+///   uint32_t  number of heaps
+///   per heap:
+///     uint32_t  key length
+///     uint64_t  payload size
+///     char[]    key (as CerealCore::getHeapKey)
+///     char[]    payload (backend specific)
+
+/// Legacy format: each payload is a Tny dump of the heap, exactly as found
+/// inside of serializeAllComponents. Supports every component. Tny only
+/// reports the size of a dump by producing it, so the encoder holds the
+/// dump between sizing and writing.
+struct TnyWireBackend
+{
+  static const uint32_t ID = 1;
+
+  class HeapEncoder
+  {
+  public:
+    HeapEncoder(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap);
+    ~HeapEncoder();
+
+    size_t getSize() const      {return mSize;}
+    void write(char* out) const;
+
+  private:
+    HeapEncoder(const HeapEncoder&);
+    HeapEncoder& operator=(const HeapEncoder&);
+
+    void*   mDump;
+    size_t  mSize;
+  };
+
+  static void decodeHeapCreate(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap,
+                               const char* data, size_t size);
+};
+
+/// Compact binary format. Fields are described once per heap (name and
+/// size), followed by one record per component: the entity ID as a varint
+/// delta from the previous record and the packed fields. Decoding matches
+/// fields by name, so fields added to or removed from a component since it
+/// was encoded are tolerated (missing fields keep their default values).
+/// Requires a valid ComponentLayout. Records are written by each
+/// component's serialize function (see ComponentSerializeInterface::
+/// packComponents); scalar fields are little endian.
+struct BinaryWireBackend
+{
+  static const uint32_t ID = 2;
+
+  class HeapEncoder
+  {
+  public:
+    HeapEncoder(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap);
+
+    size_t getSize() const      {return mSize;}
+    void write(char* out) const;
+
+  private:
+    const ComponentLayout*  mLayout;
+    std::vector<char>       mRecords;       ///< See packComponents.
+    size_t                  mNumComponents;
+    size_t                  mSize;
+  };
+
+  static void decodeHeapCreate(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap,
+                               const char* data, size_t size);
+};
+
+/// Fixed layout format. A header (layout fingerprint, record size, record
+/// count) followed by fixed size records: a uint64_t entity ID and the
+/// packed fields. Fields are not matched by name, so decoding requires the
+/// reading component's layout to be identical (equal fingerprint). Each
+/// record is unpacked into a default constructed temporary T which is then
+/// added with addComponent (a copy); the component's serialize function is
+/// not called while decoding, so anything it does besides transferring
+/// fields is skipped. Requires a valid ComponentLayout. Records are written
+/// by each component's serialize function (see
+/// ComponentSerializeInterface::packComponents); scalar fields are little
+/// endian.
+struct RecordWireBackend
+{
+  static const uint32_t ID = 3;
+
+  class HeapEncoder
+  {
+  public:
+    HeapEncoder(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap);
+
+    size_t getSize() const      {return 16 + mNumComponents * (sizeof(uint64_t) + mLayout->getPackedSize());}
+    void write(char* out) const;
+
+  private:
+    const ComponentLayout*  mLayout;
+    std::vector<char>       mRecords;       ///< See packComponents.
+    size_t                  mNumComponents;
+  };
+
+  static void decodeHeapCreate(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap,
+                               const char* data, size_t size);
+};
+
+namespace wire_detail {
+
+const uint32_t VERSION      = 1;
+const size_t   HEADER_SIZE  = 16;
+
+/// Writes the framing header. Returns the end of the header.
+char* writeHeader(char* out, uint32_t backendID, uint32_t numHeaps);
+
+/// Size of the frame of a heap keyed \p key, excluding its payload.
+size_t getFrameSize(const char* key);
+
+/// Writes the frame of a heap keyed \p key whose payload is
+/// \p payloadSize bytes. Returns where the payload goes.
+char* writeFrame(char* out, const char* key, uint64_t payloadSize);
+
+size_t getVarintSize(uint64_t value);
+
+/// Writes \p value as a varint. Returns the end of the varint.
+char* writeVarint(char* out, uint64_t value);
+
+/// Reads a varint at \p offset, advancing it. Returns false if the varint
+/// is truncated or longer than 10 bytes.
+bool readVarint(const char* data, size_t size, size_t& offset, uint64_t& value);
+
+/// Walks the heaps of a framed buffer. Throws std::runtime_error if the
+/// framing is malformed or was written by a different backend.
+class WireReader
+{
+public:
+  WireReader(const void* data, size_t size, uint32_t backendID);
+
+  /// Retrieves the next heap. Returns false once all heaps were read.
+  bool nextHeap(std::string& key, const char*& payload, size_t& payloadSize);
+
+  uint32_t getNumHeaps() const {return mNumHeaps;}
+
+private:
+  const char* mData;
+  size_t      mSize;
+  size_t      mOffset;
+  uint32_t    mNumHeaps;
+  uint32_t    mHeapsRead;
+};
+
+/// Layout of \p heap. Throws std::runtime_error if the layout is invalid.
+const ComponentLayout& requireLayout(CPM_ES_NS::ESCoreBase& core,
+                                     ComponentSerializeInterface& heap);
+}
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
@@ -1,8 +1,24 @@
+#include <algorithm>
+#include <functional>
+
 #include "ComponentSerialize.hpp"
+#include "CerealCore.hpp"
+#include "CerealPrefab.hpp"
 #include <tny/tny.hpp>
 
 namespace CPM_ES_CEREAL_NS {
 
+const char* const ComponentSerialize::ENTITY_TYPE_NAME = "entity";
+
+CerealAllocator& ComponentSerialize::getCoreAllocator(CPM_ES_NS::ESCoreBase& core)
+{
+  CerealCore* cerealCore = dynamic_cast<CerealCore*>(&core);
+  if (cerealCore != nullptr)
+    return cerealCore->getAllocator();
+  else
+    return CerealAllocator::getDefault();
+}
+
 ComponentSerialize::~ComponentSerialize()
 {
   if (mTnyRoot != NULL && mDeserializing == false)
@@ -35,6 +51,71 @@ void ComponentSerialize::prepareForNewComponent(int32_t componentIndex)
   }
 }
 
+void ComponentSerialize::setEntityFieldRecorder(const void* component, size_t size,
+                                                std::vector<size_t>* offsets)
+{
+  mRecordBase = static_cast<const char*>(component);
+  mRecordSize = size;
+  mEntityFieldOffsets = offsets;
+}
+
+void ComponentSerialize::recordEntityField(const uint64_t* field)
+{
+  const char* fieldPtr = reinterpret_cast<const char*>(field);
+  if (fieldPtr < mRecordBase || fieldPtr + sizeof(uint64_t) > mRecordBase + mRecordSize)
+    return;
+
+  size_t offset = static_cast<size_t>(fieldPtr - mRecordBase);
+  for (size_t existing : *mEntityFieldOffsets)
+  {
+    if (existing == offset)
+      return;
+  }
+
+  mEntityFieldOffsets->push_back(offset);
+}
+
+void ComponentSerialize::setRecordPacker(const void* component, const ComponentLayout* layout,
+                                         char* out)
+{
+  mPackLayout = layout;
+  mPackBase = static_cast<const char*>(component);
+  mPackOut = out;
+  mPackWritten.assign(layout != nullptr ? layout->getNumFields() : 0, 0);
+  mPackNumWritten = 0;
+  mPackMismatch = false;
+}
+
+bool ComponentSerialize::isPackComplete() const
+{
+  return !mPackMismatch && mPackLayout != nullptr && mPackNumWritten == mPackLayout->getNumFields();
+}
+
+void ComponentSerialize::packField(const char* name, const void* field, size_t size)
+{
+  int index = mPackLayout->findField(name);
+  const char* fieldPtr = static_cast<const char*>(field);
+  if (index == -1 || fieldPtr < mPackBase)
+  {
+    mPackMismatch = true;
+    return;
+  }
+
+  const LayoutField& layoutField = mPackLayout->getField(static_cast<size_t>(index));
+  if (static_cast<size_t>(fieldPtr - mPackBase) != layoutField.offset || size != layoutField.size)
+  {
+    mPackMismatch = true;
+    return;
+  }
+
+  // Repeated names are ignored, as they are when recording the layout.
+  if (mPackWritten[index])
+    return;
+  mPackWritten[index] = 1;
+  ++mPackNumWritten;
+  ComponentLayout::packField(layoutField, field, mPackOut);
+}
+
 Tny* ComponentSerialize::getSerializedObject()
 {
   return mTnyRoot->root;
@@ -55,5 +136,272 @@ Tny* ComponentSerialize::getTypeHeader()
   return root->root;
 }
 
+//------------------------------------------------------------------------------
+// ComponentSerializeInterface defaults
+//------------------------------------------------------------------------------
+
+namespace {
+
+/// Deep copies \p heap (as written by writeSerializedHeap) into \p holder, a
+/// new one element array, and returns the copy. Entity ID fields of the
+/// copy, and its owning entity IDs if \p owners is set, are passed through
+/// \p translate. The caller frees \p holder with Tny_free.
+Tny* copyTranslatedHeap(CPM_ES_NS::ESCoreBase& core, Tny* heap, bool owners,
+                        const std::function<uint64_t(uint64_t)>& translate, Tny*& holder)
+{
+  holder = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+  Tny* copy = Tny_add(holder, TNY_OBJ, NULL, heap, 0)->value.tny;
+  try
+  {
+    ComponentSerialize s(core, true);
+    ComponentSerialize::HeaderList headers(
+        CerealStlAllocator<ComponentSerialize::HeaderItem>(s.getAllocator()));
+    Tny* cur = heap_detail::readSerializedHeap(s, copy, headers);
+    if (cur == nullptr)
+    {
+      std::cerr << "cpm-es-cereal: Corrupt heap header." << std::endl;
+      throw std::runtime_error("cpm-es-cereal: Corrupt heap header.");
+    }
+
+    std::vector<const char*> entityFields;
+    for (const ComponentSerialize::HeaderItem& item : headers)
+    {
+      if (item.basicTypeName == ComponentSerialize::ENTITY_TYPE_NAME)
+        entityFields.push_back(item.name.c_str());
+    }
+
+    uint64_t entityID = 0;
+    Tny* obj = NULL;
+    while (heap_detail::readSerializedRecord(cur, entityID, obj))
+    {
+      if (owners)
+        Tny_prev(cur)->value.num = translate(entityID);
+
+      for (const char* name : entityFields)
+      {
+        Tny* field = Tny_get(obj, name);
+        if (field != NULL && field->type == TNY_INT64)
+          field->value.num = translate(field->value.num);
+      }
+    }
+  }
+  catch (...)
+  {
+    Tny_free(holder);
+    holder = NULL;
+    throw;
+  }
+  return copy;
+}
+
+/// Prefab heap of heaps without their own decodePrefab. Holds a copy of the
+/// serialized heap, and instantiates translated copies of it.
+class TnyPrefabHeap : public PrefabHeapInterface
+{
+public:
+  TnyPrefabHeap(CPM_ES_NS::ESCoreBase& core, ComponentSerializeInterface& heap, Tny* root) :
+      mCore(core),
+      mHeap(heap),
+      mHolder(Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0)),
+      mRoot(Tny_add(mHolder, TNY_OBJ, NULL, root, 0)->value.tny)
+  {
+    heap_detail::collectSerializedEntityIDs(mRoot, mEntityIDs);
+  }
+
+  ~TnyPrefabHeap()  {Tny_free(mHolder);}
+
+  void instantiate(const IDMap& idMap) override
+  {
+    Tny* holder = NULL;
+    Tny* copy = copyTranslatedHeap(mCore, mRoot, true,
+                                   [&idMap](uint64_t id) {return idMap.translate(id);}, holder);
+    try
+    {
+      mHeap.deserializeCreate(mCore, copy);
+    }
+    catch (...)
+    {
+      Tny_free(holder);
+      throw;
+    }
+    Tny_free(holder);
+  }
+
+  void collectEntityIDs(std::vector<uint64_t>& ids) const override
+  {
+    ids.insert(ids.end(), mEntityIDs.begin(), mEntityIDs.end());
+  }
+
+  size_t getNumComponents() const override {return mEntityIDs.size();}
+
+private:
+  TnyPrefabHeap(const TnyPrefabHeap&);
+  TnyPrefabHeap& operator=(const TnyPrefabHeap&);
+
+  CPM_ES_NS::ESCoreBase&        mCore;
+  ComponentSerializeInterface&  mHeap;
+  Tny*                          mHolder;    ///< One element array holding mRoot.
+  Tny*                          mRoot;      ///< Copy of the serialized heap.
+  std::vector<uint64_t>         mEntityIDs; ///< Owner of every component.
+};
+
+ComponentLayout makeInvalidLayout()
+{
+  ComponentLayout layout;
+  layout.invalidate();
+  return layout;
+}
+
+}
+
+CerealBuffer ComponentSerializeInterface::dumpEntity(CPM_ES_NS::ESCoreBase& core, uint64_t entity)
+{
+  Tny* root = serializeEntity(core, entity);
+  if (root == NULL)
+    return CerealBuffer();
+
+  try
+  {
+    CerealBuffer dump = heap_detail::dumpToBuffer(root, ComponentSerialize::getCoreAllocator(core));
+    Tny_free(root);
+    return dump;
+  }
+  catch (...)
+  {
+    Tny_free(root);
+    throw;
+  }
+}
+
+Tny* ComponentSerializeInterface::serializeEntities(CPM_ES_NS::ESCoreBase& core,
+                                                    const uint64_t* entityIDs, size_t count)
+{
+  Tny* root = serialize(core);
+  if (root == NULL)
+    return NULL;
+
+  Tny* compArray = NULL;
+  Tny* result = NULL;
+  try
+  {
+    ComponentSerialize s(core, true);
+    ComponentSerialize::HeaderList headers(
+        CerealStlAllocator<ComponentSerialize::HeaderItem>(s.getAllocator()));
+    Tny* cur = heap_detail::readSerializedHeap(s, root, headers);
+
+    uint64_t entityID = 0;
+    Tny* obj = NULL;
+    while (cur != nullptr && heap_detail::readSerializedRecord(cur, entityID, obj))
+    {
+      if (!std::binary_search(entityIDs, entityIDs + count, entityID))
+        continue;
+
+      if (compArray == NULL)
+        compArray = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+      compArray = heap_detail::addSerializedComponent(compArray, obj, entityID);
+    }
+
+    if (compArray != NULL)
+    {
+      // Same type header as the whole heap.
+      result = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+      result = Tny_add(result, TNY_OBJ, NULL, Tny_next(root)->value.tny, 0);
+      result = Tny_add(result, TNY_OBJ, NULL, compArray->root, 0);
+      result = result->root;
+    }
+  }
+  catch (...)
+  {
+    if (compArray != NULL)
+      Tny_free(compArray);
+    Tny_free(root);
+    throw;
+  }
+
+  if (compArray != NULL)
+    Tny_free(compArray);
+  Tny_free(root);
+  return result;
+}
+
+void ComponentSerializeInterface::deserializeCreate(CPM_ES_NS::ESCoreBase& core, Tny* root,
+                                                    EntityRemap* remap)
+{
+  if (remap == nullptr)
+  {
+    deserializeCreate(core, root);
+    return;
+  }
+
+  Tny* holder = NULL;
+  Tny* copy = copyTranslatedHeap(core, root, true,
+                                 [remap](uint64_t id) {return remap->remap(id);}, holder);
+  try
+  {
+    deserializeCreate(core, copy);
+  }
+  catch (...)
+  {
+    Tny_free(holder);
+    throw;
+  }
+  Tny_free(holder);
+}
+
+std::unique_ptr<PrefabHeapInterface> ComponentSerializeInterface::decodePrefab(
+    CPM_ES_NS::ESCoreBase& core, Tny* root)
+{
+  return std::unique_ptr<PrefabHeapInterface>(new TnyPrefabHeap(core, *this, root));
+}
+
+void ComponentSerializeInterface::remapEntityReferences(CPM_ES_NS::ESCoreBase& core,
+                                                        const EntityIDTable& table)
+{
+  if (table.empty())
+    return;
+
+  Tny* root = serialize(core);
+  if (root == NULL)
+    return;
+
+  Tny* holder = NULL;
+  try
+  {
+    Tny* copy = copyTranslatedHeap(core, root, false,
+                                   [&table](uint64_t id) {return table.translate(id);}, holder);
+    deserializeMerge(core, copy, true);
+  }
+  catch (...)
+  {
+    if (holder != NULL)
+      Tny_free(holder);
+    Tny_free(root);
+    throw;
+  }
+  Tny_free(holder);
+  Tny_free(root);
+}
+
+const ComponentLayout& ComponentSerializeInterface::getLayout(CPM_ES_NS::ESCoreBase& /* core */)
+{
+  static const ComponentLayout invalid = makeInvalidLayout();
+  return invalid;
+}
+
+size_t ComponentSerializeInterface::packComponents(CPM_ES_NS::ESCoreBase& /* core */,
+                                                   std::vector<char>& /* records */)
+{
+  std::cerr << "cpm-es-cereal: " << getComponentName() << " does not implement packComponents." << std::endl;
+  throw std::runtime_error("cpm-es-cereal: packComponents not implemented.");
+}
+
+void ComponentSerializeInterface::createFromPacked(CPM_ES_NS::ESCoreBase& /* core */,
+                                                   const char* /* records */, size_t /* count */,
+                                                   size_t /* stride */)
+{
+  std::cerr << "cpm-es-cereal: " << getComponentName() << " does not implement createFromPacked." << std::endl;
+  throw std::runtime_error("cpm-es-cereal: createFromPacked not implemented.");
+}
+
 } // namespace CPM_ES_CEREAL_NS
 
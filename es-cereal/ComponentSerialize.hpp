@@ -1,14 +1,23 @@
 #ifndef IAUNS_COMMON_COMPONENTSERIALIZE_HPP
 #define IAUNS_COMMON_COMPONENTSERIALIZE_HPP
 
+#include <memory>
+#include <type_traits>
+#include <vector>
 #include <entity-system/ESCoreBase.hpp>
 #include "CerealTypeSerialize.hpp"
+#include "CerealAllocator.hpp"
+#include "CerealBuffer.hpp"
+#include "CerealLayout.hpp"
+#include "EntityRemap.hpp"
 
 struct _Tny;
 typedef _Tny Tny;
 
 namespace CPM_ES_CEREAL_NS {
 
+class PrefabHeapInterface;
+
 // Idea to speed up serialization:
 // Add integer block alongside every component. This will denote the offsets
 // into the component heap header of the component. This will be in pairs:
@@ -26,9 +35,24 @@ public:
   // The instance members in this class are only used when the serialize
   // member function is called.
   ComponentSerialize(CPM_ES_NS::ESCoreBase& core, bool deserializing) :
-    mDeserializing(deserializing),
     mLastIndex(-1),
+    mAllocator(getCoreAllocator(core)),
+    mHeader(CerealStlAllocator<HeaderItem>(mAllocator)),
+    mDeserializing(deserializing),
     mTnyRoot(NULL),
+    mRemap(nullptr),
+    mRecordBase(nullptr),
+    mRecordSize(0),
+    mEntityFieldOffsets(nullptr),
+    mLayout(nullptr),
+    mLayoutBase(nullptr),
+    mLayoutSize(0),
+    mPackLayout(nullptr),
+    mPackBase(nullptr),
+    mPackOut(nullptr),
+    mPackNumWritten(0),
+    mPackMismatch(false),
+    mRecordOnly(false),
     mCore(core)
   {
     if (deserializing) mHeader.reserve(15);
@@ -43,6 +67,14 @@ public:
 
     // Using template specialization we will select the appropriate context
     // under which we will serialize the type.
+    if (mPackLayout != nullptr)
+    {
+      packField(name, &v, sizeof(T));
+      return;
+    }
+    if (mRecordOnly)
+      return;
+
     if (isDeserializing() == true)
     {
       // Find the name in our current component dictionary and serialize.
@@ -51,44 +83,62 @@ public:
     }
     else
     {
-      ++mLastIndex;
-
-      // Check mLastIndex (if it exists), and see if it has same name
-      // as the object we are trying to serialize.
-      bool searchForName = true;
-      if (mLastIndex < mHeader.size())
-      {
-        if (mHeader[mLastIndex].name == name)
-        {
-          searchForName = false;
-        }
-      }
-
-      if (searchForName)
-      {
-        bool foundName = false;
-        for (HeaderItem& item : mHeader)
-        {
-          if (item.name == name)
-          {
-            foundName = true;
-            break;
-          }
-        }
-
-        if (!foundName)
-        {
-          // Add the name to header.
-          mHeader.push_back(HeaderItem(name, CerealSerializeType<T>::getTypeName()));
-        }
-      }
+      addHeaderItem(name, CerealSerializeType<T>::getTypeName());
 
       // Insert the name along with the Tny object serialized from the
       // appropriate type.
       mTnyRoot = CerealSerializeType<T>::out(mTnyRoot, name, v);
     }
+
+    if (mLayout != nullptr)
+    {
+      mLayout->addField(name, CerealSerializeType<T>::getTypeName(), mLayoutBase, mLayoutSize,
+                        &v, sizeof(T), std::is_trivially_copyable<T>::value
+                                       && !std::is_pointer<T>::value,
+                        std::is_arithmetic<T>::value);
+    }
+  }
+
+  /// Serializes an entity ID stored inside of a component (a parent, a
+  /// target, etc...). Stored like a uint64_t, but recorded in the type header
+  /// with the type name ENTITY_TYPE_NAME so tools and fixup passes can tell
+  /// references apart from plain integers. When deserializing with an entity
+  /// remap installed, the deserialized ID is translated through the remap.
+  void serializeEntityID(const char* name, uint64_t& id)
+  {
+    if (mPackLayout != nullptr)
+    {
+      packField(name, &id, sizeof(id));
+      return;
+    }
+    if (mRecordOnly)
+    {
+      if (mEntityFieldOffsets != nullptr)
+        recordEntityField(&id);
+      return;
+    }
+
+    if (isDeserializing() == true)
+    {
+      if (CerealSerializeType<uint64_t>::in(mTnyRoot, name, id) && mRemap != nullptr)
+        id = mRemap->remap(id);
+    }
+    else
+    {
+      addHeaderItem(name, ENTITY_TYPE_NAME);
+      mTnyRoot = CerealSerializeType<uint64_t>::out(mTnyRoot, name, id);
+    }
+
+    if (mEntityFieldOffsets != nullptr)
+      recordEntityField(&id);
+    if (mLayout != nullptr)
+      mLayout->addField(name, ENTITY_TYPE_NAME, mLayoutBase, mLayoutSize, &id, sizeof(id), true, true);
   }
 
+  /// Type name recorded in the type header for fields serialized with
+  /// serializeEntityID.
+  static const char* const ENTITY_TYPE_NAME;
+
   virtual ~ComponentSerialize();
 
   /// Prepares this class for a new component. Only called when serializing.
@@ -104,6 +154,40 @@ public:
   /// Sets the root element to use for deserialization.
   void setDeserializeRoot(Tny* root) {mTnyRoot = root;}
 
+  /// Sets the remap applied to entity IDs while deserializing. May be NULL.
+  void setEntityRemap(EntityRemap* remap) {mRemap = remap;}
+  EntityRemap* getEntityRemap()           {return mRemap;}
+
+  /// While serializing or deserializing, records the byte offsets (relative to
+  /// \p component) of every field passed to serializeEntityID into
+  /// \p offsets. Fields that do not live inside of
+  /// [component, component + size) are ignored. Pass NULL to stop recording.
+  void setEntityFieldRecorder(const void* component, size_t size,
+                              std::vector<size_t>* offsets);
+
+  /// While set, serialize and serializeEntityID only feed the entity field
+  /// recorder (see setEntityFieldRecorder); nothing is serialized.
+  void setRecordOnly(bool recordOnly)     {mRecordOnly = recordOnly;}
+
+  /// While serializing, appends every field of \p component (of \p size
+  /// bytes) to \p layout. Pass NULL to stop recording.
+  void setLayoutRecorder(const void* component, size_t size, ComponentLayout* layout)
+  {
+    mLayoutBase = component;
+    mLayoutSize = size;
+    mLayout = layout;
+  }
+
+  /// While serializing, writes the fields of \p component into the packed
+  /// record \p out of \p layout instead of building a Tny object. Call once
+  /// per component, before its serialize function, and check isPackComplete
+  /// afterwards. Pass NULL to stop packing.
+  void setRecordPacker(const void* component, const ComponentLayout* layout, char* out);
+
+  /// True if the component given to setRecordPacker serialized exactly the
+  /// fields of the layout, at the layout's offsets.
+  bool isPackComplete() const;
+
   /// Constructs a header containing the real types of elements.
   Tny* getTypeHeader();
 
@@ -111,6 +195,15 @@ public:
   /// serialization class.
   CPM_ES_NS::ESCoreBase& getCore()  {return mCore;}
 
+  /// Retrieves the allocator of the core responsible for this serialization.
+  /// Components that allocate while deserializing (see
+  /// CST_detail::inBinaryAlloc) should allocate from here.
+  CerealAllocator& getAllocator()   {return mAllocator;}
+
+  /// Returns the allocator installed on \p core if it is a CerealCore,
+  /// otherwise the default allocator.
+  static CerealAllocator& getCoreAllocator(CPM_ES_NS::ESCoreBase& core);
+
   // A header doesn't need to be built for the components. It's just for
   // determining explicit type is being serialized remotely. Later, it could
   // be used for speeding up deserialization alongside component header that
@@ -130,28 +223,143 @@ public:
                                   ///< Tny doesn't contain many basic types.
   };
 
+  /// List of header items. Storage comes from the core's allocator.
+  typedef std::vector<HeaderItem, CerealStlAllocator<HeaderItem>> HeaderList;
+
 private:
 
+  void recordEntityField(const uint64_t* field);
+  void packField(const char* name, const void* field, size_t size);
+
+  /// Adds \p name to the type header if it is not already present.
+  void addHeaderItem(const char* name, const char* typeName)
+  {
+    ++mLastIndex;
+
+    // Check mLastIndex (if it exists), and see if it has same name
+    // as the object we are trying to serialize.
+    bool searchForName = true;
+    if (mLastIndex < mHeader.size())
+    {
+      if (mHeader[mLastIndex].name == name)
+      {
+        searchForName = false;
+      }
+    }
+
+    if (searchForName)
+    {
+      bool foundName = false;
+      for (HeaderItem& item : mHeader)
+      {
+        if (item.name == name)
+        {
+          foundName = true;
+          break;
+        }
+      }
+
+      if (!foundName)
+      {
+        // Add the name to header.
+        mHeader.push_back(HeaderItem(name, typeName));
+      }
+    }
+  }
+
   int                     mLastIndex;     ///< Last memoized index inside mHeader.
-  std::vector<HeaderItem> mHeader;        ///< Deserialize header.
+  CerealAllocator&        mAllocator;     ///< Allocator of the owning core.
+  HeaderList              mHeader;        ///< Deserialize header.
 
   bool                    mDeserializing; ///< True if we are serializing into variables.
   Tny*                    mTnyRoot;       ///< When serializing in, this is the source.
+  EntityRemap*            mRemap;         ///< Remap for deserialized entity IDs.
+  const char*             mRecordBase;    ///< Component used to compute offsets.
+  size_t                  mRecordSize;    ///< Size of mRecordBase's component.
+  std::vector<size_t>*    mEntityFieldOffsets;  ///< Recorded entity ID field offsets.
+  ComponentLayout*        mLayout;        ///< Recorded component layout.
+  const void*             mLayoutBase;    ///< Component mLayout is recorded from.
+  size_t                  mLayoutSize;    ///< Size of mLayoutBase's component.
+  const ComponentLayout*  mPackLayout;    ///< Layout of mPackOut's record.
+  const char*             mPackBase;      ///< Component being packed.
+  char*                   mPackOut;       ///< Packed record being written.
+  std::vector<char>       mPackWritten;   ///< Per layout field, set once packed.
+  size_t                  mPackNumWritten;
+  bool                    mPackMismatch;  ///< A field differed from the layout.
+  bool                    mRecordOnly;    ///< See setRecordOnly.
 
   CPM_ES_NS::ESCoreBase&  mCore;          ///< ESCore.
 };
 
 /// Interface defining what a ComponentHeap must implement in order to properly
 /// serialize the component system.
+///
+/// Only serialize, serializeEntity, deserializeMerge, deserializeCreate
+/// (without a remap) and getComponentName must be implemented. Every other
+/// function has a default implementation built on those, working on the
+/// serialized Tny heaps. CerealHeap overrides all of them with faster
+/// versions working on the component array.
 class ComponentSerializeInterface
 {
 public:
   virtual Tny* serialize(CPM_ES_NS::ESCoreBase& core) = 0;
   virtual Tny* serializeEntity(CPM_ES_NS::ESCoreBase& core, uint64_t entity) = 0;
+  /// Tny dump of serializeEntity's output, allocated from the core's
+  /// allocator. Returns an empty buffer if \p entity has no components in
+  /// this heap.
+  virtual CerealBuffer dumpEntity(CPM_ES_NS::ESCoreBase& core, uint64_t entity);
+  /// Serializes the components of the \p count entities in \p entityIDs
+  /// (sorted, without duplicates) into one heap. Returns NULL if none of
+  /// them have components in this heap. By default the records of those
+  /// entities are picked out of serialize's output.
+  virtual Tny* serializeEntities(CPM_ES_NS::ESCoreBase& core, const uint64_t* entityIDs,
+                                 size_t count);
+  /// Queues the components of the \p count entities in \p entityIDs
+  /// (sorted, without duplicates) for removal, as removeSequence would for
+  /// each. Returns false if the heap doesn't support batch removal, in
+  /// which case the caller removes the entities one at a time.
+  virtual bool removeEntities(CPM_ES_NS::ESCoreBase& /* core */, const uint64_t* /* entityIDs */,
+                              size_t /* count */) {return false;}
   virtual void deserializeMerge(CPM_ES_NS::ESCoreBase& core, Tny* root, bool copyExisting) = 0;
   virtual void deserializeCreate(CPM_ES_NS::ESCoreBase& core, Tny* root) = 0;
+  /// deserializeCreate with every entity ID (owners, and fields tagged
+  /// ComponentSerialize::ENTITY_TYPE_NAME in the type header) translated
+  /// through \p remap. By default a translated copy of \p root is created.
+  virtual void deserializeCreate(CPM_ES_NS::ESCoreBase& core, Tny* root, EntityRemap* remap);
+  /// Decodes \p root for CerealPrefab. By default the prefab holds a copy of
+  /// \p root and instantiates it with deserializeCreate.
+  virtual std::unique_ptr<PrefabHeapInterface> decodePrefab(CPM_ES_NS::ESCoreBase& core, Tny* root);
+  /// Translates every entity ID field (see ComponentSerialize::serializeEntityID)
+  /// of every component through \p table. Owning entity IDs are unchanged.
+  /// By default a translated copy of serialize's output is merged back with
+  /// deserializeMerge, so the change is applied by the next renormalize.
+  virtual void remapEntityReferences(CPM_ES_NS::ESCoreBase& core, const EntityIDTable& table);
   virtual bool isSerializable() {return true;}
 
+  /// Changes whenever the contents of the heap may have changed. Heaps that
+  /// do not track changes return 0, and are never assumed to be unchanged.
+  virtual uint64_t getGeneration() {return 0;}
+
+  /// Layout of the component's serialized fields. See ComponentLayout.
+  /// Invalid by default, so only TnyWireBackend encodes the heap.
+  virtual const ComponentLayout& getLayout(CPM_ES_NS::ESCoreBase& core);
+
+  /// Appends a record per component to \p records: a little endian uint64_t
+  /// entity ID directly followed by a packed record of getLayout, written
+  /// by the component's serialize function. Components whose serialize
+  /// function returns false are skipped. Throws std::runtime_error if a
+  /// component serializes fields that differ from the layout. Returns the
+  /// number of records appended. Throws by default: must be implemented
+  /// along with getLayout.
+  virtual size_t packComponents(CPM_ES_NS::ESCoreBase& core, std::vector<char>& records);
+
+  /// Adds \p count components. Each of the records (\p stride bytes apart)
+  /// holds a little endian uint64_t entity ID directly followed by a packed
+  /// record of getLayout. Renormalization is required after calling.
+  /// Throws by default: must be implemented along with getLayout.
+  virtual void createFromPacked(CPM_ES_NS::ESCoreBase& core, const char* records,
+                                size_t count, size_t stride);
+
   virtual const char* getComponentName() = 0;
 };
 
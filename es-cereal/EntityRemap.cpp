@@ -0,0 +1,199 @@
+
+#include <entity-system/ESCoreBase.hpp>
+
+#include "EntityRemap.hpp"
+
+namespace CPM_ES_CEREAL_NS {
+
+EntityIDTable::EntityIDTable() :
+    mMask(0),
+    mSize(0),
+    mHasEmptyKey(false),
+    mEmptyKeyValue(0)
+{
+}
+
+void EntityIDTable::reserve(size_t numEntries)
+{
+  // Keep the load factor at or below one half.
+  size_t numSlots = 16;
+  while (numSlots < numEntries * 2)
+    numSlots *= 2;
+
+  if (numSlots > mSlots.size())
+    rehash(numSlots);
+}
+
+void EntityIDTable::rehash(size_t numSlots)
+{
+  std::vector<Slot> oldSlots;
+  oldSlots.swap(mSlots);
+
+  Slot empty = {EMPTY_KEY, 0};
+  mSlots.assign(numSlots, empty);
+  mMask = numSlots - 1;
+  mSize = 0;
+
+  for (const Slot& slot : oldSlots)
+  {
+    if (slot.key != EMPTY_KEY)
+      insert(slot.key, slot.value);
+  }
+}
+
+void EntityIDTable::insert(uint64_t from, uint64_t to)
+{
+  if (from == EMPTY_KEY)
+  {
+    mHasEmptyKey = true;
+    mEmptyKeyValue = to;
+    return;
+  }
+
+  if ((mSize + 1) * 2 > mSlots.size())
+    rehash(mSlots.empty() ? 16 : mSlots.size() * 2);
+
+  size_t index = hash(from) & mMask;
+  for (;;)
+  {
+    Slot& slot = mSlots[index];
+    if (slot.key == from)
+    {
+      slot.value = to;
+      return;
+    }
+    if (slot.key == EMPTY_KEY)
+    {
+      slot.key = from;
+      slot.value = to;
+      ++mSize;
+      return;
+    }
+    index = (index + 1) & mMask;
+  }
+}
+
+bool EntityIDTable::find(uint64_t from, uint64_t& to) const
+{
+  if (from == EMPTY_KEY)
+  {
+    if (mHasEmptyKey) to = mEmptyKeyValue;
+    return mHasEmptyKey;
+  }
+
+  if (mSize == 0)
+    return false;
+
+  size_t index = hash(from) & mMask;
+  for (;;)
+  {
+    const Slot& slot = mSlots[index];
+    if (slot.key == from)
+    {
+      to = slot.value;
+      return true;
+    }
+    if (slot.key == EMPTY_KEY)
+      return false;
+    index = (index + 1) & mMask;
+  }
+}
+
+void EntityIDTable::translate(uint64_t* ids, size_t count) const
+{
+  for (size_t i = 0; i < count; ++i)
+    ids[i] = translate(ids[i]);
+}
+
+void EntityIDTable::translateFields(void* base, size_t count, size_t stride,
+                                    const size_t* fieldOffsets, size_t numOffsets) const
+{
+  if (empty() || numOffsets == 0)
+    return;
+
+  char* record = static_cast<char*>(base);
+  for (size_t i = 0; i < count; ++i, record += stride)
+  {
+    for (size_t f = 0; f < numOffsets; ++f)
+    {
+      uint64_t* field = reinterpret_cast<uint64_t*>(record + fieldOffsets[f]);
+      *field = translate(*field);
+    }
+  }
+}
+
+void EntityIDTable::clear()
+{
+  mSlots.clear();
+  mMask = 0;
+  mSize = 0;
+  mHasEmptyKey = false;
+  mEmptyKeyValue = 0;
+}
+
+EntityRemap::EntityRemap() :
+    mCore(nullptr),
+    mHaveEntities(false)
+{
+}
+
+EntityRemap::EntityRemap(RemapFunction function) :
+    mFunction(function),
+    mCore(nullptr),
+    mHaveEntities(false)
+{
+}
+
+EntityRemap::EntityRemap(CPM_ES_NS::ESCoreBase& core) :
+    mCore(&core),
+    mHaveEntities(false)
+{
+}
+
+void EntityRemap::addMapping(uint64_t from, uint64_t to)
+{
+  mMappings.insert(from, to);
+}
+
+void EntityRemap::addEntity(uint64_t entityID)
+{
+  if (mCore == nullptr || entityID == 0)
+    return;
+
+  mHaveEntities = true;
+  uint64_t mapped = 0;
+  if (!mMappings.find(entityID, mapped))
+    mMappings.insert(entityID, mCore->getNewEntityID());
+}
+
+uint64_t EntityRemap::remap(uint64_t entityID)
+{
+  if (entityID == 0)
+    return 0;
+
+  uint64_t mapped = 0;
+  if (mMappings.find(entityID, mapped))
+    return mapped;
+
+  if (mFunction)
+    return mFunction(entityID);
+
+  // Declared entities were mapped above; anything else lives outside of
+  // the data being created.
+  if (mCore != nullptr && !mHaveEntities)
+  {
+    uint64_t newID = mCore->getNewEntityID();
+    mMappings.insert(entityID, newID);
+    return newID;
+  }
+
+  return entityID;
+}
+
+void EntityRemap::clear()
+{
+  mMappings.clear();
+  mHaveEntities = false;
+}
+
+} // namespace CPM_ES_CEREAL_NS
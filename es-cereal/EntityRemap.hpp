@@ -0,0 +1,150 @@
+#ifndef IAUNS_ENTITYREMAP_HPP
+#define IAUNS_ENTITYREMAP_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace CPM_ES_NS {
+class ESCoreBase;
+}
+
+namespace CPM_ES_CEREAL_NS {
+
+/// Flat, open addressed hash table mapping old entity IDs to new entity IDs.
+/// Used by entity reference fixup passes where millions of lookups are made
+/// in a row: all entries live in one contiguous array of (key, value) slots
+/// with linear probing, so a lookup is a multiply, a mask and (usually) a
+/// single cache line.
+class EntityIDTable
+{
+public:
+  EntityIDTable();
+
+  /// Ensures \p numEntries can be inserted without rehashing.
+  void reserve(size_t numEntries);
+
+  /// Maps \p from to \p to, replacing any existing mapping.
+  void insert(uint64_t from, uint64_t to);
+
+  /// Retrieves the mapping for \p from. Returns false if there is none.
+  bool find(uint64_t from, uint64_t& to) const;
+
+  /// Returns the mapping for \p id, or \p id itself if it is not mapped.
+  uint64_t translate(uint64_t id) const
+  {
+    if (id == EMPTY_KEY)
+      return mHasEmptyKey ? mEmptyKeyValue : id;
+    if (mSize == 0)
+      return id;
+
+    size_t index = hash(id) & mMask;
+    for (;;)
+    {
+      const Slot& slot = mSlots[index];
+      if (slot.key == id)         return slot.value;
+      if (slot.key == EMPTY_KEY)  return id;
+      index = (index + 1) & mMask;
+    }
+  }
+
+  /// Translates \p count IDs in place.
+  void translate(uint64_t* ids, size_t count) const;
+
+  /// Translates, in place, the uint64_t fields found at each of
+  /// \p fieldOffsets within \p count records spaced \p stride bytes apart
+  /// starting at \p base. This is the sweep used to fix up entity references
+  /// across an entire component array.
+  void translateFields(void* base, size_t count, size_t stride,
+                       const size_t* fieldOffsets, size_t numOffsets) const;
+
+  /// Number of mappings.
+  size_t size() const   {return mSize + (mHasEmptyKey ? 1 : 0);}
+  bool empty() const    {return size() == 0;}
+
+  /// Removes all mappings.
+  void clear();
+
+private:
+  struct Slot
+  {
+    uint64_t key;
+    uint64_t value;
+  };
+
+  static const uint64_t EMPTY_KEY = ~static_cast<uint64_t>(0);
+
+  static size_t hash(uint64_t id)
+  {
+    // Finalizer from MurmurHash3. Entity IDs are usually sequential, this
+    // spreads them across the table.
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return static_cast<size_t>(id);
+  }
+
+  void rehash(size_t numSlots);
+
+  std::vector<Slot> mSlots;         ///< Power of two number of slots.
+  size_t            mMask;          ///< mSlots.size() - 1.
+  size_t            mSize;          ///< Occupied slots.
+  bool              mHasEmptyKey;   ///< True if EMPTY_KEY itself is mapped.
+  uint64_t          mEmptyKeyValue; ///< Mapping for EMPTY_KEY.
+};
+
+/// Translates entity IDs found in serialized data into the entity IDs that
+/// should be used when creating components. Used to instantiate the same
+/// serialized entities (prefabs) many times with fresh IDs. Lookups are
+/// performed in the following order: explicit mappings added with
+/// addMapping, then the remap function (if any), then fresh IDs from the
+/// core (if constructed with one). If none apply the ID is unchanged.
+/// 0 is the null entity reference and is never remapped.
+class EntityRemap
+{
+public:
+  typedef std::function<uint64_t(uint64_t)> RemapFunction;
+
+  /// Identity remap. Add mappings with addMapping.
+  EntityRemap();
+
+  /// Remaps every ID through \p function.
+  explicit EntityRemap(RemapFunction function);
+
+  /// Every distinct source ID is given a fresh ID from \p core the first
+  /// time it is seen. Subsequent references to the same source ID (other
+  /// components, entity ID fields) resolve to the same fresh ID. Once
+  /// entities are declared with addEntity, only those are given fresh IDs;
+  /// references to any other entity are left unchanged.
+  explicit EntityRemap(CPM_ES_NS::ESCoreBase& core);
+
+  /// Explicitly maps \p from to \p to.
+  void addMapping(uint64_t from, uint64_t to);
+
+  /// Declares \p entityID as one of the entities being created (see the
+  /// core constructor), giving it a fresh ID if it has none yet. Has no
+  /// effect on remaps without a core. CerealCore::deserializeComponentCreate
+  /// declares every entity owning a component before decoding.
+  void addEntity(uint64_t entityID);
+
+  /// Returns the ID that \p entityID maps to.
+  uint64_t remap(uint64_t entityID);
+
+  /// Forgets all mappings and declared entities. Use between instantiations
+  /// of a prefab when this remap hands out fresh IDs.
+  void clear();
+
+  /// Retrieves all mappings resolved or added so far.
+  const EntityIDTable& getMappings() const {return mMappings;}
+
+private:
+  EntityIDTable                           mMappings;  ///< Source ID -> new ID.
+  RemapFunction                           mFunction;  ///< Optional remap function.
+  CPM_ES_NS::ESCoreBase*                  mCore;      ///< Source of fresh IDs.
+  bool                                    mHaveEntities;  ///< addEntity was called.
+};
+
+} // namespace CPM_ES_CEREAL_NS
+
+#endif
@@ -0,0 +1,138 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+// Allocator that tracks the number of outstanding allocations and bytes.
+class CountingAllocator : public cereal::CerealAllocator
+{
+public:
+  CountingAllocator() :
+      numAllocations(0), outstanding(0), outstandingBytes(0),
+      lastAllocation(nullptr), lastSize(0)
+  {}
+
+  void* allocate(size_t size) override
+  {
+    ++numAllocations;
+    ++outstanding;
+    outstandingBytes += size;
+    lastAllocation = std::malloc(size);
+    lastSize = size;
+    return lastAllocation;
+  }
+
+  void deallocate(void* ptr, size_t size) override
+  {
+    --outstanding;
+    outstandingBytes -= size;
+    std::free(ptr);
+  }
+
+  int     numAllocations;
+  int     outstanding;
+  int64_t outstandingBytes;
+  void*   lastAllocation;
+  size_t  lastSize;
+};
+
+struct CompName
+{
+  CompName() {}
+  CompName(const std::string& nameIn, int32_t levelIn) : name(nameIn), level(levelIn) {}
+
+  std::string name;
+  int32_t     level;
+
+  static const char* getName() {return "game:CompName";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("name", name);
+    s.serialize("level", level);
+    return true;
+  }
+};
+
+TEST(EntitySystem, CustomAllocator)
+{
+  CountingAllocator allocator;
+  {
+    std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+    core->setAllocator(allocator);
+    EXPECT_EQ(&allocator, &core->getAllocator());
+
+    core->registerComponent<CompName>();
+    EXPECT_LT(0, allocator.outstanding);
+
+    uint64_t idA = core->getNewEntityID();
+    uint64_t idB = core->getNewEntityID();
+    core->addComponent(idA, CompName("alpha", 3));
+    core->addComponent(idB, CompName("beta", 7));
+    core->renormalize(true);
+
+    Tny* root = core->serializeAllComponents();
+
+    int allocationsBefore = allocator.numAllocations;
+    core->clearAllComponentContainersImmediately();
+    core->deserializeComponentCreate(root);
+    core->renormalize(true);
+    EXPECT_LT(allocationsBefore, allocator.numAllocations);
+
+    cereal::CerealHeap<CompName>* heap = core->getOrCreateComponentContainer<CompName>();
+    ASSERT_EQ(2, heap->getNumComponents());
+    EXPECT_EQ(std::string("alpha"), heap->getComponentArray()[0].component.name);
+    EXPECT_EQ(std::string("beta"), heap->getComponentArray()[1].component.name);
+    EXPECT_EQ(std::string("string"), heap->getTypeOfElement("name"));
+
+    // Allocator aware binary retrieval.
+    Tny* dict = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+    dict = cereal::CST_detail::outString(dict, "blob", "payload");
+    void* data = nullptr;
+    size_t size = 0;
+    int outstandingBefore = allocator.outstanding;
+    ASSERT_TRUE(cereal::CST_detail::inBinaryAlloc(dict->root, "blob", allocator, &data, &size));
+    EXPECT_EQ(8, size);
+    EXPECT_EQ(std::string("payload"), static_cast<const char*>(data));
+    EXPECT_EQ(outstandingBefore + 1, allocator.outstanding);
+    allocator.deallocate(data, size);
+    Tny_free(dict);
+
+    // Dumps obtained through an allocator are owned by that allocator.
+    void* dump = nullptr;
+    size_t dumpSize = 0;
+    outstandingBefore = allocator.outstanding;
+    std::tie(dump, dumpSize) = cereal::CerealCore::dumpTny(root, allocator);
+    ASSERT_NE(nullptr, dump);
+    EXPECT_EQ(outstandingBefore + 1, allocator.outstanding);
+    // The returned memory is the allocator's, sized exactly.
+    EXPECT_EQ(allocator.lastAllocation, dump);
+    EXPECT_EQ(allocator.lastSize, dumpSize);
+
+    void* tnyDump = nullptr;
+    size_t tnyDumpSize = 0;
+    std::tie(tnyDump, tnyDumpSize) = cereal::CerealCore::dumpTny(root);
+    ASSERT_EQ(tnyDumpSize, dumpSize);
+    EXPECT_EQ(0, std::memcmp(tnyDump, dump, dumpSize));
+    cereal::CerealCore::freeTnyDataPtr(tnyDump);
+    Tny* loaded = cereal::CerealCore::loadTny(dump, dumpSize);
+    ASSERT_NE(nullptr, loaded);
+    allocator.deallocate(dump, dumpSize);
+
+    Tny_free(loaded);
+    Tny_free(root);
+  }
+
+  EXPECT_EQ(0, allocator.outstanding);
+  EXPECT_EQ(0, allocator.outstandingBytes);
+}
+
+}
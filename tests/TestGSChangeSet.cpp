@@ -0,0 +1,124 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <es-cereal/CerealChangeSet.hpp>
+#include <gtest/gtest.h>
+#include <memory>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "changes:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompHealth
+{
+  CompHealth() : health(0) {}
+  CompHealth(int32_t healthIn) : health(healthIn) {}
+
+  int32_t health;
+
+  static const char* getName() {return "changes:CompHealth";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    return true;
+  }
+};
+
+void populate(cereal::CerealCore& core, int32_t numEntities)
+{
+  core.registerComponent<CompPosition>();
+  core.registerComponent<CompHealth>();
+  for (int32_t i = 1; i <= numEntities; ++i)
+  {
+    core.addComponent(i, CompPosition(i, -i));
+    core.addComponent(i, CompHealth(i));
+    core.addComponent(i, CompHealth(i * 2));
+  }
+  core.renormalize(true);
+}
+
+TEST(EntitySystem, ChangeSetBuilder)
+{
+  const int32_t numEntities = 5000;
+  cereal::CerealCore source;
+  cereal::CerealCore target;
+  populate(source, 0);
+  populate(target, numEntities);
+
+  // One edit per entity, added in reverse order, plus edits to the second
+  // health component of a few entities.
+  cereal::ChangeSetBuilder changes(source);
+  for (int32_t i = numEntities; i >= 1; --i)
+  {
+    CompPosition position(i * 10, i * 20);
+    changes.add(position, i);
+  }
+  for (int32_t i = 1; i <= numEntities; i += 1000)
+  {
+    CompHealth health(-i);
+    changes.add(health, i, 1);
+  }
+  EXPECT_EQ(numEntities + 5, changes.getNumChanges());
+
+  Tny* root = changes.build();
+  EXPECT_TRUE(changes.empty());
+  ASSERT_NE(nullptr, root);
+
+  // One heap per component type, each with a single type header.
+  EXPECT_EQ(2, root->size);
+  Tny* positions = Tny_get(root, "changes:CompPosition");
+  ASSERT_NE(nullptr, positions);
+  Tny* header = Tny_next(positions->value.tny);
+  EXPECT_EQ(2, header->value.tny->size);
+  Tny* records = Tny_next(header)->value.tny;
+  EXPECT_EQ(numEntities * 2, records->size);
+  EXPECT_EQ(1, Tny_next(records)->value.num);
+
+  target.deserializeComponentMerge(root, false);
+  target.renormalize(true);
+  Tny_free(root);
+
+  cereal::CerealHeap<CompPosition>* positionHeap = target.getOrCreateComponentContainer<CompPosition>();
+  cereal::CerealHeap<CompHealth>* healthHeap = target.getOrCreateComponentContainer<CompHealth>();
+  for (int32_t i = 1; i <= numEntities; ++i)
+  {
+    ASSERT_EQ(i * 10, positionHeap->getComponentArray()[i - 1].component.x);
+    ASSERT_EQ(i * 20, positionHeap->getComponentArray()[i - 1].component.y);
+  }
+  EXPECT_EQ(1001, healthHeap->getComponentArray()[2000].component.health);
+  EXPECT_EQ(-1001, healthHeap->getComponentArray()[2001].component.health);
+  EXPECT_EQ(2004, healthHeap->getComponentArray()[2003].component.health);
+
+  // Builders are reusable, and an empty change set is a valid document.
+  root = changes.build();
+  EXPECT_EQ(0, root->size);
+  target.deserializeComponentMerge(root, false);
+  Tny_free(root);
+
+  CompHealth health(7);
+  changes.add(health, 3);
+  changes.clear();
+  EXPECT_TRUE(changes.empty());
+}
+
+}
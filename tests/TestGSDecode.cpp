@@ -0,0 +1,207 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <es-cereal/CerealDecode.hpp>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompName
+{
+  CompName() {}
+  CompName(const std::string& nameIn) : name(nameIn) {}
+
+  std::string name;
+
+  static const char* getName() {return "decode:CompName";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("name", name);
+    return true;
+  }
+};
+
+struct CompValue
+{
+  CompValue() : value(0) {}
+  CompValue(int32_t valueIn) : value(valueIn) {}
+
+  int32_t value;
+
+  static const char* getName() {return "decode:CompValue";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("value", value);
+    return true;
+  }
+};
+
+cereal::CerealDecodeResult decode(Tny* root, const cereal::CerealDecodeLimits& limits)
+{
+  cereal::CerealBuffer buffer = cereal::CerealCore::dumpTnyShared(root);
+  cereal::CerealDecodeResult result = cereal::DECODE_OK;
+  Tny* loaded = cereal::loadTnyChecked(buffer.data(), buffer.size(), limits, &result);
+  EXPECT_EQ(result == cereal::DECODE_OK, loaded != nullptr);
+  if (loaded != nullptr)
+    Tny_free(loaded);
+  return result;
+}
+
+TEST(EntitySystem, HardenedDecode)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompName>();
+  core->registerComponent<CompValue>();
+  for (uint64_t i = 1; i <= 100; ++i)
+  {
+    core->addComponent(i, CompName(std::string(static_cast<size_t>(i), 'a')));
+    core->addComponent(i, CompValue(static_cast<int32_t>(i)));
+  }
+  core->renormalize(true);
+
+  Tny* root = core->serializeAllComponents();
+
+  cereal::CerealDecodeLimits limits;
+  EXPECT_EQ(cereal::DECODE_OK, decode(root, limits));
+
+  cereal::CerealDecodeLimits tight = limits;
+  tight.maxBytes = 64;
+  EXPECT_EQ(cereal::DECODE_TOO_LARGE, decode(root, tight));
+
+  tight = limits;
+  tight.maxNodes = 100;
+  EXPECT_EQ(cereal::DECODE_TOO_MANY_NODES, decode(root, tight));
+
+  tight = limits;
+  tight.maxDepth = 2;
+  EXPECT_EQ(cereal::DECODE_TOO_DEEP, decode(root, tight));
+
+  tight = limits;
+  tight.maxBlobSize = 50;
+  EXPECT_EQ(cereal::DECODE_BLOB_TOO_LARGE, decode(root, tight));
+
+  tight = limits;
+  tight.maxHeaps = 1;
+  EXPECT_EQ(cereal::DECODE_TOO_MANY_HEAPS, decode(root, tight));
+
+  tight = limits;
+  tight.maxComponentsPerHeap = 99;
+  EXPECT_EQ(cereal::DECODE_TOO_MANY_COMPONENTS, decode(root, tight));
+
+  Tny_free(root);
+
+  // Well formed Tny that isn't a set of serialized heaps.
+  Tny* bogus = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  int32_t number = 7;
+  bogus = Tny_add(bogus, TNY_INT32, const_cast<char*>("decode:CompValue"), &number, 0);
+  EXPECT_EQ(cereal::DECODE_MALFORMED, decode(bogus->root, limits));
+  Tny_free(bogus->root);
+
+  // Parallel validation of snapshot slices.
+  cereal::CerealSnapshot snapshot = core->dumpSnapshot();
+  EXPECT_EQ(cereal::DECODE_OK, snapshot.validate(limits, 4));
+  EXPECT_EQ(cereal::DECODE_OK, snapshot.validate(limits));
+  tight = limits;
+  tight.maxBlobSize = 50;
+  EXPECT_EQ(cereal::DECODE_BLOB_TOO_LARGE, snapshot.validate(tight, 4));
+  tight = limits;
+  tight.maxBytes = 128;
+  EXPECT_EQ(cereal::DECODE_TOO_LARGE, snapshot.validate(tight, 4));
+
+  // Nodes are counted across slices: each slice fits in maxNodes, the
+  // snapshot does not.
+  size_t sliceNodes[2] = {0, 0};
+  for (size_t i = 0; i < 2; ++i)
+  {
+    Tny* slice = cereal::loadTnyChecked(snapshot.getHeap(i).data(), snapshot.getHeap(i).size(), limits);
+    ASSERT_NE(nullptr, slice);
+    EXPECT_EQ(cereal::DECODE_OK, cereal::decode_detail::checkTree(slice, limits, sliceNodes[i]));
+    Tny_free(slice);
+  }
+  tight = limits;
+  tight.maxNodes = sliceNodes[0] + sliceNodes[1];
+  EXPECT_EQ(cereal::DECODE_OK, snapshot.validate(tight, 4));
+  tight.maxNodes = std::max(sliceNodes[0], sliceNodes[1]);
+  EXPECT_EQ(cereal::DECODE_TOO_MANY_NODES, snapshot.validate(tight));
+  EXPECT_EQ(cereal::DECODE_TOO_MANY_NODES, snapshot.validate(tight, 4));
+}
+
+std::vector<char> dump(Tny* root)
+{
+  cereal::CerealBuffer buffer = cereal::CerealCore::dumpTnyShared(root);
+  const char* bytes = static_cast<const char*>(buffer.data());
+  return std::vector<char>(bytes, bytes + buffer.size());
+}
+
+cereal::CerealDecodeResult decodeBytes(const std::vector<char>& bytes,
+                                       const cereal::CerealDecodeLimits& limits)
+{
+  cereal::CerealDecodeResult result = cereal::DECODE_OK;
+  Tny* loaded = cereal::loadTnyChecked(&bytes[0], bytes.size(), limits, &result);
+  EXPECT_EQ(nullptr, loaded);
+  if (loaded != nullptr)
+    Tny_free(loaded);
+  return result;
+}
+
+TEST(EntitySystem, DecodeScansBeforeParsing)
+{
+  cereal::CerealDecodeLimits limits;
+
+  // A document nested far deeper than any stack could recurse. Nesting one
+  // more level prepends the same bytes, so they are repeated.
+  Tny* inner = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+  Tny* outer = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+  Tny_add(outer, TNY_OBJ, NULL, inner, 0);
+  std::vector<char> innerBytes = dump(inner);
+  std::vector<char> outerBytes = dump(outer);
+  Tny_free(inner);
+  Tny_free(outer);
+  ASSERT_GT(outerBytes.size(), innerBytes.size());
+  ASSERT_TRUE(std::equal(innerBytes.begin(), innerBytes.end(),
+                         outerBytes.end() - innerBytes.size()));
+  std::vector<char> prefix(outerBytes.begin(), outerBytes.end() - innerBytes.size());
+
+  std::vector<char> deep;
+  for (int i = 0; i < 1000000; ++i)
+    deep.insert(deep.end(), prefix.begin(), prefix.end());
+  deep.insert(deep.end(), innerBytes.begin(), innerBytes.end());
+  cereal::CerealDecodeLimits large = limits;
+  large.maxBytes = deep.size();
+  EXPECT_EQ(cereal::DECODE_TOO_DEEP, decodeBytes(deep, large));
+
+  // A blob whose declared size is far larger than the input.
+  std::vector<char> blob(1024 * 1024, 'b');
+  Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  Tny_add(root, TNY_BIN, const_cast<char*>("blob"), &blob[0], blob.size());
+  std::vector<char> truncated = dump(root);
+  Tny_free(root);
+  truncated.resize(64);
+  cereal::CerealDecodeLimits tight = limits;
+  tight.maxBlobSize = 1024;
+  EXPECT_EQ(cereal::DECODE_BLOB_TOO_LARGE, decodeBytes(truncated, tight));
+  EXPECT_EQ(cereal::DECODE_MALFORMED, decodeBytes(truncated, limits));
+
+  // A container declaring more elements than the input could hold.
+  root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  Tny* cur = root;
+  for (int32_t i = 0; i < 1000; ++i)
+    cur = Tny_add(cur, TNY_INT32, const_cast<char*>("n"), &i, 0);
+  truncated = dump(root);
+  Tny_free(root);
+  truncated.resize(32);
+  tight = limits;
+  tight.maxHeaps = 100000;
+  EXPECT_EQ(cereal::DECODE_MALFORMED, decodeBytes(truncated, tight));
+}
+
+}
@@ -0,0 +1,200 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <cstring>
+#include <memory>
+#include <string>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+int gNumSerializeCalls = 0;
+
+struct CompCosmetic
+{
+  CompCosmetic() : hat(0), color(0) {}
+  CompCosmetic(int32_t hatIn, int32_t colorIn) : hat(hatIn), color(colorIn) {}
+
+  int32_t hat;
+  int32_t color;
+
+  static const char* getName() {return "cache:CompCosmetic";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    if (!s.isDeserializing()) ++gNumSerializeCalls;
+    s.serialize("hat", hat);
+    s.serialize("color", color);
+    return true;
+  }
+};
+
+struct CompNickname
+{
+  CompNickname() {}
+  CompNickname(const std::string& nameIn) : name(nameIn) {}
+
+  std::string name;
+
+  static const char* getName() {return "cache:CompNickname";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    if (!s.isDeserializing()) ++gNumSerializeCalls;
+    s.serialize("name", name);
+    return true;
+  }
+};
+
+std::string dumpEntity(cereal::CerealCore& core, uint64_t entityID)
+{
+  Tny* root = core.serializeEntity(entityID);
+  void* data = NULL;
+  size_t size = Tny_dumps(root, &data);
+  std::string bytes(static_cast<const char*>(data), size);
+  free(data);
+  Tny_free(root);
+  return bytes;
+}
+
+TEST(EntitySystem, EncodedEntityCache)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompCosmetic>();
+  for (int32_t i = 1; i <= 5; ++i)
+    core->addComponent(i, CompCosmetic(i, i * 10));
+  core->renormalize(true);
+
+  cereal::CerealHeap<CompCosmetic>* heap = core->getOrCreateComponentContainer<CompCosmetic>();
+  std::string uncached = dumpEntity(*core, 2);
+
+  heap->setCacheEncodedEntities(true);
+  gNumSerializeCalls = 0;
+  EXPECT_EQ(uncached, dumpEntity(*core, 2));
+  EXPECT_EQ(uncached, dumpEntity(*core, 2));
+  EXPECT_EQ(uncached, dumpEntity(*core, 2));
+  EXPECT_EQ(1, gNumSerializeCalls);
+  EXPECT_EQ(1, heap->getNumEncodedEntities());
+
+  // Merging into the entity invalidates it, even if it is serialized again
+  // before the merge is applied.
+  {
+    cereal::CerealCore other;
+    other.registerComponent<CompCosmetic>();
+    other.addComponent(2, CompCosmetic(7, 70));
+    other.renormalize(true);
+    Tny* delta = other.serializeAllComponents();
+    core->deserializeComponentMerge(delta, false);
+    Tny_free(delta);
+  }
+  dumpEntity(*core, 2);
+  core->renormalize(true);
+  gNumSerializeCalls = 0;
+  std::string merged = dumpEntity(*core, 2);
+  EXPECT_EQ(1, gNumSerializeCalls);
+  EXPECT_NE(uncached, merged);
+  heap->setCacheEncodedEntities(false);
+  EXPECT_EQ(merged, dumpEntity(*core, 2));
+  heap->setCacheEncodedEntities(true);
+
+  // Other entities are unaffected by changes to entity 2.
+  dumpEntity(*core, 3);
+  core->addComponent(2, CompCosmetic(8, 80));
+  core->renormalize(true);
+  gNumSerializeCalls = 0;
+  dumpEntity(*core, 3);
+  EXPECT_EQ(0, gNumSerializeCalls);
+  dumpEntity(*core, 2);
+  EXPECT_EQ(2, gNumSerializeCalls);
+
+  // Direct writes must be flagged.
+  heap->getComponentArray()[3].component.hat = 99;  // Entity 3.
+  heap->markModified(3);
+  gNumSerializeCalls = 0;
+  std::string written = dumpEntity(*core, 3);
+  EXPECT_EQ(1, gNumSerializeCalls);
+  heap->setCacheEncodedEntities(false);
+  EXPECT_EQ(written, dumpEntity(*core, 3));
+  heap->setCacheEncodedEntities(true);
+
+  // Removed entities are dropped from the cache.
+  dumpEntity(*core, 3);
+  EXPECT_EQ(1, heap->getNumEncodedEntities());
+  core->removeEntity(3);
+  core->renormalize(true);
+  EXPECT_EQ(0, heap->getNumEncodedEntities());
+
+  core->clearAllComponentContainersImmediately();
+  EXPECT_EQ(0, heap->getNumEncodedEntities());
+}
+
+TEST(EntitySystem, EncodedEntityDump)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompCosmetic>();
+  for (int32_t i = 1; i <= 5; ++i)
+    core->addComponent(i, CompCosmetic(i, i * 10));
+  core->renormalize(true);
+
+  cereal::CerealHeap<CompCosmetic>* heap = core->getOrCreateComponentContainer<CompCosmetic>();
+  std::string expected = dumpEntity(*core, 4);
+
+  cereal::CerealBuffer uncached = core->dumpEntity(4);
+  EXPECT_EQ(expected, std::string(static_cast<const char*>(uncached.data()), uncached.size()));
+
+  // Cached entities hand out the same bytes without serializing again, and
+  // the per-heap dump is shared rather than copied.
+  heap->setCacheEncodedEntities(true);
+  cereal::CerealBuffer first = heap->dumpEntity(*core, 4);
+  gNumSerializeCalls = 0;
+  cereal::CerealBuffer second = heap->dumpEntity(*core, 4);
+  EXPECT_EQ(0, gNumSerializeCalls);
+  EXPECT_EQ(first.data(), second.data());
+  EXPECT_EQ(3, second.getUseCount());
+
+  cereal::CerealBuffer cached = core->dumpEntity(4);
+  EXPECT_EQ(0, gNumSerializeCalls);
+  EXPECT_EQ(expected, std::string(static_cast<const char*>(cached.data()), cached.size()));
+
+  heap->getComponentArray()[3].component.color = 41;  // Entity 4.
+  heap->markModified(4);
+  cereal::CerealBuffer changed = core->dumpEntity(4);
+  EXPECT_EQ(1, gNumSerializeCalls);
+  EXPECT_EQ(dumpEntity(*core, 4), std::string(static_cast<const char*>(changed.data()), changed.size()));
+
+  // Entities without components dump as an empty document.
+  cereal::CerealBuffer missing = core->dumpEntity(42);
+  Tny* root = missing.loadTny();
+  ASSERT_NE(nullptr, root);
+  EXPECT_EQ(0, root->size);
+  Tny_free(root);
+}
+
+// Components owning heap memory are cached as well.
+TEST(EntitySystem, EncodedEntityCacheNonTrivial)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompNickname>();
+  core->addComponent(1, CompNickname("first"));
+  core->renormalize(true);
+
+  cereal::CerealHeap<CompNickname>* heap = core->getOrCreateComponentContainer<CompNickname>();
+  heap->setCacheEncodedEntities(true);
+  std::string first = dumpEntity(*core, 1);
+  gNumSerializeCalls = 0;
+  EXPECT_EQ(first, dumpEntity(*core, 1));
+  EXPECT_EQ(0, gNumSerializeCalls);
+
+  heap->getComponentArray()[0].component.name = "second";
+  heap->markModified(1);
+  std::string second = dumpEntity(*core, 1);
+  EXPECT_EQ(1, gNumSerializeCalls);
+  EXPECT_NE(first, second);
+  heap->setCacheEncodedEntities(false);
+  EXPECT_EQ(second, dumpEntity(*core, 1));
+}
+
+}
@@ -0,0 +1,148 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <es-cereal/CerealFileWriter.hpp>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "file:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompHealth
+{
+  CompHealth() : health(0) {}
+  CompHealth(int32_t healthIn) : health(healthIn) {}
+
+  int32_t health;
+
+  static const char* getName() {return "file:CompHealth";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    return true;
+  }
+};
+
+std::string makeTempPath()
+{
+  char path[] = "/tmp/cereal_writer_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd != -1)
+    close(fd);
+  return path;
+}
+
+std::vector<char> readFile(const std::string& path)
+{
+  std::vector<char> contents;
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return contents;
+  char block[4096];
+  size_t count = 0;
+  while ((count = std::fread(block, 1, sizeof(block), file)) > 0)
+    contents.insert(contents.end(), block, block + count);
+  std::fclose(file);
+  return contents;
+}
+
+TEST(EntitySystem, FileWriterSnapshot)
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompPosition>();
+  core.registerComponent<CompHealth>();
+  for (int32_t i = 1; i <= 3000; ++i)
+  {
+    core.addComponent(i, CompPosition(i, -i));
+    core.addComponent(i, CompHealth(i * 10));
+  }
+  core.renormalize(true);
+
+  cereal::CerealSnapshot snapshot = core.dumpSnapshot();
+  std::string path = makeTempPath();
+
+  // io_uring (where available) and the writer thread, buffered and direct.
+  for (int mode = 0; mode < 4; ++mode)
+  {
+    cereal::CerealFileWriter writer;
+    writer.setAllowIoUring(mode < 2);
+    writer.open(path.c_str(), (mode % 2) != 0);
+    if (mode >= 2)
+      EXPECT_FALSE(writer.isUsingIoUring());
+    core.writeSnapshot(writer);
+    EXPECT_EQ(snapshot.getBuffer().size(), writer.getBytesSubmitted());
+    writer.finish();
+    EXPECT_FALSE(writer.isOpen());
+
+    std::vector<char> contents = readFile(path);
+    ASSERT_EQ(snapshot.getBuffer().size(), contents.size());
+    EXPECT_EQ(0, std::memcmp(snapshot.getBuffer().data(), &contents[0], contents.size()));
+  }
+
+  std::remove(path.c_str());
+}
+
+TEST(EntitySystem, FileWriterDirectStaging)
+{
+  // Buffers larger than, and straddling, the staging blocks.
+  std::vector<char> expected;
+  std::vector<cereal::CerealBuffer> buffers;
+  size_t sizes[] = {3, cereal::CerealFileWriter::DIRECT_STAGING_SIZE * 2 + 17, 4096, 1};
+  for (size_t size : sizes)
+  {
+    std::vector<char> bytes(size);
+    for (size_t i = 0; i < size; ++i)
+      bytes[i] = static_cast<char>((expected.size() + i) * 7);
+    expected.insert(expected.end(), bytes.begin(), bytes.end());
+    buffers.push_back(cereal::CerealBuffer::copy(&bytes[0], size, cereal::CerealAllocator::getDefault()));
+  }
+
+  std::string path = makeTempPath();
+  for (int allowIoUring = 0; allowIoUring < 2; ++allowIoUring)
+  {
+    {
+      cereal::CerealFileWriter writer;
+      writer.setAllowIoUring(allowIoUring != 0);
+      writer.open(path.c_str(), true);
+      for (const cereal::CerealBuffer& buffer : buffers)
+        writer.submit(buffer);
+      // The destructor finishes the file.
+    }
+
+    std::vector<char> contents = readFile(path);
+    ASSERT_EQ(expected.size(), contents.size());
+    EXPECT_TRUE(expected == contents);
+  }
+  std::remove(path.c_str());
+
+  cereal::CerealFileWriter writer;
+  EXPECT_THROW(writer.open("/nonexistent-directory/file"), std::runtime_error);
+}
+
+}
@@ -0,0 +1,100 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <es-cereal/CerealForkSaver.hpp>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "fork:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+std::string makeTempPath()
+{
+  char path[] = "/tmp/cereal_fork_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd != -1)
+    close(fd);
+  return path;
+}
+
+std::vector<char> readFile(const std::string& path)
+{
+  std::vector<char> contents;
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return contents;
+  char block[4096];
+  size_t count = 0;
+  while ((count = std::fread(block, 1, sizeof(block), file)) > 0)
+    contents.insert(contents.end(), block, block + count);
+  std::fclose(file);
+  return contents;
+}
+
+TEST(EntitySystem, ForkSaver)
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompPosition>();
+  for (int32_t i = 1; i <= 2000; ++i)
+    core.addComponent(i, CompPosition(i, -i));
+  core.renormalize(true);
+
+  cereal::CerealSnapshot snapshot = core.dumpSnapshot();
+  std::string path = makeTempPath();
+
+  cereal::CerealForkSaver saver;
+  EXPECT_EQ(cereal::FORK_SAVE_IDLE, saver.poll());
+  ASSERT_TRUE(saver.start(core, path));
+  EXPECT_TRUE(saver.isRunning());
+  EXPECT_FALSE(saver.start(core, path));
+
+  // The child saves the state at fork time, whatever the parent does next.
+  core.getOrCreateComponentContainer<CompPosition>()->getComponentArray()[10].component.x = 1234;
+
+  struct pollfd notify = {saver.getNotifyFD(), POLLIN, 0};
+  EXPECT_EQ(1, ::poll(&notify, 1, 10000));
+  EXPECT_EQ(cereal::FORK_SAVE_SUCCEEDED, saver.wait());
+  EXPECT_FALSE(saver.isRunning());
+  EXPECT_EQ(-1, saver.getNotifyFD());
+  EXPECT_EQ(snapshot.getBuffer().size(), saver.getBytesWritten());
+
+  std::vector<char> contents = readFile(path);
+  ASSERT_EQ(snapshot.getBuffer().size(), contents.size());
+  EXPECT_EQ(0, std::memcmp(snapshot.getBuffer().data(), &contents[0], contents.size()));
+  std::remove(path.c_str());
+
+  // Failures in the child are reported to the parent.
+  ASSERT_TRUE(saver.start(core, "/nonexistent-directory/file"));
+  while (saver.poll() == cereal::FORK_SAVE_RUNNING)
+    usleep(1000);
+  EXPECT_EQ(cereal::FORK_SAVE_FAILED, saver.poll());
+  EXPECT_NE(0, saver.getError());
+}
+
+}
@@ -0,0 +1,229 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <cstring>
+#include <memory>
+#include <string>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompTerrain
+{
+  CompTerrain() : height(0) {}
+  CompTerrain(int32_t heightIn) : height(heightIn) {}
+
+  int32_t height;
+
+  static const char* getName() {return "gen:CompTerrain";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("height", height);
+    return true;
+  }
+};
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "gen:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+// Checks that every heap in \p root matches a fresh serialization.
+void expectSameAsFresh(cereal::CerealCore& core, Tny* root)
+{
+  cereal::ComponentSerializeInterface* heaps[] = {
+    core.getOrCreateComponentContainer<CompTerrain>(),
+    core.getOrCreateComponentContainer<CompPosition>()
+  };
+
+  for (cereal::ComponentSerializeInterface* heap : heaps)
+  {
+    Tny* cached = Tny_get(root, heap->getComponentName());
+    ASSERT_NE(nullptr, cached);
+    Tny* fresh = heap->serialize(core);
+
+    void* a = NULL;
+    void* b = NULL;
+    size_t sizeA = Tny_dumps(cached->value.tny, &a);
+    size_t sizeB = Tny_dumps(fresh, &b);
+    EXPECT_EQ(sizeA, sizeB);
+    EXPECT_TRUE(sizeA == sizeB && std::memcmp(a, b, sizeA) == 0);
+    free(a);
+    free(b);
+    Tny_free(fresh);
+  }
+}
+
+TEST(EntitySystem, HeapGenerations)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompTerrain>();
+  core->registerComponent<CompPosition>();
+  for (int32_t i = 1; i <= 10; ++i)
+  {
+    core->addComponent(i, CompTerrain(i * 3));
+    core->addComponent(i, CompPosition(i, -i));
+  }
+  core->renormalize(true);
+
+  cereal::CerealHeap<CompTerrain>* terrain = core->getOrCreateComponentContainer<CompTerrain>();
+  cereal::CerealHeap<CompPosition>* positions = core->getOrCreateComponentContainer<CompPosition>();
+
+  // Renormalizing without changes leaves the generation alone.
+  uint64_t terrainGeneration = terrain->getGeneration();
+  core->renormalize(true);
+  EXPECT_EQ(terrainGeneration, terrain->getGeneration());
+
+  core->setReuseUnchangedHeaps(true);
+  Tny* root = core->serializeAllComponents();
+  EXPECT_EQ(0, core->getNumHeapsReused());
+  Tny_free(root);
+
+  root = core->serializeAllComponents();
+  EXPECT_EQ(2, core->getNumHeapsReused());
+  expectSameAsFresh(*core, root);
+  Tny_free(root);
+
+  // Only the modified heap is serialized again.
+  core->addComponent(11, CompPosition(11, -11));
+  core->renormalize(true);
+  EXPECT_EQ(terrainGeneration, terrain->getGeneration());
+  root = core->serializeAllComponents();
+  EXPECT_EQ(1, core->getNumHeapsReused());
+  expectSameAsFresh(*core, root);
+  Tny_free(root);
+
+  // Removal touches every heap the entity lives in.
+  core->removeEntity(3);
+  core->renormalize(true);
+  root = core->serializeAllComponents();
+  EXPECT_EQ(0, core->getNumHeapsReused());
+  expectSameAsFresh(*core, root);
+  Tny_free(root);
+
+  // Writes made outside of es-cereal must be flagged.
+  positions->getComponentArray()[0].component.x = 1000;
+  positions->markModified();
+  core->renormalize(true);
+  root = core->serializeAllComponents();
+  EXPECT_EQ(1, core->getNumHeapsReused());
+  expectSameAsFresh(*core, root);
+  Tny_free(root);
+
+  // Components added through the core directly change the component count,
+  // which renormalize notices.
+  terrain->addComponent(12, CompTerrain(36));
+  core->renormalize(true);
+  EXPECT_NE(terrainGeneration, terrain->getGeneration());
+  root = core->serializeAllComponents();
+  EXPECT_EQ(1, core->getNumHeapsReused());
+  expectSameAsFresh(*core, root);
+  Tny_free(root);
+  terrainGeneration = terrain->getGeneration();
+
+  // Merging bumps the generation as well.
+  {
+    cereal::CerealCore other;
+    other.registerComponent<CompTerrain>();
+    other.addComponent(4, CompTerrain(-4));
+    other.renormalize(true);
+    Tny* delta = other.serializeAllComponents();
+    core->deserializeComponentMerge(delta, false);
+    core->renormalize(true);
+    Tny_free(delta);
+  }
+  EXPECT_NE(terrainGeneration, terrain->getGeneration());
+  EXPECT_EQ(-4, terrain->getComponentArray()[2].component.height);
+  root = core->serializeAllComponents();
+  EXPECT_EQ(1, core->getNumHeapsReused());
+  expectSameAsFresh(*core, root);
+  Tny_free(root);
+
+  // Snapshots reuse the dumped bytes of unchanged heaps.
+  cereal::CerealSnapshot first = core->dumpSnapshot();
+  cereal::CerealSnapshot second = core->dumpSnapshot();
+  EXPECT_EQ(2, core->getNumHeapsReused());
+  ASSERT_EQ(first.getBuffer().size(), second.getBuffer().size());
+  EXPECT_EQ(0, std::memcmp(first.getBuffer().data(), second.getBuffer().data(),
+                           first.getBuffer().size()));
+
+  // A different key mode changes the dump.
+  core->setHeapKeyMode(cereal::CerealCore::HEAP_KEY_ID);
+  cereal::CerealSnapshot third = core->dumpSnapshot();
+  EXPECT_EQ(0, core->getNumHeapsReused());
+  EXPECT_FALSE(third.findHeap(cereal::CerealCore::makeHeapIDKey(core->getHeapID("gen:CompTerrain"))).empty());
+
+  // Clearing bumps every heap.
+  core->clearAllComponentContainersImmediately();
+  root = core->serializeAllComponents();
+  EXPECT_EQ(0, core->getNumHeapsReused());
+  Tny_free(root);
+}
+
+struct CompLabel
+{
+  CompLabel() {}
+  CompLabel(const std::string& textIn) : text(textIn) {}
+
+  std::string text;
+
+  static const char* getName() {return "gen:CompLabel";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("text", text);
+    return true;
+  }
+};
+
+// Generations are tracked for any component, including those owning heap
+// memory.
+TEST(EntitySystem, HeapGenerationsNonTrivial)
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompLabel>();
+  core.addComponent(1, CompLabel("first"));
+  core.renormalize(true);
+
+  cereal::CerealHeap<CompLabel>* labels = core.getOrCreateComponentContainer<CompLabel>();
+  EXPECT_NE(0, labels->getGeneration());
+
+  core.setReuseUnchangedHeaps(true);
+  for (int i = 0; i < 3; ++i)
+  {
+    Tny* root = core.serializeAllComponents();
+    EXPECT_EQ(i == 0 ? 0 : 1, core.getNumHeapsReused());
+    Tny_free(root);
+  }
+
+  labels->getComponentArray()[0].component.text = "second";
+  labels->markModified();
+  Tny* root = core.serializeAllComponents();
+  EXPECT_EQ(0, core.getNumHeapsReused());
+  cereal::CerealCore loaded;
+  loaded.registerComponent<CompLabel>();
+  loaded.deserializeComponentCreate(root);
+  loaded.renormalize(true);
+  Tny_free(root);
+  EXPECT_EQ(std::string("second"),
+            loaded.getOrCreateComponentContainer<CompLabel>()->getComponentArray()[0].component.text);
+}
+
+}
@@ -0,0 +1,157 @@
+#include <es-cereal/CerealTypeSerialize.hpp>
+#include <es-cereal/CerealTypeSerializeInline.hpp>
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <vector>
+#include <tny/tny.hpp>
+
+namespace cereal = CPM_ES_CEREAL_NS;
+
+// Compares the header only scalar functions (CST_detail::inline_scalars, used
+// with CPM_ES_CEREAL_INLINE_SCALARS) against the out of line versions in
+// CerealTypeSerialize.cpp. Defining the macro in this translation unit alone
+// would give CerealSerializeType a different definition here than elsewhere,
+// so both variants are called directly instead. When the library itself is
+// built with the macro, CST_detail resolves to the inline versions too.
+
+namespace {
+
+template <typename T>
+struct ScalarFunctions
+{
+  bool (*in)(Tny* root, const char* name, T& v);
+  Tny* (*out)(Tny* root, const char* name, const T& v);
+  Tny* (*inArray)(Tny* root, T& v);
+  Tny* (*outArray)(Tny* root, const T& v);
+};
+
+std::string dump(Tny* root)
+{
+  void* data = NULL;
+  size_t size = Tny_dumps(root, &data);
+  std::string bytes(static_cast<const char*>(data), size);
+  free(data);
+  return bytes;
+}
+
+template <typename T>
+Tny* writeDict(const ScalarFunctions<T>& functions, const std::vector<T>& values)
+{
+  Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  for (size_t i = 0; i < values.size(); ++i)
+    root = functions.out(root, std::to_string(i).c_str(), values[i]);
+  return root->root;
+}
+
+template <typename T>
+Tny* writeArray(const ScalarFunctions<T>& functions, const std::vector<T>& values)
+{
+  Tny* root = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+  for (size_t i = 0; i < values.size(); ++i)
+    root = functions.outArray(root, values[i]);
+  return root->root;
+}
+
+template <typename T>
+void expectReads(const ScalarFunctions<T>& functions, Tny* dict, Tny* array,
+                 const std::vector<T>& values)
+{
+  for (size_t i = 0; i < values.size(); ++i)
+  {
+    T v = T();
+    EXPECT_TRUE(functions.in(dict, std::to_string(i).c_str(), v));
+    EXPECT_EQ(values[i], v);
+  }
+
+  T missing = T();
+  EXPECT_FALSE(functions.in(dict, "missing", missing));
+
+  Tny* cur = Tny_next(array);
+  for (size_t i = 0; i < values.size(); ++i)
+  {
+    T v = T();
+    cur = functions.inArray(cur, v);
+    EXPECT_EQ(values[i], v);
+  }
+}
+
+/// Writes \p values with each variant, checks the dumps are identical, and
+/// reads what each variant wrote back with both.
+template <typename T>
+void checkScalar(const ScalarFunctions<T>& outOfLine, const ScalarFunctions<T>& inlined,
+                 const std::vector<T>& values)
+{
+  Tny* dicts[] = {writeDict(outOfLine, values), writeDict(inlined, values)};
+  Tny* arrays[] = {writeArray(outOfLine, values), writeArray(inlined, values)};
+  EXPECT_EQ(dump(dicts[0]), dump(dicts[1]));
+  EXPECT_EQ(dump(arrays[0]), dump(arrays[1]));
+
+  for (int i = 0; i < 2; ++i)
+  {
+    expectReads(outOfLine, dicts[i], arrays[i], values);
+    expectReads(inlined, dicts[i], arrays[i], values);
+    Tny_free(dicts[i]);
+    Tny_free(arrays[i]);
+  }
+}
+
+/// Both variants reject a field of the wrong Tny type and leave the value
+/// untouched.
+template <typename T, typename U>
+void checkMismatch(const ScalarFunctions<T>& outOfLine, const ScalarFunctions<T>& inlined,
+                   const ScalarFunctions<U>& other)
+{
+  Tny* dict = writeDict(other, std::vector<U>(1, U()));
+  T v = T();
+  EXPECT_FALSE(outOfLine.in(dict, "0", v));
+  EXPECT_FALSE(inlined.in(dict, "0", v));
+  EXPECT_EQ(T(), v);
+  Tny_free(dict);
+}
+
+#define CEREAL_SCALAR_FUNCTIONS(ns, name) \
+  {&ns::in##name, &ns::out##name, &ns::in##name##Array, &ns::out##name##Array}
+
+TEST(EntitySystem, InlineScalarsMatchOutOfLine)
+{
+  namespace ool = cereal::CST_detail;
+  namespace inl = cereal::CST_detail::inline_scalars;
+
+  ScalarFunctions<bool> bools[]         = {CEREAL_SCALAR_FUNCTIONS(ool, Bool), CEREAL_SCALAR_FUNCTIONS(inl, Bool)};
+  ScalarFunctions<int8_t> int8s[]       = {CEREAL_SCALAR_FUNCTIONS(ool, Int8), CEREAL_SCALAR_FUNCTIONS(inl, Int8)};
+  ScalarFunctions<uint8_t> uint8s[]     = {CEREAL_SCALAR_FUNCTIONS(ool, UInt8), CEREAL_SCALAR_FUNCTIONS(inl, UInt8)};
+  ScalarFunctions<int32_t> int32s[]     = {CEREAL_SCALAR_FUNCTIONS(ool, Int32), CEREAL_SCALAR_FUNCTIONS(inl, Int32)};
+  ScalarFunctions<uint32_t> uint32s[]   = {CEREAL_SCALAR_FUNCTIONS(ool, UInt32), CEREAL_SCALAR_FUNCTIONS(inl, UInt32)};
+  ScalarFunctions<int64_t> int64s[]     = {CEREAL_SCALAR_FUNCTIONS(ool, Int64), CEREAL_SCALAR_FUNCTIONS(inl, Int64)};
+  ScalarFunctions<uint64_t> uint64s[]   = {CEREAL_SCALAR_FUNCTIONS(ool, UInt64), CEREAL_SCALAR_FUNCTIONS(inl, UInt64)};
+  ScalarFunctions<float> floats[]       = {CEREAL_SCALAR_FUNCTIONS(ool, Float), CEREAL_SCALAR_FUNCTIONS(inl, Float)};
+  ScalarFunctions<double> doubles[]     = {CEREAL_SCALAR_FUNCTIONS(ool, Double), CEREAL_SCALAR_FUNCTIONS(inl, Double)};
+
+  checkScalar(bools[0], bools[1], std::vector<bool>{true, false, true});
+  checkScalar(int8s[0], int8s[1], std::vector<int8_t>{0, 1, -1, std::numeric_limits<int8_t>::min(),
+                                                      std::numeric_limits<int8_t>::max()});
+  checkScalar(uint8s[0], uint8s[1], std::vector<uint8_t>{0, 1, 0x80, 0xFF});
+  checkScalar(int32s[0], int32s[1], std::vector<int32_t>{0, 1, -1, std::numeric_limits<int32_t>::min(),
+                                                         std::numeric_limits<int32_t>::max()});
+  checkScalar(uint32s[0], uint32s[1], std::vector<uint32_t>{0, 1, 0x80000000u, 0xFFFFFFFFu});
+  checkScalar(int64s[0], int64s[1], std::vector<int64_t>{0, 1, -1, std::numeric_limits<int64_t>::min(),
+                                                         std::numeric_limits<int64_t>::max()});
+  checkScalar(uint64s[0], uint64s[1], std::vector<uint64_t>{0, 1, 0x8000000000000000ull,
+                                                            0xFFFFFFFFFFFFFFFFull});
+  checkScalar(floats[0], floats[1], std::vector<float>{0.0f, -0.5f, 3.25f, std::numeric_limits<float>::max(),
+                                                       std::numeric_limits<float>::denorm_min()});
+  checkScalar(doubles[0], doubles[1], std::vector<double>{0.0, -0.5, 3.25, std::numeric_limits<double>::max(),
+                                                          std::numeric_limits<double>::denorm_min()});
+
+  checkMismatch(bools[0], bools[1], int32s[0]);
+  checkMismatch(int8s[0], int8s[1], int64s[0]);
+  checkMismatch(int32s[0], int32s[1], int8s[0]);
+  checkMismatch(uint32s[0], uint32s[1], doubles[0]);
+  checkMismatch(int64s[0], int64s[1], floats[0]);
+  checkMismatch(floats[0], floats[1], uint64s[0]);
+  checkMismatch(doubles[0], doubles[1], uint8s[0]);
+}
+
+}
@@ -0,0 +1,141 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <es-cereal/CerealPrefab.hpp>
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+// The default implementations of ComponentSerializeInterface, used by heaps
+// implementing only the original Tny functions. They are called with
+// qualified names on a CerealHeap and checked against CerealHeap's own
+// implementations.
+
+namespace {
+
+struct CompLink
+{
+  CompLink() : target(0), weight(0) {}
+  CompLink(uint64_t targetIn, int32_t weightIn) : target(targetIn), weight(weightIn) {}
+
+  uint64_t target;
+  int32_t  weight;
+
+  static const char* getName() {return "defaults:CompLink";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serializeEntityID("target", target);
+    s.serialize("weight", weight);
+    return true;
+  }
+};
+
+typedef cereal::ComponentSerializeInterface Interface;
+
+std::string dump(Tny* root)
+{
+  void* data = NULL;
+  size_t size = Tny_dumps(root, &data);
+  std::string bytes(static_cast<const char*>(data), size);
+  free(data);
+  return bytes;
+}
+
+std::string bytes(const cereal::CerealBuffer& buffer)
+{
+  return std::string(static_cast<const char*>(buffer.data()), buffer.size());
+}
+
+void fill(cereal::CerealCore& core)
+{
+  core.registerComponent<CompLink>();
+  for (uint64_t i = 1; i <= 6; ++i)
+    core.addComponent(i, CompLink(i + 1, static_cast<int32_t>(i) * 10));
+  core.addComponent(4, CompLink(1, 400));
+  core.renormalize(true);
+}
+
+TEST(EntitySystem, InterfaceDefaults)
+{
+  cereal::CerealCore core;
+  fill(core);
+  cereal::CerealHeap<CompLink>* heap = core.getOrCreateComponentContainer<CompLink>();
+
+  EXPECT_EQ(bytes(heap->dumpEntity(core, 4)), bytes(heap->Interface::dumpEntity(core, 4)));
+
+  uint64_t ids[] = {2, 4, 9};
+  Tny* expected = heap->serializeEntities(core, ids, 3);
+  Tny* actual = heap->Interface::serializeEntities(core, ids, 3);
+  ASSERT_NE(nullptr, actual);
+  EXPECT_EQ(dump(expected), dump(actual));
+  Tny_free(expected);
+  Tny_free(actual);
+  uint64_t missing = 9;
+  EXPECT_EQ(nullptr, heap->Interface::serializeEntities(core, &missing, 1));
+
+  EXPECT_FALSE(heap->Interface::getLayout(core).isValid());
+  std::vector<char> records;
+  EXPECT_THROW(heap->Interface::packComponents(core, records), std::runtime_error);
+
+  // Creating with a remap: owners and entity fields are translated.
+  Tny* serialized = heap->serialize(core);
+  cereal::CerealCore created;
+  created.registerComponent<CompLink>();
+  cereal::CerealHeap<CompLink>* createdHeap = created.getOrCreateComponentContainer<CompLink>();
+  cereal::EntityRemap remap([](uint64_t id) {return id + 100;});
+  createdHeap->Interface::deserializeCreate(created, serialized, &remap);
+  created.renormalize(true);
+  ASSERT_EQ(7, createdHeap->getNumComponents());
+  EXPECT_EQ(101, createdHeap->getComponentArray()[0].sequence);
+  EXPECT_EQ(102, createdHeap->getComponentArray()[0].component.target);
+  EXPECT_EQ(10, createdHeap->getComponentArray()[0].component.weight);
+  EXPECT_EQ(101, createdHeap->getComponentArray()[4].component.target);
+
+  // Prefabs hold the serialized heap.
+  std::unique_ptr<cereal::PrefabHeapInterface> prefab = heap->Interface::decodePrefab(core, serialized);
+  Tny_free(serialized);
+  ASSERT_EQ(7, prefab->getNumComponents());
+  std::vector<uint64_t> owners;
+  prefab->collectEntityIDs(owners);
+  EXPECT_EQ(4, owners[4]);
+
+  cereal::EntityIDTable idMap;
+  idMap.insert(1, 50);
+  idMap.insert(2, 60);
+  cereal::CerealCore instanced;
+  instanced.registerComponent<CompLink>();
+  std::unique_ptr<cereal::PrefabHeapInterface> instancedPrefab;
+  {
+    Tny* source = heap->serialize(core);
+    instancedPrefab = instanced.getOrCreateComponentContainer<CompLink>()->Interface::decodePrefab(instanced, source);
+    Tny_free(source);
+  }
+  instancedPrefab->instantiate(idMap);
+  instanced.renormalize(true);
+  cereal::CerealHeap<CompLink>* instancedHeap = instanced.getOrCreateComponentContainer<CompLink>();
+  ASSERT_EQ(7, instancedHeap->getNumComponents());
+  EXPECT_EQ(3, instancedHeap->getComponentArray()[0].sequence);
+  EXPECT_EQ(50, instancedHeap->getComponentArray()[instancedHeap->getNumComponents() - 2].sequence);
+  EXPECT_EQ(60, instancedHeap->getComponentArray()[instancedHeap->getNumComponents() - 2].component.target);
+
+  // Remapping references merges a translated copy; owners are unchanged.
+  cereal::EntityIDTable table;
+  table.insert(2, 20);
+  table.insert(1, 10);
+  heap->Interface::remapEntityReferences(core, table);
+  core.renormalize(true);
+  EXPECT_EQ(1, heap->getComponentArray()[0].sequence);
+  EXPECT_EQ(20, heap->getComponentArray()[0].component.target);
+  EXPECT_EQ(3, heap->getComponentArray()[1].component.target);
+  int index = heap->getComponentItemIndexWithSequence(4);
+  EXPECT_EQ(10, heap->getComponentArray()[index + 1].component.target);
+  EXPECT_EQ(400, heap->getComponentArray()[index + 1].component.weight);
+}
+
+}
@@ -0,0 +1,177 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <memory>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompCounter
+{
+  CompCounter() : count(0) {}
+  CompCounter(int32_t countIn) : count(countIn) {}
+
+  int32_t count;
+
+  static const char* getName() {return "game:CompCounter";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("count", count);
+    return true;
+  }
+};
+
+struct Record
+{
+  uint64_t  entityID;
+  int32_t   count;
+};
+
+// Builds a merge document containing the given records, in the given order.
+Tny* buildMergeDocument(cereal::CerealCore& core, const std::vector<Record>& records)
+{
+  cereal::ComponentSerialize s(core, false);
+  Tny* compArray = Tny_add(NULL, TNY_ARRAY, NULL, NULL, 0);
+  for (const Record& r : records)
+  {
+    CompCounter value(r.count);
+    s.prepareForNewComponent();
+    value.serialize(s, r.entityID);
+    compArray = cereal::heap_detail::addSerializedComponent(
+        compArray, s.getSerializedObject(), r.entityID);
+  }
+
+  Tny* heap = cereal::heap_detail::writeSerializedHeap(s, compArray->root);
+  Tny_free(compArray);
+
+  Tny* root = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+  Tny_add(root, TNY_OBJ, const_cast<char*>(CompCounter::getName()), heap->root, 0);
+  Tny_free(heap);
+  return root;
+}
+
+void populate(cereal::CerealCore& core, size_t numEntities)
+{
+  core.registerComponent<CompCounter>();
+  for (size_t i = 0; i < numEntities; ++i)
+  {
+    uint64_t id = core.getNewEntityID();
+    core.addComponent(id, CompCounter(static_cast<int32_t>(id)));
+
+    // Every tenth entity has a second component.
+    if (id % 10 == 0)
+      core.addComponent(id, CompCounter(static_cast<int32_t>(id) + 1000));
+  }
+  core.renormalize(true);
+}
+
+void checkCounts(cereal::CerealCore& core, const std::map<std::pair<uint64_t, int>, int32_t>& expected)
+{
+  cereal::CerealHeap<CompCounter>* heap = core.getOrCreateComponentContainer<CompCounter>();
+  cereal::CerealHeap<CompCounter>::ComponentItem* array = heap->getComponentArray();
+  uint64_t lastID = 0;
+  int index = 0;
+  for (size_t i = 0; i < heap->getNumComponents(); ++i)
+  {
+    uint64_t id = array[i].sequence;
+    index = (id == lastID) ? index + 1 : 0;
+    lastID = id;
+
+    auto it = expected.find(std::make_pair(id, index));
+    int32_t value = static_cast<int32_t>(id) + (index == 1 ? 1000 : 0);
+    if (it != expected.end())
+      value = it->second;
+    EXPECT_EQ(value, array[i].component.count) << "Entity " << id << " index " << index;
+  }
+}
+
+TEST(EntitySystem, MergeWalkSorted)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  populate(*core, 200);
+
+  std::vector<Record> records = {
+    {1, -1}, {2, -2}, {10, -10}, {10, -11}, {57, -57}, {150, -150}, {199, -199}, {200, -200}
+  };
+  Tny* root = buildMergeDocument(*core, records);
+  core->deserializeComponentMerge(root, false);
+  core->renormalize(true);
+  Tny_free(root);
+
+  std::map<std::pair<uint64_t, int>, int32_t> expected;
+  expected[std::make_pair(1, 0)] = -1;
+  expected[std::make_pair(2, 0)] = -2;
+  expected[std::make_pair(10, 0)] = -10;
+  expected[std::make_pair(10, 1)] = -11;
+  expected[std::make_pair(57, 0)] = -57;
+  expected[std::make_pair(150, 0)] = -150;
+  expected[std::make_pair(199, 0)] = -199;
+  expected[std::make_pair(200, 0)] = -200;
+  checkCounts(*core, expected);
+}
+
+TEST(EntitySystem, MergeWalkUnsortedAndMissing)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  populate(*core, 100);
+
+  // Out of order records and records for entities that do not exist.
+  std::vector<Record> records = {
+    {80, -80}, {5000, -1}, {3, -3}, {90, -90}, {90, -91}, {40, -40}, {0, -1}
+  };
+  Tny* root = buildMergeDocument(*core, records);
+  core->deserializeComponentMerge(root, false);
+  core->renormalize(true);
+  Tny_free(root);
+
+  std::map<std::pair<uint64_t, int>, int32_t> expected;
+  expected[std::make_pair(80, 0)] = -80;
+  expected[std::make_pair(3, 0)] = -3;
+  expected[std::make_pair(90, 0)] = -90;
+  expected[std::make_pair(90, 1)] = -91;
+  expected[std::make_pair(40, 0)] = -40;
+  checkCounts(*core, expected);
+}
+
+TEST(EntitySystem, MergeGallopSparse)
+{
+  typedef cereal::CerealHeap<CompCounter> Heap;
+  Heap::MergeSearch searches[] = {Heap::MERGE_SEARCH_AUTO, Heap::MERGE_SEARCH_WALK, Heap::MERGE_SEARCH_GALLOP};
+
+  for (Heap::MergeSearch search : searches)
+  {
+    std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+    populate(*core, 5000);
+    core->getOrCreateComponentContainer<CompCounter>()->setMergeSearch(search);
+
+    // Sparse delta, including the first and last entities, an entity with
+    // two components and a gap that is not present in the heap.
+    std::vector<Record> records = {
+      {1, -1}, {2, -2}, {700, -700}, {700, -701}, {701, -701}, {2500, -2500},
+      {4096, -4096}, {4999, -4999}, {5000, -5000}, {5000, -5001}, {9000, -9000}
+    };
+    Tny* root = buildMergeDocument(*core, records);
+    core->deserializeComponentMerge(root, false);
+    core->renormalize(true);
+    Tny_free(root);
+
+    std::map<std::pair<uint64_t, int>, int32_t> expected;
+    expected[std::make_pair(1, 0)] = -1;
+    expected[std::make_pair(2, 0)] = -2;
+    expected[std::make_pair(700, 0)] = -700;
+    expected[std::make_pair(700, 1)] = -701;
+    expected[std::make_pair(701, 0)] = -701;
+    expected[std::make_pair(2500, 0)] = -2500;
+    expected[std::make_pair(4096, 0)] = -4096;
+    expected[std::make_pair(4999, 0)] = -4999;
+    expected[std::make_pair(5000, 0)] = -5000;
+    expected[std::make_pair(5000, 1)] = -5001;
+    checkCounts(*core, expected);
+  }
+}
+
+}
@@ -0,0 +1,195 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <vector>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "migrate:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompHealth
+{
+  CompHealth() : health(0) {}
+  CompHealth(int32_t healthIn) : health(healthIn) {}
+
+  int32_t health;
+
+  static const char* getName() {return "migrate:CompHealth";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    return true;
+  }
+};
+
+TEST(EntitySystem, MigrateEntities)
+{
+  cereal::CerealCore source;
+  source.registerComponent<CompPosition>();
+  source.registerComponent<CompHealth>();
+  for (int32_t i = 1; i <= 100; ++i)
+  {
+    source.addComponent(i, CompPosition(i, -i));
+    if (i % 3 == 0)
+      source.addComponent(i, CompHealth(i * 10));
+  }
+  // Entity 50 has two positions.
+  source.addComponent(50, CompPosition(500, -500));
+  source.renormalize(true);
+
+  // Duplicates and unknown entities are ignored.
+  std::vector<uint64_t> moving;
+  for (uint64_t id = 10; id <= 60; id += 10)
+    moving.push_back(id);
+  moving.push_back(30);
+  moving.push_back(9999);
+
+  cereal::CerealBuffer payload = source.extractEntities(moving);
+  ASSERT_FALSE(payload.empty());
+  source.renormalize(true);
+
+  cereal::CerealHeap<CompPosition>* sourcePositions = source.getOrCreateComponentContainer<CompPosition>();
+  cereal::CerealHeap<CompHealth>* sourceHealth = source.getOrCreateComponentContainer<CompHealth>();
+  EXPECT_EQ(94, sourcePositions->getNumComponents());
+  EXPECT_EQ(31, sourceHealth->getNumComponents());
+  EXPECT_EQ(-1, sourcePositions->getComponentItemIndexWithSequence(50));
+  EXPECT_NE(-1, sourcePositions->getComponentItemIndexWithSequence(51));
+
+  cereal::CerealCore destination;
+  destination.registerComponent<CompPosition>();
+  destination.registerComponent<CompHealth>();
+  destination.addComponent(1000, CompPosition(1, 1));
+  destination.renormalize(true);
+  destination.insertEntities(payload);
+  destination.renormalize(true);
+
+  cereal::CerealHeap<CompPosition>* positions = destination.getOrCreateComponentContainer<CompPosition>();
+  cereal::CerealHeap<CompHealth>* health = destination.getOrCreateComponentContainer<CompHealth>();
+  ASSERT_EQ(8, positions->getNumComponents());
+  ASSERT_EQ(2, health->getNumComponents());
+
+  int index = positions->getComponentItemIndexWithSequence(50);
+  ASSERT_NE(-1, index);
+  EXPECT_EQ(50, positions->getComponentArray()[index].component.x);
+  EXPECT_EQ(500, positions->getComponentArray()[index + 1].component.x);
+  EXPECT_EQ(50, positions->getComponentArray()[index + 1].sequence);
+  EXPECT_EQ(30, health->getComponentArray()[0].sequence);
+  EXPECT_EQ(300, health->getComponentArray()[0].component.health);
+  EXPECT_EQ(600, health->getComponentArray()[1].component.health);
+
+  // Copying without removal leaves the source untouched.
+  cereal::CerealBuffer copy = source.extractEntities(std::vector<uint64_t>(1, 1), false);
+  source.renormalize(true);
+  EXPECT_EQ(94, sourcePositions->getNumComponents());
+  cereal::CerealCore other;
+  other.registerComponent<CompPosition>();
+  other.insertEntities(copy);
+  other.renormalize(true);
+  ASSERT_EQ(1, other.getOrCreateComponentContainer<CompPosition>()->getNumComponents());
+  EXPECT_EQ(-1, other.getOrCreateComponentContainer<CompPosition>()->getComponentArray()[0].component.y);
+
+  // An empty batch inserts nothing.
+  cereal::CerealBuffer empty = source.extractEntities(std::vector<uint64_t>());
+  destination.insertEntities(empty);
+  destination.renormalize(true);
+  EXPECT_EQ(8, positions->getNumComponents());
+
+  EXPECT_THROW(destination.insertEntities(cereal::CerealBuffer()), std::runtime_error);
+}
+
+// Extraction locates the batch with either search strategy.
+TEST(EntitySystem, MigrateEntitiesSearch)
+{
+  cereal::CerealHeap<CompPosition>::MergeSearch searches[] = {
+      cereal::CerealHeap<CompPosition>::MERGE_SEARCH_WALK,
+      cereal::CerealHeap<CompPosition>::MERGE_SEARCH_GALLOP};
+  for (cereal::CerealHeap<CompPosition>::MergeSearch search : searches)
+  {
+    cereal::CerealCore source;
+    source.registerComponent<CompPosition>();
+    for (int32_t i = 1; i <= 1000; ++i)
+      source.addComponent(i, CompPosition(i, -i));
+    source.renormalize(true);
+
+    cereal::CerealHeap<CompPosition>* positions = source.getOrCreateComponentContainer<CompPosition>();
+    positions->setMergeSearch(search);
+    cereal::CerealBuffer payload = source.extractEntities(std::vector<uint64_t>({1, 500, 999, 5000}));
+    source.renormalize(true);
+    EXPECT_EQ(997, positions->getNumComponents());
+    EXPECT_EQ(-1, positions->getComponentItemIndexWithSequence(500));
+    EXPECT_NE(-1, positions->getComponentItemIndexWithSequence(1000));
+
+    cereal::CerealCore destination;
+    destination.registerComponent<CompPosition>();
+    destination.insertEntities(payload);
+    destination.renormalize(true);
+    cereal::CerealHeap<CompPosition>* moved = destination.getOrCreateComponentContainer<CompPosition>();
+    ASSERT_EQ(3, moved->getNumComponents());
+    EXPECT_EQ(999, moved->getComponentArray()[2].component.x);
+  }
+}
+
+// Inserting into a core that allocates its own IDs: the remap hands the
+// incoming entities fresh IDs, so they can't collide with the destination's
+// entities, before or after the insert.
+TEST(EntitySystem, MigrateEntitiesRemapped)
+{
+  cereal::CerealCore source;
+  source.registerComponent<CompPosition>();
+  for (int32_t i = 1; i <= 5; ++i)
+    source.addComponent(i, CompPosition(i, -i));
+  source.renormalize(true);
+  cereal::CerealBuffer payload = source.extractEntities(std::vector<uint64_t>({2, 4}));
+
+  cereal::CerealCore destination;
+  destination.registerComponent<CompPosition>();
+  std::vector<uint64_t> local;
+  for (int32_t i = 0; i < 4; ++i)
+  {
+    local.push_back(destination.getNewEntityID());
+    destination.addComponent(local.back(), CompPosition(100, 100));
+  }
+  destination.renormalize(true);
+
+  cereal::EntityRemap remap(destination);
+  destination.insertEntities(payload, &remap);
+  uint64_t next = destination.getNewEntityID();
+  destination.renormalize(true);
+
+  cereal::CerealHeap<CompPosition>* positions = destination.getOrCreateComponentContainer<CompPosition>();
+  ASSERT_EQ(6, positions->getNumComponents());
+  for (uint64_t id : {uint64_t(2), uint64_t(4)})
+  {
+    uint64_t newID = remap.remap(id);
+    EXPECT_EQ(local.end(), std::find(local.begin(), local.end(), newID));
+    EXPECT_NE(next, newID);
+
+    int index = positions->getComponentItemIndexWithSequence(newID);
+    ASSERT_NE(-1, index);
+    EXPECT_EQ(static_cast<int32_t>(id), positions->getComponentArray()[index].component.x);
+  }
+}
+
+}
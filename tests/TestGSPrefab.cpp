@@ -0,0 +1,369 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <memory>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompTransform
+{
+  CompTransform() : x(0.0f), y(0.0f) {}
+  CompTransform(float xIn, float yIn) : x(xIn), y(yIn) {}
+
+  float x;
+  float y;
+
+  static const char* getName() {return "scene:CompTransform";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompParent
+{
+  CompParent() : parent(0) {}
+  CompParent(uint64_t parentIn) : parent(parentIn) {}
+
+  uint64_t parent;
+
+  static const char* getName() {return "scene:CompParent";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serializeEntityID("parent", parent);
+    return true;
+  }
+};
+
+// Serializes its target only when linked, so its entity ID fields depend on
+// its contents.
+struct CompLink
+{
+  CompLink() : linked(false), target(0) {}
+  CompLink(uint64_t targetIn) : linked(true), target(targetIn) {}
+
+  bool linked;
+  uint64_t target;
+
+  static const char* getName() {return "scene:CompLink";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("linked", linked);
+    if (linked)
+      s.serializeEntityID("target", target);
+    return true;
+  }
+};
+
+// Builds a two entity prefab: a root and a child parented to the root.
+Tny* buildPrefab()
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompTransform>();
+  core.registerComponent<CompParent>();
+
+  uint64_t rootID = core.getNewEntityID();
+  uint64_t childID = core.getNewEntityID();
+  core.addComponent(rootID, CompTransform(1.0f, 2.0f));
+  core.addComponent(childID, CompTransform(3.0f, 4.0f));
+  core.addComponent(childID, CompParent(rootID));
+  core.renormalize(true);
+
+  return core.serializeAllComponents();
+}
+
+TEST(EntitySystem, PrefabRemapCreate)
+{
+  Tny* prefab = buildPrefab();
+
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompTransform>();
+  core->registerComponent<CompParent>();
+
+  // Occupy the IDs used by the prefab so instances can't collide with them.
+  for (int i = 0; i < 10; ++i)
+    core->getNewEntityID();
+
+  const int numInstances = 3;
+  std::vector<std::pair<uint64_t, uint64_t>> instances;
+  cereal::EntityRemap remap(*core);
+  for (int i = 0; i < numInstances; ++i)
+  {
+    remap.clear();
+    core->deserializeComponentCreate(prefab, remap);
+    ASSERT_EQ(2, remap.getMappings().size());
+    instances.push_back(std::make_pair(remap.remap(1), remap.remap(2)));
+  }
+  core->renormalize(true);
+
+  cereal::CerealHeap<CompTransform>* transforms = core->getOrCreateComponentContainer<CompTransform>();
+  cereal::CerealHeap<CompParent>* parents = core->getOrCreateComponentContainer<CompParent>();
+  ASSERT_EQ(2 * numInstances, transforms->getNumComponents());
+  ASSERT_EQ(numInstances, parents->getNumComponents());
+
+  for (auto& instance : instances)
+  {
+    EXPECT_LT(10, instance.first);
+    EXPECT_LT(10, instance.second);
+    EXPECT_NE(instance.first, instance.second);
+
+    int rootIndex = transforms->getComponentItemIndexWithSequence(instance.first);
+    int childIndex = transforms->getComponentItemIndexWithSequence(instance.second);
+    ASSERT_NE(-1, rootIndex);
+    ASSERT_NE(-1, childIndex);
+    EXPECT_FLOAT_EQ(1.0f, transforms->getComponentArray()[rootIndex].component.x);
+    EXPECT_FLOAT_EQ(4.0f, transforms->getComponentArray()[childIndex].component.y);
+
+    // The child's parent reference must point at this instance's root.
+    int parentIndex = parents->getComponentItemIndexWithSequence(instance.second);
+    ASSERT_NE(-1, parentIndex);
+    EXPECT_EQ(instance.first, parents->getComponentArray()[parentIndex].component.parent);
+  }
+
+  // Explicit table and function remaps.
+  core->clearAllComponentContainersImmediately();
+  cereal::EntityRemap table;
+  table.addMapping(1, 100);
+  table.addMapping(2, 200);
+  core->deserializeComponentCreate(prefab, table);
+  cereal::EntityRemap offset([](uint64_t id) { return id + 1000; });
+  core->deserializeComponentCreate(prefab, offset);
+  core->renormalize(true);
+
+  ASSERT_EQ(2, parents->getNumComponents());
+  EXPECT_EQ(200, parents->getComponentArray()[0].sequence);
+  EXPECT_EQ(100, parents->getComponentArray()[0].component.parent);
+  EXPECT_EQ(1002, parents->getComponentArray()[1].sequence);
+  EXPECT_EQ(1001, parents->getComponentArray()[1].component.parent);
+
+  Tny_free(prefab);
+}
+
+// Only entities inside of the template get fresh IDs. A null parent stays
+// null and a parent outside of the template keeps its ID.
+TEST(EntitySystem, PrefabRemapExternalReferences)
+{
+  const uint64_t outsideID = 500;
+  Tny* prefab = nullptr;
+  {
+    cereal::CerealCore core;
+    core.registerComponent<CompTransform>();
+    core.registerComponent<CompParent>();
+    core.addComponent(1, CompParent(0));
+    core.addComponent(2, CompParent(outsideID));
+    core.addComponent(3, CompParent(1));
+    core.renormalize(true);
+    prefab = core.serializeAllComponents();
+  }
+
+  cereal::CerealCore core;
+  core.registerComponent<CompTransform>();
+  core.registerComponent<CompParent>();
+  for (int i = 0; i < 10; ++i)
+    core.getNewEntityID();
+
+  cereal::EntityRemap remap(core);
+  core.deserializeComponentCreate(prefab, remap);
+  core.renormalize(true);
+  Tny_free(prefab);
+
+  EXPECT_EQ(3, remap.getMappings().size());
+  EXPECT_EQ(0, remap.remap(0));
+  EXPECT_EQ(outsideID, remap.remap(outsideID));
+
+  cereal::CerealHeap<CompParent>* parents = core.getOrCreateComponentContainer<CompParent>();
+  ASSERT_EQ(3, parents->getNumComponents());
+  for (uint64_t id = 1; id <= 3; ++id)
+    EXPECT_LT(10, remap.remap(id));
+
+  int nullIndex = parents->getComponentItemIndexWithSequence(remap.remap(1));
+  int outsideIndex = parents->getComponentItemIndexWithSequence(remap.remap(2));
+  int childIndex = parents->getComponentItemIndexWithSequence(remap.remap(3));
+  ASSERT_NE(-1, nullIndex);
+  ASSERT_NE(-1, outsideIndex);
+  ASSERT_NE(-1, childIndex);
+  EXPECT_EQ(0, parents->getComponentArray()[nullIndex].component.parent);
+  EXPECT_EQ(outsideID, parents->getComponentArray()[outsideIndex].component.parent);
+  EXPECT_EQ(remap.remap(1), parents->getComponentArray()[childIndex].component.parent);
+}
+
+TEST(EntitySystem, PrefabCache)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompTransform>();
+  core->registerComponent<CompParent>();
+
+  // Template with an additional entity that references something outside
+  // of the template (a world entity). That reference must be preserved.
+  Tny* prefabRoot = nullptr;
+  const uint64_t worldID = 5000;
+  {
+    cereal::CerealCore templateCore;
+    templateCore.registerComponent<CompTransform>();
+    templateCore.registerComponent<CompParent>();
+    templateCore.addComponent(1, CompTransform(1.0f, 2.0f));
+    templateCore.addComponent(2, CompTransform(3.0f, 4.0f));
+    templateCore.addComponent(2, CompParent(1));
+    templateCore.addComponent(3, CompParent(worldID));
+    templateCore.renormalize(true);
+    prefabRoot = templateCore.serializeAllComponents();
+  }
+
+  core->cachePrefab("projectile", prefabRoot);
+  Tny_free(prefabRoot);
+
+  std::shared_ptr<cereal::CerealPrefab> prefab = core->getCachedPrefab("projectile");
+  ASSERT_TRUE(static_cast<bool>(prefab));
+  EXPECT_FALSE(static_cast<bool>(core->getCachedPrefab("npc")));
+  EXPECT_EQ(4, prefab->getNumComponents());
+  ASSERT_EQ(3, prefab->getEntityIDs().size());
+
+  for (int i = 0; i < 20; ++i)
+    core->getNewEntityID();
+
+  const int numInstances = 100;
+  cereal::EntityRemap remap(*core);
+  std::vector<std::pair<uint64_t, uint64_t>> instances;
+  cereal::CerealHeap<CompTransform>* transforms = core->getOrCreateComponentContainer<CompTransform>();
+  cereal::CerealHeap<CompParent>* parents = core->getOrCreateComponentContainer<CompParent>();
+  uint64_t generation = parents->getGeneration();
+  for (int i = 0; i < numInstances; ++i)
+  {
+    remap.clear();
+    core->instantiatePrefab(*prefab, remap);
+    instances.push_back(std::make_pair(remap.remap(1), remap.remap(2)));
+  }
+  EXPECT_LT(generation, parents->getGeneration());
+  core->renormalize(true);
+
+  ASSERT_EQ(2 * numInstances, transforms->getNumComponents());
+  ASSERT_EQ(2 * numInstances, parents->getNumComponents());
+
+  size_t worldReferences = 0;
+  for (size_t i = 0; i < parents->getNumComponents(); ++i)
+  {
+    if (parents->getComponentArray()[i].component.parent == worldID)
+      ++worldReferences;
+  }
+  EXPECT_EQ(numInstances, worldReferences);
+
+  for (auto& instance : instances)
+  {
+    int childIndex = parents->getComponentItemIndexWithSequence(instance.second);
+    ASSERT_NE(-1, childIndex);
+    EXPECT_EQ(instance.first, parents->getComponentArray()[childIndex].component.parent);
+
+    int rootIndex = transforms->getComponentItemIndexWithSequence(instance.first);
+    ASSERT_NE(-1, rootIndex);
+    EXPECT_FLOAT_EQ(2.0f, transforms->getComponentArray()[rootIndex].component.y);
+  }
+
+  core->uncachePrefab("projectile");
+  EXPECT_FALSE(static_cast<bool>(core->getCachedPrefab("projectile")));
+}
+
+TEST(EntitySystem, EntityReferenceFixup)
+{
+  cereal::EntityIDTable table;
+  EXPECT_TRUE(table.empty());
+  EXPECT_EQ(42, table.translate(42));
+
+  const uint64_t numMappings = 10000;
+  for (uint64_t i = 1; i <= numMappings; ++i)
+    table.insert(i, i + 100000);
+  table.insert(~static_cast<uint64_t>(0), 7);
+  table.insert(5, 55);
+
+  EXPECT_EQ(numMappings + 1, table.size());
+  EXPECT_EQ(55, table.translate(5));
+  EXPECT_EQ(100001, table.translate(1));
+  EXPECT_EQ(110000, table.translate(numMappings));
+  EXPECT_EQ(numMappings + 1, table.translate(numMappings + 1));
+  EXPECT_EQ(7, table.translate(~static_cast<uint64_t>(0)));
+
+  uint64_t found = 0;
+  EXPECT_TRUE(table.find(2, found));
+  EXPECT_EQ(100002, found);
+  EXPECT_FALSE(table.find(0, found));
+
+  uint64_t ids[] = {1, 0, 3};
+  table.translate(ids, 3);
+  EXPECT_EQ(100001, ids[0]);
+  EXPECT_EQ(0, ids[1]);
+  EXPECT_EQ(100003, ids[2]);
+
+  // Bulk fixup of entity references stored in components.
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompTransform>();
+  core->registerComponent<CompParent>();
+
+  const uint64_t numEntities = 500;
+  for (uint64_t i = 1; i <= numEntities; ++i)
+  {
+    core->addComponent(i, CompTransform(static_cast<float>(i), 0.0f));
+    core->addComponent(i, CompParent(i - 1));
+  }
+  core->renormalize(true);
+
+  cereal::EntityIDTable fixup;
+  fixup.reserve(numEntities);
+  for (uint64_t i = 0; i < numEntities; i += 2)
+    fixup.insert(i, i + 1000);
+  core->remapEntityReferences(fixup);
+
+  cereal::CerealHeap<CompParent>* parents = core->getOrCreateComponentContainer<CompParent>();
+  ASSERT_EQ(numEntities, parents->getNumComponents());
+  for (size_t i = 0; i < parents->getNumComponents(); ++i)
+  {
+    const auto& item = parents->getComponentArray()[i];
+    uint64_t original = item.sequence - 1;
+    uint64_t expected = (original % 2 == 0) ? original + 1000 : original;
+    EXPECT_EQ(expected, item.component.parent);
+  }
+
+  // Owners and non-reference fields are untouched.
+  cereal::CerealHeap<CompTransform>* transforms = core->getOrCreateComponentContainer<CompTransform>();
+  EXPECT_EQ(1, transforms->getComponentArray()[0].sequence);
+  EXPECT_FLOAT_EQ(1.0f, transforms->getComponentArray()[0].component.x);
+
+  // Entity references are tagged in the type header.
+  Tny* root = core->serializeAllComponents();
+  std::shared_ptr<cereal::CerealCore> loaded(new cereal::CerealCore());
+  loaded->registerComponent<CompTransform>();
+  loaded->registerComponent<CompParent>();
+  loaded->deserializeComponentCreate(root);
+  EXPECT_EQ(std::string(cereal::ComponentSerialize::ENTITY_TYPE_NAME),
+            loaded->getOrCreateComponentContainer<CompParent>()->getTypeOfElement("parent"));
+  Tny_free(root);
+}
+
+TEST(EntitySystem, EntityReferenceFixupVaryingFields)
+{
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompLink>();
+
+  // The first component alone would suggest the target is an entity field.
+  core->addComponent(1, CompLink(2));
+  core->addComponent(2, CompLink());
+  core->renormalize(true);
+
+  cereal::EntityIDTable fixup;
+  fixup.insert(2, 20);
+  EXPECT_THROW(core->remapEntityReferences(fixup), std::runtime_error);
+
+  // Nothing was translated.
+  cereal::CerealHeap<CompLink>* links = core->getOrCreateComponentContainer<CompLink>();
+  EXPECT_EQ(2, links->getComponentArray()[0].component.target);
+  EXPECT_EQ(0, links->getComponentArray()[1].component.target);
+}
+
+}
@@ -0,0 +1,283 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <cstring>
+#include <memory>
+#include <string>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "registry:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompHealth
+{
+  CompHealth() : health(0) {}
+  CompHealth(int32_t healthIn) : health(healthIn) {}
+
+  int32_t health;
+
+  static const char* getName() {return "registry:CompHealth";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    return true;
+  }
+};
+
+// Same name as CompHealth.
+struct CompHealthDuplicate
+{
+  int32_t health;
+
+  static const char* getName() {return "registry:CompHealth";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    return true;
+  }
+};
+
+// "costarring" and "liquid" share a 32 bit FNV-1a hash.
+struct CompCollideA
+{
+  int32_t value;
+
+  static constexpr const char* getName() {return "costarring";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("value", value);
+    return true;
+  }
+};
+
+struct CompCollideB
+{
+  int32_t value;
+
+  static const char* getName() {return "liquid";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("value", value);
+    return true;
+  }
+};
+
+static_assert(cereal::hashName("costarring") == 0x5e4daa9du, "FNV-1a");
+static_assert(cereal::hashName(CompCollideA::getName()) == cereal::hashName("liquid"), "FNV-1a");
+
+TEST(EntitySystem, HeapRegistry)
+{
+  const uint32_t positionID = cereal::hashName("registry:CompPosition");
+  const uint32_t healthID = cereal::hashName("registry:CompHealth");
+
+  // IDs default to the hash of the component name.
+  {
+    cereal::CerealCore core;
+    EXPECT_EQ(positionID, core.registerComponent<CompPosition>());
+    EXPECT_EQ(healthID, core.registerComponent<CompHealth>());
+    EXPECT_EQ(positionID, core.getHeapID("registry:CompPosition"));
+    EXPECT_EQ(healthID, core.getHeapID("registry:CompHealth"));
+    EXPECT_EQ(0, core.getHeapID("registry:Missing"));
+    EXPECT_EQ(core.getOrCreateComponentContainer<CompHealth>(), core.getHeapByID(healthID));
+    EXPECT_EQ(nullptr, core.getHeapByID(3));
+
+    EXPECT_THROW(core.registerComponent<CompHealthDuplicate>(), std::runtime_error);
+  }
+
+  // Explicit IDs.
+  {
+    cereal::CerealCore core;
+    EXPECT_EQ(1, core.registerComponent<CompHealth>(1));
+    EXPECT_THROW(core.registerComponent<CompPosition>(1), std::runtime_error);
+    EXPECT_EQ(positionID, core.registerComponent<CompPosition>());
+  }
+
+  // Name hash collisions are caught at registration, even with explicit IDs.
+  {
+    cereal::CerealCore core;
+    core.registerComponent<CompCollideA>();
+    EXPECT_THROW(core.registerComponent<CompCollideB>(), std::runtime_error);
+    EXPECT_THROW(core.registerComponent<CompCollideB>(7), std::runtime_error);
+    EXPECT_EQ(nullptr, core.getHeapByID(7));
+    EXPECT_EQ(0, core.getHeapID("liquid"));
+  }
+
+  // Heap IDs on the wire. Explicit IDs here; hashed IDs are checked below.
+  Tny* root = NULL;
+  {
+    cereal::CerealCore core;
+    core.registerComponent<CompPosition>(10);
+    core.registerComponent<CompHealth>(20);
+    core.setHeapKeyMode(cereal::CerealCore::HEAP_KEY_ID);
+    for (int32_t i = 1; i <= 5; ++i)
+    {
+      core.addComponent(i, CompPosition(i, i * 2));
+      core.addComponent(i, CompHealth(i * 100));
+    }
+    core.renormalize(true);
+    root = core.serializeAllComponents();
+  }
+
+  ASSERT_NE(nullptr, root);
+  EXPECT_NE(nullptr, Tny_get(root, cereal::CerealCore::makeHeapIDKey(10).c_str()));
+  EXPECT_NE(nullptr, Tny_get(root, cereal::CerealCore::makeHeapIDKey(20).c_str()));
+  EXPECT_EQ(nullptr, Tny_get(root, "registry:CompHealth"));
+
+  {
+    cereal::CerealCore core;
+    core.registerComponent<CompHealth>(20);
+    core.registerComponent<CompPosition>(10);
+    core.deserializeComponentCreate(root);
+    core.renormalize(true);
+
+    cereal::CerealHeap<CompPosition>* positions = core.getOrCreateComponentContainer<CompPosition>();
+    cereal::CerealHeap<CompHealth>* health = core.getOrCreateComponentContainer<CompHealth>();
+    ASSERT_EQ(5, positions->getNumComponents());
+    ASSERT_EQ(5, health->getNumComponents());
+    EXPECT_EQ(8, positions->getComponentArray()[3].component.y);
+    EXPECT_EQ(300, health->getComponentArray()[2].component.health);
+
+    // Hashed IDs agree between cores regardless of registration order.
+    cereal::CerealCore hashed;
+    hashed.registerComponent<CompHealth>();
+    hashed.registerComponent<CompPosition>();
+    hashed.setHeapKeyMode(cereal::CerealCore::HEAP_KEY_ID);
+    hashed.addComponent(9, CompHealth(900));
+    hashed.renormalize(true);
+    Tny* hashedRoot = hashed.serializeAllComponents();
+    EXPECT_NE(nullptr, Tny_get(hashedRoot, cereal::CerealCore::makeHeapIDKey(healthID).c_str()));
+
+    cereal::CerealCore reader;
+    reader.registerComponent<CompPosition>();
+    reader.registerComponent<CompHealth>();
+    reader.deserializeComponentCreate(hashedRoot);
+    reader.renormalize(true);
+    EXPECT_EQ(1, reader.getOrCreateComponentContainer<CompHealth>()->getNumComponents());
+    Tny_free(hashedRoot);
+
+    // Name keyed output is still understood.
+    Tny* named = core.serializeAllComponents();
+    EXPECT_NE(nullptr, Tny_get(named, "registry:CompHealth"));
+    core.clearAllComponentContainersImmediately();
+    core.deserializeComponentCreate(named);
+    core.renormalize(true);
+    EXPECT_EQ(5, health->getNumComponents());
+    Tny_free(named);
+
+    // Decimal heap ID keys written by earlier versions are still understood.
+    Tny* decimal = Tny_add(NULL, TNY_DICT, NULL, NULL, 0);
+    Tny* heap = Tny_get(root, cereal::CerealCore::makeHeapIDKey(20).c_str());
+    ASSERT_NE(nullptr, heap);
+    Tny_add(decimal, TNY_OBJ, const_cast<char*>("#20"), heap->value.tny, 0);
+    core.clearAllComponentContainersImmediately();
+    core.deserializeComponentCreate(decimal);
+    core.renormalize(true);
+    EXPECT_EQ(5, health->getNumComponents());
+    Tny_free(decimal);
+  }
+
+  Tny_free(root);
+}
+
+// Reloading a component type: unregister it, then register the same name
+// again, under the same or a replacement type.
+TEST(EntitySystem, HeapRegistryReload)
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompPosition>();
+  EXPECT_EQ(20, core.registerComponent<CompHealth>(20));
+  core.setHeapKeyMode(cereal::CerealCore::HEAP_KEY_ID);
+  core.addComponent(1, CompPosition(1, 2));
+  core.addComponent(1, CompHealth(100));
+  core.renormalize(true);
+
+  EXPECT_TRUE(core.unregisterComponent<CompHealth>());
+  EXPECT_FALSE(core.unregisterComponent<CompHealth>());
+  EXPECT_FALSE(core.unregisterComponent<CompHealthDuplicate>());
+  EXPECT_EQ(0, core.getHeapID("registry:CompHealth"));
+  EXPECT_EQ(nullptr, core.getHeapByID(20));
+  EXPECT_EQ(0, core.getOrCreateComponentContainer<CompHealth>()->getNumComponents());
+
+  // The old heap is no longer written, and its ID is reserved.
+  Tny* root = core.serializeAllComponents();
+  EXPECT_EQ(1, root->size);
+  EXPECT_EQ(nullptr, Tny_get(root, cereal::CerealCore::makeHeapIDKey(20).c_str()));
+  EXPECT_EQ(nullptr, Tny_get(root, "registry:CompHealth"));
+  Tny_free(root);
+  EXPECT_THROW(core.registerComponent<CompCollideB>(20), std::runtime_error);
+
+  // A replacement type keeps the ID.
+  EXPECT_THROW(core.registerComponent<CompHealthDuplicate>(21), std::runtime_error);
+  EXPECT_EQ(20, core.registerComponent<CompHealthDuplicate>());
+  EXPECT_EQ(20, core.getHeapID("registry:CompHealth"));
+  EXPECT_EQ(core.getOrCreateComponentContainer<CompHealthDuplicate>(), core.getHeapByID(20));
+  EXPECT_THROW(core.registerComponent<CompHealth>(), std::runtime_error);
+
+  CompHealthDuplicate health;
+  health.health = 200;
+  core.addComponent(2, health);
+  core.renormalize(true);
+  root = core.serializeAllComponents();
+  EXPECT_NE(nullptr, Tny_get(root, cereal::CerealCore::makeHeapIDKey(20).c_str()));
+  Tny_free(root);
+
+  // The same type can be registered again, and is serialized again.
+  EXPECT_TRUE(core.unregisterComponent<CompPosition>());
+  EXPECT_FALSE(core.getOrCreateComponentContainer<CompPosition>()->isSerializable());
+  EXPECT_EQ(cereal::hashName("registry:CompPosition"), core.registerComponent<CompPosition>());
+  EXPECT_TRUE(core.getOrCreateComponentContainer<CompPosition>()->isSerializable());
+}
+
+TEST(EntitySystem, RegistryHeapIDKeys)
+{
+  uint32_t ids[] = {1, 10, 127, 128, 0x7FFFFFFF, 0xFFFFFFFF, cereal::hashName("registry:CompHealth")};
+  for (uint32_t id : ids)
+  {
+    std::string key = cereal::CerealCore::makeHeapIDKey(id);
+    ASSERT_EQ(cereal::CerealCore::HEAP_ID_KEY_SIZE, key.size());
+    EXPECT_EQ(std::string::npos, key.find('\0'));
+
+    uint32_t parsed = 0;
+    EXPECT_TRUE(cereal::CerealCore::parseHeapIDKey(key.c_str(), parsed));
+    EXPECT_EQ(id, parsed);
+  }
+
+  uint32_t parsed = 0;
+  EXPECT_FALSE(cereal::CerealCore::parseHeapIDKey("registry:CompHealth", parsed));
+  EXPECT_FALSE(cereal::CerealCore::parseHeapIDKey("#20", parsed));
+  EXPECT_FALSE(cereal::CerealCore::parseHeapIDKey(
+      cereal::CerealCore::makeHeapIDKey(20).substr(0, 3).c_str(), parsed));
+  EXPECT_FALSE(cereal::CerealCore::parseHeapIDKey(
+      (cereal::CerealCore::makeHeapIDKey(20) + "x").c_str(), parsed));
+
+  // Five 7 bit groups hold 35 bits; anything above 32 bits is rejected.
+  std::string tooLarge = cereal::CerealCore::makeHeapIDKey(0xFFFFFFFF);
+  tooLarge[1] = static_cast<char>(0xFF);
+  EXPECT_FALSE(cereal::CerealCore::parseHeapIDKey(tooLarge.c_str(), parsed));
+}
+
+}
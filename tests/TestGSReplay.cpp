@@ -0,0 +1,329 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <es-cereal/CerealReplay.hpp>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "replay:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompHealth
+{
+  CompHealth() : health(0) {}
+  CompHealth(int32_t healthIn) : health(healthIn) {}
+
+  int32_t health;
+
+  static const char* getName() {return "replay:CompHealth";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    return true;
+  }
+};
+
+typedef std::vector<std::pair<uint64_t, CompPosition>> PositionState;
+
+PositionState capturePositions(cereal::CerealCore& core)
+{
+  PositionState state;
+  cereal::CerealHeap<CompPosition>* heap = core.getOrCreateComponentContainer<CompPosition>();
+  for (size_t i = 0; i < heap->getNumComponents(); ++i)
+  {
+    const auto& item = heap->getComponentArray()[i];
+    state.push_back(std::make_pair(item.sequence, item.component));
+  }
+  return state;
+}
+
+void expectPositions(const PositionState& expected, cereal::CerealCore& core)
+{
+  PositionState actual = capturePositions(core);
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i)
+  {
+    EXPECT_EQ(expected[i].first, actual[i].first);
+    EXPECT_EQ(expected[i].second.x, actual[i].second.x);
+    EXPECT_EQ(expected[i].second.y, actual[i].second.y);
+  }
+}
+
+TEST(EntitySystem, ReplayRecordAndSeek)
+{
+  const char* filename = "TestGSReplay.crpl";
+  const uint64_t numTicks = 100;
+  const uint64_t spawnTick = 55;
+  std::vector<PositionState> expected;
+
+  {
+    std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+    core->registerComponent<CompPosition>();
+    core->registerComponent<CompHealth>();
+    for (uint64_t i = 1; i <= 10; ++i)
+    {
+      core->addComponent(i, CompPosition(0, static_cast<int32_t>(i)));
+      core->addComponent(i, CompHealth(100));
+    }
+    core->renormalize(true);
+
+    cereal::CerealReplayRecorder recorder(*core, filename, 10, true);
+    for (uint64_t tick = 0; tick < numTicks; ++tick)
+    {
+      if (tick == spawnTick)
+      {
+        // Structural change, forces a keyframe.
+        core->addComponent(11, CompPosition(-1, -1));
+        core->renormalize(true);
+      }
+      else if (tick > 0)
+      {
+        // Move a single entity each tick.
+        cereal::CerealHeap<CompPosition>* heap = core->getOrCreateComponentContainer<CompPosition>();
+        heap->getComponentArray()[tick % 10].component.x += 1;
+      }
+
+      recorder.recordTick(tick);
+      expected.push_back(capturePositions(*core));
+    }
+
+    EXPECT_EQ(11, recorder.getNumKeyframes());
+    EXPECT_EQ(numTicks - 11, recorder.getNumDeltas());
+    EXPECT_THROW(recorder.recordTick(numTicks - 1), std::runtime_error);
+  }
+
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompPosition>();
+  core->registerComponent<CompHealth>();
+
+  cereal::CerealReplayPlayer player(*core, filename);
+  EXPECT_EQ(numTicks, player.getNumFrames());
+  EXPECT_EQ(11, player.getNumKeyframes());
+  EXPECT_EQ(10, player.getKeyframeInterval());
+
+  const uint64_t seekTicks[] = {37, 5, 99, 54, 55, 0, 63};
+  for (uint64_t tick : seekTicks)
+  {
+    ASSERT_TRUE(player.seek(tick));
+    EXPECT_EQ(tick, player.getCurrentTick());
+    EXPECT_GT(10, player.getNumDeltasApplied());
+    expectPositions(expected[tick], *core);
+  }
+
+  // Scrubbing forward within a keyframe span only applies the deltas in
+  // between.
+  ASSERT_TRUE(player.seek(31));
+  ASSERT_TRUE(player.seek(34));
+  EXPECT_EQ(3, player.getNumDeltasApplied());
+  expectPositions(expected[34], *core);
+
+  // Seeking past the end lands on the last tick.
+  ASSERT_TRUE(player.seek(1000));
+  EXPECT_EQ(numTicks - 1, player.getCurrentTick());
+
+  // Sequential playback.
+  ASSERT_TRUE(player.seek(0));
+  for (uint64_t tick = 1; tick < numTicks; ++tick)
+  {
+    ASSERT_TRUE(player.step());
+    EXPECT_EQ(tick, player.getCurrentTick());
+    expectPositions(expected[tick], *core);
+  }
+  EXPECT_FALSE(player.step());
+
+  cereal::CerealHeap<CompHealth>* health = core->getOrCreateComponentContainer<CompHealth>();
+  ASSERT_EQ(10, health->getNumComponents());
+  EXPECT_EQ(100, health->getComponentArray()[3].component.health);
+
+  // Version 1 files, whose trailer only indexed keyframes, are still read:
+  // their frames are scanned up to the old trailer. Unknown versions throw.
+  {
+    std::ifstream in(filename, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+
+    size_t indexOffset = bytes.size() - numTicks * cereal::replay_detail::INDEX_ENTRY_SIZE
+        - cereal::replay_detail::INDEX_FOOTER_SIZE;
+    // Version 1 headers have no recording ID.
+    const size_t idSize = cereal::replay_detail::FILE_HEADER_SIZE
+        - cereal::replay_detail::FILE_HEADER_SIZE_V2;
+    std::vector<char> v1(bytes.begin(), bytes.begin() + cereal::replay_detail::FILE_HEADER_SIZE_V2);
+    v1.insert(v1.end(), bytes.begin() + cereal::replay_detail::FILE_HEADER_SIZE,
+              bytes.begin() + indexOffset);
+    v1[4] = 1;
+
+    auto appendU64 = [&v1](uint64_t value)
+    {
+      for (int i = 0; i < 8; ++i)
+        v1.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    };
+    uint64_t numKeyframes = 0;
+    for (uint64_t i = 0; i < numTicks; ++i)
+    {
+      const char* entry = &bytes[indexOffset + i * cereal::replay_detail::INDEX_ENTRY_SIZE];
+      if (entry[16] != cereal::REPLAY_KEYFRAME)
+        continue;
+      v1.insert(v1.end(), entry, entry + 8);
+      uint64_t offset = 0;
+      for (int b = 0; b < 8; ++b)
+        offset |= static_cast<uint64_t>(static_cast<unsigned char>(entry[8 + b])) << (8 * b);
+      appendU64(offset - idSize);
+      ++numKeyframes;
+    }
+    appendU64(numKeyframes);
+    appendU64(indexOffset - idSize);
+    v1.insert(v1.end(), bytes.end() - 4, bytes.end());
+
+    const char* v1Filename = "TestGSReplayV1.crpl";
+    {
+      std::ofstream out(v1Filename, std::ios::binary | std::ios::trunc);
+      out.write(&v1[0], v1.size());
+    }
+
+    cereal::CerealReplayPlayer old(*core, v1Filename);
+    EXPECT_EQ(numTicks, old.getNumFrames());
+    EXPECT_EQ(11, old.getNumKeyframes());
+    ASSERT_TRUE(old.seek(47));
+    expectPositions(expected[47], *core);
+
+    v1[4] = 4;
+    {
+      std::ofstream out(v1Filename, std::ios::binary | std::ios::trunc);
+      out.write(&v1[0], v1.size());
+    }
+    EXPECT_THROW(cereal::CerealReplayPlayer(*core, v1Filename), std::runtime_error);
+    std::remove(v1Filename);
+  }
+
+  // Drop the trailing index, as if the recording had been interrupted. The
+  // sidecar index is used instead, and without it the frames are scanned.
+  {
+    std::ifstream in(filename, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    bytes.resize(bytes.size() - numTicks * cereal::replay_detail::INDEX_ENTRY_SIZE
+                 - cereal::replay_detail::INDEX_FOOTER_SIZE);
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    out.write(&bytes[0], bytes.size());
+  }
+
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    if (pass == 1)
+      std::remove(cereal::replay_detail::getSidecarFilename(filename).c_str());
+
+    cereal::CerealReplayPlayer truncated(*core, filename);
+    EXPECT_EQ(numTicks, truncated.getNumFrames());
+    EXPECT_EQ(11, truncated.getNumKeyframes());
+    ASSERT_TRUE(truncated.seek(72));
+    EXPECT_EQ(7, truncated.getNumDeltasApplied());
+    expectPositions(expected[72], *core);
+  }
+
+  std::remove(filename);
+}
+
+// Sidecars that don't describe the replay next to them are ignored.
+TEST(EntitySystem, ReplayStaleSidecar)
+{
+  const char* filename = "TestGSReplayStale.crpl";
+  std::string sidecarName = cereal::replay_detail::getSidecarFilename(filename);
+
+  std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+  core->registerComponent<CompPosition>();
+  core->addComponent(1, CompPosition(0, 0));
+  core->renormalize(true);
+
+  auto record = [&](uint64_t numTicks, bool sidecarIndex)
+  {
+    cereal::CerealReplayRecorder recorder(*core, filename, 4, sidecarIndex);
+    for (uint64_t tick = 0; tick < numTicks; ++tick)
+    {
+      core->getOrCreateComponentContainer<CompPosition>()->getComponentArray()[0].component.x =
+          static_cast<int32_t>(tick);
+      recorder.recordTick(tick);
+    }
+  };
+
+  auto readFile = [](const std::string& name)
+  {
+    std::ifstream in(name, std::ios::binary);
+    return std::vector<char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  };
+
+  auto writeFile = [](const std::string& name, const std::vector<char>& bytes)
+  {
+    std::ofstream out(name, std::ios::binary | std::ios::trunc);
+    out.write(&bytes[0], bytes.size());
+  };
+
+  auto dropTrailer = [&](uint64_t numTicks)
+  {
+    std::vector<char> bytes = readFile(filename);
+    bytes.resize(bytes.size() - numTicks * cereal::replay_detail::INDEX_ENTRY_SIZE
+                 - cereal::replay_detail::INDEX_FOOTER_SIZE);
+    writeFile(filename, bytes);
+  };
+
+  // Recording without a sidecar removes the one left by the last recording.
+  record(20, true);
+  std::vector<char> oldSidecar = readFile(sidecarName);
+  ASSERT_FALSE(oldSidecar.empty());
+  record(10, false);
+  EXPECT_FALSE(std::ifstream(sidecarName).good());
+
+  // A sidecar of another recording is never used, even when its entries
+  // would fit the file.
+  writeFile(sidecarName, oldSidecar);
+  dropTrailer(10);
+  {
+    cereal::CerealReplayPlayer player(*core, filename);
+    EXPECT_EQ(10, player.getNumFrames());
+    ASSERT_TRUE(player.seek(9));
+    EXPECT_EQ(9, core->getOrCreateComponentContainer<CompPosition>()->getComponentArray()[0].component.x);
+  }
+
+  // Entries that don't match their frames fall back to scanning.
+  record(10, true);
+  dropTrailer(10);
+  std::vector<char> sidecar = readFile(sidecarName);
+  size_t firstEntry = cereal::replay_detail::SIDECAR_HEADER_SIZE;
+  sidecar[firstEntry + cereal::replay_detail::INDEX_ENTRY_SIZE] ^= 1;  // Tick of the second frame.
+  writeFile(sidecarName, sidecar);
+  {
+    cereal::CerealReplayPlayer player(*core, filename);
+    EXPECT_EQ(10, player.getNumFrames());
+    ASSERT_TRUE(player.seek(9));
+    EXPECT_EQ(9, core->getOrCreateComponentContainer<CompPosition>()->getComponentArray()[0].component.x);
+  }
+
+  std::remove(sidecarName.c_str());
+  std::remove(filename);
+}
+
+}
@@ -0,0 +1,104 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "segments:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompHealth
+{
+  CompHealth() : health(0) {}
+  CompHealth(int32_t healthIn) : health(healthIn) {}
+
+  int32_t health;
+
+  static const char* getName() {return "segments:CompHealth";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    return true;
+  }
+};
+
+TEST(EntitySystem, SnapshotSegments)
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompPosition>();
+  core.registerComponent<CompHealth>();
+  for (int32_t i = 1; i <= 2000; ++i)
+  {
+    core.addComponent(i, CompPosition(i, -i));
+    core.addComponent(i, CompHealth(i * 10));
+  }
+  core.renormalize(true);
+
+  cereal::CerealSnapshot snapshot = core.dumpSnapshot();
+  cereal::CerealSegmentList segments = core.dumpSnapshotSegments();
+
+  // A frame followed by a dump, per heap.
+  ASSERT_EQ(4, segments.getNumSegments());
+  EXPECT_EQ(snapshot.getBuffer().size(), segments.getTotalSize());
+  EXPECT_EQ(snapshot.getHeap(0).size(), segments.getSegment(1).size());
+
+  // Frames share one allocation.
+  EXPECT_EQ(static_cast<const char*>(segments.getSegment(0).data()) + segments.getSegment(0).size(),
+            segments.getSegment(2).data());
+
+  // Gathered bytes are the snapshot.
+  cereal::CerealBuffer joined = segments.concatenate(core.getAllocator());
+  ASSERT_EQ(snapshot.getBuffer().size(), joined.size());
+  EXPECT_EQ(0, std::memcmp(snapshot.getBuffer().data(), joined.data(), joined.size()));
+  cereal::CerealSnapshot parsed = cereal::CerealSnapshot::parse(joined);
+  EXPECT_EQ(2, parsed.getNumHeaps());
+
+  std::vector<struct iovec> iov(segments.getNumSegments());
+  EXPECT_EQ(3, segments.fillIOVec(&iov[0], 3));
+  EXPECT_EQ(segments.getSegment(2).data(), iov[2].iov_base);
+  EXPECT_EQ(1, segments.fillIOVec(&iov[0], iov.size(), 3));
+  EXPECT_EQ(segments.getSegment(3).size(), iov[0].iov_len);
+
+  // writev to a file, then read back.
+  FILE* file = std::tmpfile();
+  ASSERT_NE(nullptr, file);
+  segments.writeTo(fileno(file));
+  std::vector<char> readBack(segments.getTotalSize() + 1);
+  std::rewind(file);
+  ASSERT_EQ(segments.getTotalSize(), std::fread(&readBack[0], 1, readBack.size(), file));
+  EXPECT_EQ(0, std::memcmp(snapshot.getBuffer().data(), &readBack[0], segments.getTotalSize()));
+  std::fclose(file);
+
+  // An empty core still produces a valid snapshot.
+  cereal::CerealCore empty;
+  cereal::CerealSegmentList emptySegments = empty.dumpSnapshotSegments();
+  ASSERT_EQ(1, emptySegments.getNumSegments());
+  EXPECT_EQ(0, cereal::CerealSnapshot::parse(emptySegments.getSegment(0)).getNumHeaps());
+}
+
+}
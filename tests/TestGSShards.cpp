@@ -0,0 +1,233 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <es-cereal/CerealShards.hpp>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "shards:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompTerrain
+{
+  CompTerrain() : height(0) {}
+  CompTerrain(int32_t heightIn) : height(heightIn) {}
+
+  int32_t height;
+
+  static const char* getName() {return "shards:CompTerrain";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("height", height);
+    return true;
+  }
+};
+
+struct CompMarker
+{
+  CompMarker() : marker(0) {}
+  CompMarker(int32_t markerIn) : marker(markerIn) {}
+
+  int32_t marker;
+
+  static const char* getName() {return "shards:CompMarker";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("marker", marker);
+    return true;
+  }
+};
+
+std::string makeTempDirectory()
+{
+  char path[] = "/tmp/cereal_shards_XXXXXX";
+  if (mkdtemp(path) == NULL)
+    return std::string();
+  return path;
+}
+
+void removeDirectory(const std::string& directory)
+{
+  cereal::CerealShardManifest manifest;
+  if (manifest.load(directory))
+  {
+    for (const cereal::CerealShardManifest::Entry& entry : manifest.entries)
+      std::remove((directory + "/" + entry.fileName).c_str());
+  }
+  std::remove((directory + "/" + cereal::CerealShardManifest::MANIFEST_NAME).c_str());
+  rmdir(directory.c_str());
+}
+
+TEST(EntitySystem, ShardedSave)
+{
+  std::string directory = makeTempDirectory();
+  ASSERT_FALSE(directory.empty());
+
+  cereal::CerealCore core;
+  core.registerComponent<CompPosition>();
+  core.registerComponent<CompTerrain>();
+  core.registerComponent<CompMarker>();
+  for (int32_t i = 1; i <= 1000; ++i)
+  {
+    core.addComponent(i, CompPosition(i, -i));
+    core.addComponent(i, CompTerrain(i * 3));
+  }
+  core.addComponent(5000, CompMarker(55));
+  core.renormalize(true);
+
+  EXPECT_EQ(3, core.saveShards(directory, 3, false));
+
+  cereal::CerealShardManifest manifest;
+  ASSERT_TRUE(manifest.load(directory));
+  ASSERT_EQ(3, manifest.entries.size());
+  const cereal::CerealShardManifest::Entry* terrain = manifest.find("shards:CompTerrain");
+  ASSERT_NE(nullptr, terrain);
+  EXPECT_EQ(cereal::CerealShardManifest::getFileName("shards:CompTerrain", terrain->fingerprint),
+            terrain->fileName);
+
+  // Nothing changed: nothing is rewritten.
+  EXPECT_EQ(0, core.saveShards(directory, 3, false));
+
+  // Only the modified heap is rewritten. The marker heap is now empty and
+  // still saved (as an empty heap).
+  core.getOrCreateComponentContainer<CompPosition>()->getComponentArray()[10].component.x = 1234;
+  core.removeEntity(5000);
+  core.renormalize(true);
+  EXPECT_EQ(2, core.saveShards(directory, 2, false));
+  cereal::CerealShardManifest updated;
+  ASSERT_TRUE(updated.load(directory));
+  EXPECT_EQ(terrain->fingerprint, updated.find("shards:CompTerrain")->fingerprint);
+  EXPECT_NE(manifest.find("shards:CompPosition")->fingerprint,
+            updated.find("shards:CompPosition")->fingerprint);
+
+  // Changed heaps went to new files; the replaced ones are gone.
+  EXPECT_NE(manifest.find("shards:CompPosition")->fileName,
+            updated.find("shards:CompPosition")->fileName);
+  EXPECT_EQ(-1, cereal::shard_detail::getFileSize(
+                    directory + "/" + manifest.find("shards:CompPosition")->fileName));
+
+  // Heaps are read back in parallel.
+  cereal::CerealCore loaded;
+  loaded.registerComponent<CompPosition>();
+  loaded.registerComponent<CompTerrain>();
+  loaded.registerComponent<CompMarker>();
+  loaded.loadShards(directory, 3);
+  loaded.renormalize(true);
+
+  cereal::CerealHeap<CompPosition>* positions = loaded.getOrCreateComponentContainer<CompPosition>();
+  cereal::CerealHeap<CompTerrain>* terrains = loaded.getOrCreateComponentContainer<CompTerrain>();
+  ASSERT_EQ(1000, positions->getNumComponents());
+  ASSERT_EQ(1000, terrains->getNumComponents());
+  EXPECT_EQ(1234, positions->getComponentArray()[10].component.x);
+  EXPECT_EQ(-500, positions->getComponentArray()[499].component.y);
+  EXPECT_EQ(3000, terrains->getComponentArray()[999].component.height);
+  EXPECT_EQ(0, loaded.getOrCreateComponentContainer<CompMarker>()->getNumComponents());
+
+  // A damaged heap file is detected and nothing is created.
+  std::string path = directory + "/" + terrain->fileName;
+  FILE* file = std::fopen(path.c_str(), "r+b");
+  ASSERT_NE(nullptr, file);
+  std::fseek(file, -1, SEEK_END);
+  int last = std::fgetc(file);
+  std::fseek(file, -1, SEEK_END);
+  std::fputc(last ^ 0xFF, file);
+  std::fclose(file);
+
+  cereal::CerealCore damaged;
+  damaged.registerComponent<CompPosition>();
+  damaged.registerComponent<CompTerrain>();
+  EXPECT_THROW(damaged.loadShards(directory, 2), std::runtime_error);
+  damaged.renormalize(true);
+  EXPECT_EQ(0, damaged.getOrCreateComponentContainer<CompPosition>()->getNumComponents());
+
+  removeDirectory(directory);
+  cereal::CerealCore missing;
+  EXPECT_THROW(missing.loadShards(directory), std::runtime_error);
+}
+
+TEST(EntitySystem, ShardedSaveFailure)
+{
+  std::string directory = makeTempDirectory();
+  std::string scratch = makeTempDirectory();
+  ASSERT_FALSE(directory.empty());
+  ASSERT_FALSE(scratch.empty());
+
+  cereal::CerealCore core;
+  core.registerComponent<CompPosition>();
+  core.registerComponent<CompTerrain>();
+  for (int32_t i = 1; i <= 100; ++i)
+  {
+    core.addComponent(i, CompPosition(i, -i));
+    core.addComponent(i, CompTerrain(i * 3));
+  }
+  core.renormalize(true);
+  EXPECT_EQ(2, core.saveShards(directory, 1, false));
+
+  // Change both heaps. The scratch save tells us the file the terrain heap
+  // will be written to; a directory in the way of its temporary file makes
+  // that write fail after the position heap may have been written.
+  core.getOrCreateComponentContainer<CompPosition>()->getComponentArray()[0].component.x = 77;
+  core.getOrCreateComponentContainer<CompTerrain>()->getComponentArray()[0].component.height = 88;
+  core.renormalize(true);
+  EXPECT_EQ(2, core.saveShards(scratch, 1, false));
+  cereal::CerealShardManifest next;
+  ASSERT_TRUE(next.load(scratch));
+  std::string blocker = directory + "/" + next.find("shards:CompTerrain")->fileName + ".tmp";
+  ASSERT_EQ(0, mkdir(blocker.c_str(), 0755));
+
+  EXPECT_THROW(core.saveShards(directory, 1, false), std::runtime_error);
+  EXPECT_EQ(-1, cereal::shard_detail::getFileSize(
+                    directory + "/" + next.find("shards:CompPosition")->fileName));
+
+  // The previous save is untouched and still loads.
+  cereal::CerealCore loaded;
+  loaded.registerComponent<CompPosition>();
+  loaded.registerComponent<CompTerrain>();
+  loaded.loadShards(directory);
+  loaded.renormalize(true);
+  ASSERT_EQ(100, loaded.getOrCreateComponentContainer<CompPosition>()->getNumComponents());
+  EXPECT_EQ(1, loaded.getOrCreateComponentContainer<CompPosition>()->getComponentArray()[0].component.x);
+  EXPECT_EQ(3, loaded.getOrCreateComponentContainer<CompTerrain>()->getComponentArray()[0].component.height);
+
+  // Once the write succeeds, the new save replaces the old one.
+  ASSERT_EQ(0, rmdir(blocker.c_str()));
+  EXPECT_EQ(2, core.saveShards(directory, 1, false));
+  cereal::CerealCore reloaded;
+  reloaded.registerComponent<CompPosition>();
+  reloaded.registerComponent<CompTerrain>();
+  reloaded.loadShards(directory);
+  reloaded.renormalize(true);
+  EXPECT_EQ(77, reloaded.getOrCreateComponentContainer<CompPosition>()->getComponentArray()[0].component.x);
+  EXPECT_EQ(88, reloaded.getOrCreateComponentContainer<CompTerrain>()->getComponentArray()[0].component.height);
+
+  removeDirectory(directory);
+  removeDirectory(scratch);
+}
+
+}
@@ -0,0 +1,148 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "snap:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+struct CompHealth
+{
+  CompHealth() : health(0) {}
+  CompHealth(int32_t healthIn) : health(healthIn) {}
+
+  int32_t health;
+
+  static const char* getName() {return "snap:CompHealth";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    return true;
+  }
+};
+
+TEST(EntitySystem, SharedSnapshot)
+{
+  cereal::CerealSnapshot snapshot;
+  {
+    std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+    core->registerComponent<CompPosition>();
+    core->registerComponent<CompHealth>();
+    for (int32_t i = 1; i <= 10; ++i)
+    {
+      core->addComponent(i, CompPosition(i, -i));
+      core->addComponent(i, CompHealth(i * 10));
+    }
+    core->renormalize(true);
+
+    snapshot = core->dumpSnapshot();
+  }
+
+  // The snapshot outlives the core that produced it.
+  ASSERT_EQ(2, snapshot.getNumHeaps());
+  // The whole buffer plus one slice per heap.
+  EXPECT_EQ(3, snapshot.getBuffer().getUseCount());
+
+  // Fan out: every consumer shares the same memory.
+  cereal::CerealBuffer consumerA = snapshot.getBuffer();
+  cereal::CerealBuffer consumerB = snapshot.getBuffer();
+  EXPECT_EQ(snapshot.getBuffer().data(), consumerA.data());
+  EXPECT_EQ(consumerA.data(), consumerB.data());
+
+  cereal::CerealBuffer health = snapshot.findHeap("snap:CompHealth");
+  ASSERT_FALSE(health.empty());
+  EXPECT_TRUE(snapshot.findHeap("snap:Missing").empty());
+  EXPECT_GE(static_cast<const char*>(health.data()),
+            static_cast<const char*>(snapshot.getBuffer().data()));
+
+  // Slices are independently loadable.
+  {
+    std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+    core->registerComponent<CompHealth>();
+    Tny* root = health.loadTny();
+    ASSERT_NE(nullptr, root);
+    core->deserializeComponentCreate(root);
+    core->renormalize(true);
+    Tny_free(root);
+
+    cereal::CerealHeap<CompHealth>* heap = core->getOrCreateComponentContainer<CompHealth>();
+    ASSERT_EQ(10, heap->getNumComponents());
+    EXPECT_EQ(100, heap->getComponentArray()[9].component.health);
+  }
+
+  // Re-parsing the raw bytes (as a receiver would) yields the same snapshot.
+  cereal::CerealSnapshot received = cereal::CerealSnapshot::parse(consumerA);
+  {
+    std::shared_ptr<cereal::CerealCore> core(new cereal::CerealCore());
+    core->registerComponent<CompPosition>();
+    core->registerComponent<CompHealth>();
+    core->deserializeComponentCreate(received);
+    core->renormalize(true);
+
+    cereal::CerealHeap<CompPosition>* positions = core->getOrCreateComponentContainer<CompPosition>();
+    ASSERT_EQ(10, positions->getNumComponents());
+    EXPECT_EQ(-3, positions->getComponentArray()[2].component.y);
+  }
+
+  // Memory is released once the last reference is dropped.
+  cereal::CerealBuffer tail = consumerB.slice(consumerB.size() - 4, 4);
+  snapshot = cereal::CerealSnapshot();
+  received = cereal::CerealSnapshot();
+  consumerA = cereal::CerealBuffer();
+  consumerB = cereal::CerealBuffer();
+  health = cereal::CerealBuffer();
+  EXPECT_EQ(1, tail.getUseCount());
+  EXPECT_EQ(4, tail.size());
+
+  EXPECT_THROW(tail.slice(2, 4), std::out_of_range);
+  EXPECT_THROW(cereal::CerealSnapshot::parse(tail), std::runtime_error);
+}
+
+// Heaps in snapshots are the Tny dump of serializeAllComponents.
+TEST(EntitySystem, SnapshotDumpMatchesTny)
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompPosition>();
+  for (int32_t i = 1; i <= 10; ++i)
+    core.addComponent(i, CompPosition(i, -i));
+  core.renormalize(true);
+
+  cereal::CerealSnapshot snapshot = core.dumpSnapshot();
+  ASSERT_EQ(1, snapshot.getNumHeaps());
+  cereal::CerealBuffer heap = snapshot.findHeap("snap:CompPosition");
+
+  void* expected = NULL;
+  Tny* serialized = core.serializeAllComponents();
+  size_t expectedSize = Tny_dumps(serialized, &expected);
+  Tny_free(serialized);
+  ASSERT_EQ(expectedSize, heap.size());
+  EXPECT_EQ(0, std::memcmp(expected, heap.data(), expectedSize));
+  std::free(expected);
+}
+
+}
@@ -0,0 +1,96 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <es-cereal/CerealSnapshotRing.hpp>
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0), y(0) {}
+  CompPosition(int32_t xIn, int32_t yIn) : x(xIn), y(yIn) {}
+
+  int32_t x;
+  int32_t y;
+
+  static const char* getName() {return "ring:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    return true;
+  }
+};
+
+TEST(EntitySystem, SnapshotRing)
+{
+  std::string name = "/cereal_ring_" + std::to_string(getpid());
+
+  cereal::CerealCore core;
+  core.registerComponent<CompPosition>();
+  for (int32_t i = 1; i <= 500; ++i)
+    core.addComponent(i, CompPosition(i, -i));
+  core.renormalize(true);
+
+  cereal::CerealRingReader reader;
+  EXPECT_FALSE(reader.open(name));
+
+  cereal::CerealRingPublisher publisher;
+  publisher.create(name, 2, 64 * 1024);
+  ASSERT_TRUE(reader.open(name));
+  EXPECT_EQ(0, reader.getLatestSequence());
+  cereal::CerealCore nothing;
+  EXPECT_EQ(0, reader.loadLatest(nothing));
+
+  EXPECT_EQ(1, publisher.publish(core));
+  EXPECT_EQ(1, reader.getLatestSequence());
+
+  // The reader's snapshot refers into the mapping, which it keeps alive.
+  cereal::CerealSnapshot expected = core.dumpSnapshot();
+  cereal::CerealSnapshot snapshot;
+  EXPECT_EQ(1, reader.acquireLatest(snapshot));
+  reader.close();
+  ASSERT_EQ(expected.getBuffer().size(), snapshot.getBuffer().size());
+  EXPECT_EQ(0, std::memcmp(expected.getBuffer().data(), snapshot.getBuffer().data(),
+                           snapshot.getBuffer().size()));
+  ASSERT_EQ(1, snapshot.getNumHeaps());
+  EXPECT_EQ("ring:CompPosition", snapshot.getHeapName(0));
+
+  // Publishing wraps around the two slots, overwriting snapshot 1.
+  ASSERT_TRUE(reader.open(name));
+  EXPECT_TRUE(reader.isIntact(1));
+  core.getOrCreateComponentContainer<CompPosition>()->getComponentArray()[0].component.x = 77;
+  EXPECT_EQ(2, publisher.publish(core));
+  EXPECT_TRUE(reader.isIntact(1));
+  EXPECT_EQ(3, publisher.publish(core.dumpSnapshot()));
+  EXPECT_FALSE(reader.isIntact(1));
+  EXPECT_TRUE(reader.isIntact(3));
+
+  cereal::CerealCore loaded;
+  loaded.registerComponent<CompPosition>();
+  EXPECT_EQ(3, reader.loadLatest(loaded));
+  loaded.renormalize(true);
+  cereal::CerealHeap<CompPosition>* positions = loaded.getOrCreateComponentContainer<CompPosition>();
+  ASSERT_EQ(500, positions->getNumComponents());
+  EXPECT_EQ(77, positions->getComponentArray()[0].component.x);
+  EXPECT_EQ(-500, positions->getComponentArray()[499].component.y);
+
+  // Snapshots larger than a slot are refused without publishing.
+  cereal::CerealRingPublisher small;
+  small.create(name + "_small", 1, 16);
+  EXPECT_THROW(small.publish(core), std::runtime_error);
+  EXPECT_EQ(0, small.getSequence());
+
+  publisher.close();
+  EXPECT_FALSE(reader.open(name));
+}
+
+}
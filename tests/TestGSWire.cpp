@@ -0,0 +1,352 @@
+#include <entity-system/GenericSystem.hpp>
+#include <entity-system/ESCore.hpp>
+#include <es-cereal/CerealCore.hpp>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+namespace es = CPM_ES_NS;
+namespace cereal = CPM_ES_CEREAL_NS;
+
+namespace {
+
+struct CompPosition
+{
+  CompPosition() : x(0.0f), y(0.0f), z(0.0f) {}
+  CompPosition(float xIn, float yIn, float zIn) : x(xIn), y(yIn), z(zIn) {}
+
+  float x;
+  float y;
+  float z;
+
+  static const char* getName() {return "wire:CompPosition";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("x", x);
+    s.serialize("y", y);
+    s.serialize("z", z);
+    return true;
+  }
+};
+
+struct CompTarget
+{
+  CompTarget() : target(0), weight(0) {}
+  CompTarget(uint64_t targetIn, int32_t weightIn) : target(targetIn), weight(weightIn) {}
+
+  uint64_t target;
+  int32_t weight;
+
+  static const char* getName() {return "wire:CompTarget";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serializeEntityID("target", target);
+    s.serialize("weight", weight);
+    return true;
+  }
+};
+
+// Two versions of the same component, as seen by an old and a new build.
+struct CompStatsV1
+{
+  CompStatsV1() : health(0), armor(0) {}
+
+  int32_t health;
+  int32_t armor;
+
+  static const char* getName() {return "wire:CompStats";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("health", health);
+    s.serialize("armor", armor);
+    return true;
+  }
+};
+
+struct CompStatsV2
+{
+  CompStatsV2() : mana(50), health(0), speed(1.5) {}
+
+  int32_t mana;
+  int32_t health;
+  double speed;
+
+  static const char* getName() {return "wire:CompStats";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("mana", mana);
+    s.serialize("health", health);
+    s.serialize("speed", speed);
+    return true;
+  }
+};
+
+struct CompLabel
+{
+  std::string label;
+
+  static const char* getName() {return "wire:CompLabel";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("label", label);
+    return true;
+  }
+};
+
+void populate(cereal::CerealCore& core, uint64_t numEntities)
+{
+  core.registerComponent<CompPosition>();
+  core.registerComponent<CompTarget>();
+  for (uint64_t i = 1; i <= numEntities; ++i)
+  {
+    float f = static_cast<float>(i);
+    core.addComponent(i * 3, CompPosition(f, f * 0.5f, -f));
+    if (i % 2 == 0)
+      core.addComponent(i * 3, CompTarget(i * 3 - 3, static_cast<int32_t>(-i)));
+  }
+  core.renormalize(true);
+}
+
+template <typename Backend>
+void checkRoundTrip()
+{
+  const uint64_t numEntities = 500;
+  cereal::CerealCore source;
+  populate(source, numEntities);
+
+  cereal::CerealBuffer data = source.encodeAllComponents<Backend>();
+
+  cereal::CerealCore target;
+  target.registerComponent<CompPosition>();
+  target.registerComponent<CompTarget>();
+  target.decodeComponentCreate<Backend>(data);
+  target.renormalize(true);
+
+  cereal::CerealHeap<CompPosition>* positions = target.getOrCreateComponentContainer<CompPosition>();
+  cereal::CerealHeap<CompTarget>* targets = target.getOrCreateComponentContainer<CompTarget>();
+  ASSERT_EQ(numEntities, positions->getNumComponents());
+  ASSERT_EQ(numEntities / 2, targets->getNumComponents());
+  for (uint64_t i = 1; i <= numEntities; ++i)
+  {
+    const auto& item = positions->getComponentArray()[i - 1];
+    ASSERT_EQ(i * 3, item.sequence);
+    ASSERT_EQ(static_cast<float>(i), item.component.x);
+    ASSERT_EQ(static_cast<float>(i) * 0.5f, item.component.y);
+    ASSERT_EQ(-static_cast<float>(i), item.component.z);
+  }
+  for (uint64_t i = 1; i <= numEntities / 2; ++i)
+  {
+    const auto& item = targets->getComponentArray()[i - 1];
+    ASSERT_EQ(i * 6, item.sequence);
+    ASSERT_EQ(i * 6 - 3, item.component.target);
+    ASSERT_EQ(static_cast<int32_t>(-(i * 2)), item.component.weight);
+  }
+
+  // Buffers are tagged with their backend.
+  cereal::CerealCore other;
+  if (Backend::ID != cereal::TnyWireBackend::ID)
+    EXPECT_THROW(other.decodeComponentCreate<cereal::TnyWireBackend>(data), std::runtime_error);
+  else
+    EXPECT_THROW(other.decodeComponentCreate<cereal::RecordWireBackend>(data), std::runtime_error);
+}
+
+TEST(EntitySystem, WireTnyRoundTrip)
+{
+  checkRoundTrip<cereal::TnyWireBackend>();
+}
+
+TEST(EntitySystem, WireBinaryRoundTrip)
+{
+  checkRoundTrip<cereal::BinaryWireBackend>();
+}
+
+TEST(EntitySystem, WireRecordRoundTrip)
+{
+  checkRoundTrip<cereal::RecordWireBackend>();
+}
+
+template <typename Backend>
+void checkExactSize()
+{
+  cereal::CerealCore core;
+  populate(core, 300);
+
+  size_t size = core.measureAllComponents<Backend>();
+  cereal::CerealBuffer data = core.encodeAllComponents<Backend>();
+  EXPECT_EQ(size, data.size());
+
+  // Over budget output is rejected before encoding, output within budget is not.
+  EXPECT_EQ(0, core.encodeAllComponents<Backend>(size - 1).size());
+  EXPECT_EQ(size, core.encodeAllComponents<Backend>(size).size());
+
+  cereal::CerealCore empty;
+  EXPECT_EQ(16, empty.measureAllComponents<Backend>());
+  EXPECT_EQ(16, empty.encodeAllComponents<Backend>().size());
+}
+
+TEST(EntitySystem, WireExactSize)
+{
+  checkExactSize<cereal::TnyWireBackend>();
+  checkExactSize<cereal::BinaryWireBackend>();
+  checkExactSize<cereal::RecordWireBackend>();
+}
+
+TEST(EntitySystem, WireBinaryVersionTolerance)
+{
+  cereal::CerealCore oldCore;
+  oldCore.registerComponent<CompStatsV1>();
+  for (uint64_t i = 1; i <= 10; ++i)
+  {
+    CompStatsV1 stats;
+    stats.health = static_cast<int32_t>(i * 10);
+    stats.armor = static_cast<int32_t>(i);
+    oldCore.addComponent(i, stats);
+  }
+  oldCore.renormalize(true);
+
+  cereal::CerealBuffer data = oldCore.encodeAllComponents<cereal::BinaryWireBackend>();
+
+  // 'armor' was removed, 'mana' and 'speed' were added.
+  cereal::CerealCore newCore;
+  newCore.registerComponent<CompStatsV2>();
+  newCore.decodeComponentCreate<cereal::BinaryWireBackend>(data);
+  newCore.renormalize(true);
+
+  cereal::CerealHeap<CompStatsV2>* heap = newCore.getOrCreateComponentContainer<CompStatsV2>();
+  ASSERT_EQ(10, heap->getNumComponents());
+  for (uint64_t i = 1; i <= 10; ++i)
+  {
+    const auto& item = heap->getComponentArray()[i - 1];
+    EXPECT_EQ(i, item.sequence);
+    EXPECT_EQ(static_cast<int32_t>(i * 10), item.component.health);
+    EXPECT_EQ(50, item.component.mana);
+    EXPECT_EQ(1.5, item.component.speed);
+  }
+
+  // Fixed records refuse the changed layout.
+  cereal::CerealBuffer records = oldCore.encodeAllComponents<cereal::RecordWireBackend>();
+  cereal::CerealCore strictCore;
+  strictCore.registerComponent<CompStatsV2>();
+  EXPECT_THROW(strictCore.decodeComponentCreate<cereal::RecordWireBackend>(records), std::runtime_error);
+}
+
+// Only serializes trivially copyable fields, but copying those fields
+// would not copy the component.
+struct CompCached
+{
+  CompCached() : value(0) {}
+
+  int32_t           value;
+  std::vector<int>  cache;
+
+  static const char* getName() {return "wire:CompCached";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    s.serialize("value", value);
+    return true;
+  }
+};
+
+TEST(EntitySystem, WireRequiresTrivialFields)
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompLabel>();
+  CompLabel label;
+  label.label = "a label long enough to avoid the small string buffer";
+  core.addComponent(1, label);
+  core.renormalize(true);
+
+  EXPECT_THROW(core.encodeAllComponents<cereal::BinaryWireBackend>(), std::runtime_error);
+  EXPECT_THROW(core.encodeAllComponents<cereal::RecordWireBackend>(), std::runtime_error);
+
+  cereal::CerealBuffer data = core.encodeAllComponents<cereal::TnyWireBackend>();
+  cereal::CerealCore target;
+  target.registerComponent<CompLabel>();
+  target.decodeComponentCreate<cereal::TnyWireBackend>(data);
+  target.renormalize(true);
+  cereal::CerealHeap<CompLabel>* heap = target.getOrCreateComponentContainer<CompLabel>();
+  ASSERT_EQ(1, heap->getNumComponents());
+  EXPECT_EQ(label.label, heap->getComponentArray()[0].component.label);
+
+  cereal::CerealCore cached;
+  cached.registerComponent<CompCached>();
+  cached.addComponent(1, CompCached());
+  cached.renormalize(true);
+  EXPECT_THROW(cached.encodeAllComponents<cereal::BinaryWireBackend>(), std::runtime_error);
+  EXPECT_THROW(cached.encodeAllComponents<cereal::RecordWireBackend>(), std::runtime_error);
+
+  // Truncated buffers are rejected rather than read past their end.
+  cereal::CerealBuffer truncated = data.slice(0, data.size() - 1);
+  EXPECT_THROW(target.decodeComponentCreate<cereal::TnyWireBackend>(truncated), std::runtime_error);
+}
+
+// Skips hidden instances and only serializes 'bonus' when it is set.
+struct CompOptional
+{
+  CompOptional() : value(0), bonus(0), hidden(false) {}
+  CompOptional(int32_t valueIn, int32_t bonusIn, bool hiddenIn) :
+      value(valueIn), bonus(bonusIn), hidden(hiddenIn) {}
+
+  int32_t value;
+  int32_t bonus;
+  bool    hidden;
+
+  static const char* getName() {return "wire:CompOptional";}
+
+  bool serialize(cereal::ComponentSerialize& s, uint64_t /* entityID */)
+  {
+    if (hidden) return false;
+    s.serialize("value", value);
+    if (bonus != 0 || s.isDeserializing()) s.serialize("bonus", bonus);
+    return true;
+  }
+};
+
+// Packed backends run serialize for every component.
+TEST(EntitySystem, WirePackedRunsSerialize)
+{
+  cereal::CerealCore core;
+  core.registerComponent<CompOptional>();
+  core.addComponent(1, CompOptional(1, 0, false));
+  core.addComponent(2, CompOptional(2, 0, true));
+  core.addComponent(3, CompOptional(0x01020304, 0, false));
+  core.renormalize(true);
+
+  cereal::CerealBuffer records = core.encodeAllComponents<cereal::RecordWireBackend>();
+  cereal::CerealCore target;
+  target.registerComponent<CompOptional>();
+  target.decodeComponentCreate<cereal::RecordWireBackend>(records);
+  target.renormalize(true);
+  cereal::CerealHeap<CompOptional>* heap = target.getOrCreateComponentContainer<CompOptional>();
+  ASSERT_EQ(2, heap->getNumComponents());
+  EXPECT_EQ(1, heap->getComponentArray()[0].sequence);
+  EXPECT_EQ(3, heap->getComponentArray()[1].sequence);
+  EXPECT_EQ(0x01020304, heap->getComponentArray()[1].component.value);
+
+  // Fields are little endian: the last record ends with 'value' of entity 3.
+  const unsigned char* end = static_cast<const unsigned char*>(records.data()) + records.size();
+  EXPECT_EQ(0x04, end[-4]);
+  EXPECT_EQ(0x01, end[-1]);
+
+  cereal::CerealBuffer binary = core.encodeAllComponents<cereal::BinaryWireBackend>();
+  EXPECT_EQ(core.measureAllComponents<cereal::BinaryWireBackend>(), binary.size());
+  cereal::CerealCore binaryTarget;
+  binaryTarget.registerComponent<CompOptional>();
+  binaryTarget.decodeComponentCreate<cereal::BinaryWireBackend>(binary);
+  binaryTarget.renormalize(true);
+  EXPECT_EQ(2, binaryTarget.getOrCreateComponentContainer<CompOptional>()->getNumComponents());
+
+  // Fields that depend on the component's contents don't fit a layout.
+  core.addComponent(4, CompOptional(4, 40, false));
+  core.renormalize(true);
+  EXPECT_THROW(core.encodeAllComponents<cereal::BinaryWireBackend>(), std::runtime_error);
+  EXPECT_THROW(core.encodeAllComponents<cereal::RecordWireBackend>(), std::runtime_error);
+}
+
+}